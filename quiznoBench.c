@@ -0,0 +1,881 @@
+/////////////////////////////////////////////////////////////////////////////
+//  quiznoBench - A load benchmark for quiznoBot. It plays the IRC server and
+//                a crowd of users on loopback, so it runs without a network.
+/////////////////////////////////////////////////////////////////////////////
+//  Copyright 2010 Ron Moore
+/////////////////////////////////////////////////////////////////////////////
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+/////////////////////////////////////////////////////////////////////////////
+//  Instructions:
+//    make bench runs it with the defaults, make bench BENCH="..." with
+//    options:
+//      quiznoBench (-c clients) (-f files) (-s size) (-o name=value) (-v)
+//    The options work as follows:
+//      -c [clients] -- number of users that ask for a pack at the same time
+//      -f [files] -- number of files in the generated share; client n asks
+//                 for pack n modulo files
+//      -s [size] -- size of every generated file (k, m and g work)
+//      -o [name=value] -- handed to the bot as a tunable, for example
+//                 -o model=fork; can be given more than once
+//      -b [path] -- the bot to run, ./quiznoBot unless given
+//      -d [dir] -- share this directory instead of generating one
+//      -t [seconds] -- give up on the clients that aren't done by then
+//      -j [threads] -- download on this many threads, so the benchmark
+//                 isn't what stops a bot with several workers
+//      -v -- show what the bot prints
+/////////////////////////////////////////////////////////////////////////////
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
+
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/epoll.h>
+#include <poll.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+//bytes read from a DCC socket per recv()
+#define DCC_READ_CHUNK (256 * 1024)
+//size of the block the generated files are written in
+#define SHARE_WRITE_CHUNK (1024 * 1024)
+//how long the bot gets to connect, log in and join
+#define BOT_START_TIMEOUT 60
+//how long the bot gets to exit after "bot die"
+#define BOT_EXIT_TIMEOUT 10
+//longest line the IRC side keeps
+#define IRC_LINE_SIZE 1024
+
+//a simulated user and its download
+struct BenchClient
+{
+   char nick[32];
+   int packNumber;
+   int socket;            //-1 until the offer comes
+   int loop;              //epoll instance of the thread downloading it
+   long long size;
+   long long received;
+   long long requestedAt; //monotonic ns
+   long long firstByteAt;
+   long long doneAt;
+   char failed;
+};
+
+struct BenchClient *clients = NULL;
+int numClients = 20;
+int numFiles = 4;
+long long fileSize = 64LL * 1024 * 1024;
+char botPath[512] = "./quiznoBot";
+char shareDirectory[512];
+char generatedShare = 0;
+char **botOptions = NULL;
+int numBotOptions = 0;
+int timeoutSeconds = 300;
+int numThreads = 1;
+int verbose = 0;
+
+pid_t bot = -1;
+int ircSocket = -1;
+char ircBuffer[IRC_LINE_SIZE * 4];
+int ircFill = 0;
+int epollFd = -1;
+int *threadLoops = NULL;       //one epoll instance per download thread
+int finishedClients = 0;       //atomic, the threads finish clients
+long long deadline;
+
+long long monotonicNs()
+{
+   struct timespec now;
+   
+   clock_gettime(CLOCK_MONOTONIC, &now);
+   return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Parses a size such as 4096, 64k, 10m or 1g into a number of bytes.
+/////////////////////////////////////////////////////////////////////////////
+long long parseSize(const char *text)
+{
+   char *end = NULL;
+   long long value = strtoll(text, &end, 10);
+   
+   switch (*end)
+   {
+      case 'k': case 'K': value *= 1024LL; break;
+      case 'm': case 'M': value *= 1024LL * 1024LL; break;
+      case 'g': case 'G': value *= 1024LL * 1024LL * 1024LL; break;
+   }
+   return value;
+}
+
+void printUsage()
+{
+   printf("Usage: quiznoBench [options]\n");
+   printf("Options:\n");
+   printf("\tc clients - Users asking for a pack at the same time "
+          "(default 20).\n");
+   printf("\tf files - Files in the generated share (default 4).\n");
+   printf("\ts size - Size of every generated file (default 64m).\n");
+   printf("\to name=value - Sets a tunable of the bot, can be repeated.\n");
+   printf("\tb path - The bot to run (default ./quiznoBot).\n");
+   printf("\td directory - Shares this directory instead of generating "
+          "one.\n");
+   printf("\tt seconds - Gives up on clients after this long "
+          "(default 300).\n");
+   printf("\tj threads - Threads downloading the offers (default 1).\n");
+   printf("\tv - Shows what the bot prints.\n\n");
+   printf("Examples:\n");
+   printf("\tquiznoBench -c 100 -s 16m -o model=fork\n");
+   printf("\tquiznoBench -c 400 -s 16m -j 4 -o workers=4\n");
+   printf("\tmake bench BENCH=\"-o sendmode=splice -o slots=5\"\n");
+}
+
+void parseCommandline(int argc, char **argv)
+{
+   int option;
+   
+   while ((option = getopt(argc, argv, "c:f:s:o:b:d:t:j:vh")) != -1)
+   {
+      switch (option)
+      {
+         case 'c': numClients = atoi(optarg); break;
+         case 'f': numFiles = atoi(optarg); break;
+         case 's': fileSize = parseSize(optarg); break;
+         case 'o':
+            botOptions = realloc(botOptions,
+                                 sizeof(char*) * (numBotOptions + 1));
+            botOptions[numBotOptions++] = optarg;
+            break;
+         case 'b':
+            snprintf(botPath, sizeof(botPath), "%s", optarg);
+            break;
+         case 'd':
+            snprintf(shareDirectory, sizeof(shareDirectory), "%s", optarg);
+            break;
+         case 't': timeoutSeconds = atoi(optarg); break;
+         case 'j': numThreads = atoi(optarg); break;
+         case 'v': ++verbose; break;
+         default:
+            printUsage();
+            exit(option == 'h' ? 0 : 1);
+      }
+   }
+   if (numClients < 1 || numFiles < 1 || fileSize < 1 || numThreads < 1)
+   {
+      fprintf(stderr, "clients, files, size and threads must be at least "
+            "1\n");
+      exit(1);
+   }
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Fills a temporary directory with numFiles files of fileSize bytes. The
+// contents are pseudo random so nothing along the way can compress them.
+/////////////////////////////////////////////////////////////////////////////
+int BENCH_MakeShare()
+{
+   char path[600];
+   unsigned long long state = 0x9e3779b97f4a7c15ULL;
+   unsigned long long *block;
+   long long left;
+   ssize_t length;
+   int fileDescriptor;
+   int i, j;
+   
+   snprintf(shareDirectory, sizeof(shareDirectory), "/tmp/quiznoBench.XXXXXX");
+   if (mkdtemp(shareDirectory) == NULL)
+   {
+      fprintf(stderr, "Couldn't create a share directory: %s\n",
+            strerror(errno));
+      return -1;
+   }
+   generatedShare = 1;
+   block = malloc(SHARE_WRITE_CHUNK);
+   fprintf(stderr, "Writing %i files of %lld bytes to %s...\n", numFiles,
+         fileSize, shareDirectory);
+   for (i = 0; i < numFiles; ++i)
+   {
+      snprintf(path, sizeof(path), "%s/pack%04i.bin", shareDirectory, i);
+      fileDescriptor = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+      if (fileDescriptor == -1)
+      {
+         fprintf(stderr, "Couldn't create %s: %s\n", path, strerror(errno));
+         free(block);
+         return -1;
+      }
+      for (left = fileSize; left > 0; left -= length)
+      {
+         //xorshift64
+         for (j = 0; j < SHARE_WRITE_CHUNK / 8; ++j)
+         {
+            state ^= state << 13;
+            state ^= state >> 7;
+            state ^= state << 17;
+            block[j] = state;
+         }
+         length = write(fileDescriptor, block, left < SHARE_WRITE_CHUNK ?
+                        left : SHARE_WRITE_CHUNK);
+         if (length <= 0)
+         {
+            fprintf(stderr, "Couldn't write %s: %s\n", path, strerror(errno));
+            close(fileDescriptor);
+            free(block);
+            return -1;
+         }
+      }
+      close(fileDescriptor);
+   }
+   free(block);
+   return 0;
+}
+
+//removes the generated share, and nothing else
+void BENCH_RemoveShare()
+{
+   char path[600];
+   int i;
+   
+   if (!generatedShare)
+      return;
+   for (i = 0; i < numFiles; ++i)
+   {
+      snprintf(path, sizeof(path), "%s/pack%04i.bin", shareDirectory, i);
+      unlink(path);
+   }
+   rmdir(shareDirectory);
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Starts the bot against our IRC port. The defaults keep it from doing
+// anything besides serving: no catalog, checksums or announces, no flood
+// pacing, and enough slots, queue and send queue for every client. Options
+// given with -o come after them and win.
+/////////////////////////////////////////////////////////////////////////////
+pid_t BENCH_StartBot(int port)
+{
+   char portText[16];
+   char slots[32];
+   char queue[32];
+   char sendQueue[32];
+   char **argv;
+   int argc = 0;
+   int i;
+   pid_t child;
+   int devNull;
+   
+   snprintf(portText, sizeof(portText), "%i", port);
+   snprintf(slots, sizeof(slots), "slots=%i", numClients);
+   snprintf(queue, sizeof(queue), "queuesize=%i",
+            numClients > 100 ? numClients : 100);
+   //an offer and maybe a queue notice for every client at once
+   snprintf(sendQueue, sizeof(sendQueue), "sendqueue=%i",
+            numClients > 50 ? numClients * 2 : 100);
+   argv = calloc(32 + numBotOptions * 2, sizeof(char*));
+   argv[argc++] = botPath;
+   argv[argc++] = "-n"; argv[argc++] = "bench";
+   argv[argc++] = "-s"; argv[argc++] = "127.0.0.1";
+   argv[argc++] = "-p"; argv[argc++] = portText;
+   argv[argc++] = "-c"; argv[argc++] = "#bench";
+   argv[argc++] = "-d"; argv[argc++] = shareDirectory;
+   argv[argc++] = "-e"; argv[argc++] = "127.0.0.1";
+   argv[argc++] = "-o"; argv[argc++] = "catalog=none";
+   argv[argc++] = "-o"; argv[argc++] = "hashthreads=0";
+   argv[argc++] = "-o"; argv[argc++] = "announcelines=0";
+   argv[argc++] = "-o"; argv[argc++] = "floodcost=0";
+   argv[argc++] = "-o"; argv[argc++] = slots;
+   argv[argc++] = "-o"; argv[argc++] = queue;
+   argv[argc++] = "-o"; argv[argc++] = sendQueue;
+   for (i = 0; i < numBotOptions; ++i)
+   {
+      argv[argc++] = "-o";
+      argv[argc++] = botOptions[i];
+   }
+   if (verbose > 1)
+      argv[argc++] = "-v";
+   argv[argc] = NULL;
+   
+   child = fork();
+   if (child == 0)
+   {
+      if (!verbose)
+      {
+         devNull = open("/dev/null", O_WRONLY);
+         dup2(devNull, STDOUT_FILENO);
+         dup2(devNull, STDERR_FILENO);
+         close(devNull);
+      }
+      execv(botPath, argv);
+      fprintf(stderr, "Couldn't run %s: %s\n", botPath, strerror(errno));
+      _exit(127);
+   }
+   free(argv);
+   return child;
+}
+
+void BENCH_SendLine(const char *line)
+{
+   size_t length = strlen(line);
+   size_t sent = 0;
+   ssize_t result;
+   
+   while (sent < length)
+   {
+      result = send(ircSocket, line + sent, length - sent, MSG_NOSIGNAL);
+      if (result <= 0)
+      {
+         if (result == -1 && (errno == EAGAIN || errno == EINTR))
+            continue;
+         return;
+      }
+      sent += result;
+   }
+}
+
+//takes the next complete line out of ircBuffer, without its CR LF
+char *BENCH_NextLine(char *line)
+{
+   char *newline;
+   size_t length;
+   
+   newline = memchr(ircBuffer, '\n', ircFill);
+   if (newline == NULL)
+   {
+      //a line longer than the buffer is of no interest
+      if (ircFill == sizeof(ircBuffer))
+         ircFill = 0;
+      return NULL;
+   }
+   length = newline - ircBuffer;
+   if (length >= IRC_LINE_SIZE)
+      length = IRC_LINE_SIZE - 1;
+   memcpy(line, ircBuffer, length);
+   if (length > 0 && line[length - 1] == '\r')
+      --length;
+   line[length] = '\0';
+   ircFill -= newline - ircBuffer + 1;
+   memmove(ircBuffer, newline + 1, ircFill);
+   return line;
+}
+
+//reads what the bot sent, waiting at most timeoutMs; 0 means the bot hung up
+int BENCH_FillBuffer(int timeoutMs)
+{
+   struct pollfd waitFor = { ircSocket, POLLIN, 0 };
+   ssize_t received;
+   
+   if (poll(&waitFor, 1, timeoutMs) != 1)
+      return -1;
+   received = recv(ircSocket, ircBuffer + ircFill,
+                   sizeof(ircBuffer) - ircFill, MSG_DONTWAIT);
+   if (received > 0)
+      ircFill += received;
+   return received;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Plays the server's part of the login: welcome the bot once it sent NICK
+// and wait for it to join the channel.
+/////////////////////////////////////////////////////////////////////////////
+int BENCH_Login(int listenSocket)
+{
+   char line[IRC_LINE_SIZE];
+   long long deadline = monotonicNs() + BOT_START_TIMEOUT * 1000000000LL;
+   struct pollfd waitFor = { listenSocket, POLLIN, 0 };
+   long long left;
+   
+   if (poll(&waitFor, 1, BOT_START_TIMEOUT * 1000) != 1 ||
+       (ircSocket = accept(listenSocket, NULL, NULL)) == -1)
+   {
+      fprintf(stderr, "The bot didn't connect\n");
+      return -1;
+   }
+   while (1)
+   {
+      while (BENCH_NextLine(line) != NULL)
+      {
+         if (verbose)
+            fprintf(stderr, "bot: %s\n", line);
+         if (strncmp(line, "NICK ", 5) == 0)
+            BENCH_SendLine(":bench.local 001 bench :Welcome\r\n"
+                           ":bench.local 376 bench :End of /MOTD.\r\n");
+         else if (strncmp(line, "JOIN ", 5) == 0)
+            return 0;
+      }
+      left = (deadline - monotonicNs()) / 1000000;
+      if (left <= 0 || BENCH_FillBuffer(left) <= 0)
+         break;
+   }
+   fprintf(stderr, "The bot didn't log in\n");
+   return -1;
+}
+
+struct BenchClient *BENCH_FindClient(const char *nick)
+{
+   int i;
+   
+   for (i = 0; i < numClients; ++i)
+      if (strcmp(clients[i].nick, nick) == 0)
+         return &clients[i];
+   return NULL;
+}
+
+void BENCH_Finish(struct BenchClient *client, char failed)
+{
+   if (client->doneAt != 0 || client->failed)
+      return;
+   if (failed)
+      client->failed = 1;
+   else
+      client->doneAt = monotonicNs();
+   if (client->socket != -1)
+   {
+      epoll_ctl(client->loop, EPOLL_CTL_DEL, client->socket, NULL);
+      close(client->socket);
+      client->socket = -1;
+   }
+   __atomic_add_fetch(&finishedClients, 1, __ATOMIC_RELEASE);
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Takes a DCC offer:
+//    PRIVMSG <nick> :\001DCC SEND "<file>" <ip> <port> <size>\001
+// and connects to the port. The file name is skipped, the numbers are read
+// from the end.
+/////////////////////////////////////////////////////////////////////////////
+void BENCH_OnOffer(char *line)
+{
+   struct BenchClient *client;
+   struct sockaddr_in address;
+   struct epoll_event event;
+   char nick[32];
+   char *text, *end;
+   char *fields[3];
+   int i;
+   
+   if (sscanf(line, "PRIVMSG %31s", nick) != 1 ||
+       (text = strstr(line, ":\001DCC ")) == NULL)
+      return;
+   client = BENCH_FindClient(nick);
+   if (client == NULL || client->socket != -1 || client->doneAt != 0)
+      return;
+   end = strchr(text + 2, '\001');
+   if (end != NULL)
+      *end = '\0';
+   for (i = 2; i >= 0; --i)
+   {
+      end = strrchr(text, ' ');
+      if (end == NULL)
+         return;
+      *end = '\0';
+      fields[i] = end + 1;
+   }
+   client->size = strtoll(fields[2], NULL, 10);
+   
+   memset(&address, 0, sizeof(address));
+   address.sin_family = AF_INET;
+   address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+   address.sin_port = htons(atoi(fields[1]));
+   client->socket = socket(AF_INET, SOCK_STREAM, 0);
+   if (client->socket == -1 ||
+       connect(client->socket, (struct sockaddr*)&address,
+               sizeof(address)) == -1)
+   {
+      fprintf(stderr, "%s couldn't connect to port %s: %s\n", client->nick,
+            fields[1], strerror(errno));
+      BENCH_Finish(client, 1);
+      return;
+   }
+   fcntl(client->socket, F_SETFL,
+         fcntl(client->socket, F_GETFL) | O_NONBLOCK);
+   event.events = EPOLLIN | EPOLLRDHUP;
+   event.data.ptr = client;
+   epoll_ctl(client->loop, EPOLL_CTL_ADD, client->socket, &event);
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Reads what arrived and acknowledges it with the 32 bit big endian count
+// of bytes received, the way mIRC does.
+/////////////////////////////////////////////////////////////////////////////
+void BENCH_OnData(struct BenchClient *client, char *buffer)
+{
+   unsigned char ack[4];
+   unsigned int position;
+   ssize_t received;
+   long long before = client->received;
+   
+   while ((received = recv(client->socket, buffer, DCC_READ_CHUNK, 0)) > 0)
+   {
+      if (client->firstByteAt == 0)
+         client->firstByteAt = monotonicNs();
+      client->received += received;
+   }
+   if (client->received > before)
+   {
+      position = (unsigned int)client->received;
+      ack[0] = position >> 24;
+      ack[1] = position >> 16;
+      ack[2] = position >> 8;
+      ack[3] = position;
+      send(client->socket, ack, sizeof(ack), MSG_NOSIGNAL);
+   }
+   if (client->received >= client->size)
+      BENCH_Finish(client, 0);
+   else if (received == 0 ||
+            (received == -1 && errno != EAGAIN && errno != EWOULDBLOCK &&
+             errno != EINTR))
+   {
+      fprintf(stderr, "%s: transfer broke off after %lld of %lld bytes\n",
+            client->nick, client->received, client->size);
+      BENCH_Finish(client, 1);
+   }
+}
+
+//reads the bot's lines that are waiting without blocking
+void BENCH_OnIrc()
+{
+   char line[IRC_LINE_SIZE];
+   
+   if (BENCH_FillBuffer(0) == 0)
+   {
+      fprintf(stderr, "The bot hung up\n");
+      epoll_ctl(epollFd, EPOLL_CTL_DEL, ircSocket, NULL);
+   }
+   while (BENCH_NextLine(line) != NULL)
+   {
+      if (verbose)
+         fprintf(stderr, "bot: %s\n", line);
+      if (strncmp(line, "PRIVMSG ", 8) == 0)
+         BENCH_OnOffer(line);
+      else if (strncmp(line, "PING ", 5) == 0)
+         BENCH_SendLine(":bench.local PONG bench.local\r\n");
+   }
+}
+
+//true once every client is done or the time is up
+int BENCH_Over()
+{
+   return __atomic_load_n(&finishedClients, __ATOMIC_ACQUIRE) >= numClients ||
+          monotonicNs() >= deadline;
+}
+
+//with -j, every thread past the first downloads the clients of its loop
+void *BENCH_DownloadThread(void *argument)
+{
+   struct epoll_event events[64];
+   int loop = *(int*)argument;
+   char *buffer = malloc(DCC_READ_CHUNK);
+   int count;
+   int i;
+   
+   while (!BENCH_Over())
+   {
+      count = epoll_wait(loop, events, 64, 100);
+      for (i = 0; i < count; ++i)
+         BENCH_OnData(events[i].data.ptr, buffer);
+   }
+   free(buffer);
+   return NULL;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// The bot's CPU time in seconds, its finished children included, from
+// /proc/<pid>/stat.
+/////////////////////////////////////////////////////////////////////////////
+double BENCH_BotCpu()
+{
+   char path[64];
+   char stat[1024];
+   char *fields;
+   unsigned long long user, system, childUser, childSystem;
+   FILE *file;
+   size_t length;
+   
+   snprintf(path, sizeof(path), "/proc/%d/stat", (int)bot);
+   file = fopen(path, "r");
+   if (file == NULL)
+      return 0;
+   length = fread(stat, 1, sizeof(stat) - 1, file);
+   fclose(file);
+   stat[length] = '\0';
+   //the command name may contain spaces, the fields start after its ")"
+   fields = strrchr(stat, ')');
+   if (fields == NULL ||
+       sscanf(fields + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu "
+              "%llu %llu %llu", &user, &system, &childUser,
+              &childSystem) != 4)
+      return 0;
+   return (double)(user + system + childUser + childSystem) /
+          sysconf(_SC_CLK_TCK);
+}
+
+//the bot's peak resident set in kB
+long BENCH_BotPeakRss()
+{
+   char path[64];
+   char line[256];
+   long peak = 0;
+   FILE *file;
+   
+   snprintf(path, sizeof(path), "/proc/%d/status", (int)bot);
+   file = fopen(path, "r");
+   if (file == NULL)
+      return 0;
+   while (fgets(line, sizeof(line), file) != NULL)
+      if (sscanf(line, "VmHWM: %ld", &peak) == 1)
+         break;
+   fclose(file);
+   return peak;
+}
+
+int compareDoubles(const void *left, const void *right)
+{
+   double a = *(const double*)left;
+   double b = *(const double*)right;
+   
+   return a < b ? -1 : a > b;
+}
+
+//nearest rank percentile of sorted values
+double percentile(double *sorted, int count, double p)
+{
+   int rank = (int)(p / 100.0 * count + 0.999999);
+   
+   if (count == 0)
+      return 0;
+   if (rank < 1)
+      rank = 1;
+   return sorted[rank - 1];
+}
+
+void BENCH_Report(long long started, double botCpu, long peakRss,
+                  double benchCpu)
+{
+   double *firstByte = malloc(sizeof(double) * numClients);
+   double *completion = malloc(sizeof(double) * numClients);
+   long long bytes = 0;
+   long long lastDone = started;
+   double seconds;
+   int done = 0;
+   int failed = 0;
+   int i;
+   
+   for (i = 0; i < numClients; ++i)
+   {
+      bytes += clients[i].received;
+      if (clients[i].doneAt == 0)
+      {
+         ++failed;
+         continue;
+      }
+      firstByte[done] = (clients[i].firstByteAt - clients[i].requestedAt) /
+                        1e6;
+      completion[done] = (clients[i].doneAt - clients[i].requestedAt) / 1e9;
+      if (clients[i].doneAt > lastDone)
+         lastDone = clients[i].doneAt;
+      ++done;
+   }
+   qsort(firstByte, done, sizeof(double), compareDoubles);
+   qsort(completion, done, sizeof(double), compareDoubles);
+   seconds = (lastDone - started) / 1e9;
+   
+   printf("quiznoBench: %i clients, %i files of %.1f MB", numClients,
+          numFiles, fileSize / 1048576.0);
+   for (i = 0; i < numBotOptions; ++i)
+      printf("%s%s", i == 0 ? ", " : " ", botOptions[i]);
+   printf("\n");
+   printf("  completed           %i of %i (%i failed)\n", done, numClients,
+          failed);
+   printf("  transferred         %.1f MB in %.2f s, %.1f MB/s\n",
+          bytes / 1048576.0, seconds,
+          seconds > 0 ? bytes / 1048576.0 / seconds : 0);
+   printf("  time to first byte  p50 %.2f ms, p99 %.2f ms, max %.2f ms\n",
+          percentile(firstByte, done, 50), percentile(firstByte, done, 99),
+          done > 0 ? firstByte[done - 1] : 0);
+   printf("  completion time     p50 %.3f s, p99 %.3f s, max %.3f s\n",
+          percentile(completion, done, 50), percentile(completion, done, 99),
+          done > 0 ? completion[done - 1] : 0);
+   printf("  bot CPU             %.2f s, %.2f s per GB\n", botCpu,
+          bytes > 0 ? botCpu / (bytes / 1073741824.0) : 0);
+   printf("  bot peak RSS        %.1f MB\n", peakRss / 1024.0);
+   printf("  benchmark CPU       %.2f s\n", benchCpu);
+   free(firstByte);
+   free(completion);
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// The run: every client asks for its pack at once, then one epoll loop
+// downloads all the offers that come back. With -j the clients are dealt
+// out to that many loops, the first of which also reads the IRC side.
+/////////////////////////////////////////////////////////////////////////////
+int BENCH_Run()
+{
+   struct epoll_event events[64];
+   struct epoll_event event;
+   struct rusage usage;
+   pthread_t *threads;
+   char request[256];
+   char *buffer;
+   long long started;
+   double cpuBefore, botCpu, benchCpu;
+   long peakRss;
+   int completed = 0;
+   int count;
+   int i;
+   
+   clients = calloc(numClients, sizeof(struct BenchClient));
+   epollFd = epoll_create1(0);
+   event.events = EPOLLIN;
+   event.data.ptr = NULL;
+   epoll_ctl(epollFd, EPOLL_CTL_ADD, ircSocket, &event);
+   buffer = malloc(DCC_READ_CHUNK);
+   threads = calloc(numThreads, sizeof(pthread_t));
+   threadLoops = calloc(numThreads, sizeof(int));
+   threadLoops[0] = epollFd;
+   for (i = 1; i < numThreads; ++i)
+      threadLoops[i] = epoll_create1(0);
+   
+   cpuBefore = BENCH_BotCpu();
+   started = monotonicNs();
+   deadline = started + timeoutSeconds * 1000000000LL;
+   for (i = 1; i < numThreads; ++i)
+      pthread_create(&threads[i], NULL, BENCH_DownloadThread,
+                     &threadLoops[i]);
+   for (i = 0; i < numClients; ++i)
+   {
+      snprintf(clients[i].nick, sizeof(clients[i].nick), "client%i", i);
+      clients[i].packNumber = i % numFiles;
+      clients[i].socket = -1;
+      clients[i].loop = threadLoops[i % numThreads];
+      clients[i].requestedAt = monotonicNs();
+      snprintf(request, sizeof(request),
+               ":%s!bench@127.0.0.1 PRIVMSG bench :xdcc send #%i\r\n",
+               clients[i].nick, clients[i].packNumber);
+      BENCH_SendLine(request);
+   }
+   
+   while (!BENCH_Over())
+   {
+      count = epoll_wait(epollFd, events, 64, 1000);
+      for (i = 0; i < count; ++i)
+      {
+         if (events[i].data.ptr == NULL)
+            BENCH_OnIrc();
+         else
+            BENCH_OnData(events[i].data.ptr, buffer);
+      }
+   }
+   for (i = 1; i < numThreads; ++i)
+   {
+      pthread_join(threads[i], NULL);
+      close(threadLoops[i]);
+   }
+   for (i = 0; i < numClients; ++i)
+   {
+      if (clients[i].doneAt != 0)
+         ++completed;
+      else if (!clients[i].failed)
+      {
+         fprintf(stderr, "%s timed out after %lld of %lld bytes\n",
+               clients[i].nick, clients[i].received, clients[i].size);
+         BENCH_Finish(&clients[i], 1);
+      }
+   }
+   
+   botCpu = BENCH_BotCpu() - cpuBefore;
+   peakRss = BENCH_BotPeakRss();
+   getrusage(RUSAGE_SELF, &usage);
+   benchCpu = usage.ru_utime.tv_sec + usage.ru_stime.tv_sec +
+              (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+   BENCH_Report(started, botCpu, peakRss, benchCpu);
+   free(buffer);
+   free(threads);
+   //finishedClients counts the failed clients too
+   return completed == numClients ? 0 : 1;
+}
+
+//asks the bot to quit and makes sure it did
+void BENCH_StopBot()
+{
+   int i;
+   
+   if (ircSocket != -1)
+   {
+      BENCH_SendLine(":admin!bench@127.0.0.1 PRIVMSG bench :bot die\r\n");
+      shutdown(ircSocket, SHUT_WR);
+   }
+   for (i = 0; i < BOT_EXIT_TIMEOUT * 10; ++i)
+   {
+      if (waitpid(bot, NULL, WNOHANG) == bot)
+         return;
+      usleep(100000);
+   }
+   kill(bot, SIGKILL);
+   waitpid(bot, NULL, 0);
+}
+
+int main(int argc, char **argv)
+{
+   struct sockaddr_in address;
+   socklen_t addressLength = sizeof(address);
+   int listenSocket;
+   int result = 1;
+   
+   parseCommandline(argc, argv);
+   signal(SIGPIPE, SIG_IGN);
+   
+   if (shareDirectory[0] == '\0' && BENCH_MakeShare() == -1)
+   {
+      BENCH_RemoveShare();
+      return 1;
+   }
+   
+   //the IRC server, on a port the kernel picks
+   listenSocket = socket(AF_INET, SOCK_STREAM, 0);
+   memset(&address, 0, sizeof(address));
+   address.sin_family = AF_INET;
+   address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+   if (listenSocket == -1 ||
+       bind(listenSocket, (struct sockaddr*)&address, sizeof(address)) == -1 ||
+       listen(listenSocket, 1) == -1 ||
+       getsockname(listenSocket, (struct sockaddr*)&address,
+                   &addressLength) == -1)
+   {
+      perror("Couldn't listen for the bot");
+      BENCH_RemoveShare();
+      return 1;
+   }
+   
+   bot = BENCH_StartBot(ntohs(address.sin_port));
+   if (bot == -1)
+      perror("fork");
+   else if (BENCH_Login(listenSocket) == 0)
+      result = BENCH_Run();
+   close(listenSocket);
+   if (bot != -1)
+      BENCH_StopBot();
+   BENCH_RemoveShare();
+   return result;
+}
@@ -22,8 +22,12 @@
 //      quiznoBot -n [nick] -c [channel] -s [server] -p [port] -d [dir] (-v)(-v)
 //    The options work as follows:
 //      -n [nick] -- Specify the name of the bot on the IRC network.
-//      -c [channel] -- specify the channel the bot will join.
-//      -s [server] -- specify the server the bot will join (IPV4 only please)
+//      -c [channel] -- specify the channel the bot will join. Can be given
+//                 more than once or as a comma separated list.
+//      -s [server] -- specify the server the bot will join (IPv4 or IPv6)
+//                 Can be given more than once to serve several networks;
+//                 -n, -c and -p before the first -s apply to every network,
+//                 after an -s only to that network.
 //      -p [port] -- specify the port the server will use
 //      -d [dir] -- specify the directory the server will share.
 //      -v -- increase the debug level (amount of information printed to the
@@ -31,8 +35,15 @@
 //      -e [ip] -- Sets the external IP in case the bot is behind a firewall
 //                 or NAT and cannot receive incomming connections on its 
 //                 network adapter's IP address.
+//      -o [name=value] -- sets one of the tunables listed by -h, for example
+//                 -o sendmode=buffered
+//      -b -- scans and checksums the directory, prints files/s and GB/s,
+//            then times the search index on a million made up names
 /////////////////////////////////////////////////////////////////////////////
 
+//splice() and F_SETPIPE_SZ are Linux extensions
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -48,10 +59,98 @@
 #include <dirent.h>
 #include <sys/wait.h>
 #include <signal.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/sendfile.h>
+#include <poll.h>
+#include <stddef.h>
+#include <limits.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <strings.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/resource.h>
+#include <netinet/tcp.h>
+#include <stdarg.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+//set by the Makefile when the kernel headers know io_uring
+#ifdef HAVE_IO_URING
+#include <linux/io_uring.h>
+#endif
 
 //defines the default timeout in seconds
 #define DEFAULT_TIMEOUT 10
-#define COMMAND_TOKENS 500
+//the receive buffer of the IRC connection, a few lines' worth
+#define IRC_BUFFER_SIZE 8192
+//RFC 1459 allows at most 15 parameters
+#define IRC_MAX_PARAMS 15
+//lines handed to one writev() on the IRC connection
+#define IRC_WRITE_BATCH 32
+//longest line the server relays, CR LF included
+#define IRC_MAX_LINE 512
+//room the server takes for the "nick!user@host " it puts in front of what we
+//say to a channel, not counting the nick
+#define IRC_PREFIX_RESERVE 80
+//how often an idle announcer looks for new packs, in milliseconds
+#define ANNOUNCE_IDLE_CHECK 10000
+//size of the block handed to sendfile()/splice() per call
+#define ZERO_COPY_CHUNK (1024 * 1024)
+//size of the block used by the buffered read()/send() loop
+#define BUFFERED_CHUNK 4096
+//a transfer that sees no acknowledgement for this many seconds is dropped
+#define DCC_STALL_TIMEOUT 180
+//how long a turbo transfer waits for the client to hang up after the last
+//byte went out
+#define DCC_LINGER_TIMEOUT 30
+//how long a DCC offer waits for the client to connect, unless offertimeout
+//says otherwise
+#define DCC_OFFER_TIMEOUT 300
+//how long we try to reach the client of a passive DCC offer
+#define DCC_CONNECT_TIMEOUT 30
+//io=uring: entries of the submission queue, and of the completion queue
+#define URING_ENTRIES 1024
+#define URING_COMPLETIONS 8192
+//io=uring: buffers registered with the kernel, and the size of each, which
+//is also how much of a pack is read and sent at once
+#define URING_BUFFERS 256
+#define URING_CHUNK (64 * 1024)
+
+//a queued request that has been passed over this many times by the
+//smallfirst policy is started next regardless of its size
+#define QUEUE_AGING_LIMIT 8
+
+//a bucket holds at most this many seconds worth of its rate
+#define SHAPER_BURST_SECONDS 0.5
+//a shaped transfer waits until it may send at least this much at once
+#define SHAPER_QUANTUM 16384
+//nicks that can be shaped at the same time
+#define SHAPER_MAX_NICKS 512
+
+//threads that get a block of metric counters of their own; the rest share
+//the last one
+#define METRIC_MAX_BLOCKS 64
+//send slots whose transfers show up one by one in the metrics
+#define METRIC_MAX_TRANSFERS 1024
+//buckets of a histogram, the last one catches everything above the others
+#define METRIC_BUCKETS 8
+//most requested packs that get a series of their own in the metrics
+#define METRIC_TOP_PACKS 10
+//a metrics client that hasn't taken its answer after this many seconds is
+//dropped
+#define METRICS_CLIENT_TIMEOUT 5
+
+//gets the structure a member is embedded in
+#define CONTAINER_OF(pointer, type, member) \
+   ((type*)((char*)(pointer) - offsetof(type, member)))
 
 #define TERM_BLUE_ON_BLACK "\e[36;40m"
 #define TERM_GREEN_ON_BLACK "\e[32;40m"
@@ -69,744 +168,9309 @@ enum CommandLineSettings
    IRC_EXTERNAL_IP_SET = 0x20
 } settings;
 
-struct SharedFile
+enum SendMode
+{
+   SEND_MODE_SENDFILE = 0,
+   SEND_MODE_SPLICE,
+   SEND_MODE_BUFFERED
+};
+
+const char *sendModeNames[] = { "sendfile", "splice", "buffered", NULL };
+
+//how transfers are run: all in this process from the event loop, or one
+//forked child per transfer the way the bot used to work
+enum TransferModel
+{
+   MODEL_REACTOR = 0,
+   MODEL_FORK
+};
+
+const char *transferModelNames[] = { "reactor", "fork", NULL };
+
+//how the reactor model does DCC I/O: a system call at a time when epoll says
+//a socket is ready, or queued on an io_uring
+enum IoBackend
+{
+   IO_EPOLL = 0,
+   IO_URING
+};
+
+const char *ioBackendNames[] = { "epoll", "uring", NULL };
+
+//which queued request gets the next free slot
+enum QueuePolicy
+{
+   QUEUE_ROUND_ROBIN = 0,
+   QUEUE_SMALL_FIRST
+};
+
+const char *queuePolicyNames[] = { "roundrobin", "smallfirst", NULL };
+
+enum TunableType
+{
+   TUNABLE_INT = 0,
+   TUNABLE_SIZE,
+   TUNABLE_CHOICE,
+   TUNABLE_STRING
+};
+
+//a setting that can be changed with -o name=value
+struct Tunable
 {
-   char *filename;
-   long filesize;
+   const char *name;
+   enum TunableType type;
+   void *value;
+   const char **choices; //TUNABLE_CHOICE: NULL terminated list of names
+   size_t size;          //TUNABLE_STRING: size of the destination buffer
+   const char *help;
+   char startupOnly;     //can't be changed with "bot set"
+};
+
+struct PackChecksum
+{
+   unsigned int crc32;
+   unsigned char md5[16];
+};
+
+//the shared packs, one array per field indexed by pack number; see the
+//catalog below
+struct Catalog
+{
+   int numPacks;
+   int size;                   //room in the arrays
+   char *names;                //every name NUL terminated, one after another
+   size_t namesLength;
+   size_t namesSize;
+   unsigned int *nameOffsets;  //where the name of a pack starts in names
+   long *filesizes;
+   time_t *mtimes;
+   unsigned long long *inodes;
+   char *removed;  //gone from the share, the pack number stays reserved
+   char *hashStates;           //HASH_NONE, HASH_QUEUED or HASH_DONE
+   unsigned int *addedVersions; //catalogVersion when it (re)appeared
+   unsigned int *requests;     //times it was asked for since the start
+   double *popularity;         //decaying request count, see CACHE_Touch
+   time_t *popularAt;          //when popularity was last brought up to date
+   struct PackChecksum *checksums;
+   unsigned int retiredEpoch;  //see CATALOG_Retire
+   struct Catalog *nextRetired;
 } *dirContents = NULL;
 
+enum HashState
+{
+   HASH_NONE = 0,
+   HASH_QUEUED,
+   HASH_DONE
+};
+
+//a directory of the share as it was when it was last read
+struct CatalogDirectory
+{
+   char *path;    //relative to the shared directory, "" for the top
+   long long mtimeSeconds;
+   long mtimeNanoseconds;
+   unsigned long long inode;
+};
+
+//an IRC network the bot serves; every -s on the command line adds one
+struct Network
+{
+   char server[128];
+   char port[10];
+   char nick[128];
+   char channels[512];  //comma separated, the way JOIN takes them
+};
+
 struct TransferRequest
 {
+   struct IrcConnection *connection;  //the network the request came from
    int filenumber;
    char nick[128];
+   char turbo;
+   char passive;       //the client listens and we connect, see DCC_Connect
+   int skipped;        //times the smallfirst policy passed it over
+   time_t queuedAt;
 };
 
-struct TransferRequest transferQueue[100];
+//requests waiting for a send slot, a ring buffer of queueSize entries
+struct TransferRequest *transferQueue = NULL;
 int transferQueueFront = 0;
-int transferQueueBack = 0;
+int transferQueueLength = 0;
+
+//a send slot that is taken by an offer or a running transfer
+struct ActiveSlot
+{
+   int id;
+   pid_t pid;          //the child running it in the fork model
+   int port;           //fork model: the port the child listens on
+   int resumePipe;     //fork model: tells the child where to resume
+   struct IrcConnection *connection;
+   int packNumber;
+   char nick[128];
+   struct TransferStats *stats; //NULL when all records are taken
+};
+
+struct ActiveSlot *activeSlots = NULL;
+int numActiveSlots = 0;
+int activeSlotsSize = 0;
+int nextSlotId = 1;
+char lastServedNick[128];
+struct IrcConnection *lastServedConnection = NULL;
+char schedulerDirty = 0;
 
 const char* QUIT_COMMAND = "QUIT :quiznoBot http://blog.codeland.se\r\n";
 
-int sharedFileArraySize = 0;
-int numSharedFiles = 0;
+//bumped whenever a pack is added, removed or resized
+unsigned int catalogVersion = 0;
+//bumped on every change that is saved with the catalog, checksums included
+unsigned int catalogChanges = 0;
+//bumped when a pack appears, goes or changes size: what xdcc list shows
+unsigned int listingVersion = 0;
+//packs that aren't removed, kept up to date so the metrics needn't count
+int numValidPacks = 0;
+//inotify descriptor for the share, and the path (relative to directory) of
+//every watched directory indexed by its watch descriptor
+int catalogWatchFd = -1;
+char **watchedPaths = NULL;
+int watchedPathsSize = 0;
+pthread_mutex_t watchedPathsLock = PTHREAD_MUTEX_INITIALIZER;
+//every directory of the share, with a hash from path to index + 1
+struct CatalogDirectory *catalogDirectories = NULL;
+int numCatalogDirectories = 0;
+int catalogDirectoriesSize = 0;
+int *directoryIndex = NULL;
+int directoryIndexSize = 0;
+//the catalog file and its mapping; paths of loaded directories point into
+//it
+char catalogPath[4096];
+char *catalogMap = NULL;
+size_t catalogMapSize = 0;
+unsigned int savedCatalogChanges = 0;
+//open addressing hash from filename to pack number + 1 (0 is empty)
+int *catalogIndex = NULL;
+int catalogIndexSize = 0;
 
-char channel[128];
+//what networks use unless -n, -c or -p were given after their -s
+char channel[512];
 char nick[128];
 char server[128];
 char directory[512];
 char port[10];
 char externalIP[20];
 
+struct Network *networks = NULL;
+int numNetworks = 0;
+
 int debugLevel = 0;
 
-struct addrinfo *serverAddress;
-struct addrinfo serverAddressHints;
-struct addrinfo *myAddress;
-int serverSocket = -1;
 
-char userCommandSent = 0;
-char nickCommandSent = 0;
-char joinCommandSent = 0;
+int sendMode = SEND_MODE_SENDFILE;
+int transferModel = MODEL_REACTOR;
+int ioBackend = IO_EPOLL;
+int transferWorkers = 0;
+int scanThreads = 0;
+int hashThreads = 2;
+char benchmarkScan = 0;
+int queueSize = 100;
+int sendSlots = 10;
+int nickSlots = 1;
+int nickQueue = 5;
+int queuePolicy = QUEUE_ROUND_ROBIN;
+int announceLines = 6;
+int announceEvery = 1800;
+int floodCost = 2000;
+int floodBurst = 10000;
+int sendQueueLines = 100;
+long long globalRate = 0;
+long long transferRate = 0;
+long long nickRate = 0;
+long long minimumRate = 0;
+char adminPassword[128];
+char metricsAddress[256];
+char statsFile[4096];
+int statsEvery = 60;
+char dccPorts[32] = "41000-41199";
+int offerTimeout = DCC_OFFER_TIMEOUT;
+int passiveLocal = 0;
+long long cacheSize = 256 * 1024 * 1024;
+int cachePacks = 16;
+int searchResults = 5;
+int listPage = 10;
+char running = 1;
+
+struct Tunable tunables[] =
+{
+   { "sendmode", TUNABLE_CHOICE, &sendMode, sendModeNames, 0,
+     "how packs are written to the DCC socket (sendfile, splice, buffered)" },
+   { "model", TUNABLE_CHOICE, &transferModel, transferModelNames, 0,
+     "run transfers in the event loop (reactor) or in forked children (fork)" },
+   { "io", TUNABLE_CHOICE, &ioBackend, ioBackendNames, 0,
+     "DCC I/O of the reactor model: epoll readiness or queued on io_uring",
+     1 },
+   { "workers", TUNABLE_INT, &transferWorkers, NULL, 0,
+     "threads running reactor transfers, 0 for one per CPU, 1 for the main "
+     "loop", 1 },
+   { "slots", TUNABLE_INT, &sendSlots, NULL, 0,
+     "number of packs sent at the same time" },
+   { "nickslots", TUNABLE_INT, &nickSlots, NULL, 0,
+     "number of packs one nick may receive at the same time" },
+   { "nickqueue", TUNABLE_INT, &nickQueue, NULL, 0,
+     "number of packs one nick may have waiting in the queue" },
+   { "queuesize", TUNABLE_INT, &queueSize, NULL, 0,
+     "number of requests the queue holds", 1 },
+   { "scanthreads", TUNABLE_INT, &scanThreads, NULL, 0,
+     "threads that scan the shared directory, 0 for one per CPU (at least 4)" },
+   { "catalog", TUNABLE_STRING, catalogPath, NULL, sizeof(catalogPath),
+     "file the catalog is kept in between runs, none to not keep it", 1 },
+   { "hashthreads", TUNABLE_INT, &hashThreads, NULL, 0,
+     "threads computing CRC32/MD5 checksums in the background, 0 for none",
+     1 },
+   { "announcelines", TUNABLE_INT, &announceLines, NULL, 0,
+     "lines of announces sent to the channel per minute, 0 for none" },
+   { "announceevery", TUNABLE_INT, &announceEvery, NULL, 0,
+     "seconds between announces of the whole list, 0 for only new packs" },
+   { "floodcost", TUNABLE_INT, &floodCost, NULL, 0,
+     "milliseconds the server charges per line we send, 0 for no pacing" },
+   { "floodburst", TUNABLE_INT, &floodBurst, NULL, 0,
+     "milliseconds of charges the server lets us run ahead before it cuts in" },
+   { "sendqueue", TUNABLE_INT, &sendQueueLines, NULL, 0,
+     "lines of replies, and of announces, that may wait to go to the server" },
+   { "queuepolicy", TUNABLE_CHOICE, &queuePolicy, queuePolicyNames, 0,
+     "which request gets a free slot (roundrobin across nicks, smallfirst)" },
+   { "maxrate", TUNABLE_SIZE, &globalRate, NULL, 0,
+     "bytes/s all transfers together may use, 0 for no limit" },
+   { "transferrate", TUNABLE_SIZE, &transferRate, NULL, 0,
+     "bytes/s a single transfer may use, 0 for no limit" },
+   { "nickrate", TUNABLE_SIZE, &nickRate, NULL, 0,
+     "bytes/s all transfers to one nick may use, 0 for no limit" },
+   { "minrate", TUNABLE_SIZE, &minimumRate, NULL, 0,
+     "bytes/s every running transfer gets even when maxrate is used up" },
+   { "metrics", TUNABLE_STRING, metricsAddress, NULL, sizeof(metricsAddress),
+     "serve Prometheus metrics on a port, ip:port or unix socket path", 1 },
+   { "statsfile", TUNABLE_STRING, statsFile, NULL, sizeof(statsFile),
+     "file the metrics are written to every statsevery seconds", 1 },
+   { "statsevery", TUNABLE_INT, &statsEvery, NULL, 0,
+     "seconds between writes of the statsfile" },
+   { "ports", TUNABLE_STRING, dccPorts, NULL, sizeof(dccPorts),
+     "range of ports DCC offers listen on, such as 41000-41199", 1 },
+   { "offertimeout", TUNABLE_INT, &offerTimeout, NULL, 0,
+     "seconds a client has to connect after a DCC offer" },
+   { "passivelocal", TUNABLE_INT, &passiveLocal, NULL, 0,
+     "1 lets passive DCC connect to loopback, private and link-local IPs" },
+   { "cachesize", TUNABLE_SIZE, &cacheSize, NULL, 0,
+     "bytes of popular packs kept mapped and in the page cache, 0 for none" },
+   { "cachepacks", TUNABLE_INT, &cachePacks, NULL, 0,
+     "number of the most popular packs kept in the cache at most" },
+   { "searchresults", TUNABLE_INT, &searchResults, NULL, 0,
+     "packs listed at most in the answer to xdcc search" },
+   { "listpage", TUNABLE_INT, &listPage, NULL, 0,
+     "packs on a page of xdcc list" },
+   { "adminpass", TUNABLE_STRING, adminPassword, NULL, sizeof(adminPassword),
+     "password for the \"bot set\" command, which is off while unset" },
+   { NULL, 0, NULL, NULL, 0, NULL, 0 }
+};
+
+/////////////////////////////////////////////////////////////////////////////
+// Metrics. Every thread counts into a MetricBlock of its own that no other
+// thread writes, so counting is a plain add without a lock or a locked
+// instruction; whoever exports the numbers sums the blocks. Threads past
+// METRIC_MAX_BLOCKS share the last block and add atomically. Every send
+// slot also gets a TransferStats record in a shared mapping, written by
+// whoever runs the transfer (the event loop or a forked child) and folded
+// into the totals when the slot is freed.
+/////////////////////////////////////////////////////////////////////////////
+enum MetricCounter
+{
+   METRIC_TRANSFERS_STARTED = 0, //of freed slots, running ones are added
+   METRIC_TRANSFERS_COMPLETED,
+   METRIC_TRANSFERS_FAILED,
+   METRIC_SENT_BYTES,            //of freed slots, running ones are added
+   METRIC_HASHED_BYTES,
+   METRIC_CACHE_HITS,
+   METRIC_CACHE_MISSES,
+   METRIC_URING_SUBMITS,         //io_uring_enter() calls
+   METRIC_URING_OPS,             //operations they handed to the kernel
+   METRIC_WORKER_STEALS,         //transfers idle workers took over
+   METRIC_PACK_REQUESTS,
+   METRIC_NUM_COUNTERS
+};
+
+//a bucket counts what is above the previous bound and at most its own, the
+//last one everything above the last bound
+struct MetricHistogram
+{
+   unsigned long long buckets[METRIC_BUCKETS];
+   unsigned long long sum;
+};
+
+struct MetricBlock
+{
+   unsigned long long counters[METRIC_NUM_COUNTERS];
+   struct MetricHistogram queueWait; //seconds from request to slot
+   struct MetricHistogram ircLine;   //nanoseconds to parse and handle a line
+} __attribute__((aligned(64)));     //no two threads write one cache line
+
+const long long queueWaitBounds[METRIC_BUCKETS - 1] =
+   { 1, 10, 30, 60, 300, 900, 3600 };
+const long long ircLineBounds[METRIC_BUCKETS - 1] =
+   { 10000, 50000, 100000, 500000, 1000000, 5000000, 10000000 };
+
+struct TransferStats
+{
+   int slotId;                 //0 when the record is free
+   struct IrcConnection *connection;
+   int packNumber;
+   char nick[128];
+   long long startedAt;        //monotonic ms, 0 until the client connects
+   long long startOffset;
+   long long sentBytes;        //since startOffset
+   long long ackedBytes;       //since startOffset
+   unsigned int rttUs;         //smoothed round trip time of the socket
+   char finished;
+   char succeeded;
+};
+
+struct MetricBlock metricBlocks[METRIC_MAX_BLOCKS];
+int numMetricBlocks = 0;
+//the most requested packs, most first; the event loop keeps them
+int topPacks[METRIC_TOP_PACKS];
+int numTopPacks = 0;
+__thread struct MetricBlock *metricBlock = NULL;
+__thread char metricBlockShared = 0;
+struct TransferStats *transferStats = NULL;
+
+void METRIC_Init()
+{
+   transferStats = mmap(NULL, sizeof(struct TransferStats) *
+                        METRIC_MAX_TRANSFERS, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+   if (transferStats == MAP_FAILED)
+   {
+      perror("mmap");
+      exit(1);
+   }
+}
 
-int transferPort = 41000;
-char transferPortString[10];
+long long METRIC_Clock()
+{
+   struct timespec now;
+   
+   clock_gettime(CLOCK_MONOTONIC, &now);
+   return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
 
-int enqueueTransfer(int filenumber, char* nick)
+struct MetricBlock *METRIC_Block()
 {
-   ++transferQueueBack;
-   transferQueue[transferQueueBack].filenumber = filenumber;
-   strcpy(transferQueue[transferQueueBack].nick, nick);
-   return transferQueueBack;
+   int index;
+   
+   if (metricBlock == NULL)
+   {
+      index = __atomic_fetch_add(&numMetricBlocks, 1, __ATOMIC_RELAXED);
+      if (index >= METRIC_MAX_BLOCKS - 1)
+      {
+         index = METRIC_MAX_BLOCKS - 1;
+         metricBlockShared = 1;
+      }
+      metricBlock = &metricBlocks[index];
+   }
+   return metricBlock;
 }
 
-void dequeueTransfer()
+//the store is atomic only so a reader never sees half of it
+void METRIC_Bump(unsigned long long *cell, unsigned long long value)
 {
-   ++transferQueueFront;
-   if (transferQueueFront > transferQueueBack) --transferQueueFront;
+   if (metricBlockShared)
+      __atomic_fetch_add(cell, value, __ATOMIC_RELAXED);
+   else
+      __atomic_store_n(cell, *cell + value, __ATOMIC_RELAXED);
 }
 
-void printUsage()
+void METRIC_Count(enum MetricCounter counter, unsigned long long value)
 {
-   printf("Usage: %squiznoBot%s [options]\n", TERM_YELLOW_ON_BLACK,
-         TERM_RESET_COLOR);
-   printf("%sOptions:%s\n", TERM_RED_ON_BLACK, TERM_RESET_COLOR);
-   printf("\t%ss %sserver%s - %sSets the server to connect to.%s\n",
-         TERM_RED_ON_BLACK, TERM_BLUE_ON_BLACK, TERM_RESET_COLOR,
-         TERM_GREEN_ON_BLACK, TERM_RESET_COLOR);
-   printf("\t%sc %schannel%s - %sSets the channel to join.%s\n",
-         TERM_RED_ON_BLACK, TERM_BLUE_ON_BLACK, TERM_RESET_COLOR,
-         TERM_GREEN_ON_BLACK, TERM_RESET_COLOR);
-   printf("\t%sn %snick%s - %sSets the bot's nickname.%s\n",
-         TERM_RED_ON_BLACK, TERM_BLUE_ON_BLACK, TERM_RESET_COLOR,
-         TERM_GREEN_ON_BLACK, TERM_RESET_COLOR);
-   printf("\t%sd %sdirectory%s - %sSets the directory the bot scans for files.%s\n",
-         TERM_RED_ON_BLACK, TERM_BLUE_ON_BLACK, TERM_RESET_COLOR,
-         TERM_GREEN_ON_BLACK, TERM_RESET_COLOR);
-   printf("\t%sp %sport%s - %sSets the port to use to connect to the server.%s\n",
-         TERM_RED_ON_BLACK, TERM_BLUE_ON_BLACK, TERM_RESET_COLOR,
-         TERM_GREEN_ON_BLACK, TERM_RESET_COLOR);
-   printf("\t%sv%s - %sIncreases the verbosity level (can be used more",
-         TERM_RED_ON_BLACK, TERM_RESET_COLOR, TERM_GREEN_ON_BLACK);
-   printf(" than once)%s\n", TERM_RESET_COLOR);
-   printf("\t%se %sip%s - %sSets the IP the bot will send for all",
-         TERM_RED_ON_BLACK, TERM_BLUE_ON_BLACK, TERM_RESET_COLOR,
-         TERM_GREEN_ON_BLACK);
-   printf("file transfers.%s\n\n", TERM_RESET_COLOR);
-   printf("Examples:\n");
-   printf("\t%squiznoBot%s -%ss %sirc.rizon.net%s -%sc %s#eclipse%s -%sn %sMyAwesomeBot%s",
-         TERM_YELLOW_ON_BLACK, TERM_RESET_COLOR,
-         TERM_RED_ON_BLACK, TERM_BLUE_ON_BLACK, TERM_RESET_COLOR,
-         TERM_RED_ON_BLACK, TERM_BLUE_ON_BLACK, TERM_RESET_COLOR,
-         TERM_RED_ON_BLACK, TERM_BLUE_ON_BLACK, TERM_RESET_COLOR);
-   printf(" -%sp %s6667%s\n", TERM_RED_ON_BLACK, TERM_BLUE_ON_BLACK,
-         TERM_RESET_COLOR);
-   printf("\tConnects to irc.rizon.net on port 6667 joins #eclipse and ");
-   printf("sets\n\tthe nick to MyAwesomeBot\n\n");
-   printf("Defaults:\n");
-   printf("\tBy Default the server is run with the following options:\n");
-   printf("\tquiznoBot -d ./ -s irc.zesty-irc.net -c #bottest");
-   printf(" -n IRC_BOT_#### -p 6667\n");
+   METRIC_Bump(&METRIC_Block()->counters[counter], value);
 }
 
-void parseCommandline(int argc, char **argv)
+void METRIC_Observe(struct MetricHistogram *histogram,
+                    const long long *bounds, long long value)
 {
-   int currentArg = 1;
-   while (currentArg < argc)
+   int bucket = 0;
+   
+   while (bucket < METRIC_BUCKETS - 1 && value > bounds[bucket])
+      ++bucket;
+   METRIC_Bump(&histogram->buckets[bucket], 1);
+   METRIC_Bump(&histogram->sum, value);
+}
+
+//xdcc send: counts the request and moves the pack up the top packs
+void METRIC_CountRequest(int packNumber)
+{
+   unsigned int requests = ++dirContents->requests[packNumber];
+   int i = 0;
+   
+   METRIC_Count(METRIC_PACK_REQUESTS, 1);
+   while (i < numTopPacks && topPacks[i] != packNumber)
+      ++i;
+   if (i == numTopPacks)
    {
-      if (argv[currentArg][0] == '-')
+      if (numTopPacks < METRIC_TOP_PACKS)
+         ++numTopPacks;
+      else if (dirContents->requests[topPacks[i - 1]] >= requests)
+         return;
+      i = numTopPacks - 1;
+      topPacks[i] = packNumber;
+   }
+   for (; i > 0 && dirContents->requests[topPacks[i - 1]] < requests; --i)
+   {
+      topPacks[i] = topPacks[i - 1];
+      topPacks[i - 1] = packNumber;
+   }
+}
+
+//a removed pack makes room for the next one asked for
+void METRIC_ForgetPack(int packNumber)
+{
+   int i = 0;
+   
+   while (i < numTopPacks && topPacks[i] != packNumber)
+      ++i;
+   if (i == numTopPacks)
+      return;
+   memmove(&topPacks[i], &topPacks[i + 1],
+           sizeof(int) * (numTopPacks - i - 1));
+   --numTopPacks;
+}
+
+//called by the event loop only, so the records need no lock
+struct TransferStats *METRIC_ClaimTransfer(struct IrcConnection *connection,
+                                           const char *nick, int packNumber,
+                                           int slotId)
+{
+   struct TransferStats *stats;
+   int i;
+   
+   for (i = 0; i < METRIC_MAX_TRANSFERS; ++i)
+   {
+      stats = &transferStats[i];
+      if (stats->slotId != 0)
+         continue;
+      memset(stats, 0, sizeof(struct TransferStats));
+      stats->slotId = slotId;
+      stats->connection = connection;
+      stats->packNumber = packNumber;
+      snprintf(stats->nick, sizeof(stats->nick), "%s", nick);
+      return stats;
+   }
+   return NULL;
+}
+
+void METRIC_ReleaseTransfer(struct TransferStats *stats)
+{
+   if (stats == NULL)
+      return;
+   if (stats->startedAt != 0)
+   {
+      METRIC_Count(METRIC_TRANSFERS_STARTED, 1);
+      METRIC_Count(stats->succeeded ? METRIC_TRANSFERS_COMPLETED :
+                   METRIC_TRANSFERS_FAILED, 1);
+      METRIC_Count(METRIC_SENT_BYTES, stats->sentBytes);
+   }
+   stats->slotId = 0;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// The DCC port pool. Every port of the ports range is bound and listening
+// from the start, so an offer takes a socket off the free list instead of
+// racing other offers for a random port. Ports go back to the end of the
+// list, which leaves a port alone for as long as possible before the next
+// offer uses it; a client of an old offer that connects in between is
+// hung up on when the port is taken again.
+/////////////////////////////////////////////////////////////////////////////
+struct PortPool
+{
+   int first;       //the port of sockets[0]
+   int count;
+   int *sockets;    //-1 where the port couldn't be bound
+   int *freeList;   //a ring of indexes into sockets
+   int freeFront;
+   int numFree;
+} portPool;
+
+int PORT_Bind(int port)
+{
+   struct sockaddr_in address;
+   int listenSocket;
+   int one = 1;
+   
+   listenSocket = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                         0);
+   if (listenSocket == -1)
+      return -1;
+   setsockopt(listenSocket, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+   memset(&address, 0, sizeof(address));
+   address.sin_family = AF_INET;
+   address.sin_addr.s_addr = htonl(INADDR_ANY);
+   address.sin_port = htons(port);
+   if (bind(listenSocket, (struct sockaddr*)&address, sizeof(address)) == -1 ||
+       listen(listenSocket, 4) == -1)
+   {
+      close(listenSocket);
+      return -1;
+   }
+   return listenSocket;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Binds the ports range. Ports something else has taken are skipped.
+// Returns -1 if the range is invalid or not one port could be bound.
+/////////////////////////////////////////////////////////////////////////////
+int PORT_Open()
+{
+   struct rlimit files;
+   int first, last;
+   int i;
+   
+   switch (sscanf(dccPorts, "%i-%i", &first, &last))
+   {
+      case 1:
+         last = first;
+         //fall through
+      case 2:
+         if (first > 0 && last <= 65535 && first <= last)
+            break;
+         //fall through
+      default:
+         fprintf(stderr, "Invalid port range: %s\n", dccPorts);
+         return -1;
+   }
+   //every port is a descriptor, on top of the ones transfers need
+   if (getrlimit(RLIMIT_NOFILE, &files) == 0 &&
+       files.rlim_cur < (rlim_t)(last - first + 1) + 256)
+   {
+      files.rlim_cur = files.rlim_max;
+      setrlimit(RLIMIT_NOFILE, &files);
+   }
+   
+   portPool.first = first;
+   portPool.count = last - first + 1;
+   portPool.sockets = malloc(sizeof(int) * portPool.count);
+   portPool.freeList = malloc(sizeof(int) * portPool.count);
+   portPool.freeFront = 0;
+   portPool.numFree = 0;
+   for (i = 0; i < portPool.count; ++i)
+   {
+      portPool.sockets[i] = PORT_Bind(first + i);
+      if (portPool.sockets[i] == -1)
       {
-         switch (argv[currentArg][1])
-         {
-            case 's':
-               if (debugLevel >= 1)
-                  fprintf(stderr, "Setting server to: %s\n", 
-                     argv[currentArg + 1]);
-               strcpy(server, argv[currentArg + 1]);
-               ++currentArg;
-               settings |= IRC_SERVER_SET;
-               break;
-            case 'c':
-               if (debugLevel >= 1)
-                  fprintf(stderr, "Setting channel to: %s\n",
-                     argv[currentArg + 1]);
-               strcpy(channel, argv[currentArg + 1]);
-               ++currentArg;
-               settings |= IRC_CHANNEL_SET;
-               break;
-            case 'n':
-               if (debugLevel >= 1)
-                  fprintf(stderr, "Setting nick to: %s\n",
-                     argv[currentArg + 1]);
-               strcpy(nick, argv[currentArg + 1]);
-               ++currentArg;
-               settings |= IRC_NICK_SET;
-               break;
-            case 'd':
-               if (debugLevel >= 1)
-                  fprintf(stderr, "Setting directory to: %s\n",
-                     argv[currentArg + 1]);
-               strcpy(directory, argv[currentArg + 1]);
-               ++currentArg;
-               settings |= BOT_DIRECTORY_SET;
-               break;
-            case 'p':
-               if (debugLevel >= 1)
-                  fprintf(stderr, "Setting port to: %i\n",
-                     atoi(argv[currentArg + 1]));
-               strcpy(port, argv[currentArg + 1]);
-               ++currentArg;
-               settings |= IRC_PORT_SET;
-               break;
-            case 'v':
-               ++debugLevel;
-               fprintf(stderr, "Increasing debug level to: %i\n", debugLevel);
-               break;
-            case '?':
-               printUsage();
-               exit(0);
-               break;
-            case 'h':
-               printUsage();
-               exit(0);
-               break;
-            case 'e':
-               strcpy(externalIP, argv[currentArg + 1]);
-               ++currentArg;
-               settings |= IRC_EXTERNAL_IP_SET;
-               break;
-            default:
-               fprintf(stderr, "Unknown option: %c", argv[currentArg][1]);
-               break;
-         }
+         if (debugLevel > 0)
+            fprintf(stderr, "Couldn't bind DCC port %i: %s\n", first + i,
+                  strerror(errno));
+         continue;
       }
-      ++currentArg;
+      portPool.freeList[portPool.numFree++] = i;
+   }
+   if (portPool.numFree == 0)
+   {
+      fprintf(stderr, "Couldn't bind any DCC port in %s\n", dccPorts);
+      return -1;
+   }
+   if (debugLevel > 0)
+      fprintf(stderr, "Listening on %i DCC ports from %i\n", portPool.numFree,
+            first);
+   return 0;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Takes a port off the free list and returns its listening socket, or -1 if
+// every port is in use by an offer.
+/////////////////////////////////////////////////////////////////////////////
+int PORT_Take(int *port)
+{
+   int index;
+   int stale;
+   
+   if (portPool.numFree == 0)
+      return -1;
+   index = portPool.freeList[portPool.freeFront];
+   portPool.freeFront = (portPool.freeFront + 1) % portPool.count;
+   --portPool.numFree;
+   while ((stale = accept4(portPool.sockets[index], NULL, NULL,
+                           SOCK_CLOEXEC)) != -1)
+      close(stale);
+   *port = portPool.first + index;
+   return portPool.sockets[index];
+}
+
+//puts a port back at the end of the free list
+void PORT_Return(int port)
+{
+   int index = port - portPool.first;
+   
+   if (index < 0 || index >= portPool.count || portPool.sockets[index] == -1)
+      return;
+   portPool.freeList[(portPool.freeFront + portPool.numFree) %
+                     portPool.count] = index;
+   ++portPool.numFree;
+   schedulerDirty = 1;
+}
+
+struct TransferRequest *queueEntry(int position)
+{
+   return &transferQueue[(transferQueueFront + position) % queueSize];
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Adds a request to the back of the queue. Returns its position (counting
+// from 0) or -1 if the queue is full.
+/////////////////////////////////////////////////////////////////////////////
+int enqueueTransfer(struct IrcConnection *connection, int filenumber,
+                    const char* nick, char turbo, char passive)
+{
+   struct TransferRequest *request;
+   
+   if (transferQueue == NULL)
+      transferQueue = calloc(queueSize, sizeof(struct TransferRequest));
+   if (transferQueueLength >= queueSize)
+      return -1;
+   request = queueEntry(transferQueueLength);
+   request->connection = connection;
+   request->filenumber = filenumber;
+   snprintf(request->nick, sizeof(request->nick), "%s", nick);
+   request->turbo = turbo;
+   request->passive = passive;
+   request->skipped = 0;
+   request->queuedAt = time(NULL);
+   return transferQueueLength++;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Removes the request at the given position, closing the gap by moving the
+// requests in front of it back one place.
+/////////////////////////////////////////////////////////////////////////////
+void dequeueTransfer(int position)
+{
+   if (position < 0 || position >= transferQueueLength)
+      return;
+   for (; position > 0; --position)
+      *queueEntry(position) = *queueEntry(position - 1);
+   transferQueueFront = (transferQueueFront + 1) % queueSize;
+   --transferQueueLength;
+}
+
+//the same nick on two networks is two different people
+int SCHED_SameUser(struct IrcConnection *connection, const char *nick,
+                   struct IrcConnection *otherConnection,
+                   const char *otherNick)
+{
+   return connection == otherConnection && strcasecmp(nick, otherNick) == 0;
+}
+
+int SCHED_NickActive(struct IrcConnection *connection, const char *nick)
+{
+   int i;
+   int count = 0;
+   
+   for (i = 0; i < numActiveSlots; ++i)
+      if (SCHED_SameUser(activeSlots[i].connection, activeSlots[i].nick,
+                         connection, nick))
+         ++count;
+   return count;
+}
+
+int SCHED_NickQueued(struct IrcConnection *connection, const char *nick)
+{
+   int i;
+   int count = 0;
+   
+   for (i = 0; i < transferQueueLength; ++i)
+      if (SCHED_SameUser(queueEntry(i)->connection, queueEntry(i)->nick,
+                         connection, nick))
+         ++count;
+   return count;
+}
+
+int SCHED_ClaimSlot(struct IrcConnection *connection, const char *nick,
+                    int packNumber)
+{
+   struct ActiveSlot *slot;
+   
+   if (numActiveSlots == activeSlotsSize)
+   {
+      activeSlotsSize = activeSlotsSize == 0 ? 16 : activeSlotsSize * 2;
+      activeSlots = realloc(activeSlots,
+                            sizeof(struct ActiveSlot) * activeSlotsSize);
+   }
+   slot = &activeSlots[numActiveSlots++];
+   slot->id = nextSlotId++;
+   slot->pid = 0;
+   slot->port = 0;
+   slot->resumePipe = -1;
+   slot->connection = connection;
+   slot->packNumber = packNumber;
+   snprintf(slot->nick, sizeof(slot->nick), "%s", nick);
+   slot->stats = METRIC_ClaimTransfer(connection, nick, packNumber, slot->id);
+   return slot->id;
+}
+
+void SCHED_SetSlotChild(int slotId, pid_t pid, int port, int resumePipe)
+{
+   int i;
+   
+   for (i = 0; i < numActiveSlots; ++i)
+   {
+      if (activeSlots[i].id == slotId)
+      {
+         activeSlots[i].pid = pid;
+         activeSlots[i].port = port;
+         activeSlots[i].resumePipe = resumePipe;
+      }
+   }
+}
+
+//frees the slot and lets the main loop hand it to the next request
+void SCHED_ReleaseSlot(int slotId)
+{
+   int i;
+   
+   for (i = 0; i < numActiveSlots; ++i)
+   {
+      if (activeSlots[i].id == slotId)
+      {
+         if (activeSlots[i].resumePipe != -1)
+            close(activeSlots[i].resumePipe);
+         //a forked child holds its port until it exits
+         if (activeSlots[i].port != 0)
+            PORT_Return(activeSlots[i].port);
+         METRIC_ReleaseTransfer(activeSlots[i].stats);
+         activeSlots[i] = activeSlots[--numActiveSlots];
+         schedulerDirty = 1;
+         return;
+      }
+   }
+}
+
+struct TransferStats *SCHED_SlotStats(int slotId)
+{
+   int i;
+   
+   for (i = 0; i < numActiveSlots; ++i)
+      if (activeSlots[i].id == slotId)
+         return activeSlots[i].stats;
+   return NULL;
+}
+
+void SCHED_ReleasePid(pid_t pid)
+{
+   int i;
+   
+   for (i = 0; i < numActiveSlots; ++i)
+   {
+      if (activeSlots[i].pid == pid)
+      {
+         SCHED_ReleaseSlot(activeSlots[i].id);
+         return;
+      }
+   }
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Parses a size such as 4096, 64k, 10m or 1g into a number of bytes.
+/////////////////////////////////////////////////////////////////////////////
+long long parseSize(const char *text)
+{
+   char *end = NULL;
+   long long value = strtoll(text, &end, 10);
+   
+   switch (*end)
+   {
+      case 'k': case 'K': value *= 1024LL; break;
+      case 'm': case 'M': value *= 1024LL * 1024LL; break;
+      case 'g': case 'G': value *= 1024LL * 1024LL * 1024LL; break;
+   }
+   return value;
+}
+
+struct Tunable *findTunable(const char *name, size_t nameLength)
+{
+   struct Tunable *current;
+   
+   for (current = tunables; current->name != NULL; ++current)
+   {
+      if (strlen(current->name) == nameLength &&
+          strncmp(current->name, name, nameLength) == 0)
+         return current;
+   }
+   return NULL;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Applies a "name=value" setting. Returns 0 on success and -1 if the name
+// is unknown or the value isn't valid for it.
+/////////////////////////////////////////////////////////////////////////////
+int setTunable(const char *assignment)
+{
+   const char *equals = strchr(assignment, '=');
+   const char *value;
+   struct Tunable *tunable;
+   int i;
+   
+   if (equals == NULL)
+   {
+      fprintf(stderr, "Expected name=value, got: %s\n", assignment);
+      return -1;
+   }
+   tunable = findTunable(assignment, equals - assignment);
+   if (tunable == NULL)
+   {
+      fprintf(stderr, "Unknown tunable: %s\n", assignment);
+      return -1;
+   }
+   value = equals + 1;
+   
+   switch (tunable->type)
+   {
+      case TUNABLE_INT:
+         *(int*)tunable->value = atoi(value);
+         break;
+      case TUNABLE_SIZE:
+         *(long long*)tunable->value = parseSize(value);
+         break;
+      case TUNABLE_CHOICE:
+         for (i = 0; tunable->choices[i] != NULL; ++i)
+         {
+            if (strcmp(tunable->choices[i], value) == 0)
+            {
+               *(int*)tunable->value = i;
+               break;
+            }
+         }
+         if (tunable->choices[i] == NULL)
+         {
+            fprintf(stderr, "Invalid value for %s: %s\n", tunable->name,
+                  value);
+            return -1;
+         }
+         break;
+      case TUNABLE_STRING:
+         snprintf((char*)tunable->value, tunable->size, "%s", value);
+         break;
+   }
+   if (debugLevel >= 1)
+      fprintf(stderr, "Setting %s to: %s\n", tunable->name, value);
+   return 0;
+}
+
+void printUsage()
+{
+   struct Tunable *tunable;
+   
+   printf("Usage: %squiznoBot%s [options]\n", TERM_YELLOW_ON_BLACK,
+         TERM_RESET_COLOR);
+   printf("%sOptions:%s\n", TERM_RED_ON_BLACK, TERM_RESET_COLOR);
+   printf("\t%ss %sserver%s - %sSets the server to connect to. Repeat it to",
+         TERM_RED_ON_BLACK, TERM_BLUE_ON_BLACK, TERM_RESET_COLOR,
+         TERM_GREEN_ON_BLACK);
+   printf(" serve several networks; c, n and p after it belong to that");
+   printf(" network.%s\n", TERM_RESET_COLOR);
+   printf("\t%sc %schannel%s - %sSets the channel to join (repeat it or use",
+         TERM_RED_ON_BLACK, TERM_BLUE_ON_BLACK, TERM_RESET_COLOR,
+         TERM_GREEN_ON_BLACK);
+   printf(" commas for more).%s\n", TERM_RESET_COLOR);
+   printf("\t%sn %snick%s - %sSets the bot's nickname.%s\n",
+         TERM_RED_ON_BLACK, TERM_BLUE_ON_BLACK, TERM_RESET_COLOR,
+         TERM_GREEN_ON_BLACK, TERM_RESET_COLOR);
+   printf("\t%sd %sdirectory%s - %sSets the directory the bot scans for files.%s\n",
+         TERM_RED_ON_BLACK, TERM_BLUE_ON_BLACK, TERM_RESET_COLOR,
+         TERM_GREEN_ON_BLACK, TERM_RESET_COLOR);
+   printf("\t%sp %sport%s - %sSets the port to use to connect to the server.%s\n",
+         TERM_RED_ON_BLACK, TERM_BLUE_ON_BLACK, TERM_RESET_COLOR,
+         TERM_GREEN_ON_BLACK, TERM_RESET_COLOR);
+   printf("\t%sv%s - %sIncreases the verbosity level (can be used more",
+         TERM_RED_ON_BLACK, TERM_RESET_COLOR, TERM_GREEN_ON_BLACK);
+   printf(" than once)%s\n", TERM_RESET_COLOR);
+   printf("\t%se %sip%s - %sSets the IP the bot will send for all",
+         TERM_RED_ON_BLACK, TERM_BLUE_ON_BLACK, TERM_RESET_COLOR,
+         TERM_GREEN_ON_BLACK);
+   printf("file transfers.%s\n", TERM_RESET_COLOR);
+   printf("\t%sb%s - %sScans and checksums the directory, prints how fast that",
+         TERM_RED_ON_BLACK, TERM_RESET_COLOR, TERM_GREEN_ON_BLACK);
+   printf(" went,\n\t\ttimes the search index on a million made up names "
+         "and exits.%s\n", TERM_RESET_COLOR);
+   printf("\t%so %sname=value%s - %sSets one of the tunables below.%s\n\n",
+         TERM_RED_ON_BLACK, TERM_BLUE_ON_BLACK, TERM_RESET_COLOR,
+         TERM_GREEN_ON_BLACK, TERM_RESET_COLOR);
+   printf("Tunables:\n");
+   for (tunable = tunables; tunable->name != NULL; ++tunable)
+      printf("\t%s%s%s - %s%s%s\n", TERM_BLUE_ON_BLACK, tunable->name,
+            TERM_RESET_COLOR, TERM_GREEN_ON_BLACK, tunable->help,
+            TERM_RESET_COLOR);
+   printf("\n");
+   printf("Examples:\n");
+   printf("\t%squiznoBot%s -%ss %sirc.rizon.net%s -%sc %s#eclipse%s -%sn %sMyAwesomeBot%s",
+         TERM_YELLOW_ON_BLACK, TERM_RESET_COLOR,
+         TERM_RED_ON_BLACK, TERM_BLUE_ON_BLACK, TERM_RESET_COLOR,
+         TERM_RED_ON_BLACK, TERM_BLUE_ON_BLACK, TERM_RESET_COLOR,
+         TERM_RED_ON_BLACK, TERM_BLUE_ON_BLACK, TERM_RESET_COLOR);
+   printf(" -%sp %s6667%s\n", TERM_RED_ON_BLACK, TERM_BLUE_ON_BLACK,
+         TERM_RESET_COLOR);
+   printf("\tConnects to irc.rizon.net on port 6667 joins #eclipse and ");
+   printf("sets\n\tthe nick to MyAwesomeBot\n\n");
+   printf("Defaults:\n");
+   printf("\tBy Default the server is run with the following options:\n");
+   printf("\tquiznoBot -d ./ -s irc.zesty-irc.net -c #bottest");
+   printf(" -n IRC_BOT_#### -p 6667\n");
+}
+
+//-c may be given more than once, and takes comma separated lists too
+void addChannels(char *channels, size_t size, const char *toAdd)
+{
+   size_t length = strlen(channels);
+   
+   snprintf(channels + length, size - length, "%s%s", length > 0 ? "," : "",
+            toAdd);
+}
+
+void addNetwork(const char *serverName)
+{
+   struct Network *network;
+   
+   networks = realloc(networks, sizeof(struct Network) * (numNetworks + 1));
+   network = &networks[numNetworks++];
+   memset(network, 0, sizeof(struct Network));
+   snprintf(network->server, sizeof(network->server), "%s", serverName);
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Every -s adds a network. -n, -c and -p given before the first -s are the
+// defaults of all networks; after an -s they only apply to that network.
+/////////////////////////////////////////////////////////////////////////////
+void parseCommandline(int argc, char **argv)
+{
+   struct Network *network = NULL;
+   int currentArg = 1;
+   while (currentArg < argc)
+   {
+      if (argv[currentArg][0] == '-')
+      {
+         switch (argv[currentArg][1])
+         {
+            case 's':
+               if (debugLevel >= 1)
+                  fprintf(stderr, "Setting server to: %s\n", 
+                     argv[currentArg + 1]);
+               addNetwork(argv[currentArg + 1]);
+               network = &networks[numNetworks - 1];
+               ++currentArg;
+               settings |= IRC_SERVER_SET;
+               break;
+            case 'c':
+               if (debugLevel >= 1)
+                  fprintf(stderr, "Setting channel to: %s\n",
+                     argv[currentArg + 1]);
+               if (network != NULL)
+                  addChannels(network->channels, sizeof(network->channels),
+                              argv[currentArg + 1]);
+               else
+               {
+                  addChannels(channel, sizeof(channel), argv[currentArg + 1]);
+                  settings |= IRC_CHANNEL_SET;
+               }
+               ++currentArg;
+               break;
+            case 'n':
+               if (debugLevel >= 1)
+                  fprintf(stderr, "Setting nick to: %s\n",
+                     argv[currentArg + 1]);
+               if (network != NULL)
+                  snprintf(network->nick, sizeof(network->nick), "%s",
+                           argv[currentArg + 1]);
+               else
+               {
+                  snprintf(nick, sizeof(nick), "%s", argv[currentArg + 1]);
+                  settings |= IRC_NICK_SET;
+               }
+               ++currentArg;
+               break;
+            case 'd':
+               if (debugLevel >= 1)
+                  fprintf(stderr, "Setting directory to: %s\n",
+                     argv[currentArg + 1]);
+               strcpy(directory, argv[currentArg + 1]);
+               ++currentArg;
+               settings |= BOT_DIRECTORY_SET;
+               break;
+            case 'p':
+               if (debugLevel >= 1)
+                  fprintf(stderr, "Setting port to: %i\n",
+                     atoi(argv[currentArg + 1]));
+               if (network != NULL)
+                  snprintf(network->port, sizeof(network->port), "%s",
+                           argv[currentArg + 1]);
+               else
+               {
+                  snprintf(port, sizeof(port), "%s", argv[currentArg + 1]);
+                  settings |= IRC_PORT_SET;
+               }
+               ++currentArg;
+               break;
+            case 'v':
+               ++debugLevel;
+               fprintf(stderr, "Increasing debug level to: %i\n", debugLevel);
+               break;
+            case '?':
+               printUsage();
+               exit(0);
+               break;
+            case 'h':
+               printUsage();
+               exit(0);
+               break;
+            case 'e':
+               strcpy(externalIP, argv[currentArg + 1]);
+               ++currentArg;
+               settings |= IRC_EXTERNAL_IP_SET;
+               break;
+            case 'b':
+               benchmarkScan = 1;
+               break;
+            case 'o':
+               if (currentArg + 1 >= argc ||
+                   setTunable(argv[currentArg + 1]) != 0)
+                  exit(-1);
+               ++currentArg;
+               break;
+            default:
+               fprintf(stderr, "Unknown option: %c", argv[currentArg][1]);
+               break;
+         }
+      }
+      ++currentArg;
+   }
+}
+
+void setDefaults()
+{
+   int i;
+   
+   if ((settings & IRC_PORT_SET) == 0x0) //if the port wasn't set...
+   {
+      if (debugLevel >= 1)
+         fprintf(stderr, "Port not set: defaulting to 6667...\n");
+      strcpy(port, "6667");
+   }
+   
+   if ((settings & IRC_SERVER_SET) == 0x0) //if the server wasn't set
+   {
+      if (debugLevel >= 1)
+         fprintf(stderr, "Server not set: defaulting to irc.freenode.net\n");
+      strcpy(server, "irc.freenode.net");
+      addNetwork(server);
+   }
+   
+   if ((settings & IRC_NICK_SET) == 0x0) //if the nick wasn't set
+   {
+      sprintf(nick, "IRC_BOT_%04d", rand() % 10000);
+      if (debugLevel >= 1)
+         fprintf(stderr, "Nick not set: defaulting to %s\n", nick);
+   }
+   
+   if ((settings & BOT_DIRECTORY_SET) == 0x0) //if the directory wasn't set
+   {
+      getcwd(directory, 512);
+      if (debugLevel >= 1)
+         fprintf(stderr, "Directory not set: defaulting to %s\n", directory);
+   }
+   
+   if ((settings & IRC_CHANNEL_SET) == 0x0) //if the channel wasn't set
+   {
+      strcpy(channel, "#bottest");
+      if (debugLevel >= 1)
+         fprintf(stderr, "Channel not set: defaulting to %s\n", channel);
+   }
+   
+   for (i = 0; i < numNetworks; ++i)
+   {
+      if (networks[i].nick[0] == '\0')
+         strcpy(networks[i].nick, nick);
+      if (networks[i].port[0] == '\0')
+         strcpy(networks[i].port, port);
+      if (networks[i].channels[0] == '\0')
+         strcpy(networks[i].channels, channel);
+   }
+   
+   //hidden directories aren't shared, so the catalog can live in the share;
+   //in a directory of its own so saving it doesn't change the mtime of the
+   //top directory
+   if (catalogPath[0] == '\0')
+      snprintf(catalogPath, sizeof(catalogPath), "%s/.quiznoBot/catalog",
+               directory);
+}
+
+int IRC_GetServerResponse(char *serverMessage)
+{
+   char *currentChar = serverMessage;
+   char temp[5];
+   int tempPos = 0;
+   int numSpacesPassed = 0;
+   
+   while (numSpacesPassed < 1)
+   {
+      if (*currentChar == ' ') ++numSpacesPassed;
+      ++currentChar;
+   }
+   
+   while (*currentChar != ' ')
+   {
+      if (*currentChar >= 0x30 && *currentChar <= 0x39)
+      {
+         temp[tempPos] = *currentChar;
+         temp[tempPos + 1] = '\0';
+         tempPos += 1;
+      }
+      ++currentChar;
+   }
+   return atoi(temp);
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// The catalog keeps every field of the packs in an array of its own and all
+// names in one arena, found by their offset, so a million packs take a
+// dozen allocations instead of a million, and going through the sizes or
+// flags of every pack (list, search, announce, metrics) reads only those.
+// Packs are only ever appended. A catalog that is full is copied into a
+// bigger generation, which is published in dirContents, and the old one is
+// retired: threads outside the main loop (the transfer workers) may still
+// be reading it. Those readers note the catalogEpoch between passes of
+// their loops, and a generation is freed once every one of them has seen an
+// epoch past the one it was retired in. Only the main loop writes to it.
+/////////////////////////////////////////////////////////////////////////////
+struct Catalog *retiredCatalogs = NULL;
+unsigned int catalogEpoch = 1;
+//per reader thread, the catalogEpoch it saw last between two passes
+unsigned int *readerEpochs = NULL;
+int numReaders = 0;
+
+struct Catalog *CATALOG_New(int size, size_t namesSize)
+{
+   struct Catalog *catalog = calloc(1, sizeof(struct Catalog));
+   
+   if (size < 64)
+      size = 64;
+   if (namesSize < 4096)
+      namesSize = 4096;
+   catalog->size = size;
+   catalog->namesSize = namesSize;
+   catalog->names = malloc(namesSize);
+   catalog->nameOffsets = malloc(sizeof(unsigned int) * size);
+   catalog->filesizes = malloc(sizeof(long) * size);
+   catalog->mtimes = malloc(sizeof(time_t) * size);
+   catalog->inodes = malloc(sizeof(unsigned long long) * size);
+   catalog->removed = malloc(size);
+   catalog->hashStates = malloc(size);
+   catalog->addedVersions = malloc(sizeof(unsigned int) * size);
+   catalog->requests = malloc(sizeof(unsigned int) * size);
+   catalog->popularity = malloc(sizeof(double) * size);
+   catalog->popularAt = malloc(sizeof(time_t) * size);
+   catalog->checksums = malloc(sizeof(struct PackChecksum) * size);
+   return catalog;
+}
+
+void CATALOG_Free(struct Catalog *catalog)
+{
+   free(catalog->names);
+   free(catalog->nameOffsets);
+   free(catalog->filesizes);
+   free(catalog->mtimes);
+   free(catalog->inodes);
+   free(catalog->removed);
+   free(catalog->hashStates);
+   free(catalog->addedVersions);
+   free(catalog->requests);
+   free(catalog->popularity);
+   free(catalog->popularAt);
+   free(catalog->checksums);
+   free(catalog);
+}
+
+//puts a new generation in place of dirContents, the old one is freed when
+//no reader can be looking at it any more
+void CATALOG_Publish(struct Catalog *catalog)
+{
+   struct Catalog *old = dirContents;
+   
+   __atomic_store_n(&dirContents, catalog, __ATOMIC_SEQ_CST);
+   if (old == NULL)
+      return;
+   old->retiredEpoch = __atomic_add_fetch(&catalogEpoch, 1, __ATOMIC_SEQ_CST);
+   old->nextRetired = retiredCatalogs;
+   retiredCatalogs = old;
+}
+
+//a copy of the catalog with room for size packs and namesSize bytes of
+//names takes its place
+void CATALOG_Resize(int size, size_t namesSize)
+{
+   struct Catalog *old = dirContents;
+   struct Catalog *grown = CATALOG_New(size, namesSize);
+   int n = old->numPacks;
+   
+   memcpy(grown->names, old->names, old->namesLength);
+   memcpy(grown->nameOffsets, old->nameOffsets, sizeof(unsigned int) * n);
+   memcpy(grown->filesizes, old->filesizes, sizeof(long) * n);
+   memcpy(grown->mtimes, old->mtimes, sizeof(time_t) * n);
+   memcpy(grown->inodes, old->inodes, sizeof(unsigned long long) * n);
+   memcpy(grown->removed, old->removed, n);
+   memcpy(grown->hashStates, old->hashStates, n);
+   memcpy(grown->addedVersions, old->addedVersions, sizeof(unsigned int) * n);
+   memcpy(grown->requests, old->requests, sizeof(unsigned int) * n);
+   memcpy(grown->popularity, old->popularity, sizeof(double) * n);
+   memcpy(grown->popularAt, old->popularAt, sizeof(time_t) * n);
+   memcpy(grown->checksums, old->checksums, sizeof(struct PackChecksum) * n);
+   grown->numPacks = n;
+   grown->namesLength = old->namesLength;
+   CATALOG_Publish(grown);
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Makes room for morePacks packs with moreNames bytes of names. A catalog
+// that has to grow does so by half at least, or to just the size asked for
+// if that is more. Names are found by 32 bit offsets, so there can't be
+// more than 4GB of them.
+/////////////////////////////////////////////////////////////////////////////
+int CATALOG_Reserve(int morePacks, size_t moreNames)
+{
+   long long packs = (long long)dirContents->numPacks + morePacks;
+   unsigned long long names = dirContents->namesLength + moreNames;
+   long long size = dirContents->size;
+   unsigned long long namesSize = dirContents->namesSize;
+   
+   if (packs <= size && names <= namesSize)
+      return 0;
+   if (packs > INT_MAX || names > UINT_MAX)
+   {
+      fprintf(stderr, "The catalog can't hold more than %i packs or 4GB of "
+            "names\n", INT_MAX);
+      return -1;
+   }
+   if (packs > size)
+      size = packs > size + size / 2 ? packs : size + size / 2;
+   if (names > namesSize)
+      namesSize = names > namesSize + namesSize / 2 ? names :
+                  namesSize + namesSize / 2;
+   CATALOG_Resize(size < INT_MAX ? size : INT_MAX,
+                  namesSize < UINT_MAX ? namesSize : UINT_MAX);
+   return 0;
+}
+
+//gives back what growing left unused, once a scan is done
+void CATALOG_Compact()
+{
+   if (dirContents->size > dirContents->numPacks + dirContents->numPacks / 8 ||
+       dirContents->namesSize > dirContents->namesLength +
+                                dirContents->namesLength / 8)
+      CATALOG_Resize(dirContents->numPacks, dirContents->namesLength);
+}
+
+//memory the catalog takes, names included
+size_t CATALOG_Bytes(struct Catalog *catalog)
+{
+   size_t perPack = sizeof(unsigned int) + sizeof(long) + sizeof(time_t) +
+                    sizeof(unsigned long long) + 2 * sizeof(char) +
+                    2 * sizeof(unsigned int) +
+                    sizeof(double) + sizeof(time_t) +
+                    sizeof(struct PackChecksum);
+   
+   return sizeof(struct Catalog) + perPack * catalog->size +
+          catalog->namesSize;
+}
+
+//adds a pack at the end of the catalog, returns its number or -1
+int CATALOG_Append(const char *name, long filesize, time_t mtime,
+                   unsigned long long inode)
+{
+   size_t length = strlen(name) + 1;
+   int packNumber;
+   
+   if (CATALOG_Reserve(1, length) == -1)
+      return -1;
+   packNumber = dirContents->numPacks;
+   dirContents->nameOffsets[packNumber] = dirContents->namesLength;
+   memcpy(dirContents->names + dirContents->namesLength, name, length);
+   dirContents->namesLength += length;
+   dirContents->filesizes[packNumber] = filesize;
+   dirContents->mtimes[packNumber] = mtime;
+   dirContents->inodes[packNumber] = inode;
+   dirContents->removed[packNumber] = 0;
+   dirContents->hashStates[packNumber] = HASH_NONE;
+   dirContents->addedVersions[packNumber] = catalogVersion + 1;
+   dirContents->requests[packNumber] = 0;
+   dirContents->popularity[packNumber] = 0;
+   dirContents->popularAt[packNumber] = 0;
+   memset(&dirContents->checksums[packNumber], 0, sizeof(struct PackChecksum));
+   //readers only look at packs below numPacks
+   __atomic_store_n(&dirContents->numPacks, packNumber + 1, __ATOMIC_RELEASE);
+   ++numValidPacks;
+   return packNumber;
+}
+
+const char *DIR_Name(int packNumber)
+{
+   return dirContents->names + dirContents->nameOffsets[packNumber];
+}
+
+//readers outside the main loop take the catalog this way, and may keep it
+//until the end of their pass
+struct Catalog *CATALOG_Current()
+{
+   return __atomic_load_n(&dirContents, __ATOMIC_SEQ_CST);
+}
+
+//a reader between two passes holds on to no generation
+void CATALOG_Quiesce(int reader)
+{
+   __atomic_store_n(&readerEpochs[reader],
+                    __atomic_load_n(&catalogEpoch, __ATOMIC_SEQ_CST),
+                    __ATOMIC_RELEASE);
+}
+
+//makes room for readers reader threads, before they start
+void CATALOG_AddReaders(int readers)
+{
+   int i;
+   
+   readerEpochs = realloc(readerEpochs, sizeof(unsigned int) * readers);
+   for (i = 0; i < readers; ++i)
+      readerEpochs[i] = catalogEpoch;
+   numReaders = readers;
+}
+
+//frees the generations no reader can be looking at; only between passes of
+//the main loop, which may hold names of the catalog itself
+void CATALOG_Reclaim()
+{
+   struct Catalog **link = &retiredCatalogs;
+   struct Catalog *catalog;
+   unsigned int oldest = catalogEpoch;
+   unsigned int seen;
+   int i;
+   
+   for (i = 0; i < numReaders; ++i)
+   {
+      seen = __atomic_load_n(&readerEpochs[i], __ATOMIC_ACQUIRE);
+      if (seen < oldest)
+         oldest = seen;
+   }
+   while ((catalog = *link) != NULL)
+   {
+      if (catalog->retiredEpoch <= oldest)
+      {
+         *link = catalog->nextRetired;
+         CATALOG_Free(catalog);
+      }
+      else
+         link = &catalog->nextRetired;
+   }
+}
+
+unsigned int DIR_HashName(const char *name)
+{
+   unsigned int hash = 2166136261u;
+   
+   while (*name != '\0')
+      hash = (hash ^ (unsigned char)*name++) * 16777619u;
+   return hash;
+}
+
+void DIR_IndexInsert(int packNumber)
+{
+   unsigned int slot;
+   int *oldIndex = catalogIndex;
+   int oldSize = catalogIndexSize;
+   int i;
+   
+   //keep the table at most half full
+   if (dirContents->numPacks * 2 >= catalogIndexSize)
+   {
+      catalogIndexSize = catalogIndexSize == 0 ? 64 : catalogIndexSize * 2;
+      catalogIndex = calloc(catalogIndexSize, sizeof(int));
+      for (i = 0; i < oldSize; ++i)
+         if (oldIndex[i] != 0 && oldIndex[i] - 1 != packNumber)
+            DIR_IndexInsert(oldIndex[i] - 1);
+      free(oldIndex);
+   }
+   slot = DIR_HashName(DIR_Name(packNumber)) & (catalogIndexSize - 1);
+   while (catalogIndex[slot] != 0)
+      slot = (slot + 1) & (catalogIndexSize - 1);
+   catalogIndex[slot] = packNumber + 1;
+}
+
+//the pack number a file has (or had, if it was removed), -1 if none
+int DIR_FindPack(const char *name)
+{
+   unsigned int slot;
+   
+   if (catalogIndexSize == 0)
+      return -1;
+   slot = DIR_HashName(name) & (catalogIndexSize - 1);
+   while (catalogIndex[slot] != 0)
+   {
+      if (strcmp(DIR_Name(catalogIndex[slot] - 1), name) == 0)
+         return catalogIndex[slot] - 1;
+      slot = (slot + 1) & (catalogIndexSize - 1);
+   }
+   return -1;
+}
+
+int DIR_PackValid(int packNumber)
+{
+   return packNumber >= 0 && packNumber < dirContents->numPacks &&
+          !dirContents->removed[packNumber];
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// The search index behind xdcc search: for every trigram (three letters or
+// digits in a row, case folded) the sorted list of packs whose file name
+// contains it. Punctuation and spaces split names into words, bytes above
+// 127 all count as the same letter. A query looks up the trigrams of its
+// words, intersects the lists starting with the shortest and then checks
+// the names of what's left, so only packs that share the rarest trigram are
+// ever looked at. Pack numbers never change and only grow, so packs are
+// added when they first appear and stay; removed ones are skipped when
+// searching.
+/////////////////////////////////////////////////////////////////////////////
+#define SEARCH_ALPHABET 38
+#define SEARCH_TRIGRAMS (SEARCH_ALPHABET * SEARCH_ALPHABET * SEARCH_ALPHABET)
+//the packs of the rarest trigram a query looks at, newest first; more and
+//the answer is cut off
+#define SEARCH_MAX_CANDIDATES 5000
+#define SEARCH_MAX_WORDS 8
+
+struct SearchPosting
+{
+   int *packs;
+   int length;
+   int size;
+};
+
+struct SearchPosting *searchIndex = NULL;  //SEARCH_TRIGRAMS of them
+
+//0 for what splits words, else the letter's place in the alphabet
+int SEARCH_Symbol(unsigned char c)
+{
+   if (c >= 'a' && c <= 'z') return c - 'a' + 1;
+   if (c >= 'A' && c <= 'Z') return c - 'A' + 1;
+   if (c >= '0' && c <= '9') return c - '0' + 27;
+   if (c >= 0x80) return 37;
+   return 0;
+}
+
+//lower case letters, digits and high bytes, everything else a space
+void SEARCH_Normalize(const char *text, char *normalized, int size)
+{
+   int i;
+   
+   for (i = 0; text[i] != '\0' && i < size - 1; ++i)
+   {
+      if (SEARCH_Symbol(text[i]) == 0)
+         normalized[i] = ' ';
+      else if (text[i] >= 'A' && text[i] <= 'Z')
+         normalized[i] = text[i] - 'A' + 'a';
+      else
+         normalized[i] = text[i];
+   }
+   normalized[i] = '\0';
+}
+
+const char *SEARCH_Name(int packNumber)
+{
+   const char *slash = strrchr(DIR_Name(packNumber), '/');
+   
+   return slash == NULL ? DIR_Name(packNumber) : slash + 1;
+}
+
+int SEARCH_Trigram(int first, int second, int third)
+{
+   return (first * SEARCH_ALPHABET + second) * SEARCH_ALPHABET + third;
+}
+
+//a trigram that repeats in a name is only listed once
+void SEARCH_AddTrigram(int trigram, int packNumber)
+{
+   struct SearchPosting *posting = &searchIndex[trigram];
+   
+   if (posting->length > 0 && posting->packs[posting->length - 1] ==
+       packNumber)
+      return;
+   if (posting->length == posting->size)
+   {
+      posting->size = posting->size == 0 ? 4 : posting->size * 2;
+      posting->packs = realloc(posting->packs, sizeof(int) * posting->size);
+   }
+   posting->packs[posting->length++] = packNumber;
+}
+
+//indexes a pack that just appeared, pack numbers have to come in order
+void SEARCH_Add(int packNumber)
+{
+   const char *name = SEARCH_Name(packNumber);
+   int previous = 0, beforePrevious = 0;
+   int symbol;
+   
+   if (searchIndex == NULL)
+      searchIndex = calloc(SEARCH_TRIGRAMS, sizeof(struct SearchPosting));
+   for (; *name != '\0'; ++name)
+   {
+      symbol = SEARCH_Symbol(*name);
+      if (symbol != 0 && previous != 0 && beforePrevious != 0)
+         SEARCH_AddTrigram(SEARCH_Trigram(beforePrevious, previous, symbol),
+                           packNumber);
+      beforePrevious = previous;
+      previous = symbol;
+   }
+}
+
+void SEARCH_Reset()
+{
+   int i;
+   
+   if (searchIndex == NULL)
+      return;
+   for (i = 0; i < SEARCH_TRIGRAMS; ++i)
+      free(searchIndex[i].packs);
+   free(searchIndex);
+   searchIndex = NULL;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// The position of the last pack in the list that is at most packNumber,
+// looking no further than from, or -1 if there is none. Queries walk every
+// list backwards, so this gallops back from where the last call ended up
+// and then halves the gap.
+/////////////////////////////////////////////////////////////////////////////
+int SEARCH_Seek(struct SearchPosting *posting, int from, int packNumber)
+{
+   int high = from, low, middle;
+   int step = 1;
+   
+   if (high < 0 || posting->packs[high] <= packNumber)
+      return high;
+   low = high - 1;
+   while (low >= 0 && posting->packs[low] > packNumber)
+   {
+      high = low;
+      low -= step;
+      step *= 2;
+   }
+   if (low < 0)
+      low = -1;
+   //packs[low] <= packNumber < packs[high]
+   while (high - low > 1)
+   {
+      middle = (low + high) / 2;
+      if (posting->packs[middle] <= packNumber)
+         low = middle;
+      else
+         high = middle;
+   }
+   return low;
+}
+
+struct SearchQuery
+{
+   struct SearchPosting *lists[64];  //the trigrams of every word
+   int cursors[64];                  //where SEARCH_Seek got to in each
+   int numLists;
+   char words[SEARCH_MAX_WORDS][64];
+   int numWords;
+};
+
+/////////////////////////////////////////////////////////////////////////////
+// 0 if the name lacks one of the words, else more the better it fits: a
+// word at the start of the name or after punctuation counts double. Words
+// have no punctuation in them, so they can be looked for in the name as it
+// is.
+/////////////////////////////////////////////////////////////////////////////
+int SEARCH_Score(struct SearchQuery *query, int packNumber)
+{
+   const char *name = SEARCH_Name(packNumber);
+   const char *found;
+   int score = 0;
+   int i;
+   
+   for (i = 0; i < query->numWords; ++i)
+   {
+      found = strcasestr(name, query->words[i]);
+      if (found == NULL)
+         return 0;
+      score += found == name || SEARCH_Symbol(found[-1]) == 0 ? 2 : 1;
+   }
+   return score;
+}
+
+//whether pack a belongs before pack b in the answer
+int SEARCH_Better(int scoreA, int a, int scoreB, int b)
+{
+   if (scoreA != scoreB)
+      return scoreA > scoreB;
+   if (dirContents->requests[a] != dirContents->requests[b])
+      return dirContents->requests[a] > dirContents->requests[b];
+   return a > b;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Finds the packs whose name contains every word of terms, best first: the
+// maxResults best go into results and their number into numResults.
+// Returns how many packs matched, -1 if no word has three letters to look
+// up. truncated is set when there were too many candidates to check all,
+// then the count is of the newest ones only.
+/////////////////////////////////////////////////////////////////////////////
+int SEARCH_Query(const char *terms, int *results, int maxResults,
+                 int *numResults, char *truncated)
+{
+   struct SearchQuery query;
+   struct SearchPosting *shortest;
+   char normalized[512];
+   int scores[64];
+   int previous, beforePrevious, symbol;
+   int candidate, score;
+   int checked = 0, matches = 0;
+   char *word, *savePointer;
+   int i, j;
+   
+   *numResults = 0;
+   *truncated = 0;
+   if (maxResults > 64)
+      maxResults = 64;
+   memset(&query, 0, sizeof(query));
+   SEARCH_Normalize(terms, normalized, sizeof(normalized));
+   for (word = strtok_r(normalized, " ", &savePointer);
+        word != NULL && query.numWords < SEARCH_MAX_WORDS;
+        word = strtok_r(NULL, " ", &savePointer))
+   {
+      snprintf(query.words[query.numWords++], sizeof(query.words[0]), "%s",
+               word);
+      previous = beforePrevious = 0;
+      for (; *word != '\0'; ++word)
+      {
+         symbol = SEARCH_Symbol(*word);
+         if (previous != 0 && beforePrevious != 0 && query.numLists < 64)
+            query.lists[query.numLists++] = searchIndex == NULL ? NULL :
+               &searchIndex[SEARCH_Trigram(beforePrevious, previous, symbol)];
+         beforePrevious = previous;
+         previous = symbol;
+      }
+   }
+   if (query.numLists == 0)
+      return -1;
+   //shortest first: it gives the candidates, the next ones rule out most
+   for (i = 0; i < query.numLists; ++i)
+   {
+      if (query.lists[i] == NULL || query.lists[i]->length == 0)
+         return 0;
+      for (j = i; j > 0 &&
+           query.lists[j]->length < query.lists[j - 1]->length; --j)
+      {
+         shortest = query.lists[j];
+         query.lists[j] = query.lists[j - 1];
+         query.lists[j - 1] = shortest;
+      }
+   }
+   for (i = 0; i < query.numLists; ++i)
+      query.cursors[i] = query.lists[i]->length - 1;
+   shortest = query.lists[0];
+   
+   //newest first, so a cut off answer still has the latest packs
+   for (i = shortest->length - 1; i >= 0; --i)
+   {
+      if (++checked > SEARCH_MAX_CANDIDATES)
+      {
+         *truncated = 1;
+         break;
+      }
+      candidate = shortest->packs[i];
+      for (j = 1; j < query.numLists; ++j)
+      {
+         query.cursors[j] = SEARCH_Seek(query.lists[j], query.cursors[j],
+                                        candidate);
+         if (query.cursors[j] == -1 ||
+             query.lists[j]->packs[query.cursors[j]] != candidate)
+            break;
+      }
+      //a list that ran out has nothing left for any other candidate either
+      if (j < query.numLists && query.cursors[j] == -1)
+         break;
+      if (j < query.numLists)
+         continue;
+      //most candidates fail on the name, so removed packs are only ruled
+      //out after it, which saves looking at one more array for the rest
+      score = SEARCH_Score(&query, candidate);
+      if (score == 0 || !DIR_PackValid(candidate))
+         continue;
+      ++matches;
+      //insertion into the short list of the best so far
+      for (j = *numResults; j > 0 &&
+           SEARCH_Better(score, candidate, scores[j - 1], results[j - 1]); --j)
+      {
+         if (j < maxResults)
+         {
+            results[j] = results[j - 1];
+            scores[j] = scores[j - 1];
+         }
+      }
+      if (j < maxResults)
+      {
+         results[j] = candidate;
+         scores[j] = score;
+         if (*numResults < maxResults)
+            ++*numResults;
+      }
+   }
+   return matches;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Puts a file into the catalog, or updates its size if it is already there.
+// name is relative to the shared directory. A file that comes back after
+// being removed gets its old pack number again. Returns the pack number,
+// -1 if the catalog is full.
+/////////////////////////////////////////////////////////////////////////////
+int DIR_AddEntry(const char *name, long long filesize, time_t mtime,
+                 unsigned long long inode)
+{
+   int packNumber = DIR_FindPack(name);
+   
+   if (packNumber == -1)
+   {
+      packNumber = CATALOG_Append(name, filesize, mtime, inode);
+      if (packNumber == -1)
+         return -1;
+      DIR_IndexInsert(packNumber);
+      SEARCH_Add(packNumber);
+      ++listingVersion;
+   }
+   else if (!dirContents->removed[packNumber] &&
+            dirContents->filesizes[packNumber] == filesize &&
+            dirContents->mtimes[packNumber] == mtime)
+   {
+      //found again as it was; only a new inode needs saving
+      if (dirContents->inodes[packNumber] != inode)
+      {
+         dirContents->inodes[packNumber] = inode;
+         ++catalogChanges;
+      }
+      return packNumber;
+   }
+   else if (dirContents->filesizes[packNumber] != filesize ||
+            dirContents->mtimes[packNumber] != mtime)
+      dirContents->hashStates[packNumber] = HASH_NONE;
+   if (dirContents->removed[packNumber] ||
+       dirContents->filesizes[packNumber] != filesize)
+      ++listingVersion;
+   dirContents->filesizes[packNumber] = filesize;
+   dirContents->mtimes[packNumber] = mtime;
+   dirContents->inodes[packNumber] = inode;
+   //a pack that comes back is announced as new again
+   if (dirContents->removed[packNumber])
+   {
+      dirContents->addedVersions[packNumber] = catalogVersion + 1;
+      ++numValidPacks;
+   }
+   dirContents->removed[packNumber] = 0;
+   ++catalogVersion;
+   ++catalogChanges;
+   if (debugLevel > 1)
+      fprintf(stderr, "\tAdding file %s - %lld bytes to slot #%i\n",
+         name, filesize, packNumber);
+   return packNumber;
+}
+
+//the name without its directories
+const char *DIR_BaseName(const char *name)
+{
+   const char *slash = strrchr(name, '/');
+   
+   return slash != NULL ? slash + 1 : name;
+}
+
+//adds or updates one file, returns its pack number or -1 if it can't be
+//shared
+int DIR_AddOrUpdate(const char *name)
+{
+   char fullpath[4096];
+   struct stat info;
+   
+   if (DIR_BaseName(name)[0] == '.')
+      return -1;
+   snprintf(fullpath, sizeof(fullpath), "%s/%s", directory, name);
+   if (stat(fullpath, &info) == -1 || !S_ISREG(info.st_mode))
+      return -1;
+   return DIR_AddEntry(name, info.st_size, info.st_mtime, info.st_ino);
+}
+
+void DIR_Remove(const char *name)
+{
+   int packNumber = DIR_FindPack(name);
+   
+   if (!DIR_PackValid(packNumber))
+      return;
+   dirContents->removed[packNumber] = 1;
+   --numValidPacks;
+   METRIC_ForgetPack(packNumber);
+   ++catalogVersion;
+   ++catalogChanges;
+   ++listingVersion;
+   if (debugLevel > 0)
+      fprintf(stderr, "Removed pack #%i - %s\n", packNumber, name);
+}
+
+//removes every pack below a directory that was deleted or moved away
+void DIR_RemoveTree(const char *path)
+{
+   size_t length = strlen(path);
+   int i;
+   
+   for (i = 0; i < dirContents->numPacks; ++i)
+      if (strncmp(DIR_Name(i), path, length) == 0 &&
+          DIR_Name(i)[length] == '/')
+         DIR_Remove(DIR_Name(i));
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// The directories of the share are kept with their mtime and inode so the
+// next start can tell which of them changed. Like the packs they are found
+// by path through an open addressing hash, rebuilt whenever the list
+// changes (which is at startup and when directories come or go).
+/////////////////////////////////////////////////////////////////////////////
+int DIR_FindDirectory(const char *path)
+{
+   unsigned int slot;
+   
+   if (directoryIndexSize == 0)
+      return -1;
+   slot = DIR_HashName(path) & (directoryIndexSize - 1);
+   while (directoryIndex[slot] != 0)
+   {
+      if (strcmp(catalogDirectories[directoryIndex[slot] - 1].path, path) == 0)
+         return directoryIndex[slot] - 1;
+      slot = (slot + 1) & (directoryIndexSize - 1);
+   }
+   return -1;
+}
+
+void DIR_IndexDirectories()
+{
+   unsigned int slot;
+   int i;
+   
+   free(directoryIndex);
+   directoryIndexSize = 64;
+   while (directoryIndexSize <= numCatalogDirectories * 2)
+      directoryIndexSize *= 2;
+   directoryIndex = calloc(directoryIndexSize, sizeof(int));
+   for (i = 0; i < numCatalogDirectories; ++i)
+   {
+      slot = DIR_HashName(catalogDirectories[i].path) &
+             (directoryIndexSize - 1);
+      while (directoryIndex[slot] != 0)
+         slot = (slot + 1) & (directoryIndexSize - 1);
+      directoryIndex[slot] = i + 1;
+   }
+}
+
+//adds a directory that was just read, or updates it if it is known
+void DIR_AddDirectory(struct CatalogDirectory *found)
+{
+   int known = DIR_FindDirectory(found->path);
+   
+   if (known != -1)
+   {
+      free(found->path);
+      found->path = catalogDirectories[known].path;
+      catalogDirectories[known] = *found;
+      return;
+   }
+   if (numCatalogDirectories == catalogDirectoriesSize)
+   {
+      catalogDirectoriesSize = catalogDirectoriesSize == 0 ? 64 :
+                               catalogDirectoriesSize * 2;
+      catalogDirectories = realloc(catalogDirectories,
+         sizeof(struct CatalogDirectory) * catalogDirectoriesSize);
+   }
+   catalogDirectories[numCatalogDirectories++] = *found;
+}
+
+//strings of a loaded catalog live in its mapping and can't be freed
+void DIR_FreeString(char *string)
+{
+   if (string < catalogMap || string >= catalogMap + catalogMapSize)
+      free(string);
+}
+
+//forgets a directory and everything below it, "" forgets them all
+void DIR_ForgetDirectories(const char *path)
+{
+   size_t length = strlen(path);
+   int kept = 0;
+   int i;
+   
+   for (i = 0; i < numCatalogDirectories; ++i)
+   {
+      if (strncmp(catalogDirectories[i].path, path, length) == 0 &&
+          (length == 0 || catalogDirectories[i].path[length] == '\0' ||
+           catalogDirectories[i].path[length] == '/'))
+         DIR_FreeString(catalogDirectories[i].path);
+      else
+         catalogDirectories[kept++] = catalogDirectories[i];
+   }
+   numCatalogDirectories = kept;
+   DIR_IndexDirectories();
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// inotify watches one directory, not a tree, so every directory the scanner
+// finds gets a watch of its own. Events name the watch descriptor, which is
+// mapped back to the directory's path here.
+/////////////////////////////////////////////////////////////////////////////
+void DIR_Watch()
+{
+   catalogWatchFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+   if (catalogWatchFd == -1)
+      fprintf(stderr, "Couldn't watch %s for changes: %s\n", directory,
+            strerror(errno));
+}
+
+void DIR_WatchDirectory(const char *path)
+{
+   char fullpath[4096];
+   int wd;
+   
+   if (catalogWatchFd == -1)
+      return;
+   snprintf(fullpath, sizeof(fullpath), "%s/%s", directory, path);
+   wd = inotify_add_watch(catalogWatchFd, fullpath,
+                          IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM |
+                          IN_CREATE | IN_DELETE | IN_DELETE_SELF |
+                          IN_MOVE_SELF | IN_ONLYDIR);
+   if (wd == -1)
+   {
+      //usually fs.inotify.max_user_watches is too low for the share
+      if (debugLevel > 0)
+         fprintf(stderr, "Couldn't watch %s: %s\n", fullpath, strerror(errno));
+      return;
+   }
+   pthread_mutex_lock(&watchedPathsLock);
+   if (wd >= watchedPathsSize)
+   {
+      int newSize = watchedPathsSize == 0 ? 64 : watchedPathsSize;
+   
+      while (newSize <= wd)
+         newSize *= 2;
+      watchedPaths = realloc(watchedPaths, sizeof(char*) * newSize);
+      memset(watchedPaths + watchedPathsSize, 0,
+             sizeof(char*) * (newSize - watchedPathsSize));
+      watchedPathsSize = newSize;
+   }
+   free(watchedPaths[wd]);
+   watchedPaths[wd] = strdup(path);
+   pthread_mutex_unlock(&watchedPathsLock);
+}
+
+//drops the watches of a directory that went away and of everything below it
+void DIR_UnwatchTree(const char *path)
+{
+   size_t length = strlen(path);
+   int wd;
+   
+   //a background rescan may be adding watches meanwhile
+   pthread_mutex_lock(&watchedPathsLock);
+   for (wd = 0; wd < watchedPathsSize; ++wd)
+   {
+      if (watchedPaths[wd] == NULL ||
+          strncmp(watchedPaths[wd], path, length) != 0 ||
+          (watchedPaths[wd][length] != '\0' && watchedPaths[wd][length] != '/'))
+         continue;
+      inotify_rm_watch(catalogWatchFd, wd);
+      free(watchedPaths[wd]);
+      watchedPaths[wd] = NULL;
+   }
+   pthread_mutex_unlock(&watchedPathsLock);
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Recursive directory scanner. Directories still to be read sit on a shared
+// stack; a pool of threads takes them off, reads them with getdents64 and
+// pushes the subdirectories they find back on. Files are sized with statx
+// (or fstatat on kernels without it) relative to the open directory, never
+// opened. Each thread collects what it found in its own list; the lists are
+// merged into the catalog by the calling thread once the pool is done, so
+// the catalog itself is never touched from more than one thread.
+/////////////////////////////////////////////////////////////////////////////
+struct LinuxDirent64
+{
+   unsigned long long d_ino;
+   long long d_off;
+   unsigned short d_reclen;
+   unsigned char d_type;
+   char d_name[];
+};
+
+struct ScanResult
+{
+   char *path;
+   long long filesize;
+   time_t mtime;
+   unsigned long long inode;
+};
+
+struct ScanWorker
+{
+   pthread_t thread;
+   struct DirectoryScan *scan;
+   struct ScanResult *results;
+   int numResults;
+   int resultsSize;
+   struct CatalogDirectory *directories;
+   int numDirectories;
+   int directoriesSize;
+};
+
+struct DirectoryScan
+{
+   pthread_mutex_t lock;
+   pthread_cond_t wake;
+   char **pending;   //directories nobody has read yet
+   int numPending;
+   int pendingSize;
+   int busy;         //directories being read right now
+   int numDirectories;
+   char skipKnown;   //leave directories the catalog knows to DIR_Revalidate
+};
+
+void SCAN_Push(struct DirectoryScan *scan, char *path)
+{
+   pthread_mutex_lock(&scan->lock);
+   if (scan->numPending == scan->pendingSize)
+   {
+      scan->pendingSize = scan->pendingSize == 0 ? 64 : scan->pendingSize * 2;
+      scan->pending = realloc(scan->pending, sizeof(char*) * scan->pendingSize);
+   }
+   scan->pending[scan->numPending++] = path;
+   ++scan->numDirectories;
+   pthread_cond_signal(&scan->wake);
+   pthread_mutex_unlock(&scan->lock);
+}
+
+//stats name relative to the open directory, 0 on success
+int SCAN_Stat(int directoryFd, const char *name, int flags, mode_t *mode,
+              long long *filesize, time_t *mtime, unsigned long long *inode)
+{
+   //every scanner thread may find out, so it is read and set atomically
+   static char noStatx = 0;
+   struct statx extended;
+   struct stat info;
+   
+   if (!__atomic_load_n(&noStatx, __ATOMIC_RELAXED))
+   {
+      if (statx(directoryFd, name, flags | AT_STATX_DONT_SYNC,
+                STATX_TYPE | STATX_SIZE | STATX_MTIME | STATX_INO,
+                &extended) == 0)
+      {
+         *mode = extended.stx_mode;
+         *filesize = extended.stx_size;
+         *mtime = extended.stx_mtime.tv_sec;
+         *inode = extended.stx_ino;
+         return 0;
+      }
+      if (errno != ENOSYS)
+         return -1;
+      __atomic_store_n(&noStatx, 1, __ATOMIC_RELAXED);
+   }
+   if (fstatat(directoryFd, name, &info, flags) == -1)
+      return -1;
+   *mode = info.st_mode;
+   *filesize = info.st_size;
+   *mtime = info.st_mtime;
+   *inode = info.st_ino;
+   return 0;
+}
+
+void SCAN_AddResult(struct ScanWorker *worker, char *path,
+                    long long filesize, time_t mtime,
+                    unsigned long long inode)
+{
+   if (worker->numResults == worker->resultsSize)
+   {
+      worker->resultsSize = worker->resultsSize == 0 ? 256 :
+                            worker->resultsSize * 2;
+      worker->results = realloc(worker->results,
+                                sizeof(struct ScanResult) * worker->resultsSize);
+   }
+   worker->results[worker->numResults].path = path;
+   worker->results[worker->numResults].filesize = filesize;
+   worker->results[worker->numResults].mtime = mtime;
+   worker->results[worker->numResults].inode = inode;
+   ++worker->numResults;
+}
+
+void SCAN_AddDirectory(struct ScanWorker *worker, const char *path,
+                       struct stat *info)
+{
+   struct CatalogDirectory *found;
+   
+   if (worker->numDirectories == worker->directoriesSize)
+   {
+      worker->directoriesSize = worker->directoriesSize == 0 ? 64 :
+                                worker->directoriesSize * 2;
+      worker->directories = realloc(worker->directories,
+         sizeof(struct CatalogDirectory) * worker->directoriesSize);
+   }
+   found = &worker->directories[worker->numDirectories++];
+   found->path = strdup(path);
+   found->mtimeSeconds = info->st_mtim.tv_sec;
+   found->mtimeNanoseconds = info->st_mtim.tv_nsec;
+   found->inode = info->st_ino;
+}
+
+void SCAN_ReadDirectory(struct ScanWorker *worker, const char *path)
+{
+   char buffer[65536] __attribute__((aligned(8)));
+   char fullpath[4096];
+   struct LinuxDirent64 *entry;
+   long length;
+   long offset;
+   int directoryFd;
+   mode_t mode;
+   long long filesize;
+   time_t mtime;
+   unsigned long long inode;
+   struct stat info;
+   char *childPath;
+   
+   snprintf(fullpath, sizeof(fullpath), "%s/%s", directory, path);
+   directoryFd = open(fullpath, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+   if (directoryFd == -1)
+   {
+      fprintf(stderr, "Couldn't open directory %s: %s\n", fullpath,
+            strerror(errno));
+      return;
+   }
+   DIR_WatchDirectory(path);
+   //the mtime from before reading, so a change made meanwhile is seen later
+   if (fstat(directoryFd, &info) == 0)
+      SCAN_AddDirectory(worker, path, &info);
+   
+   while ((length = syscall(SYS_getdents64, directoryFd, buffer,
+                            sizeof(buffer))) > 0)
+   {
+      for (offset = 0; offset < length; offset += entry->d_reclen)
+      {
+         entry = (struct LinuxDirent64*)(buffer + offset);
+         //skips . and .. along with hidden files
+         if (entry->d_name[0] == '.')
+            continue;
+         if (entry->d_type == DT_DIR)
+            mode = S_IFDIR;
+         //d_type is DT_UNKNOWN on some filesystems, statx decides then
+         else if (SCAN_Stat(directoryFd, entry->d_name, AT_SYMLINK_NOFOLLOW,
+                            &mode, &filesize, &mtime, &inode) != 0)
+            continue;
+         //a link to a file is shared, a link to a directory isn't followed
+         if (S_ISLNK(mode) &&
+             SCAN_Stat(directoryFd, entry->d_name, 0, &mode, &filesize,
+                       &mtime, &inode) == 0 && S_ISDIR(mode))
+            continue;
+         if (!S_ISDIR(mode) && !S_ISREG(mode))
+            continue;
+   
+         childPath = malloc(strlen(path) + strlen(entry->d_name) + 2);
+         if (path[0] == '\0')
+            strcpy(childPath, entry->d_name);
+         else
+            sprintf(childPath, "%s/%s", path, entry->d_name);
+         //known directories are checked on their own, see DIR_Revalidate
+         if (S_ISDIR(mode) && worker->scan->skipKnown &&
+             DIR_FindDirectory(childPath) != -1)
+            free(childPath);
+         else if (S_ISDIR(mode))
+            SCAN_Push(worker->scan, childPath);
+         else
+            SCAN_AddResult(worker, childPath, filesize, mtime, inode);
+      }
+   }
+   if (length == -1)
+      fprintf(stderr, "Couldn't read directory %s: %s\n", fullpath,
+            strerror(errno));
+   close(directoryFd);
+}
+
+void *SCAN_Worker(void *argument)
+{
+   struct ScanWorker *worker = argument;
+   struct DirectoryScan *scan = worker->scan;
+   char *path;
+   
+   pthread_mutex_lock(&scan->lock);
+   while (1)
+   {
+      while (scan->numPending == 0 && scan->busy > 0)
+         pthread_cond_wait(&scan->wake, &scan->lock);
+      //nothing waiting and nobody who could find more: done
+      if (scan->numPending == 0)
+         break;
+      path = scan->pending[--scan->numPending];
+      ++scan->busy;
+      pthread_mutex_unlock(&scan->lock);
+   
+      SCAN_ReadDirectory(worker, path);
+      free(path);
+   
+      pthread_mutex_lock(&scan->lock);
+      if (--scan->busy == 0 && scan->numPending == 0)
+         pthread_cond_broadcast(&scan->wake);
+   }
+   pthread_mutex_unlock(&scan->lock);
+   return NULL;
+}
+
+int SCAN_CompareResults(const void *left, const void *right)
+{
+   return strcmp(((const struct ScanResult*)left)->path,
+                 ((const struct ScanResult*)right)->path);
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Scans the given directories (relative to the shared directory, "" for the
+// top) and the unknown directories below them into the catalog. New files
+// are numbered in path order. DIR_ScanCollect only reads the disk and adds
+// watches, so without skipKnown it may run off the event loop;
+// DIR_ScanMerge puts what it found into the catalog.
+/////////////////////////////////////////////////////////////////////////////
+struct ScanOutput
+{
+   struct ScanResult *results; //sorted by path
+   int numResults;
+   struct CatalogDirectory *directories;
+   int numDirectories;
+   int numScanned;             //directories read
+};
+
+void DIR_ScanCollect(char **paths, int numPaths, char skipKnown,
+                     struct ScanOutput *output)
+{
+   struct DirectoryScan scan;
+   struct ScanWorker *workers;
+   struct ScanResult *results;
+   struct CatalogDirectory *directories;
+   int numThreads = scanThreads;
+   int numResults = 0;
+   int numDirectories = 0;
+   int i, j;
+   
+   if (numThreads <= 0)
+   {
+      numThreads = sysconf(_SC_NPROCESSORS_ONLN);
+      //the threads mostly wait for the disk, so more than the CPUs helps
+      if (numThreads < 4)
+         numThreads = 4;
+   }
+   memset(&scan, 0, sizeof(scan));
+   pthread_mutex_init(&scan.lock, NULL);
+   pthread_cond_init(&scan.wake, NULL);
+   scan.skipKnown = skipKnown;
+   for (i = 0; i < numPaths; ++i)
+      SCAN_Push(&scan, strdup(paths[i]));
+   
+   workers = calloc(numThreads, sizeof(struct ScanWorker));
+   for (i = 0; i < numThreads; ++i)
+      workers[i].scan = &scan;
+   //the calling thread is worker 0
+   for (i = 1; i < numThreads; ++i)
+   {
+      if (pthread_create(&workers[i].thread, NULL, SCAN_Worker,
+                         &workers[i]) != 0)
+      {
+         fprintf(stderr, "Couldn't start scanner thread %i\n", i);
+         numThreads = i;
+      }
+   }
+   SCAN_Worker(&workers[0]);
+   for (i = 1; i < numThreads; ++i)
+      pthread_join(workers[i].thread, NULL);
+   
+   for (i = 0; i < numThreads; ++i)
+   {
+      numResults += workers[i].numResults;
+      numDirectories += workers[i].numDirectories;
+   }
+   results = malloc(sizeof(struct ScanResult) * (numResults + 1));
+   directories = malloc(sizeof(struct CatalogDirectory) *
+                        (numDirectories + 1));
+   for (i = 0, numResults = 0, numDirectories = 0; i < numThreads; ++i)
+   {
+      for (j = 0; j < workers[i].numResults; ++j)
+         results[numResults++] = workers[i].results[j];
+      for (j = 0; j < workers[i].numDirectories; ++j)
+         directories[numDirectories++] = workers[i].directories[j];
+      free(workers[i].results);
+      free(workers[i].directories);
+   }
+   qsort(results, numResults, sizeof(struct ScanResult), SCAN_CompareResults);
+   
+   output->results = results;
+   output->numResults = numResults;
+   output->directories = directories;
+   output->numDirectories = numDirectories;
+   output->numScanned = scan.numDirectories;
+   free(workers);
+   free(scan.pending);
+   pthread_cond_destroy(&scan.wake);
+   pthread_mutex_destroy(&scan.lock);
+}
+
+//returns the number of files found
+int DIR_ScanMerge(struct ScanOutput *output)
+{
+   int newPacks = 0;
+   size_t newNames = 0;
+   int i;
+   
+   //room for all new packs at once, so a first scan fills the catalog exactly
+   for (i = 0; i < output->numResults; ++i)
+   {
+      if (DIR_FindPack(output->results[i].path) == -1)
+      {
+         ++newPacks;
+         newNames += strlen(output->results[i].path) + 1;
+      }
+   }
+   CATALOG_Reserve(newPacks, newNames);
+   for (i = 0; i < output->numResults; ++i)
+   {
+      DIR_AddEntry(output->results[i].path, output->results[i].filesize,
+                   output->results[i].mtime, output->results[i].inode);
+      free(output->results[i].path);
+   }
+   for (i = 0; i < output->numDirectories; ++i)
+      DIR_AddDirectory(&output->directories[i]);
+   DIR_IndexDirectories();
+   free(output->results);
+   free(output->directories);
+   return output->numResults;
+}
+
+//scans on the calling thread, returns the number of files found
+int DIR_ScanPaths(char **paths, int numPaths, int *numDirectories)
+{
+   struct ScanOutput output;
+   
+   DIR_ScanCollect(paths, numPaths, 1, &output);
+   if (numDirectories != NULL)
+      *numDirectories = output.numScanned;
+   return DIR_ScanMerge(&output);
+}
+
+//scans a directory and everything below it that isn't known yet
+int DIR_ScanTree(const char *path, int *numDirectories)
+{
+   char *paths[1];
+   
+   paths[0] = (char*)path;
+   return DIR_ScanPaths(paths, 1, numDirectories);
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// The catalog is kept in a file between runs so a restart doesn't have to
+// size every file again. The file is one header, the pack records (indexed
+// by pack number, removed packs included so numbers stay stable), the
+// directory records and then all names as NUL terminated strings. It is
+// mapped read-only; the names are copied into the arena in one go and keep
+// their offsets, the directories use their paths where they are. A changed
+// layout bumps CATALOG_VERSION and an old file is simply ignored.
+/////////////////////////////////////////////////////////////////////////////
+#define CATALOG_MAGIC "QZNOCAT"
+#define CATALOG_VERSION 2
+
+struct CatalogHeader
+{
+   char magic[8];
+   unsigned int version;
+   unsigned int rootOffset;       //realpath() of the shared directory
+   unsigned long long numPacks;
+   unsigned long long numDirectories;
+   unsigned long long stringsSize;
+};
+
+struct CatalogPackRecord
+{
+   unsigned long long nameOffset;
+   long long filesize;
+   long long mtime;
+   unsigned long long inode;
+   unsigned long long removed;
+   unsigned int hashed;
+   unsigned int crc32;
+   unsigned char md5[16];
+};
+
+struct CatalogDirectoryRecord
+{
+   unsigned long long pathOffset;
+   long long mtimeSeconds;
+   long long mtimeNanoseconds;
+   unsigned long long inode;
+};
+
+//lays the catalog file out in memory, NULL if there's nothing to save
+char *DIR_RenderCatalog(size_t *size)
+{
+   char root[4096];
+   struct CatalogHeader header;
+   struct CatalogPackRecord pack;
+   struct CatalogDirectoryRecord record;
+   unsigned long long offset;
+   size_t length;
+   char *image;
+   char *records;
+   char *strings;
+   int i;
+   
+   if (strcmp(catalogPath, "none") == 0 || realpath(directory, root) == NULL)
+      return NULL;
+   memset(&header, 0, sizeof(header));
+   memcpy(header.magic, CATALOG_MAGIC, sizeof(CATALOG_MAGIC));
+   header.version = CATALOG_VERSION;
+   header.numPacks = dirContents->numPacks;
+   header.numDirectories = numCatalogDirectories;
+   offset = strlen(root) + 1;
+   for (i = 0; i < dirContents->numPacks; ++i)
+      offset += strlen(DIR_Name(i)) + 1;
+   for (i = 0; i < numCatalogDirectories; ++i)
+      offset += strlen(catalogDirectories[i].path) + 1;
+   header.stringsSize = offset;
+   *size = sizeof(header) + sizeof(pack) * header.numPacks +
+           sizeof(record) * header.numDirectories + header.stringsSize;
+   image = malloc(*size);
+   if (image == NULL)
+   {
+      fprintf(stderr, "Couldn't save the catalog: out of memory\n");
+      return NULL;
+   }
+   memcpy(image, &header, sizeof(header));
+   records = image + sizeof(header);
+   strings = records + sizeof(pack) * header.numPacks +
+             sizeof(record) * header.numDirectories;
+   
+   length = strlen(root) + 1;
+   memcpy(strings, root, length);
+   offset = length;
+   for (i = 0; i < dirContents->numPacks; ++i)
+   {
+      memset(&pack, 0, sizeof(pack));
+      pack.nameOffset = offset;
+      pack.filesize = dirContents->filesizes[i];
+      pack.mtime = dirContents->mtimes[i];
+      pack.inode = dirContents->inodes[i];
+      pack.removed = dirContents->removed[i];
+      //a checksum still being computed is simply computed again next time
+      if (dirContents->hashStates[i] == HASH_DONE)
+      {
+         pack.hashed = 1;
+         pack.crc32 = dirContents->checksums[i].crc32;
+         memcpy(pack.md5, dirContents->checksums[i].md5, sizeof(pack.md5));
+      }
+      memcpy(records, &pack, sizeof(pack));
+      records += sizeof(pack);
+      length = strlen(DIR_Name(i)) + 1;
+      memcpy(strings + offset, DIR_Name(i), length);
+      offset += length;
+   }
+   for (i = 0; i < numCatalogDirectories; ++i)
+   {
+      record.pathOffset = offset;
+      record.mtimeSeconds = catalogDirectories[i].mtimeSeconds;
+      record.mtimeNanoseconds = catalogDirectories[i].mtimeNanoseconds;
+      record.inode = catalogDirectories[i].inode;
+      memcpy(records, &record, sizeof(record));
+      records += sizeof(record);
+      length = strlen(catalogDirectories[i].path) + 1;
+      memcpy(strings + offset, catalogDirectories[i].path, length);
+      offset += length;
+   }
+   return image;
+}
+
+//writes to a temporary file that replaces the old one in one rename()
+int DIR_WriteCatalog(const char *image, size_t size)
+{
+   char temporaryPath[4200];
+   size_t written = 0;
+   ssize_t result;
+   int catalog;
+   
+   snprintf(temporaryPath, sizeof(temporaryPath), "%s", catalogPath);
+   if (strrchr(temporaryPath, '/') != NULL)
+   {
+      *strrchr(temporaryPath, '/') = '\0';
+      mkdir(temporaryPath, 0755);
+   }
+   snprintf(temporaryPath, sizeof(temporaryPath), "%s.%i", catalogPath,
+            (int)getpid());
+   catalog = open(temporaryPath, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                  0644);
+   if (catalog == -1)
+   {
+      fprintf(stderr, "Couldn't write the catalog %s: %s\n", temporaryPath,
+            strerror(errno));
+      return -1;
+   }
+   while (written < size)
+   {
+      result = write(catalog, image + written, size - written);
+      if (result == -1 && errno == EINTR)
+         continue;
+      if (result <= 0)
+         break;
+      written += result;
+   }
+   if (written < size || fsync(catalog) != 0)
+   {
+      fprintf(stderr, "Couldn't write the catalog %s: %s\n", catalogPath,
+            strerror(errno));
+      close(catalog);
+      unlink(temporaryPath);
+      return -1;
+   }
+   if (close(catalog) != 0 || rename(temporaryPath, catalogPath) != 0)
+   {
+      fprintf(stderr, "Couldn't write the catalog %s: %s\n", catalogPath,
+            strerror(errno));
+      unlink(temporaryPath);
+      return -1;
+   }
+   return 0;
+}
+
+int DIR_SaveCatalog()
+{
+   size_t size;
+   char *image = DIR_RenderCatalog(&size);
+   int result;
+   
+   if (image == NULL)
+      return -1;
+   result = DIR_WriteCatalog(image, size);
+   free(image);
+   if (result == -1)
+      return -1;
+   savedCatalogChanges = catalogChanges;
+   if (debugLevel > 0)
+      fprintf(stderr, "Saved %i packs and %i directories to %s\n",
+            dirContents->numPacks, numCatalogDirectories, catalogPath);
+   return 0;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// While the bot runs the catalog is saved by a thread of its own, so a big
+// catalog's write and fsync don't hold up the event loop. The loop lays the
+// file out in memory, which is a copy and nothing else; the thread writes
+// it. savedCatalogChanges only moves once the thread reports success.
+/////////////////////////////////////////////////////////////////////////////
+struct CatalogSave
+{
+   pthread_t thread;
+   char *image;
+   size_t size;
+   unsigned int changes; //the catalogChanges the image holds
+   int numPacks;
+   int numDirectories;
+   int running;          //set until the thread is done, read atomically
+   int failed;
+   char joinable;
+} catalogSave;
+
+void *DIR_SaveThread(void *argument)
+{
+   catalogSave.failed =
+      DIR_WriteCatalog(catalogSave.image, catalogSave.size) == -1;
+   __atomic_store_n(&catalogSave.running, 0, __ATOMIC_RELEASE);
+   return NULL;
+}
+
+//collects a save that finished, returns -1 while one is still writing
+int DIR_FinishSave(int wait)
+{
+   if (!catalogSave.joinable)
+      return 0;
+   if (!wait && __atomic_load_n(&catalogSave.running, __ATOMIC_ACQUIRE))
+      return -1;
+   pthread_join(catalogSave.thread, NULL);
+   catalogSave.joinable = 0;
+   free(catalogSave.image);
+   catalogSave.image = NULL;
+   if (catalogSave.failed)
+      return 0;
+   savedCatalogChanges = catalogSave.changes;
+   if (debugLevel > 0)
+      fprintf(stderr, "Saved %i packs and %i directories to %s\n",
+            catalogSave.numPacks, catalogSave.numDirectories, catalogPath);
+   return 0;
+}
+
+//starts saving the catalog in the background unless a save is running
+void DIR_SaveCatalogLater()
+{
+   sigset_t allSignals, previous;
+   
+   if (DIR_FinishSave(0) == -1)
+      return;
+   catalogSave.image = DIR_RenderCatalog(&catalogSave.size);
+   if (catalogSave.image == NULL)
+      return;
+   catalogSave.changes = catalogChanges;
+   catalogSave.numPacks = dirContents->numPacks;
+   catalogSave.numDirectories = numCatalogDirectories;
+   catalogSave.running = 1;
+   sigfillset(&allSignals);
+   pthread_sigmask(SIG_BLOCK, &allSignals, &previous);
+   if (pthread_create(&catalogSave.thread, NULL, DIR_SaveThread, NULL) == 0)
+      catalogSave.joinable = 1;
+   else
+   {
+      //no thread, so it is written right here
+      catalogSave.running = 0;
+      if (DIR_WriteCatalog(catalogSave.image, catalogSave.size) == 0)
+         savedCatalogChanges = catalogSave.changes;
+      free(catalogSave.image);
+      catalogSave.image = NULL;
+   }
+   pthread_sigmask(SIG_SETMASK, &previous, NULL);
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Maps the catalog and fills dirContents and catalogDirectories from it.
+// Returns -1 (and leaves both empty) if there's no usable catalog.
+/////////////////////////////////////////////////////////////////////////////
+int DIR_LoadCatalog()
+{
+   char root[4096];
+   struct CatalogHeader *header;
+   struct CatalogPackRecord *packs;
+   struct CatalogDirectoryRecord *records;
+   struct Catalog *loaded;
+   const char *problem = NULL;
+   struct stat info;
+   char *strings;
+   int catalog;
+   unsigned long long i;
+   
+   if (strcmp(catalogPath, "none") == 0 || realpath(directory, root) == NULL)
+      return -1;
+   catalog = open(catalogPath, O_RDONLY | O_CLOEXEC);
+   if (catalog == -1)
+      return -1;
+   if (fstat(catalog, &info) == -1 ||
+       info.st_size < (off_t)sizeof(struct CatalogHeader))
+   {
+      close(catalog);
+      return -1;
+   }
+   catalogMap = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, catalog, 0);
+   close(catalog);
+   if (catalogMap == MAP_FAILED)
+   {
+      catalogMap = NULL;
+      return -1;
+   }
+   catalogMapSize = info.st_size;
+   
+   header = (struct CatalogHeader*)catalogMap;
+   packs = (struct CatalogPackRecord*)(header + 1);
+   records = (struct CatalogDirectoryRecord*)(packs + header->numPacks);
+   strings = (char*)(records + header->numDirectories);
+   if (memcmp(header->magic, CATALOG_MAGIC, sizeof(CATALOG_MAGIC)) != 0 ||
+       header->version != CATALOG_VERSION)
+      problem = "unknown format";
+   else if (header->numPacks > catalogMapSize ||
+            header->numDirectories > catalogMapSize ||
+            sizeof(struct CatalogHeader) +
+            header->numPacks * sizeof(struct CatalogPackRecord) +
+            header->numDirectories * sizeof(struct CatalogDirectoryRecord) +
+            header->stringsSize != catalogMapSize ||
+            header->stringsSize == 0 || strings[header->stringsSize - 1] != 0)
+      problem = "truncated";
+   else if (header->numPacks > INT_MAX || header->stringsSize > UINT_MAX)
+      problem = "too big";
+   else if (header->rootOffset >= header->stringsSize ||
+            strcmp(strings + header->rootOffset, root) != 0)
+      problem = "made for another directory";
+   for (i = 0; problem == NULL && i < header->numPacks; ++i)
+      if (packs[i].nameOffset >= header->stringsSize)
+         problem = "corrupt";
+   for (i = 0; problem == NULL && i < header->numDirectories; ++i)
+      if (records[i].pathOffset >= header->stringsSize)
+         problem = "corrupt";
+   if (problem != NULL)
+   {
+      fprintf(stderr, "Ignoring the catalog %s: %s\n", catalogPath, problem);
+      munmap(catalogMap, catalogMapSize);
+      catalogMap = NULL;
+      catalogMapSize = 0;
+      return -1;
+   }
+   
+   loaded = CATALOG_New(header->numPacks, header->stringsSize);
+   memcpy(loaded->names, strings, header->stringsSize);
+   loaded->namesLength = header->stringsSize;
+   for (i = 0; i < header->numPacks; ++i)
+   {
+      loaded->nameOffsets[i] = packs[i].nameOffset;
+      loaded->filesizes[i] = packs[i].filesize;
+      loaded->mtimes[i] = packs[i].mtime;
+      loaded->inodes[i] = packs[i].inode;
+      loaded->removed[i] = packs[i].removed != 0;
+      loaded->addedVersions[i] = 0;
+      loaded->requests[i] = 0;
+      loaded->popularity[i] = 0;
+      loaded->popularAt[i] = 0;
+      loaded->hashStates[i] = packs[i].hashed ? HASH_DONE : HASH_NONE;
+      loaded->checksums[i].crc32 = packs[i].crc32;
+      memcpy(loaded->checksums[i].md5, packs[i].md5, sizeof(packs[i].md5));
+   }
+   loaded->numPacks = header->numPacks;
+   numValidPacks = 0;
+   for (i = 0; i < header->numPacks; ++i)
+      numValidPacks += !loaded->removed[i];
+   CATALOG_Publish(loaded);
+   for (i = 0; i < header->numPacks; ++i)
+   {
+      DIR_IndexInsert(i);
+      SEARCH_Add(i);
+   }
+   
+   numCatalogDirectories = catalogDirectoriesSize = header->numDirectories;
+   catalogDirectories = malloc(sizeof(struct CatalogDirectory) *
+                               (catalogDirectoriesSize + 1));
+   for (i = 0; i < header->numDirectories; ++i)
+   {
+      catalogDirectories[i].path = strings + records[i].pathOffset;
+      catalogDirectories[i].mtimeSeconds = records[i].mtimeSeconds;
+      catalogDirectories[i].mtimeNanoseconds = records[i].mtimeNanoseconds;
+      catalogDirectories[i].inode = records[i].inode;
+   }
+   DIR_IndexDirectories();
+   ++catalogVersion;
+   savedCatalogChanges = ++catalogChanges;
+   return 0;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Brings a loaded catalog up to date. Adding, removing or renaming a file
+// changes the mtime of its directory, so only directories whose mtime (or
+// inode) differs from the catalog are read again; all others are just
+// stat()ed, and watched, by the scanner threads. A file rewritten in place
+// doesn't touch its directory and keeps its old size until inotify reports
+// it while the bot runs.
+/////////////////////////////////////////////////////////////////////////////
+struct DirectoryCheck
+{
+   pthread_t thread;
+   char started;    //thread runs the check and has to be joined
+   int first;
+   int last;
+   char *changed;   //per directory: 0 same, 1 changed, 2 gone
+};
+
+void *DIR_CheckDirectories(void *argument)
+{
+   struct DirectoryCheck *check = argument;
+   struct CatalogDirectory *known;
+   char fullpath[4096];
+   struct statx info;
+   int i;
+   
+   for (i = check->first; i < check->last; ++i)
+   {
+      known = &catalogDirectories[i];
+      snprintf(fullpath, sizeof(fullpath), "%s/%s", directory, known->path);
+      if (statx(AT_FDCWD, fullpath, AT_STATX_DONT_SYNC,
+                STATX_TYPE | STATX_MTIME | STATX_INO, &info) != 0 ||
+          !S_ISDIR(info.stx_mode))
+         check->changed[i] = 2;
+      else if (info.stx_mtime.tv_sec != known->mtimeSeconds ||
+               info.stx_mtime.tv_nsec != known->mtimeNanoseconds ||
+               info.stx_ino != known->inode)
+         check->changed[i] = 1;
+      else
+         DIR_WatchDirectory(known->path);
+   }
+   return NULL;
+}
+
+void DIR_Revalidate()
+{
+   struct DirectoryCheck *checks;
+   char **changedPaths;
+   char *changed;
+   char parent[4096];
+   int numChanged = 0;
+   int numGone = 0;
+   int numThreads = scanThreads;
+   int length;
+   int known;
+   int i;
+   
+   if (numThreads <= 0)
+      numThreads = sysconf(_SC_NPROCESSORS_ONLN) < 4 ? 4 :
+                   sysconf(_SC_NPROCESSORS_ONLN);
+   changed = calloc(numCatalogDirectories + 1, 1);
+   checks = calloc(numThreads, sizeof(struct DirectoryCheck));
+   for (i = 0; i < numThreads; ++i)
+   {
+      checks[i].first = (long long)numCatalogDirectories * i / numThreads;
+      checks[i].last = (long long)numCatalogDirectories * (i + 1) / numThreads;
+      checks[i].changed = changed;
+      if (i > 0 && pthread_create(&checks[i].thread, NULL,
+                                  DIR_CheckDirectories, &checks[i]) == 0)
+         checks[i].started = 1;
+      else if (i > 0)
+         DIR_CheckDirectories(&checks[i]);
+   }
+   DIR_CheckDirectories(&checks[0]);
+   for (i = 1; i < numThreads; ++i)
+      if (checks[i].started)
+         pthread_join(checks[i].thread, NULL);
+   free(checks);
+   
+   for (i = 0; i < numCatalogDirectories; ++i)
+   {
+      numChanged += changed[i] == 1;
+      numGone += changed[i] == 2;
+   }
+   if (numChanged + numGone > 0)
+   {
+      //the packs in changed directories are taken out and the rescan puts
+      //back what is still there
+      for (i = 0; i < dirContents->numPacks; ++i)
+      {
+         length = DIR_BaseName(DIR_Name(i)) - DIR_Name(i);
+         if (length > 0)
+            --length;
+         memcpy(parent, DIR_Name(i), length);
+         parent[length] = '\0';
+         known = DIR_FindDirectory(parent);
+         if ((known == -1 || changed[known] != 0) && DIR_PackValid(i))
+         {
+            dirContents->removed[i] = 1;
+            --numValidPacks;
+         }
+      }
+      changedPaths = malloc(sizeof(char*) * (numChanged + 1));
+      numChanged = 0;
+      for (i = 0; i < numCatalogDirectories; ++i)
+         if (changed[i] == 1)
+            changedPaths[numChanged++] = strdup(catalogDirectories[i].path);
+      for (i = numCatalogDirectories - 1; i >= 0; --i)
+      {
+         if (changed[i] == 0)
+            continue;
+         DIR_FreeString(catalogDirectories[i].path);
+         catalogDirectories[i] = catalogDirectories[--numCatalogDirectories];
+      }
+      DIR_IndexDirectories();
+      ++catalogVersion;
+      ++catalogChanges;
+      ++listingVersion;
+      DIR_ScanPaths(changedPaths, numChanged, NULL);
+      for (i = 0; i < numChanged; ++i)
+         free(changedPaths[i]);
+      free(changedPaths);
+   }
+   if (debugLevel > 0)
+      fprintf(stderr, "Catalog: %i directories, %i changed, %i gone\n",
+            numCatalogDirectories, numChanged, numGone);
+   free(changed);
+}
+
+void DIR_Scan()
+{
+   struct timespec started, now;
+   
+   clock_gettime(CLOCK_MONOTONIC, &started);
+   if (debugLevel > 0)
+      fprintf(stderr, "\nScanning directory: %s\n", directory);
+   
+   if (access(directory, R_OK | X_OK) != 0)
+   {
+      fprintf(stderr, "Couldn't open directory: %s", directory);
+      exit(-1);
+   }
+   if (DIR_LoadCatalog() == 0)
+      DIR_Revalidate();
+   else
+      DIR_ScanTree("", NULL);
+   CATALOG_Compact();
+   if (catalogChanges != savedCatalogChanges)
+      DIR_SaveCatalog();
+   clock_gettime(CLOCK_MONOTONIC, &now);
+   if (debugLevel > 0)
+      fprintf(stderr, "Sharing %i files, catalog ready in %.3f s\n",
+            dirContents->numPacks, now.tv_sec - started.tv_sec +
+            (now.tv_nsec - started.tv_nsec) / 1e9);
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// CRC32 (the zip/sfv one, polynomial 0xEDB88320) and MD5 of every pack, so
+// clients can check their downloads. CRC32 is computed 16 bytes at a time
+// with carry-less multiplication when the CPU has PCLMULQDQ, folding four
+// 128 bit lanes in parallel ("Fast CRC Computation for Generic Polynomials
+// Using PCLMULQDQ", Intel 2009); otherwise, and for the tail, with eight
+// lookup tables a byte each. The SSE4.2 crc32 instruction can't be used:
+// it computes CRC32C, a different polynomial.
+/////////////////////////////////////////////////////////////////////////////
+unsigned int crcTables[8][256];
+char crcHaveClmul = 0;
+
+void CRC_Init()
+{
+   unsigned int crc;
+   int i, j;
+   
+   for (i = 0; i < 256; ++i)
+   {
+      crc = i;
+      for (j = 0; j < 8; ++j)
+         crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+      crcTables[0][i] = crc;
+   }
+   for (i = 0; i < 256; ++i)
+      for (j = 1; j < 8; ++j)
+         crcTables[j][i] = (crcTables[j - 1][i] >> 8) ^
+                           crcTables[0][crcTables[j - 1][i] & 0xff];
+#if defined(__x86_64__) || defined(__i386__)
+   __builtin_cpu_init();
+   crcHaveClmul = __builtin_cpu_supports("pclmul") &&
+                  __builtin_cpu_supports("sse4.1");
+#endif
+}
+
+unsigned int CRC_Tables(unsigned int crc, const unsigned char *data,
+                        size_t length)
+{
+   unsigned int low, high;
+   
+   while (length >= 8)
+   {
+      memcpy(&low, data, 4);
+      memcpy(&high, data + 4, 4);
+      low ^= crc;
+      crc = crcTables[7][low & 0xff] ^ crcTables[6][(low >> 8) & 0xff] ^
+            crcTables[5][(low >> 16) & 0xff] ^ crcTables[4][low >> 24] ^
+            crcTables[3][high & 0xff] ^ crcTables[2][(high >> 8) & 0xff] ^
+            crcTables[1][(high >> 16) & 0xff] ^ crcTables[0][high >> 24];
+      data += 8;
+      length -= 8;
+   }
+   while (length-- > 0)
+      crc = (crc >> 8) ^ crcTables[0][(crc ^ *data++) & 0xff];
+   return crc;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+//length is at least 64 and a multiple of 16
+__attribute__((target("pclmul,sse4.1")))
+unsigned int CRC_Clmul(unsigned int crc, const unsigned char *data,
+                       size_t length)
+{
+   //x^(4*128+32) mod P, x^(4*128-32) mod P, then the same for one lane,
+   //x^64 mod P, P itself and the Barrett constant, all bit reflected
+   const __m128i k1k2 = _mm_set_epi64x(0x01c6e41596, 0x0154442bd4);
+   const __m128i k3k4 = _mm_set_epi64x(0x00ccaa009e, 0x01751997d0);
+   const __m128i k5 = _mm_set_epi64x(0, 0x0163cd6124);
+   const __m128i poly = _mm_set_epi64x(0x01f7011641, 0x01db710641);
+   const __m128i mask = _mm_setr_epi32(~0, 0, ~0, 0);
+   __m128i x1, x2, x3, x4, t1, t2, t3, t4;
+   
+   x1 = _mm_xor_si128(_mm_loadu_si128((const __m128i*)data),
+                      _mm_cvtsi32_si128(crc));
+   x2 = _mm_loadu_si128((const __m128i*)(data + 16));
+   x3 = _mm_loadu_si128((const __m128i*)(data + 32));
+   x4 = _mm_loadu_si128((const __m128i*)(data + 48));
+   data += 64;
+   length -= 64;
+   
+   while (length >= 64)
+   {
+      t1 = _mm_clmulepi64_si128(x1, k1k2, 0x00);
+      t2 = _mm_clmulepi64_si128(x2, k1k2, 0x00);
+      t3 = _mm_clmulepi64_si128(x3, k1k2, 0x00);
+      t4 = _mm_clmulepi64_si128(x4, k1k2, 0x00);
+      x1 = _mm_clmulepi64_si128(x1, k1k2, 0x11);
+      x2 = _mm_clmulepi64_si128(x2, k1k2, 0x11);
+      x3 = _mm_clmulepi64_si128(x3, k1k2, 0x11);
+      x4 = _mm_clmulepi64_si128(x4, k1k2, 0x11);
+      x1 = _mm_xor_si128(_mm_xor_si128(x1, t1),
+                         _mm_loadu_si128((const __m128i*)data));
+      x2 = _mm_xor_si128(_mm_xor_si128(x2, t2),
+                         _mm_loadu_si128((const __m128i*)(data + 16)));
+      x3 = _mm_xor_si128(_mm_xor_si128(x3, t3),
+                         _mm_loadu_si128((const __m128i*)(data + 32)));
+      x4 = _mm_xor_si128(_mm_xor_si128(x4, t4),
+                         _mm_loadu_si128((const __m128i*)(data + 48)));
+      data += 64;
+      length -= 64;
+   }
+   
+   //fold the four lanes into one
+   t1 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+   x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+   x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), t1);
+   t1 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+   x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+   x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), t1);
+   t1 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+   x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+   x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), t1);
+   
+   while (length >= 16)
+   {
+      t1 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+      x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+      x1 = _mm_xor_si128(_mm_xor_si128(x1, _mm_loadu_si128(
+                                         (const __m128i*)data)), t1);
+      data += 16;
+      length -= 16;
+   }
+   
+   //128 bits down to 64, then a Barrett reduction down to 32
+   t1 = _mm_clmulepi64_si128(x1, k3k4, 0x10);
+   x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), t1);
+   t1 = _mm_srli_si128(x1, 4);
+   x1 = _mm_clmulepi64_si128(_mm_and_si128(x1, mask), k5, 0x00);
+   x1 = _mm_xor_si128(x1, t1);
+   t1 = _mm_clmulepi64_si128(_mm_and_si128(x1, mask), poly, 0x10);
+   t1 = _mm_clmulepi64_si128(_mm_and_si128(t1, mask), poly, 0x00);
+   x1 = _mm_xor_si128(x1, t1);
+   return _mm_extract_epi32(x1, 1);
+}
+#endif
+
+//continues crc (0 to start) over data, like zlib's crc32()
+unsigned int CRC_Update(unsigned int crc, const unsigned char *data,
+                        size_t length)
+{
+   size_t chunk;
+   
+   crc = ~crc;
+#if defined(__x86_64__) || defined(__i386__)
+   if (crcHaveClmul && length >= 64)
+   {
+      chunk = length & ~(size_t)15;
+      crc = CRC_Clmul(crc, data, chunk);
+      data += chunk;
+      length -= chunk;
+   }
+#endif
+   (void)chunk;
+   return ~CRC_Tables(crc, data, length);
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// MD5 as in RFC 1321.
+/////////////////////////////////////////////////////////////////////////////
+struct Md5
+{
+   unsigned int state[4];
+   unsigned long long length;
+   unsigned char buffer[64];
+};
+
+//one step of a round: a = b + ((a + f(b, c, d) + word + sine) <<< shift)
+#define MD5_F(x, y, z) ((z) ^ ((x) & ((y) ^ (z))))
+#define MD5_G(x, y, z) ((y) ^ ((z) & ((x) ^ (y))))
+#define MD5_H(x, y, z) ((x) ^ (y) ^ (z))
+#define MD5_I(x, y, z) ((y) ^ ((x) | ~(z)))
+#define MD5_STEP(f, a, b, c, d, word, sine, shift) \
+   (a) += f((b), (c), (d)) + (word) + (sine); \
+   (a) = ((a) << (shift) | (a) >> (32 - (shift))) + (b);
+
+void MD5_Init(struct Md5 *md5)
+{
+   md5->state[0] = 0x67452301;
+   md5->state[1] = 0xefcdab89;
+   md5->state[2] = 0x98badcfe;
+   md5->state[3] = 0x10325476;
+   md5->length = 0;
+}
+
+//the rounds are spelled out, a loop picking functions and shifts is half
+//as fast
+void MD5_Block(struct Md5 *md5, const unsigned char *block)
+{
+   unsigned int a = md5->state[0], b = md5->state[1];
+   unsigned int c = md5->state[2], d = md5->state[3];
+   unsigned int words[16];
+   int i;
+
+   for (i = 0; i < 16; ++i)
+      words[i] = block[i * 4] | block[i * 4 + 1] << 8 |
+                 block[i * 4 + 2] << 16 | (unsigned int)block[i * 4 + 3] << 24;
+
+   MD5_STEP(MD5_F, a, b, c, d, words[0], 0xd76aa478, 7);
+   MD5_STEP(MD5_F, d, a, b, c, words[1], 0xe8c7b756, 12);
+   MD5_STEP(MD5_F, c, d, a, b, words[2], 0x242070db, 17);
+   MD5_STEP(MD5_F, b, c, d, a, words[3], 0xc1bdceee, 22);
+   MD5_STEP(MD5_F, a, b, c, d, words[4], 0xf57c0faf, 7);
+   MD5_STEP(MD5_F, d, a, b, c, words[5], 0x4787c62a, 12);
+   MD5_STEP(MD5_F, c, d, a, b, words[6], 0xa8304613, 17);
+   MD5_STEP(MD5_F, b, c, d, a, words[7], 0xfd469501, 22);
+   MD5_STEP(MD5_F, a, b, c, d, words[8], 0x698098d8, 7);
+   MD5_STEP(MD5_F, d, a, b, c, words[9], 0x8b44f7af, 12);
+   MD5_STEP(MD5_F, c, d, a, b, words[10], 0xffff5bb1, 17);
+   MD5_STEP(MD5_F, b, c, d, a, words[11], 0x895cd7be, 22);
+   MD5_STEP(MD5_F, a, b, c, d, words[12], 0x6b901122, 7);
+   MD5_STEP(MD5_F, d, a, b, c, words[13], 0xfd987193, 12);
+   MD5_STEP(MD5_F, c, d, a, b, words[14], 0xa679438e, 17);
+   MD5_STEP(MD5_F, b, c, d, a, words[15], 0x49b40821, 22);
+
+   MD5_STEP(MD5_G, a, b, c, d, words[1], 0xf61e2562, 5);
+   MD5_STEP(MD5_G, d, a, b, c, words[6], 0xc040b340, 9);
+   MD5_STEP(MD5_G, c, d, a, b, words[11], 0x265e5a51, 14);
+   MD5_STEP(MD5_G, b, c, d, a, words[0], 0xe9b6c7aa, 20);
+   MD5_STEP(MD5_G, a, b, c, d, words[5], 0xd62f105d, 5);
+   MD5_STEP(MD5_G, d, a, b, c, words[10], 0x02441453, 9);
+   MD5_STEP(MD5_G, c, d, a, b, words[15], 0xd8a1e681, 14);
+   MD5_STEP(MD5_G, b, c, d, a, words[4], 0xe7d3fbc8, 20);
+   MD5_STEP(MD5_G, a, b, c, d, words[9], 0x21e1cde6, 5);
+   MD5_STEP(MD5_G, d, a, b, c, words[14], 0xc33707d6, 9);
+   MD5_STEP(MD5_G, c, d, a, b, words[3], 0xf4d50d87, 14);
+   MD5_STEP(MD5_G, b, c, d, a, words[8], 0x455a14ed, 20);
+   MD5_STEP(MD5_G, a, b, c, d, words[13], 0xa9e3e905, 5);
+   MD5_STEP(MD5_G, d, a, b, c, words[2], 0xfcefa3f8, 9);
+   MD5_STEP(MD5_G, c, d, a, b, words[7], 0x676f02d9, 14);
+   MD5_STEP(MD5_G, b, c, d, a, words[12], 0x8d2a4c8a, 20);
+
+   MD5_STEP(MD5_H, a, b, c, d, words[5], 0xfffa3942, 4);
+   MD5_STEP(MD5_H, d, a, b, c, words[8], 0x8771f681, 11);
+   MD5_STEP(MD5_H, c, d, a, b, words[11], 0x6d9d6122, 16);
+   MD5_STEP(MD5_H, b, c, d, a, words[14], 0xfde5380c, 23);
+   MD5_STEP(MD5_H, a, b, c, d, words[1], 0xa4beea44, 4);
+   MD5_STEP(MD5_H, d, a, b, c, words[4], 0x4bdecfa9, 11);
+   MD5_STEP(MD5_H, c, d, a, b, words[7], 0xf6bb4b60, 16);
+   MD5_STEP(MD5_H, b, c, d, a, words[10], 0xbebfbc70, 23);
+   MD5_STEP(MD5_H, a, b, c, d, words[13], 0x289b7ec6, 4);
+   MD5_STEP(MD5_H, d, a, b, c, words[0], 0xeaa127fa, 11);
+   MD5_STEP(MD5_H, c, d, a, b, words[3], 0xd4ef3085, 16);
+   MD5_STEP(MD5_H, b, c, d, a, words[6], 0x04881d05, 23);
+   MD5_STEP(MD5_H, a, b, c, d, words[9], 0xd9d4d039, 4);
+   MD5_STEP(MD5_H, d, a, b, c, words[12], 0xe6db99e5, 11);
+   MD5_STEP(MD5_H, c, d, a, b, words[15], 0x1fa27cf8, 16);
+   MD5_STEP(MD5_H, b, c, d, a, words[2], 0xc4ac5665, 23);
+
+   MD5_STEP(MD5_I, a, b, c, d, words[0], 0xf4292244, 6);
+   MD5_STEP(MD5_I, d, a, b, c, words[7], 0x432aff97, 10);
+   MD5_STEP(MD5_I, c, d, a, b, words[14], 0xab9423a7, 15);
+   MD5_STEP(MD5_I, b, c, d, a, words[5], 0xfc93a039, 21);
+   MD5_STEP(MD5_I, a, b, c, d, words[12], 0x655b59c3, 6);
+   MD5_STEP(MD5_I, d, a, b, c, words[3], 0x8f0ccc92, 10);
+   MD5_STEP(MD5_I, c, d, a, b, words[10], 0xffeff47d, 15);
+   MD5_STEP(MD5_I, b, c, d, a, words[1], 0x85845dd1, 21);
+   MD5_STEP(MD5_I, a, b, c, d, words[8], 0x6fa87e4f, 6);
+   MD5_STEP(MD5_I, d, a, b, c, words[15], 0xfe2ce6e0, 10);
+   MD5_STEP(MD5_I, c, d, a, b, words[6], 0xa3014314, 15);
+   MD5_STEP(MD5_I, b, c, d, a, words[13], 0x4e0811a1, 21);
+   MD5_STEP(MD5_I, a, b, c, d, words[4], 0xf7537e82, 6);
+   MD5_STEP(MD5_I, d, a, b, c, words[11], 0xbd3af235, 10);
+   MD5_STEP(MD5_I, c, d, a, b, words[2], 0x2ad7d2bb, 15);
+   MD5_STEP(MD5_I, b, c, d, a, words[9], 0xeb86d391, 21);
+
+   md5->state[0] += a;
+   md5->state[1] += b;
+   md5->state[2] += c;
+   md5->state[3] += d;
+}
+
+void MD5_Update(struct Md5 *md5, const unsigned char *data, size_t length)
+{
+   size_t buffered = md5->length & 63;
+   size_t take;
+   
+   md5->length += length;
+   if (buffered > 0)
+   {
+      take = 64 - buffered < length ? 64 - buffered : length;
+      memcpy(md5->buffer + buffered, data, take);
+      data += take;
+      length -= take;
+      if (buffered + take < 64)
+         return;
+      MD5_Block(md5, md5->buffer);
+   }
+   for (; length >= 64; data += 64, length -= 64)
+      MD5_Block(md5, data);
+   memcpy(md5->buffer, data, length);
+}
+
+void MD5_Final(struct Md5 *md5, unsigned char digest[16])
+{
+   unsigned char padding[72];
+   unsigned long long bits = md5->length * 8;
+   size_t padLength = 64 - ((md5->length + 8) & 63);
+   int i;
+   
+   memset(padding, 0, sizeof(padding));
+   padding[0] = 0x80;
+   for (i = 0; i < 8; ++i)
+      padding[padLength + i] = bits >> (8 * i);
+   MD5_Update(md5, padding, padLength + 8);
+   for (i = 0; i < 16; ++i)
+      digest[i] = md5->state[i / 4] >> (8 * (i % 4));
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Checksums are computed by a pool of hashthreads threads so neither the
+// event loop nor a transfer ever waits for them. The event loop owns the
+// catalog: it hands the threads jobs that carry everything they need (the
+// path, and the size and mtime the pack had), a thread reads the file in
+// big sequential chunks and computes both sums in one pass, and the result
+// goes back through an eventfd. It is only stored if the pack still has the
+// size and mtime the job was made for. Only a few jobs are out at a time;
+// HASH_Feed walks the catalog for more as they finish.
+/////////////////////////////////////////////////////////////////////////////
+#define HASH_CHUNK (1024 * 1024)
+
+struct HashJob
+{
+   int packNumber;
+   char *path;
+   long long filesize;
+   time_t mtime;
+   int failed;
+   unsigned int crc32;
+   unsigned char md5[16];
+   struct HashJob *next;
+};
+
+struct HashPool
+{
+   pthread_mutex_t lock;
+   pthread_cond_t wake;
+   struct HashJob *waiting;
+   struct HashJob *waitingTail;
+   struct HashJob *finished;
+   int eventFd;     //counts finished jobs
+   int numThreads;
+   int inFlight;    //jobs handed out and not collected yet
+   int cursor;      //next pack HASH_Feed looks at
+   unsigned int fedVersion;
+   long long hashedBytes;
+   int hashedPacks;
+   struct timespec busySince;
+} hashPool = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL, NULL,
+               NULL, -1 };
+
+void HASH_File(struct HashJob *job, unsigned char *buffer)
+{
+   struct Md5 md5;
+   unsigned int crc = 0;
+   ssize_t length;
+   int fileDescriptor;
+   
+   fileDescriptor = open(job->path, O_RDONLY | O_CLOEXEC);
+   if (fileDescriptor == -1)
+   {
+      job->failed = 1;
+      return;
+   }
+   posix_fadvise(fileDescriptor, 0, 0, POSIX_FADV_SEQUENTIAL);
+   MD5_Init(&md5);
+   while ((length = read(fileDescriptor, buffer, HASH_CHUNK)) > 0)
+   {
+      crc = CRC_Update(crc, buffer, length);
+      MD5_Update(&md5, buffer, length);
+      METRIC_Count(METRIC_HASHED_BYTES, length);
+   }
+   job->failed = length == -1;
+   job->crc32 = crc;
+   MD5_Final(&md5, job->md5);
+   close(fileDescriptor);
+}
+
+void *HASH_Worker(void *argument)
+{
+   struct HashJob *job;
+   unsigned char *buffer;
+   unsigned long long one = 1;
+   
+   //page aligned so the kernel can copy whole pages
+   if (posix_memalign((void**)&buffer, 4096, HASH_CHUNK) != 0)
+      return NULL;
+   pthread_mutex_lock(&hashPool.lock);
+   while (1)
+   {
+      while (hashPool.waiting == NULL)
+         pthread_cond_wait(&hashPool.wake, &hashPool.lock);
+      job = hashPool.waiting;
+      hashPool.waiting = job->next;
+      pthread_mutex_unlock(&hashPool.lock);
+   
+      HASH_File(job, buffer);
+   
+      pthread_mutex_lock(&hashPool.lock);
+      job->next = hashPool.finished;
+      hashPool.finished = job;
+      write(hashPool.eventFd, &one, sizeof(one));
+   }
+   return NULL;
+}
+
+//starts the threads; they never see signals meant for the event loop
+void HASH_Start()
+{
+   pthread_t thread;
+   sigset_t allSignals, previous;
+   int i;
+   
+   CRC_Init();
+   if (hashThreads <= 0)
+      return;
+   hashPool.eventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+   if (hashPool.eventFd == -1)
+   {
+      perror("eventfd");
+      return;
+   }
+   sigfillset(&allSignals);
+   pthread_sigmask(SIG_BLOCK, &allSignals, &previous);
+   for (i = 0; i < hashThreads; ++i)
+      if (pthread_create(&thread, NULL, HASH_Worker, NULL) == 0)
+         ++hashPool.numThreads;
+   pthread_sigmask(SIG_SETMASK, &previous, NULL);
+   if (debugLevel > 0)
+      fprintf(stderr, "Computing checksums with %i threads, CRC32 %s\n",
+            hashPool.numThreads, crcHaveClmul ? "with PCLMULQDQ" : "by table");
+}
+
+//hands out jobs for packs without checksums, a couple per thread
+void HASH_Feed()
+{
+   char fullpath[4096];
+   struct HashJob *job;
+   int packNumber;
+   
+   if (hashPool.numThreads == 0)
+      return;
+   //anything may have changed, look at every pack again
+   if (hashPool.fedVersion != catalogVersion)
+   {
+      hashPool.fedVersion = catalogVersion;
+      hashPool.cursor = 0;
+   }
+   while (hashPool.inFlight < hashPool.numThreads * 2 &&
+          hashPool.cursor < dirContents->numPacks)
+   {
+      packNumber = hashPool.cursor++;
+      if (dirContents->removed[packNumber] ||
+          dirContents->hashStates[packNumber] != HASH_NONE)
+         continue;
+      snprintf(fullpath, sizeof(fullpath), "%s/%s", directory,
+               DIR_Name(packNumber));
+      job = calloc(1, sizeof(struct HashJob));
+      job->packNumber = packNumber;
+      job->path = strdup(fullpath);
+      job->filesize = dirContents->filesizes[packNumber];
+      job->mtime = dirContents->mtimes[packNumber];
+      dirContents->hashStates[packNumber] = HASH_QUEUED;
+      if (hashPool.inFlight++ == 0 && hashPool.hashedPacks == 0)
+         clock_gettime(CLOCK_MONOTONIC, &hashPool.busySince);
+   
+      pthread_mutex_lock(&hashPool.lock);
+      if (hashPool.waiting == NULL)
+         hashPool.waiting = job;
+      else
+         hashPool.waitingTail->next = job;
+      hashPool.waitingTail = job;
+      pthread_cond_signal(&hashPool.wake);
+      pthread_mutex_unlock(&hashPool.lock);
+   }
+}
+
+//stores finished checksums, then hands out more work
+void HASH_Collect()
+{
+   struct HashJob *job, *next;
+   struct timespec now;
+   int packNumber;
+   unsigned long long count;
+   double seconds;
+   
+   read(hashPool.eventFd, &count, sizeof(count));
+   pthread_mutex_lock(&hashPool.lock);
+   job = hashPool.finished;
+   hashPool.finished = NULL;
+   pthread_mutex_unlock(&hashPool.lock);
+   
+   for (; job != NULL; job = next)
+   {
+      next = job->next;
+      --hashPool.inFlight;
+      packNumber = job->packNumber;
+      if (job->failed || dirContents->removed[packNumber] ||
+          dirContents->filesizes[packNumber] != job->filesize ||
+          dirContents->mtimes[packNumber] != job->mtime)
+      {
+         //changed while it was read; it gets queued again
+         if (dirContents->hashStates[packNumber] == HASH_QUEUED)
+            dirContents->hashStates[packNumber] = HASH_NONE;
+      }
+      else
+      {
+         dirContents->checksums[packNumber].crc32 = job->crc32;
+         memcpy(dirContents->checksums[packNumber].md5, job->md5,
+                sizeof(job->md5));
+         dirContents->hashStates[packNumber] = HASH_DONE;
+         //saved with the catalog, but nothing anyone lists or announces
+         ++catalogChanges;
+         ++hashPool.hashedPacks;
+         hashPool.hashedBytes += job->filesize;
+         if (debugLevel > 1)
+            fprintf(stderr, "Pack #%i CRC32 %08X\n", job->packNumber,
+                  job->crc32);
+      }
+      free(job->path);
+      free(job);
+   }
+   HASH_Feed();
+   
+   //all caught up: how fast was it?
+   if (hashPool.inFlight == 0 && hashPool.hashedPacks > 0)
+   {
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      seconds = now.tv_sec - hashPool.busySince.tv_sec +
+                (now.tv_nsec - hashPool.busySince.tv_nsec) / 1e9;
+      if (debugLevel > 0 || benchmarkScan)
+         fprintf(benchmarkScan ? stdout : stderr,
+               "Hashed %i packs, %.2f GB in %.2f s: %.2f GB/s\n",
+               hashPool.hashedPacks, hashPool.hashedBytes / 1e9, seconds,
+               seconds > 0 ? hashPool.hashedBytes / 1e9 / seconds : 0.0);
+      hashPool.hashedPacks = 0;
+      hashPool.hashedBytes = 0;
+   }
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// The search part of -b: indexes made up names (three pronounceable words
+// out of a few thousand, an episode, a resolution and a codec) in place of
+// the catalog and times some queries, from a rare word pair to one that's
+// in a third of all names.
+/////////////////////////////////////////////////////////////////////////////
+#define SEARCH_BENCHMARK_PACKS 1000000
+#define SEARCH_BENCHMARK_WORDS 4000
+#define SEARCH_BENCHMARK_ROUNDS 200
+
+void SEARCH_Benchmark(int count)
+{
+   static const char consonants[] = "bcdfghjklmnpqrstvwxyz";
+   static const char vowels[] = "aeiou";
+   static const char *resolutions[] = { "720p", "1080p", "2160p" };
+   static const char *codecs[] = { "x264", "x265", "xvid", "av1" };
+   const char *queries[5];
+   struct Catalog *catalog = dirContents;
+   char (*vocabulary)[16];
+   char name[128];
+   char pair[64];
+   unsigned int picked = 0;
+   unsigned int random = 2463534242u;
+   long long started, elapsed;
+   int results[64];
+   int numResults;
+   int matches = 0;
+   char truncated;
+   int i, j, q;
+   
+   vocabulary = malloc(sizeof(*vocabulary) * SEARCH_BENCHMARK_WORDS);
+   for (i = 0; i < SEARCH_BENCHMARK_WORDS; ++i)
+   {
+      for (j = 0; j < 4 + i % 5; ++j)
+      {
+         random ^= random << 13; random ^= random >> 17; random ^= random << 5;
+         vocabulary[i][j] = j % 2 == 0 ? consonants[random % 21] :
+                                         vowels[random % 5];
+      }
+      vocabulary[i][j] = '\0';
+   }
+   //the names come to about 50 bytes, what's left over is compacted away
+   dirContents = CATALOG_New(count, (size_t)count * 64);
+   for (i = 0; i < count; ++i)
+   {
+      random ^= random << 13; random ^= random >> 17; random ^= random << 5;
+      snprintf(name, sizeof(name), "Shows/%s.%s.%s.S%02iE%02i.%s.%s.mkv",
+               vocabulary[random % SEARCH_BENCHMARK_WORDS],
+               vocabulary[(random >> 8) % SEARCH_BENCHMARK_WORDS],
+               vocabulary[(random >> 16) % SEARCH_BENCHMARK_WORDS],
+               1 + random % 12, 1 + (random >> 4) % 24,
+               resolutions[(random >> 12) % 3], codecs[(random >> 20) % 4]);
+      CATALOG_Append(name, 0, 0, 0);
+      if (i == count / 2)
+         picked = random;
+   }
+   CATALOG_Compact();
+   printf("Catalog of %i names: %.1f bytes per pack, %.1f of them names\n",
+          count, (double)CATALOG_Bytes(dirContents) / count,
+          (double)dirContents->namesLength / count);
+   SEARCH_Reset();
+   
+   started = METRIC_Clock();
+   for (i = 0; i < count; ++i)
+      SEARCH_Add(i);
+   elapsed = METRIC_Clock() - started;
+   printf("Indexed %i names for search in %.3f s\n", count, elapsed / 1e9);
+   
+   //two words of one of the names
+   snprintf(pair, sizeof(pair), "%s %s",
+            vocabulary[picked % SEARCH_BENCHMARK_WORDS],
+            vocabulary[(picked >> 16) % SEARCH_BENCHMARK_WORDS]);
+   queries[0] = pair;
+   queries[1] = vocabulary[5];
+   queries[2] = "s03e07";
+   queries[3] = "2160p";
+   queries[4] = "nothing like it";
+   for (q = 0; q < 5; ++q)
+   {
+      started = METRIC_Clock();
+      for (i = 0; i < SEARCH_BENCHMARK_ROUNDS; ++i)
+         matches = SEARCH_Query(queries[q], results, searchResults,
+                                &numResults, &truncated);
+      elapsed = METRIC_Clock() - started;
+      printf("Search for \"%s\": %i%s matches in %.1f us\n", queries[q],
+             matches, truncated ? "+" : "",
+             elapsed / 1e3 / SEARCH_BENCHMARK_ROUNDS);
+   }
+   
+   SEARCH_Reset();
+   CATALOG_Free(dirContents);
+   CATALOG_Reclaim();
+   free(vocabulary);
+   dirContents = catalog;
+}
+
+//-b: how fast can the share be scanned?
+void DIR_Benchmark()
+{
+   long long started;
+   double seconds;
+   int numDirectories;
+   int numFiles;
+   struct timespec now;
+   
+   if (access(directory, R_OK | X_OK) != 0)
+   {
+      fprintf(stderr, "Couldn't open directory: %s\n", directory);
+      exit(-1);
+   }
+   clock_gettime(CLOCK_MONOTONIC, &now);
+   started = now.tv_sec * 1000000LL + now.tv_nsec / 1000;
+   //always a full scan, the catalog file isn't used
+   numFiles = DIR_ScanTree("", &numDirectories);
+   clock_gettime(CLOCK_MONOTONIC, &now);
+   seconds = (now.tv_sec * 1000000LL + now.tv_nsec / 1000 - started) / 1e6;
+   printf("Scanned %i files in %i directories in %.3f s: %.0f files/s\n",
+          numFiles, numDirectories, seconds,
+          seconds > 0 ? numFiles / seconds : 0.0);
+   fflush(stdout);
+   
+   //then checksum all of it
+   HASH_Start();
+   HASH_Feed();
+   while (hashPool.inFlight > 0)
+   {
+      struct pollfd waitFor = { hashPool.eventFd, POLLIN, 0 };
+   
+      poll(&waitFor, 1, -1);
+      HASH_Collect();
+   }
+   SEARCH_Benchmark(SEARCH_BENCHMARK_PACKS);
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// IRC line parser. Received bytes are appended to a persistent buffer and
+// every complete CRLF terminated line in it is parsed in place: the prefix,
+// command and parameters become slices pointing into the buffer (their
+// separators are overwritten with NULs so they can be used as C strings as
+// well). Nothing is allocated. A partial line stays in the buffer until the
+// rest of it arrives; when the free space at the end runs out the partial
+// line is moved to the front, so a line is always contiguous.
+/////////////////////////////////////////////////////////////////////////////
+struct IrcSlice
+{
+   const char *text;
+   int length;
+};
+
+struct IrcMessage
+{
+   struct IrcSlice prefix;  //empty if the line had none
+   struct IrcSlice nick;    //the nick part of the prefix
+   struct IrcSlice command;
+   struct IrcSlice params[IRC_MAX_PARAMS];
+   int numParams;
+};
+
+struct IrcReader
+{
+   char buffer[IRC_BUFFER_SIZE];
+   size_t start;  //first byte that hasn't been parsed
+   size_t end;    //one past the last byte received
+};
+
+int IRC_SliceEquals(struct IrcSlice *slice, const char *text)
+{
+   return slice->text != NULL && (int)strlen(text) == slice->length &&
+          strncasecmp(slice->text, text, slice->length) == 0;
+}
+
+//copies a slice into a NUL terminated buffer, truncating if needed
+void IRC_SliceCopy(struct IrcSlice *slice, char *destination, size_t size)
+{
+   size_t length = slice->length < (int)size - 1 ? slice->length : size - 1;
+   
+   if (slice->text != NULL)
+      memcpy(destination, slice->text, length);
+   else
+      length = 0;
+   destination[length] = '\0';
+}
+
+char *IRC_NextToken(char *cursor, char *end, struct IrcSlice *token)
+{
+   token->text = cursor;
+   while (cursor < end && *cursor != ' ')
+      ++cursor;
+   token->length = cursor - token->text;
+   *cursor = '\0';
+   if (cursor < end) ++cursor;
+   while (cursor < end && *cursor == ' ')
+      ++cursor;
+   return cursor;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Splits one line (without its CRLF, NUL terminated at line[length]) into
+// its parts. Returns -1 if there's no command.
+/////////////////////////////////////////////////////////////////////////////
+int IRC_ParseLine(char *line, size_t length, struct IrcMessage *message)
+{
+   char *cursor = line;
+   char *end = line + length;
+   
+   memset(message, 0, sizeof(struct IrcMessage));
+   while (cursor < end && *cursor == ' ')
+      ++cursor;
+   if (cursor < end && *cursor == ':')
+   {
+      cursor = IRC_NextToken(cursor + 1, end, &message->prefix);
+      message->nick.text = message->prefix.text;
+      message->nick.length = strcspn(message->prefix.text, "!@");
+   }
+   if (cursor >= end)
+      return -1;
+   cursor = IRC_NextToken(cursor, end, &message->command);
+   while (cursor < end && message->numParams < IRC_MAX_PARAMS)
+   {
+      if (*cursor == ':' || message->numParams == IRC_MAX_PARAMS - 1)
+      {
+         //the trailing parameter runs to the end of the line
+         if (*cursor == ':') ++cursor;
+         message->params[message->numParams].text = cursor;
+         message->params[message->numParams].length = end - cursor;
+         ++message->numParams;
+         break;
+      }
+      cursor = IRC_NextToken(cursor, end,
+                             &message->params[message->numParams++]);
+   }
+   return 0;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Reads what the socket has and hands every complete line to dispatch.
+// Returns the recv() result that stopped it: 0 if the peer closed and -1
+// with errno set otherwise (EAGAIN once the socket is drained).
+/////////////////////////////////////////////////////////////////////////////
+int IRC_Read(struct IrcReader *reader, int socket,
+             void (*dispatch)(struct IrcReader *reader,
+                              struct IrcMessage *message))
+{
+   struct IrcMessage message;
+   char *lineStart;
+   char *newline;
+   size_t length;
+   ssize_t received;
+   long long parseStarted;
+   
+   while (1)
+   {
+      //the byte kept free below means the buffer is full one short of its size
+      if (reader->end >= IRC_BUFFER_SIZE - 1)
+      {
+         if (reader->start == 0)
+         {
+            //a line longer than the whole buffer; nobody sends those
+            fprintf(stderr, "Dropping overlong line from server\n");
+            reader->end = 0;
+         }
+         else
+         {
+            memmove(reader->buffer, reader->buffer + reader->start,
+                    reader->end - reader->start);
+            reader->end -= reader->start;
+            reader->start = 0;
+         }
+      }
+      //one byte is kept free so the last line can always be terminated
+      received = recv(socket, reader->buffer + reader->end,
+                      IRC_BUFFER_SIZE - reader->end - 1, MSG_DONTWAIT);
+      if (received <= 0)
+         return received;
+      reader->end += received;
+   
+      while ((newline = memchr(reader->buffer + reader->start, '\n',
+                               reader->end - reader->start)) != NULL)
+      {
+         lineStart = reader->buffer + reader->start;
+         reader->start = newline - reader->buffer + 1;
+         length = newline - lineStart;
+         if (length > 0 && lineStart[length - 1] == '\r')
+            --length;
+         lineStart[length] = '\0';
+         parseStarted = METRIC_Clock();
+         if (IRC_ParseLine(lineStart, length, &message) == 0)
+            dispatch(reader, &message);
+         METRIC_Observe(&METRIC_Block()->ircLine, ircLineBounds,
+                        METRIC_Clock() - parseStarted);
+      }
+      if (reader->start == reader->end)
+         reader->start = reader->end = 0;
+   }
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// The event loop. Everything the bot waits on (the IRC connection, DCC
+// listeners and transfers) is registered edge-triggered with one epoll
+// instance through a Watcher, and timers are kept in a list sorted by their
+// monotonic deadline so the loop knows how long it may sleep. Transfer
+// workers run loops of their own, so the epoll instance and the timers
+// belong to the thread.
+/////////////////////////////////////////////////////////////////////////////
+struct Watcher
+{
+   int fd;
+   void (*onEvent)(struct Watcher *watcher, unsigned int events);
+};
+
+struct Timer
+{
+   long long deadline; //milliseconds on the monotonic clock
+   void (*onExpire)(struct Timer *timer);
+   struct Timer *next;
+   char armed;
+};
+
+__thread int reactor = -1;
+__thread struct Timer *timerList = NULL;
+
+long long monotonicMs()
+{
+   struct timespec now;
+   
+   clock_gettime(CLOCK_MONOTONIC, &now);
+   return now.tv_sec * 1000LL + now.tv_nsec / 1000000;
+}
+
+long long monotonicUs()
+{
+   struct timespec now;
+   
+   clock_gettime(CLOCK_MONOTONIC, &now);
+   return now.tv_sec * 1000000LL + now.tv_nsec / 1000;
+}
+
+int REACTOR_Add(struct Watcher *watcher, unsigned int events)
+{
+   struct epoll_event event;
+   
+   memset(&event, 0, sizeof(event));
+   event.events = events | EPOLLET;
+   event.data.ptr = watcher;
+   if (epoll_ctl(reactor, EPOLL_CTL_ADD, watcher->fd, &event) == -1)
+   {
+      fprintf(stderr, "Couldn't watch socket %d: %s\n", watcher->fd,
+            strerror(errno));
+      return -1;
+   }
+   return 0;
+}
+
+void REACTOR_Remove(struct Watcher *watcher)
+{
+   epoll_ctl(reactor, EPOLL_CTL_DEL, watcher->fd, NULL);
+}
+
+void TIMER_Cancel(struct Timer *timer)
+{
+   struct Timer **link = &timerList;
+   
+   if (!timer->armed)
+      return;
+   while (*link != NULL && *link != timer)
+      link = &(*link)->next;
+   if (*link == timer)
+      *link = timer->next;
+   timer->armed = 0;
+}
+
+void TIMER_Arm(struct Timer *timer, int delayMs)
+{
+   struct Timer **link = &timerList;
+   
+   TIMER_Cancel(timer);
+   timer->deadline = monotonicMs() + delayMs;
+   while (*link != NULL && (*link)->deadline <= timer->deadline)
+      link = &(*link)->next;
+   timer->next = *link;
+   *link = timer;
+   timer->armed = 1;
+}
+
+//milliseconds until the next timer is due, -1 if none is armed
+int TIMER_NextTimeout()
+{
+   long long wait;
+   
+   if (timerList == NULL)
+      return -1;
+   wait = timerList->deadline - monotonicMs();
+   return wait < 0 ? 0 : (int)wait;
+}
+
+void TIMER_RunExpired()
+{
+   long long now = monotonicMs();
+   struct Timer *timer;
+   
+   while (timerList != NULL && timerList->deadline <= now)
+   {
+      timer = timerList;
+      timerList = timer->next;
+      timer->armed = 0;
+      timer->onExpire(timer);
+   }
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Transfer workers (-o workers=N). With more than one, the transfers of the
+// reactor model run on N threads with an event loop each, while the main
+// loop keeps IRC, offers, the queue and the catalog. The main loop hands a
+// connected transfer to the worker with the least work through its inbox;
+// when a transfer ends, its slot goes back through the pool's list of
+// finished slots, since only the main loop touches the scheduler. Besides
+// that (and the shaper, which has its own lock) workers share nothing.
+/////////////////////////////////////////////////////////////////////////////
+struct Worker
+{
+   pthread_t thread;
+   pthread_mutex_t lock;       //guards the inbox
+   struct Transfer *inbox;     //handed over, not picked up yet
+   struct Transfer *inboxTail;
+   int load;                   //transfers in the inbox and running
+   int running;                //only touched by the worker
+   int wanted;                 //an idle worker asks for a running transfer
+   struct Watcher wake;        //wake.fd is an eventfd
+   int reactor;
+   int ring;                   //io=uring: its ring, -1 for none
+};
+
+struct WorkerPool
+{
+   struct Worker *workers;
+   int numWorkers;             //0 when transfers run in the main loop
+   int ringBuffers;            //io=uring: buffers of every worker's ring
+   pthread_mutex_t lock;       //guards finished
+   int *finished;              //slots of transfers that ended
+   int numFinished;
+   int finishedSize;
+   struct Watcher collect;     //collect.fd is an eventfd
+} workerPool = { NULL, 0, 0, PTHREAD_MUTEX_INITIALIZER, NULL, 0, 0,
+                 { -1, NULL } };
+
+__thread struct Worker *currentWorker = NULL; //NULL in the main loop
+
+void WORKER_Wake(int eventFd)
+{
+   unsigned long long one = 1;
+   
+   write(eventFd, &one, sizeof(one));
+}
+
+struct Worker *WORKER_Least()
+{
+   struct Worker *least = &workerPool.workers[0];
+   int i;
+   
+   for (i = 1; i < workerPool.numWorkers; ++i)
+      if (__atomic_load_n(&workerPool.workers[i].load, __ATOMIC_RELAXED) <
+          __atomic_load_n(&least->load, __ATOMIC_RELAXED))
+         least = &workerPool.workers[i];
+   return least;
+}
+
+//in a worker: a transfer ended, its slot goes back to the main loop
+void WORKER_Finished(int slotId)
+{
+   --currentWorker->running;
+   __atomic_sub_fetch(&currentWorker->load, 1, __ATOMIC_RELAXED);
+   pthread_mutex_lock(&workerPool.lock);
+   if (workerPool.numFinished == workerPool.finishedSize)
+   {
+      workerPool.finishedSize = workerPool.finishedSize * 2 + 16;
+      workerPool.finished = realloc(workerPool.finished,
+                                    workerPool.finishedSize * sizeof(int));
+   }
+   workerPool.finished[workerPool.numFinished++] = slotId;
+   pthread_mutex_unlock(&workerPool.lock);
+   WORKER_Wake(workerPool.collect.fd);
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// io_uring (-o io=uring). DCC I/O is queued on a ring shared with the
+// kernel instead of being done a system call at a time when epoll reports a
+// socket ready: accepting and connecting, reading a pack into one of the
+// registered buffers, sending it and receiving acks are all UringOps that
+// pile up during a pass of the event loop and go to the kernel in one
+// io_uring_enter() at its end. The ring's fd sits in the epoll set and
+// becomes readable when completions are waiting. An op belongs to whoever
+// queued it; one that lets go (URING_Detach) has the op cancelled, and it is
+// freed when its completion shows up, since until then the kernel may still
+// write into its buffer. Every event loop has a ring of its own, see the
+// transfer workers. Without liburing the ring is set up with the raw
+// system calls; the Makefile defines HAVE_IO_URING when the kernel headers
+// have it, and otherwise, or when the kernel refuses, the bot stays on epoll.
+/////////////////////////////////////////////////////////////////////////////
+enum UringOpcode
+{
+   URING_READ = 0,
+   URING_SEND,
+   URING_RECV,
+   URING_ACCEPT,
+   URING_CONNECT
+};
+
+struct UringOp
+{
+   void (*onComplete)(struct UringOp *op, int result); //result as -errno
+   void *owner;         //NULL once the owner let go
+   enum UringOpcode opcode;
+   int fd;
+   char *memory;        //read into or sent from
+   size_t length;
+   off_t offset;        //URING_READ: position in the file
+   int buffer;          //the ring buffer memory points into, -1 for none
+   int port;            //URING_ACCEPT: goes back to the pool when it's over
+   struct sockaddr_in address; //URING_CONNECT
+   unsigned char data[64];     //URING_RECV: room for the acks
+};
+
+struct Uring
+{
+   struct Watcher watcher; //watcher.fd is the ring, -1 when not in use
+   unsigned *sqHead, *sqTail, *sqMask, *sqFlags;
+   unsigned *cqHead, *cqTail, *cqMask;
+   void *sqes;
+   void *cqes;
+   unsigned entries;
+   int queued;          //ops not handed to the kernel yet
+   char *buffers;       //numBuffers buffers of URING_CHUNK bytes
+   int numBuffers;
+   char registered;     //the kernel pinned the buffers, reads are fixed
+   int freeBuffers[URING_BUFFERS];
+   int numFree;
+};
+
+__thread struct Uring uring = { { -1, NULL } };
+
+struct UringOp *URING_NewOp(void *owner,
+                            void (*onComplete)(struct UringOp*, int))
+{
+   struct UringOp *op = calloc(1, sizeof(struct UringOp));
+   
+   op->owner = owner;
+   op->onComplete = onComplete;
+   op->buffer = -1;
+   return op;
+}
+
+void URING_FreeOp(struct UringOp *op)
+{
+   if (op->buffer != -1)
+      uring.freeBuffers[uring.numFree++] = op->buffer;
+   free(op);
+}
+
+//gives the op a buffer to read into, -1 if they are all in flight
+int URING_TakeBuffer(struct UringOp *op)
+{
+   if (uring.numFree == 0)
+      return -1;
+   op->buffer = uring.freeBuffers[--uring.numFree];
+   op->memory = uring.buffers + (size_t)op->buffer * URING_CHUNK;
+   return 0;
+}
+
+#ifdef HAVE_IO_URING
+void URING_Submit()
+{
+   int submitted;
+   
+   while (uring.queued > 0)
+   {
+      submitted = syscall(__NR_io_uring_enter, uring.watcher.fd,
+                          uring.queued, 0, 0, NULL, 0);
+      if (submitted == -1)
+      {
+         if (errno == EINTR)
+            continue;
+         //EBUSY: the completions have to be taken first, the ring's fd is
+         //readable so the loop comes back to it
+         if (errno != EAGAIN && errno != EBUSY)
+            fprintf(stderr, "io_uring_enter failed: %s\n", strerror(errno));
+         return;
+      }
+      METRIC_Count(METRIC_URING_SUBMITS, 1);
+      METRIC_Count(METRIC_URING_OPS, submitted);
+      uring.queued -= submitted;
+   }
+}
+
+void URING_OnEvent(struct Watcher *watcher, unsigned int events)
+{
+   struct io_uring_cqe *cqe;
+   struct UringOp *op;
+   unsigned head;
+   int result;
+   
+   //edge triggered, so take everything including what completes meanwhile
+   while (1)
+   {
+      head = *uring.cqHead;
+      if (head == __atomic_load_n(uring.cqTail, __ATOMIC_ACQUIRE))
+      {
+#ifdef IORING_SQ_CQ_OVERFLOW
+         //completions that didn't fit wait in the kernel until asked for
+         if (__atomic_load_n(uring.sqFlags, __ATOMIC_RELAXED) &
+             IORING_SQ_CQ_OVERFLOW)
+         {
+            syscall(__NR_io_uring_enter, uring.watcher.fd, 0, 0,
+                    IORING_ENTER_GETEVENTS, NULL, 0);
+            if (head != __atomic_load_n(uring.cqTail, __ATOMIC_ACQUIRE))
+               continue;
+         }
+#endif
+         break;
+      }
+      cqe = (struct io_uring_cqe*)uring.cqes + (head & *uring.cqMask);
+      op = (struct UringOp*)(unsigned long)cqe->user_data;
+      result = cqe->res;
+      __atomic_store_n(uring.cqHead, head + 1, __ATOMIC_RELEASE);
+      if (op == NULL) //a cancel
+         continue;
+      if (op->owner != NULL)
+         op->onComplete(op, result);
+      else
+      {
+         //the listen socket is only free again once the accept is over
+         if (op->opcode == URING_ACCEPT && result >= 0)
+            close(result);
+         if (op->opcode == URING_ACCEPT)
+            PORT_Return(op->port);
+         URING_FreeOp(op);
+      }
+   }
+}
+
+//the next free submission queue entry, NULL if the kernel is behind
+struct io_uring_sqe *URING_NextEntry()
+{
+   unsigned tail = *uring.sqTail;
+   struct io_uring_sqe *sqe;
+   
+   if (tail - __atomic_load_n(uring.sqHead, __ATOMIC_ACQUIRE) >=
+       uring.entries)
+   {
+      URING_Submit();
+      if (tail - __atomic_load_n(uring.sqHead, __ATOMIC_ACQUIRE) >=
+          uring.entries)
+         return NULL;
+   }
+   sqe = (struct io_uring_sqe*)uring.sqes + (tail & *uring.sqMask);
+   memset(sqe, 0, sizeof(struct io_uring_sqe));
+   return sqe;
+}
+
+void URING_Push()
+{
+   __atomic_store_n(uring.sqTail, *uring.sqTail + 1, __ATOMIC_RELEASE);
+   ++uring.queued;
+}
+
+//queues the op, it goes to the kernel at the end of this pass of the loop
+int URING_Queue(struct UringOp *op)
+{
+   struct io_uring_sqe *sqe = URING_NextEntry();
+   
+   if (sqe == NULL)
+   {
+      fprintf(stderr, "io_uring submission queue is full\n");
+      return -1;
+   }
+   sqe->fd = op->fd;
+   sqe->user_data = (unsigned long)op;
+   sqe->addr = (unsigned long)op->memory;
+   sqe->len = op->length;
+   switch (op->opcode)
+   {
+      case URING_READ:
+         sqe->opcode = uring.registered ? IORING_OP_READ_FIXED :
+                                          IORING_OP_READ;
+         sqe->off = op->offset;
+         sqe->buf_index = op->buffer;
+         break;
+      case URING_SEND:
+         sqe->opcode = IORING_OP_SEND;
+         sqe->msg_flags = MSG_NOSIGNAL;
+         break;
+      case URING_RECV:
+         sqe->opcode = IORING_OP_RECV;
+         break;
+      case URING_ACCEPT:
+         sqe->opcode = IORING_OP_ACCEPT;
+         sqe->addr = 0;
+         sqe->len = 0;
+         sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+         break;
+      case URING_CONNECT:
+         sqe->opcode = IORING_OP_CONNECT;
+         sqe->addr = (unsigned long)&op->address;
+         sqe->len = 0;
+         sqe->off = sizeof(op->address);
+         break;
+   }
+   URING_Push();
+   return 0;
+}
+
+void URING_Cancel(struct UringOp *op)
+{
+   struct io_uring_sqe *sqe = URING_NextEntry();
+   
+   //if even the cancel can't be queued, the op just runs its course
+   if (sqe == NULL)
+      return;
+   sqe->opcode = IORING_OP_ASYNC_CANCEL;
+   sqe->fd = -1;
+   sqe->addr = (unsigned long)op;
+   URING_Push();
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Sets up the calling thread's ring and its buffers (at most URING_BUFFERS,
+// none for a loop that doesn't send). The buffers are registered with the
+// kernel if the memlock limit allows it, which saves pinning the pages on
+// every read; if not they are read into like any other memory.
+/////////////////////////////////////////////////////////////////////////////
+int URING_Setup(int numBuffers)
+{
+   struct io_uring_params params;
+   struct iovec chunks[URING_BUFFERS];
+   struct rlimit limit;
+   size_t sqSize, cqSize, sqesSize;
+   size_t total = (size_t)numBuffers * URING_CHUNK;
+   char *sq, *cq;
+   int fd;
+   int i;
+   
+   memset(&params, 0, sizeof(params));
+   params.flags = IORING_SETUP_CQSIZE;
+   params.cq_entries = URING_COMPLETIONS;
+   fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+   if (fd == -1)
+   {
+      fprintf(stderr, "Couldn't set up io_uring: %s\n", strerror(errno));
+      return -1;
+   }
+   //older kernels throw completions away when the queue overflows
+   if ((params.features & IORING_FEAT_NODROP) == 0)
+   {
+      fprintf(stderr, "io_uring of this kernel may drop completions\n");
+      close(fd);
+      return -1;
+   }
+   sqSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+   cqSize = params.cq_off.cqes +
+            params.cq_entries * sizeof(struct io_uring_cqe);
+   sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+   if (params.features & IORING_FEAT_SINGLE_MMAP)
+      sqSize = cqSize = sqSize > cqSize ? sqSize : cqSize;
+   sq = mmap(NULL, sqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+             fd, IORING_OFF_SQ_RING);
+   cq = sq;
+   if (sq != MAP_FAILED && (params.features & IORING_FEAT_SINGLE_MMAP) == 0)
+      cq = mmap(NULL, cqSize, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+   uring.sqes = mmap(NULL, sqesSize, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+   uring.buffers = NULL;
+   if (numBuffers > 0)
+      uring.buffers = mmap(NULL, total, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+   if (sq == MAP_FAILED || cq == MAP_FAILED || uring.sqes == MAP_FAILED ||
+       uring.buffers == MAP_FAILED)
+   {
+      fprintf(stderr, "Couldn't map the io_uring: %s\n", strerror(errno));
+      if (sq != MAP_FAILED) munmap(sq, sqSize);
+      if (cq != MAP_FAILED && cq != sq) munmap(cq, cqSize);
+      if (uring.sqes != MAP_FAILED) munmap(uring.sqes, sqesSize);
+      if (uring.buffers != MAP_FAILED && uring.buffers != NULL)
+         munmap(uring.buffers, total);
+      close(fd);
+      return -1;
+   }
+   uring.sqHead = (unsigned*)(sq + params.sq_off.head);
+   uring.sqTail = (unsigned*)(sq + params.sq_off.tail);
+   uring.sqMask = (unsigned*)(sq + params.sq_off.ring_mask);
+   uring.sqFlags = (unsigned*)(sq + params.sq_off.flags);
+   uring.cqHead = (unsigned*)(cq + params.cq_off.head);
+   uring.cqTail = (unsigned*)(cq + params.cq_off.tail);
+   uring.cqMask = (unsigned*)(cq + params.cq_off.ring_mask);
+   uring.cqes = cq + params.cq_off.cqes;
+   uring.entries = params.sq_entries;
+   //entry i of the submission queue is always sqes[i]
+   for (i = 0; i < (int)params.sq_entries; ++i)
+      ((unsigned*)(sq + params.sq_off.array))[i] = i;
+   
+   for (i = 0; i < numBuffers; ++i)
+   {
+      chunks[i].iov_base = uring.buffers + (size_t)i * URING_CHUNK;
+      chunks[i].iov_len = URING_CHUNK;
+      uring.freeBuffers[i] = numBuffers - 1 - i;
+   }
+   uring.numBuffers = uring.numFree = numBuffers;
+   if (getrlimit(RLIMIT_MEMLOCK, &limit) == 0 && limit.rlim_cur < total &&
+       limit.rlim_cur < limit.rlim_max)
+   {
+      limit.rlim_cur = limit.rlim_max;
+      setrlimit(RLIMIT_MEMLOCK, &limit);
+   }
+   uring.registered = numBuffers > 0 &&
+                      syscall(__NR_io_uring_register, fd,
+                              IORING_REGISTER_BUFFERS, chunks,
+                              numBuffers) == 0;
+   if (numBuffers > 0 && !uring.registered && debugLevel > 0)
+      fprintf(stderr, "Couldn't register io_uring buffers (%s), reading "
+            "into plain memory\n", strerror(errno));
+   
+   uring.watcher.fd = fd;
+   uring.watcher.onEvent = URING_OnEvent;
+   if (REACTOR_Add(&uring.watcher, EPOLLIN) == -1)
+   {
+      close(fd);
+      uring.watcher.fd = -1;
+      return -1;
+   }
+   if (debugLevel > 0)
+      fprintf(stderr, "DCC I/O goes through io_uring (%u entries, %i "
+            "buffers)\n", uring.entries, numBuffers);
+   return 0;
+}
+#else
+int URING_Setup(int numBuffers)
+{
+   fprintf(stderr, "quiznoBot was built without io_uring\n");
+   return -1;
+}
+
+void URING_Submit()
+{
+}
+
+int URING_Queue(struct UringOp *op)
+{
+   return -1;
+}
+
+void URING_Cancel(struct UringOp *op)
+{
+}
+#endif
+
+//lets go of an op that may still be running, and forgets it
+void URING_Detach(struct UringOp **op)
+{
+   if (*op == NULL)
+      return;
+   (*op)->owner = NULL;
+   URING_Cancel(*op);
+   *op = NULL;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Everything the bot says on a network goes through the outbound queue of
+// its connection, which is the only writer of the socket. Lines wait in
+// three classes and a class only goes out when the ones before it are
+// empty: control (login, PONG, QUIT), then replies (DCC offers, notices),
+// then announces (and pages of xdcc list, which are bulk too). Replies and
+// announces hold at most sendqueue lines each; more are dropped and
+// counted.
+//
+// Pacing follows the flood control of RFC 1459 section 8.10, which is what
+// the server runs against us: every line pushes a clock floodcost ms
+// further, and lines may only go out while that clock is less than
+// floodburst ms ahead of the real one. Keeping the same books as the server
+// means the bot is never throttled or killed for flooding.
+//
+// Whatever may go out is handed to the kernel with one writev(). A line the
+// socket only took part of is finished before any other, so lines never mix.
+/////////////////////////////////////////////////////////////////////////////
+enum IrcPriority
+{
+   IRC_CONTROL = 0,
+   IRC_REPLY,
+   IRC_ANNOUNCE,
+   IRC_NUM_PRIORITIES
+};
+
+const char *ircPriorityNames[] = { "control", "replies", "announces" };
+
+struct OutLine
+{
+   struct OutLine *next;
+   int length;
+   char text[];
+};
+
+struct OutQueue
+{
+   struct OutLine *head[IRC_NUM_PRIORITIES];
+   struct OutLine *tail[IRC_NUM_PRIORITIES];
+   int depth[IRC_NUM_PRIORITIES];
+   int peakDepth[IRC_NUM_PRIORITIES];
+   unsigned long long dropped[IRC_NUM_PRIORITIES];
+   struct OutLine *writing;  //partly written, goes out before anything else
+   int writtenBytes;
+   long long floodClock;     //monotonic ms the server thinks we're up to
+   char blocked;             //the socket is full, EPOLLOUT resumes
+   char broken;              //a write failed, nothing more goes out
+   char dirty;               //lines were queued since the last flush
+   unsigned long long sentLines;
+   unsigned long long sentBytes;
+   unsigned long long writes;
+};
+
+/////////////////////////////////////////////////////////////////////////////
+// One connection per network, holding everything that is the network's own:
+// the socket, what was read and what waits to be sent, and how far the
+// announces got. The catalog, the scheduler and the bandwidth limits are
+// shared by all of them, so another network costs a connection and a socket.
+/////////////////////////////////////////////////////////////////////////////
+#define IRC_MAX_ATTEMPTS 8
+
+enum IrcState
+{
+   IRC_OFFLINE = 0,  //waiting to reconnect
+   IRC_CONNECTING,   //connect attempts are running
+   IRC_REGISTERING,  //connected, waiting for the welcome (001)
+   IRC_ONLINE        //registered with the server
+};
+
+//one of the connects that race each other, see IRC_Connect
+struct IrcAttempt
+{
+   struct Watcher watcher;   //fd -1 while it isn't running
+   struct IrcConnection *connection;
+};
+
+struct IrcConnection
+{
+   int id;                   //index in connections
+   struct Network *network;
+   int socket;               //-1 unless the server is connected
+   struct addrinfo *address;
+   enum IrcState state;
+   char nick[128];           //ours; network->nick unless that was taken
+   int nickTries;            //nicks the server turned down this login
+   char joined;
+   struct Watcher watcher;   //watcher.fd is the socket
+   struct IrcReader reader;
+   struct addrinfo *candidates[IRC_MAX_ATTEMPTS]; //in the order tried
+   int numCandidates;
+   int nextCandidate;
+   struct IrcAttempt attempts[IRC_MAX_ATTEMPTS];
+   long long connectDeadline;
+   struct Timer stateTimer;  //next attempt, timeouts, join and reconnect
+   int failures;             //logins in a row that didn't last
+   long long onlineSince;
+   struct OutQueue queue;
+   struct Timer floodTimer;
+   struct Timer announceTimer;
+   int announceCursor;       //next pack of the whole list, -1 between lists
+   int newPackCursor;        //next new pack, -1 when they've all been told
+   unsigned int announcedVersion;  //catalogVersion the last look saw
+   unsigned int newSinceVersion;   //packs added after this one are new
+   long long nextFullAnnounce;
+   unsigned int logins;      //every one after the first is a reconnect
+};
+
+struct IrcConnection *connections = NULL;
+int numConnections = 0;
+struct Timer queueReportTimer;
+
+void IRC_ClearQueue(struct OutQueue *queue)
+{
+   struct OutLine *line;
+   int priority;
+   
+   for (priority = 0; priority < IRC_NUM_PRIORITIES; ++priority)
+   {
+      while ((line = queue->head[priority]) != NULL)
+      {
+         queue->head[priority] = line->next;
+         free(line);
+      }
+      queue->tail[priority] = NULL;
+      queue->depth[priority] = 0;
+   }
+   free(queue->writing);
+   queue->writing = NULL;
+}
+
+//the line the last writev() ended in, or every line it took
+void IRC_CommitLine(struct OutQueue *queue, int priority, int length,
+                    int written)
+{
+   struct OutLine *line = queue->head[priority];
+   
+   queue->head[priority] = line->next;
+   if (line->next == NULL)
+      queue->tail[priority] = NULL;
+   --queue->depth[priority];
+   if (written < length)
+   {
+      queue->writing = line;
+      queue->writtenBytes = written;
+      return;
+   }
+   ++queue->sentLines;
+   free(line);
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Writes as much of the queue as the socket and the flood clock allow.
+// ignorePacing is for the QUIT on the way out, which can't wait.
+/////////////////////////////////////////////////////////////////////////////
+void IRC_FlushQueue(struct IrcConnection *connection, char ignorePacing)
+{
+   struct OutQueue *queue = &connection->queue;
+   struct iovec parts[IRC_WRITE_BATCH];
+   int priorities[IRC_WRITE_BATCH];
+   struct OutLine *line;
+   long long now, clock;
+   ssize_t written, taken, length;
+   int numParts, first, priority, i;
+   
+   queue->dirty = 0;
+   if (connection->socket == -1 || queue->blocked || queue->broken)
+      return;
+   while (1)
+   {
+      numParts = 0;
+      first = 0;
+      now = monotonicMs();
+      clock = queue->floodClock > now ? queue->floodClock : now;
+      if (queue->writing != NULL)
+      {
+         parts[0].iov_base = queue->writing->text + queue->writtenBytes;
+         parts[0].iov_len = queue->writing->length - queue->writtenBytes;
+         numParts = first = 1;
+      }
+      for (priority = 0; priority < IRC_NUM_PRIORITIES; ++priority)
+      {
+         for (line = queue->head[priority];
+              line != NULL && numParts < IRC_WRITE_BATCH; line = line->next)
+         {
+            if (!ignorePacing && floodCost > 0 && clock - now >= floodBurst)
+               break;
+            clock += floodCost;
+            parts[numParts].iov_base = line->text;
+            parts[numParts].iov_len = line->length;
+            priorities[numParts++] = priority;
+         }
+         if (line != NULL)
+            break;
+      }
+      if (numParts == 0)
+         break;
+      
+      written = writev(connection->socket, parts, numParts);
+      if (written == -1)
+      {
+         if (errno == EINTR)
+            continue;
+         if (errno == EAGAIN || errno == EWOULDBLOCK)
+         {
+            queue->blocked = 1;
+            return;
+         }
+         fprintf(stderr, "Couldn't write to %s: %s\n",
+               connection->network->server, strerror(errno));
+         queue->broken = 1;
+         IRC_ClearQueue(queue);
+         return;
+      }
+      ++queue->writes;
+      queue->sentBytes += written;
+      //only the lines the kernel took are charged and leave the queue
+      clock = queue->floodClock > now ? queue->floodClock : now;
+      for (i = 0; i < numParts && written > 0; ++i)
+      {
+         length = parts[i].iov_len;
+         taken = written < length ? written : length;
+         written -= taken;
+         if (i < first && taken < length)
+            queue->writtenBytes += taken;
+         else if (i < first)
+         {
+            ++queue->sentLines;
+            free(queue->writing);
+            queue->writing = NULL;
+         }
+         else
+         {
+            clock += floodCost;
+            IRC_CommitLine(queue, priorities[i], length, taken);
+         }
+      }
+      queue->floodClock = clock;
+      if (i < numParts || queue->writing != NULL)
+      {
+         //the socket is full; EPOLLOUT says when there's room again
+         queue->blocked = 1;
+         return;
+      }
+   }
+   //lines are left because of the flood clock: come back when one may go
+   if (!ignorePacing && queue->writing == NULL &&
+       (queue->depth[IRC_CONTROL] > 0 || queue->depth[IRC_REPLY] > 0 ||
+        queue->depth[IRC_ANNOUNCE] > 0) && !connection->floodTimer.armed)
+   {
+      TIMER_Arm(&connection->floodTimer,
+                (int)(queue->floodClock - floodBurst - monotonicMs()) + 1);
+   }
+}
+
+void IRC_OnFloodTimer(struct Timer *timer)
+{
+   IRC_FlushQueue(CONTAINER_OF(timer, struct IrcConnection, floodTimer), 0);
+}
+
+//whether a line of that class would be dropped right now
+int IRC_QueueFull(struct IrcConnection *connection, int priority)
+{
+   struct OutQueue *queue = &connection->queue;
+   
+   return queue->broken || connection->socket == -1 ||
+          (priority != IRC_CONTROL && queue->depth[priority] >= sendQueueLines);
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Queues a line (which ends in a newline) for the network. Returns -1 if the
+// line was dropped because its class is full or the connection is gone.
+// Once the event loop runs, lines are written when it's done with the
+// events at hand, so the replies to a burst of requests share a writev().
+/////////////////////////////////////////////////////////////////////////////
+int IRC_SendMessage(struct IrcConnection *connection, const char *toSend,
+                    int priority)
+{
+   struct OutQueue *queue = &connection->queue;
+   struct OutLine *line;
+   int length = strlen(toSend);
+   
+   if (queue->broken || connection->socket == -1)
+   {
+      ++queue->dropped[priority];
+      return -1;
+   }
+   //control lines are few and must not be lost
+   if (priority != IRC_CONTROL && queue->depth[priority] >= sendQueueLines)
+   {
+      if (queue->dropped[priority]++ == 0 || debugLevel > 1)
+         fprintf(stderr, "IRC send queue for %s full, dropping %s\n",
+               connection->network->server, ircPriorityNames[priority]);
+      return -1;
+   }
+   line = malloc(sizeof(struct OutLine) + length);
+   if (line == NULL)
+      return -1;
+   line->next = NULL;
+   line->length = length;
+   memcpy(line->text, toSend, length);
+   if (queue->tail[priority] != NULL)
+      queue->tail[priority]->next = line;
+   else
+      queue->head[priority] = line;
+   queue->tail[priority] = line;
+   if (++queue->depth[priority] > queue->peakDepth[priority])
+      queue->peakDepth[priority] = queue->depth[priority];
+   if (reactor == -1)
+      IRC_FlushQueue(connection, 0);
+   else
+      queue->dirty = 1;
+   return 0;
+}
+
+//the socket has room again
+void IRC_OnWritable(struct IrcConnection *connection)
+{
+   connection->queue.blocked = 0;
+   IRC_FlushQueue(connection, 0);
+}
+
+//gets the queue out before hanging up, waiting at most timeoutMs
+void IRC_DrainQueue(struct IrcConnection *connection, int timeoutMs)
+{
+   struct OutQueue *queue = &connection->queue;
+   long long deadline = monotonicMs() + timeoutMs;
+   struct pollfd waitFor;
+   
+   waitFor.fd = connection->socket;
+   waitFor.events = POLLOUT;
+   while (!queue->broken && connection->socket != -1 &&
+          (queue->writing != NULL || queue->depth[IRC_CONTROL] > 0 ||
+           queue->depth[IRC_REPLY] > 0 || queue->depth[IRC_ANNOUNCE] > 0))
+   {
+      queue->blocked = 0;
+      IRC_FlushQueue(connection, 1);
+      if (deadline <= monotonicMs() ||
+          (queue->blocked && poll(&waitFor, 1, deadline - monotonicMs()) < 1))
+         break;
+   }
+}
+
+void IRC_ReportQueue(struct IrcConnection *connection)
+{
+   struct OutQueue *queue = &connection->queue;
+   int priority;
+   
+   if (debugLevel == 0)
+      return;
+   fprintf(stderr, "IRC send queue for %s: %llu lines, %llu bytes in %llu "
+         "writes\n", connection->network->server, queue->sentLines,
+         queue->sentBytes, queue->writes);
+   for (priority = 0; priority < IRC_NUM_PRIORITIES; ++priority)
+      fprintf(stderr, "\t%s: %i waiting, at most %i, %llu dropped\n",
+            ircPriorityNames[priority], queue->depth[priority],
+            queue->peakDepth[priority], queue->dropped[priority]);
+}
+
+void IRC_OnQueueReport(struct Timer *timer)
+{
+   int i;
+   
+   for (i = 0; i < numConnections; ++i)
+      IRC_ReportQueue(&connections[i]);
+   TIMER_Arm(timer, 60000);
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Connecting. Every address the server's name resolves to is a candidate,
+// and they race each other the Happy Eyeballs way (RFC 8305): IPv6 and IPv4
+// take turns, another attempt starts every IRC_ATTEMPT_DELAY ms while the
+// earlier ones still run, and the first to connect wins. Only the name
+// lookup blocks. A connection that is lost or never gets anywhere is made
+// again after a backoff that doubles with every failure up to
+// IRC_BACKOFF_MAX seconds, jittered so that a netsplit doesn't bring every
+// bot back in the same second. Transfers don't need the server and go on
+// while it is away.
+/////////////////////////////////////////////////////////////////////////////
+#define IRC_ATTEMPT_DELAY 250  //ms before the next address joins the race
+#define IRC_CONNECT_TIMEOUT 30
+#define IRC_REGISTER_TIMEOUT 60
+#define IRC_JOIN_DELAY 10      //join this long after 001 if the MOTD never ends
+#define IRC_REGAIN_EVERY 60    //how often we ask for our nick back
+#define IRC_BACKOFF_FIRST 2
+#define IRC_BACKOFF_MAX 300
+#define IRC_STABLE 300         //a login that lasted this long was a success
+
+void IRC_CloseAttempts(struct IrcConnection *connection)
+{
+   int i;
+   
+   for (i = 0; i < IRC_MAX_ATTEMPTS; ++i)
+   {
+      if (connection->attempts[i].watcher.fd != -1)
+      {
+         REACTOR_Remove(&connection->attempts[i].watcher);
+         close(connection->attempts[i].watcher.fd);
+         connection->attempts[i].watcher.fd = -1;
+      }
+   }
+}
+
+//hangs up, or gives up connecting, and tries again after the backoff
+void IRC_Lost(struct IrcConnection *connection)
+{
+   long long delay;
+   
+   IRC_CloseAttempts(connection);
+   if (connection->socket != -1)
+   {
+      REACTOR_Remove(&connection->watcher);
+      close(connection->socket);
+      connection->socket = -1;
+   }
+   connection->queue.broken = 1;
+   IRC_ClearQueue(&connection->queue);
+   TIMER_Cancel(&connection->announceTimer);
+   TIMER_Cancel(&connection->floodTimer);
+   if (connection->state == IRC_ONLINE &&
+       monotonicMs() - connection->onlineSince >= IRC_STABLE * 1000LL)
+      connection->failures = 0;
+   connection->state = IRC_OFFLINE;
+   connection->joined = 0;
+   
+   delay = IRC_BACKOFF_FIRST * 1000LL <<
+           (connection->failures < 8 ? connection->failures : 8);
+   if (delay > IRC_BACKOFF_MAX * 1000LL)
+      delay = IRC_BACKOFF_MAX * 1000LL;
+   ++connection->failures;
+   //anywhere from half the backoff to all of it
+   delay = delay / 2 + rand() % (delay / 2 + 1);
+   if (debugLevel > 0)
+      fprintf(stderr, "Reconnecting to %s in %lli.%03lli seconds\n",
+            connection->network->server, delay / 1000, delay % 1000);
+   TIMER_Arm(&connection->stateTimer, (int)delay);
+}
+
+//starts a connect to the next candidate; returns -1 if none is left
+int IRC_StartAttempt(struct IrcConnection *connection)
+{
+   struct addrinfo *address;
+   struct IrcAttempt *attempt;
+   char ipString[NI_MAXHOST];
+   
+   while (connection->nextCandidate < connection->numCandidates)
+   {
+      address = connection->candidates[connection->nextCandidate];
+      attempt = &connection->attempts[connection->nextCandidate++];
+      if (debugLevel > 1 &&
+          getnameinfo(address->ai_addr, address->ai_addrlen, ipString,
+                      sizeof(ipString), NULL, 0, NI_NUMERICHOST) == 0)
+         fprintf(stderr, "Trying: %s...\n", ipString);
+      attempt->watcher.fd = socket(address->ai_family, address->ai_socktype |
+                                   SOCK_NONBLOCK | SOCK_CLOEXEC,
+                                   address->ai_protocol);
+      if (attempt->watcher.fd == -1)
+         continue;
+      if ((connect(attempt->watcher.fd, address->ai_addr,
+                   address->ai_addrlen) == 0 || errno == EINPROGRESS) &&
+          REACTOR_Add(&attempt->watcher, EPOLLOUT) == 0)
+         return 0;
+      close(attempt->watcher.fd);
+      attempt->watcher.fd = -1;
+   }
+   return -1;
+}
+
+int IRC_AttemptsRunning(struct IrcConnection *connection)
+{
+   int i;
+   int count = 0;
+   
+   for (i = 0; i < IRC_MAX_ATTEMPTS; ++i)
+      if (connection->attempts[i].watcher.fd != -1)
+         ++count;
+   return count;
+}
+
+int IRC_IsCandidate(struct IrcConnection *connection,
+                    struct addrinfo *address)
+{
+   int i;
+   
+   for (i = 0; i < connection->numCandidates; ++i)
+      if (connection->candidates[i] == address)
+         return 1;
+   return 0;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Looks the server up and starts the first connect attempt. Returns -1 if
+// there is nothing to connect to.
+/////////////////////////////////////////////////////////////////////////////
+int IRC_Connect(struct IrcConnection *connection)
+{
+   struct Network *network = connection->network;
+   struct addrinfo *address;
+   struct addrinfo hints;
+   int family;
+   
+   if (debugLevel >= 1)
+      fprintf(stderr, "\nConnecting to %s:%s...\n", network->server,
+            network->port);
+   
+   if (connection->address != NULL)
+      freeaddrinfo(connection->address);
+   memset(&hints, 0, sizeof(hints));
+   hints.ai_family = AF_UNSPEC;
+   hints.ai_socktype = SOCK_STREAM;
+   if (getaddrinfo(network->server, network->port, &hints,
+                   &connection->address))
+   {
+      fprintf(stderr, "Error: Could not resolve %s!\n", network->server);
+      connection->address = NULL;
+      return -1;
+   }
+   
+   //the families take turns, starting with the one the resolver put first
+   connection->numCandidates = 0;
+   family = connection->address->ai_family;
+   while (connection->numCandidates < IRC_MAX_ATTEMPTS)
+   {
+      for (address = connection->address; address != NULL;
+           address = address->ai_next)
+         if (address->ai_family == family &&
+             !IRC_IsCandidate(connection, address))
+            break;
+      //one family ran out, the rest are of the other
+      if (address == NULL)
+      {
+         address = connection->address;
+         while (address != NULL && IRC_IsCandidate(connection, address))
+            address = address->ai_next;
+      }
+      if (address == NULL)
+         break;
+      connection->candidates[connection->numCandidates++] = address;
+      family = address->ai_family == AF_INET6 ? AF_INET : AF_INET6;
+   }
+   
+   connection->nextCandidate = 0;
+   connection->state = IRC_CONNECTING;
+   connection->connectDeadline = monotonicMs() + IRC_CONNECT_TIMEOUT * 1000LL;
+   if (IRC_StartAttempt(connection) == -1)
+   {
+      fprintf(stderr, "Couldn't connect to %s:%s\n", network->server,
+            network->port);
+      return -1;
+   }
+   TIMER_Arm(&connection->stateTimer, IRC_ATTEMPT_DELAY);
+   return 0;
+}
+
+//sends USER and NICK; the server answers with 001 once it is happy
+int IRC_Login(struct IrcConnection *connection)
+{
+   struct Network *network = connection->network;
+   char userCommand[512];
+   char nickCommand[256];
+   char hostname[100];
+   
+   gethostname(hostname, 100);
+   snprintf(connection->nick, sizeof(connection->nick), "%s", network->nick);
+   connection->nickTries = 0;
+   
+   snprintf(userCommand, sizeof(userCommand), "USER %s %s %s :%s\n",
+            network->nick, hostname, network->server, network->nick);
+   snprintf(nickCommand, sizeof(nickCommand), "NICK %s\n", network->nick);
+   
+   if (debugLevel == 1)
+      fprintf(stderr, "Sending login commands...\n");
+   else if (debugLevel > 1)
+      fprintf(stderr, "Sending user command: %s\n", userCommand);
+   IRC_SendMessage(connection, userCommand, IRC_CONTROL);
+   
+   if (debugLevel > 1)
+      fprintf(stderr, "Sending nick command: %s\n", nickCommand);
+   return IRC_SendMessage(connection, nickCommand, IRC_CONTROL);
+}
+
+//a connect attempt finished, one way or the other
+void IRC_OnAttempt(struct Watcher *watcher, unsigned int events)
+{
+   struct IrcAttempt *attempt = (struct IrcAttempt*)watcher;
+   struct IrcConnection *connection = attempt->connection;
+   socklen_t errorLength = sizeof(int);
+   int error = 0;
+   
+   if (getsockopt(watcher->fd, SOL_SOCKET, SO_ERROR, &error,
+                  &errorLength) == -1)
+      error = errno;
+   REACTOR_Remove(watcher);
+   if (error != 0 || (events & (EPOLLERR | EPOLLHUP)))
+   {
+      if (debugLevel > 1)
+         fprintf(stderr, "A connect to %s failed: %s\n",
+               connection->network->server, strerror(error));
+      close(watcher->fd);
+      watcher->fd = -1;
+      //the next address doesn't have to wait for its turn
+      if (IRC_StartAttempt(connection) == 0)
+         TIMER_Arm(&connection->stateTimer, IRC_ATTEMPT_DELAY);
+      else if (IRC_AttemptsRunning(connection) == 0)
+      {
+         fprintf(stderr, "Couldn't connect to %s:%s\n",
+               connection->network->server, connection->network->port);
+         IRC_Lost(connection);
+      }
+      return;
+   }
+   
+   //the winner; the others are called off
+   connection->socket = watcher->fd;
+   watcher->fd = -1;
+   IRC_CloseAttempts(connection);
+   if (debugLevel >= 1)
+      fprintf(stderr, "Connected to %s:%s socket num: %08x!\n",
+            connection->network->server, connection->network->port,
+            connection->socket);
+   connection->state = IRC_REGISTERING;
+   connection->reader.start = connection->reader.end = 0;
+   connection->queue.broken = 0;
+   connection->queue.blocked = 0;
+   connection->queue.floodClock = 0;
+   connection->watcher.fd = connection->socket;
+   if (REACTOR_Add(&connection->watcher,
+                   EPOLLIN | EPOLLOUT | EPOLLRDHUP) == -1 ||
+       IRC_Login(connection) == -1)
+   {
+      IRC_Lost(connection);
+      return;
+   }
+   TIMER_Arm(&connection->stateTimer, IRC_REGISTER_TIMEOUT * 1000);
+}
+
+int IRC_Disconnect()
+{
+   struct IrcConnection *connection;
+   int result = 0;
+   int i;
+   
+   if (debugLevel >= 1)
+      fprintf(stderr, "Diconnecting from server...\n");
+   for (i = 0; i < numConnections; ++i)
+   {
+      connection = &connections[i];
+      IRC_SendMessage(connection, QUIT_COMMAND, IRC_CONTROL);
+      IRC_DrainQueue(connection, 2000);
+      IRC_ReportQueue(connection);
+   }
+   sleep(2);
+   for (i = 0; i < numConnections; ++i)
+   {
+      connection = &connections[i];
+      if (connection->address != NULL)
+         freeaddrinfo(connection->address);
+      if (connection->socket != -1 && close(connection->socket) == -1)
+      {
+         fprintf(stderr, "Couldn't close socket: %i\n", connection->socket);
+         result = -1;
+      }
+   }
+   return result;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// The hot-pack cache. Every request adds one to the pack's popularity,
+// which halves every CACHE_HALF_LIFE seconds, and the cachepacks most
+// popular packs that fit into cachesize bytes are kept open and mapped, and
+// asked into the page cache with WILLNEED so the first transfer doesn't wait
+// for the disk. Buffered sends copy straight from the mapping, forked
+// children inherit it, and sendfile and splice read the same pages. Packs
+// that fall out are dropped from the page cache with DONTNEED, but only once
+// no slot is sending them.
+/////////////////////////////////////////////////////////////////////////////
+#define CACHE_HALF_LIFE 600
+#define CACHE_REBALANCE_EVERY 10
+//below this a pack isn't worth a place, that's one request a few hours ago
+#define CACHE_MIN_POPULARITY 0.01
+
+struct HotPack
+{
+   int packNumber;
+   int fileDescriptor;
+   char *map;
+   long filesize;      //the size and mtime it was mapped with, it is stale
+   time_t mtime;       //once the catalog says otherwise
+   char wanted;        //still among the most popular, see CACHE_Rebalance
+};
+
+struct HotPack *hotPacks = NULL;
+int numHotPacks = 0;
+int hotPacksSize = 0;
+long long hotBytes = 0;
+time_t lastRebalance = 0;
+struct Timer cacheTimer;
+
+//popularity as of now; halving by whole half lives and in between along a
+//straight line is close enough for ranking
+double CACHE_Popularity(int packNumber, time_t now)
+{
+   double popularity = dirContents->popularity[packNumber];
+   time_t elapsed = now - dirContents->popularAt[packNumber];
+   
+   if (popularity == 0 || elapsed <= 0)
+      return popularity;
+   if (elapsed >= 32 * CACHE_HALF_LIFE)
+      return 0;
+   for (; elapsed >= CACHE_HALF_LIFE; elapsed -= CACHE_HALF_LIFE)
+      popularity /= 2;
+   return popularity * (1 - 0.5 * elapsed / CACHE_HALF_LIFE);
+}
+
+int CACHE_Find(int packNumber)
+{
+   int i;
+   
+   for (i = 0; i < numHotPacks; ++i)
+      if (hotPacks[i].packNumber == packNumber)
+         return i;
+   return -1;
+}
+
+//whether the hot pack still is what the catalog has under its number
+int CACHE_Current(struct HotPack *hot)
+{
+   return DIR_PackValid(hot->packNumber) &&
+          dirContents->filesizes[hot->packNumber] == hot->filesize &&
+          dirContents->mtimes[hot->packNumber] == hot->mtime;
+}
+
+int CACHE_InUse(int packNumber)
+{
+   int i;
+   
+   for (i = 0; i < numActiveSlots; ++i)
+      if (activeSlots[i].packNumber == packNumber)
+         return 1;
+   return 0;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// The mapping of a pack in the cache, or NULL if it isn't hot (or changed
+// since it was mapped) and has to be read from the file.
+/////////////////////////////////////////////////////////////////////////////
+const char *CACHE_Lookup(int packNumber)
+{
+   int index = CACHE_Find(packNumber);
+   
+   if (index == -1 || !CACHE_Current(&hotPacks[index]))
+      return NULL;
+   return hotPacks[index].map;
+}
+
+void CACHE_Evict(int index)
+{
+   struct HotPack *hot = &hotPacks[index];
+   
+   if (debugLevel > 0)
+      fprintf(stderr, "Dropping pack #%i from the cache\n", hot->packNumber);
+   posix_fadvise(hot->fileDescriptor, 0, 0, POSIX_FADV_DONTNEED);
+   munmap(hot->map, hot->filesize);
+   close(hot->fileDescriptor);
+   hotBytes -= hot->filesize;
+   *hot = hotPacks[--numHotPacks];
+}
+
+int CACHE_Load(int packNumber)
+{
+   struct HotPack *hot;
+   struct stat info;
+   char path[4096];
+   int fileDescriptor;
+   char *map;
+   
+   snprintf(path, sizeof(path), "%s/%s", directory,
+            DIR_Name(packNumber));
+   fileDescriptor = open(path, O_RDONLY | O_CLOEXEC);
+   if (fileDescriptor == -1)
+      return -1;
+   //a file that changed since the catalog saw it waits for the next scan
+   if (fstat(fileDescriptor, &info) == -1 ||
+       info.st_size != dirContents->filesizes[packNumber] || info.st_size == 0)
+   {
+      close(fileDescriptor);
+      return -1;
+   }
+   map = mmap(NULL, info.st_size, PROT_READ, MAP_SHARED, fileDescriptor, 0);
+   if (map == MAP_FAILED)
+   {
+      close(fileDescriptor);
+      return -1;
+   }
+   posix_fadvise(fileDescriptor, 0, 0, POSIX_FADV_WILLNEED);
+   
+   if (numHotPacks == hotPacksSize)
+   {
+      hotPacksSize = hotPacksSize == 0 ? 16 : hotPacksSize * 2;
+      hotPacks = realloc(hotPacks, sizeof(struct HotPack) * hotPacksSize);
+   }
+   hot = &hotPacks[numHotPacks++];
+   hot->packNumber = packNumber;
+   hot->fileDescriptor = fileDescriptor;
+   hot->map = map;
+   hot->filesize = info.st_size;
+   hot->mtime = dirContents->mtimes[packNumber];
+   hot->wanted = 1;
+   hotBytes += info.st_size;
+   if (debugLevel > 0)
+      fprintf(stderr, "Caching pack #%i (%s)\n", packNumber,
+            DIR_Name(packNumber));
+   return 0;
+}
+
+struct CacheCandidate
+{
+   int packNumber;
+   double popularity;
+};
+
+int CACHE_CompareCandidates(const void *first, const void *second)
+{
+   const struct CacheCandidate *a = first, *b = second;
+   
+   if (a->popularity != b->popularity)
+      return a->popularity < b->popularity ? 1 : -1;
+   return a->packNumber - b->packNumber;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Works out the most popular packs that fit into the budget, drops the hot
+// packs that aren't among them any more and loads the ones that are new.
+/////////////////////////////////////////////////////////////////////////////
+void CACHE_Rebalance()
+{
+   struct CacheCandidate *candidates;
+   int numCandidates = 0;
+   long long budget = cacheSize;
+   time_t now = time(NULL);
+   double popularity;
+   int taken = 0;
+   int index;
+   int i;
+   
+   lastRebalance = now;
+   for (i = 0; i < numHotPacks; ++i)
+      hotPacks[i].wanted = 0;
+   candidates = malloc(sizeof(struct CacheCandidate) *
+                       (dirContents->numPacks + 1));
+   for (i = 0; cacheSize > 0 && i < dirContents->numPacks; ++i)
+   {
+      if (!DIR_PackValid(i) || dirContents->filesizes[i] == 0)
+         continue;
+      popularity = CACHE_Popularity(i, now);
+      if (popularity < CACHE_MIN_POPULARITY)
+         continue;
+      candidates[numCandidates].packNumber = i;
+      candidates[numCandidates].popularity = popularity;
+      ++numCandidates;
+   }
+   qsort(candidates, numCandidates, sizeof(struct CacheCandidate),
+         CACHE_CompareCandidates);
+   for (i = 0; i < numCandidates && taken < cachePacks; ++i)
+   {
+      if (dirContents->filesizes[candidates[i].packNumber] > budget)
+         continue;
+      budget -= dirContents->filesizes[candidates[i].packNumber];
+      ++taken;
+      index = CACHE_Find(candidates[i].packNumber);
+      if (index != -1 && CACHE_Current(&hotPacks[index]))
+         hotPacks[index].wanted = 1;
+      else
+         candidates[i].packNumber = -candidates[i].packNumber - 1;
+   }
+   
+   //make room first; what a slot still sends stays until it's done
+   for (i = numHotPacks - 1; i >= 0; --i)
+      if (!hotPacks[i].wanted && !CACHE_InUse(hotPacks[i].packNumber))
+         CACHE_Evict(i);
+   //then load the newcomers, marked above with a negative number
+   for (i = 0; i < numCandidates; ++i)
+   {
+      if (candidates[i].packNumber >= 0)
+         continue;
+      index = -candidates[i].packNumber - 1;
+      if (CACHE_Find(index) == -1 &&
+          hotBytes + dirContents->filesizes[index] <= cacheSize)
+         CACHE_Load(index);
+   }
+   free(candidates);
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Counts a request for a pack. A pack that isn't hot yet may have just
+// become popular enough, which is checked at most once a second.
+/////////////////////////////////////////////////////////////////////////////
+void CACHE_Touch(int packNumber)
+{
+   time_t now = time(NULL);
+   
+   dirContents->popularity[packNumber] = CACHE_Popularity(packNumber, now) + 1;
+   dirContents->popularAt[packNumber] = now;
+   if (cacheSize > 0 && CACHE_Lookup(packNumber) == NULL &&
+       lastRebalance != now)
+      CACHE_Rebalance();
+}
+
+//counted when a transfer is offered, by the process that owns the slots
+void CACHE_CountOffer(int packNumber)
+{
+   if (cacheSize > 0 && DIR_PackValid(packNumber))
+      METRIC_Count(CACHE_Lookup(packNumber) != NULL ? METRIC_CACHE_HITS :
+                   METRIC_CACHE_MISSES, 1);
+}
+
+void CACHE_OnTimer(struct Timer *timer)
+{
+   CACHE_Rebalance();
+   TIMER_Arm(timer, CACHE_REBALANCE_EVERY * 1000);
+}
+
+//bytes of the hot packs that are in the page cache right now
+long long CACHE_ResidentBytes()
+{
+   long pageSize = sysconf(_SC_PAGESIZE);
+   unsigned char *pages;
+   long long resident = 0;
+   size_t numPages;
+   size_t page;
+   int i;
+   
+   for (i = 0; i < numHotPacks; ++i)
+   {
+      numPages = (hotPacks[i].filesize + pageSize - 1) / pageSize;
+      pages = malloc(numPages);
+      if (pages != NULL && mincore(hotPacks[i].map, hotPacks[i].filesize,
+                                   pages) == 0)
+         for (page = 0; page < numPages; ++page)
+            resident += (pages[page] & 1) * pageSize;
+      free(pages);
+   }
+   return resident;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Metrics export, in the Prometheus text format. With -o metrics=... the
+// bot listens on a port (127.0.0.1 unless an address is given) or a unix
+// socket and answers every connection with the current numbers, as an
+// HTTP/1.0 response so Prometheus can scrape it and curl or socat can read
+// it. With -o statsfile=... the same text is written to a file every
+// statsevery seconds, which suits node_exporter's textfile collector.
+/////////////////////////////////////////////////////////////////////////////
+struct MetricText
+{
+   char *data;
+   size_t length;
+   size_t size;
+};
+
+struct MetricsClient
+{
+   struct Watcher watcher;   //watcher.fd is the client's socket
+   struct Timer expire;
+   struct MetricText response;
+   size_t written;
+};
+
+struct Watcher metricsWatcher = { -1, NULL };
+struct Timer statsTimer;
+
+void METRIC_Printf(struct MetricText *text, const char *format, ...)
+{
+   va_list arguments;
+   int needed;
+   
+   if (text->data == NULL)
+   {
+      text->size = 16384;
+      text->data = malloc(text->size);
+   }
+   while (1)
+   {
+      va_start(arguments, format);
+      needed = vsnprintf(text->data + text->length, text->size - text->length,
+                         format, arguments);
+      va_end(arguments);
+      if (needed < 0)
+         return;
+      if (text->length + needed < text->size)
+      {
+         text->length += needed;
+         return;
+      }
+      text->size = text->size * 2 + needed;
+      text->data = realloc(text->data, text->size);
+   }
+}
+
+void METRIC_Header(struct MetricText *text, const char *name,
+                   const char *type, const char *help)
+{
+   METRIC_Printf(text, "# HELP %s %s\n# TYPE %s %s\n", name, help, name,
+                 type);
+}
+
+//label values are quoted; backslashes, quotes and newlines are escaped
+void METRIC_Escape(const char *value, char *escaped, size_t size)
+{
+   size_t length = 0;
+   
+   for (; *value != '\0' && length + 2 < size; ++value)
+   {
+      if (*value == '\\' || *value == '"' || *value == '\n')
+      {
+         escaped[length++] = '\\';
+         escaped[length++] = *value == '\n' ? 'n' : *value;
+      }
+      else
+         escaped[length++] = *value;
+   }
+   escaped[length] = '\0';
+}
+
+//adds up what every thread counted
+void METRIC_Collect(struct MetricBlock *total)
+{
+   struct MetricBlock *block;
+   int i, j;
+   
+   memset(total, 0, sizeof(struct MetricBlock));
+   for (i = 0; i < METRIC_MAX_BLOCKS; ++i)
+   {
+      block = &metricBlocks[i];
+      for (j = 0; j < METRIC_NUM_COUNTERS; ++j)
+         total->counters[j] += __atomic_load_n(&block->counters[j],
+                                               __ATOMIC_RELAXED);
+      for (j = 0; j < METRIC_BUCKETS; ++j)
+      {
+         total->queueWait.buckets[j] +=
+            __atomic_load_n(&block->queueWait.buckets[j], __ATOMIC_RELAXED);
+         total->ircLine.buckets[j] +=
+            __atomic_load_n(&block->ircLine.buckets[j], __ATOMIC_RELAXED);
+      }
+      total->queueWait.sum += __atomic_load_n(&block->queueWait.sum,
+                                              __ATOMIC_RELAXED);
+      total->ircLine.sum += __atomic_load_n(&block->ircLine.sum,
+                                            __ATOMIC_RELAXED);
+   }
+}
+
+//bounds and sum are divided by scale to get seconds
+void METRIC_WriteHistogram(struct MetricText *text, const char *name,
+                           const char *help, struct MetricHistogram *histogram,
+                           const long long *bounds, double scale)
+{
+   unsigned long long cumulative = 0;
+   int i;
+   
+   METRIC_Header(text, name, "histogram", help);
+   for (i = 0; i < METRIC_BUCKETS - 1; ++i)
+   {
+      cumulative += histogram->buckets[i];
+      METRIC_Printf(text, "%s_bucket{le=\"%g\"} %llu\n", name,
+                    bounds[i] / scale, cumulative);
+   }
+   cumulative += histogram->buckets[METRIC_BUCKETS - 1];
+   METRIC_Printf(text, "%s_bucket{le=\"+Inf\"} %llu\n", name, cumulative);
+   METRIC_Printf(text, "%s_sum %.9g\n%s_count %llu\n", name,
+                 histogram->sum / scale, name, cumulative);
+}
+
+//the labels every per transfer sample carries
+void METRIC_TransferLabels(struct TransferStats *stats, char *labels,
+                           size_t size)
+{
+   char server[256];
+   char nick[256];
+   
+   METRIC_Escape(stats->connection->network->server, server, sizeof(server));
+   METRIC_Escape(stats->nick, nick, sizeof(nick));
+   snprintf(labels, size, "slot=\"%i\",network=\"%s\",nick=\"%s\",pack=\"%i\"",
+            stats->slotId, server, nick, stats->packNumber);
+}
+
+void METRIC_Render(struct MetricText *text)
+{
+   struct MetricBlock total;
+   struct TransferStats *stats;
+   struct IrcConnection *connection;
+   char labels[1024];
+   char escaped[1024];
+   unsigned long long started, sentBytes;
+   long long now = monotonicMs();
+   long long elapsed;
+   int running = 0;
+   int i, priority;
+   
+   METRIC_Collect(&total);
+   started = total.counters[METRIC_TRANSFERS_STARTED];
+   sentBytes = total.counters[METRIC_SENT_BYTES];
+   for (i = 0; i < METRIC_MAX_TRANSFERS; ++i)
+   {
+      stats = &transferStats[i];
+      if (stats->slotId == 0 ||
+          __atomic_load_n(&stats->startedAt, __ATOMIC_RELAXED) == 0)
+         continue;
+      ++running;
+      ++started;
+      sentBytes += __atomic_load_n(&stats->sentBytes, __ATOMIC_RELAXED);
+   }
+   
+   METRIC_Header(text, "quiznobot_packs", "gauge", "Packs shared.");
+   METRIC_Printf(text, "quiznobot_packs %i\n", numValidPacks);
+   METRIC_Header(text, "quiznobot_catalog_bytes", "gauge",
+                 "Memory the catalog takes, names included.");
+   METRIC_Printf(text, "quiznobot_catalog_bytes %zu\n",
+                 CATALOG_Bytes(dirContents));
+   METRIC_Header(text, "quiznobot_slots", "gauge", "Send slots.");
+   METRIC_Printf(text, "quiznobot_slots %i\n", sendSlots);
+   METRIC_Header(text, "quiznobot_slots_used", "gauge",
+                 "Send slots taken by an offer or a transfer.");
+   METRIC_Printf(text, "quiznobot_slots_used %i\n", numActiveSlots);
+   METRIC_Header(text, "quiznobot_dcc_ports_free", "gauge",
+                 "DCC ports not taken by an offer or a forked transfer.");
+   METRIC_Printf(text, "quiznobot_dcc_ports_free %i\n", portPool.numFree);
+   METRIC_Header(text, "quiznobot_transfers_running", "gauge",
+                 "Transfers whose client has connected.");
+   METRIC_Printf(text, "quiznobot_transfers_running %i\n", running);
+   METRIC_Header(text, "quiznobot_queue_length", "gauge",
+                 "Requests waiting for a send slot.");
+   METRIC_Printf(text, "quiznobot_queue_length %i\n", transferQueueLength);
+   METRIC_Header(text, "quiznobot_transfers_started_total", "counter",
+                 "Transfers whose client connected.");
+   METRIC_Printf(text, "quiznobot_transfers_started_total %llu\n", started);
+   METRIC_Header(text, "quiznobot_transfers_completed_total", "counter",
+                 "Transfers that finished.");
+   METRIC_Printf(text, "quiznobot_transfers_completed_total %llu\n",
+                 total.counters[METRIC_TRANSFERS_COMPLETED]);
+   METRIC_Header(text, "quiznobot_transfers_failed_total", "counter",
+                 "Transfers that broke off or stalled.");
+   METRIC_Printf(text, "quiznobot_transfers_failed_total %llu\n",
+                 total.counters[METRIC_TRANSFERS_FAILED]);
+   METRIC_Header(text, "quiznobot_sent_bytes_total", "counter",
+                 "Bytes sent by all transfers.");
+   METRIC_Printf(text, "quiznobot_sent_bytes_total %llu\n", sentBytes);
+   METRIC_Header(text, "quiznobot_hashed_bytes_total", "counter",
+                 "Bytes read to compute checksums.");
+   METRIC_Printf(text, "quiznobot_hashed_bytes_total %llu\n",
+                 total.counters[METRIC_HASHED_BYTES]);
+   METRIC_Header(text, "quiznobot_cache_hits_total", "counter",
+                 "Transfers offered from a pack in the hot-pack cache.");
+   METRIC_Printf(text, "quiznobot_cache_hits_total %llu\n",
+                 total.counters[METRIC_CACHE_HITS]);
+   METRIC_Header(text, "quiznobot_cache_misses_total", "counter",
+                 "Transfers offered from a pack that wasn't in the cache.");
+   METRIC_Printf(text, "quiznobot_cache_misses_total %llu\n",
+                 total.counters[METRIC_CACHE_MISSES]);
+   METRIC_Header(text, "quiznobot_cache_packs", "gauge",
+                 "Packs in the hot-pack cache.");
+   METRIC_Printf(text, "quiznobot_cache_packs %i\n", numHotPacks);
+   METRIC_Header(text, "quiznobot_cache_bytes", "gauge",
+                 "Size of the packs in the hot-pack cache.");
+   METRIC_Printf(text, "quiznobot_cache_bytes %lld\n", hotBytes);
+   METRIC_Header(text, "quiznobot_cache_resident_bytes", "gauge",
+                 "Bytes of the cached packs that are in the page cache.");
+   METRIC_Printf(text, "quiznobot_cache_resident_bytes %lld\n",
+                 CACHE_ResidentBytes());
+   METRIC_Header(text, "quiznobot_worker_steals_total", "counter",
+                 "Transfers idle workers took over from busy ones.");
+   METRIC_Printf(text, "quiznobot_worker_steals_total %llu\n",
+                 total.counters[METRIC_WORKER_STEALS]);
+   if (workerPool.numWorkers > 0)
+      METRIC_Header(text, "quiznobot_worker_transfers", "gauge",
+                    "Transfers handed to a worker thread and not finished.");
+   for (i = 0; i < workerPool.numWorkers; ++i)
+      METRIC_Printf(text, "quiznobot_worker_transfers{worker=\"%i\"} %i\n",
+                    i, __atomic_load_n(&workerPool.workers[i].load,
+                                       __ATOMIC_RELAXED));
+   METRIC_Header(text, "quiznobot_uring_submits_total", "counter",
+                 "Calls handing queued io_uring operations to the kernel.");
+   METRIC_Printf(text, "quiznobot_uring_submits_total %llu\n",
+                 total.counters[METRIC_URING_SUBMITS]);
+   METRIC_Header(text, "quiznobot_uring_ops_total", "counter",
+                 "Operations handed to the kernel through io_uring.");
+   METRIC_Printf(text, "quiznobot_uring_ops_total %llu\n",
+                 total.counters[METRIC_URING_OPS]);
+   METRIC_WriteHistogram(text, "quiznobot_queue_wait_seconds",
+                         "Time requests waited for a send slot.",
+                         &total.queueWait, queueWaitBounds, 1);
+   
+   METRIC_Header(text, "quiznobot_transfer_sent_bytes", "gauge",
+                 "Bytes a running transfer has sent.");
+   for (i = 0; i < METRIC_MAX_TRANSFERS; ++i)
+   {
+      stats = &transferStats[i];
+      if (stats->slotId == 0 || stats->startedAt == 0)
+         continue;
+      METRIC_TransferLabels(stats, labels, sizeof(labels));
+      METRIC_Printf(text, "quiznobot_transfer_sent_bytes{%s} %lld\n", labels,
+                    __atomic_load_n(&stats->sentBytes, __ATOMIC_RELAXED));
+   }
+   METRIC_Header(text, "quiznobot_transfer_acked_bytes", "gauge",
+                 "Bytes the client of a running transfer confirmed.");
+   for (i = 0; i < METRIC_MAX_TRANSFERS; ++i)
+   {
+      stats = &transferStats[i];
+      if (stats->slotId == 0 || stats->startedAt == 0)
+         continue;
+      METRIC_TransferLabels(stats, labels, sizeof(labels));
+      METRIC_Printf(text, "quiznobot_transfer_acked_bytes{%s} %lld\n", labels,
+                    __atomic_load_n(&stats->ackedBytes, __ATOMIC_RELAXED));
+   }
+   METRIC_Header(text, "quiznobot_transfer_rate_bytes_per_second", "gauge",
+                 "Average rate of a running transfer since it started.");
+   for (i = 0; i < METRIC_MAX_TRANSFERS; ++i)
+   {
+      stats = &transferStats[i];
+      if (stats->slotId == 0 || stats->startedAt == 0)
+         continue;
+      elapsed = now - stats->startedAt;
+      METRIC_TransferLabels(stats, labels, sizeof(labels));
+      METRIC_Printf(text, "quiznobot_transfer_rate_bytes_per_second{%s} %.0f\n",
+                    labels, elapsed <= 0 ? 0.0 :
+                    __atomic_load_n(&stats->sentBytes, __ATOMIC_RELAXED) *
+                    1000.0 / elapsed);
+   }
+   METRIC_Header(text, "quiznobot_transfer_rtt_seconds", "gauge",
+                 "Round trip time of a running transfer's connection.");
+   for (i = 0; i < METRIC_MAX_TRANSFERS; ++i)
+   {
+      stats = &transferStats[i];
+      if (stats->slotId == 0 || stats->startedAt == 0)
+         continue;
+      METRIC_TransferLabels(stats, labels, sizeof(labels));
+      METRIC_Printf(text, "quiznobot_transfer_rtt_seconds{%s} %.6f\n", labels,
+                    __atomic_load_n(&stats->rttUs, __ATOMIC_RELAXED) / 1e6);
+   }
+   
+   METRIC_Header(text, "quiznobot_requests_total", "counter",
+                 "Requests for packs since the start.");
+   METRIC_Printf(text, "quiznobot_requests_total %llu\n",
+                 total.counters[METRIC_PACK_REQUESTS]);
+   METRIC_Header(text, "quiznobot_pack_requests_total", "counter",
+                 "Requests since the start for the most requested packs.");
+   for (i = 0; i < numTopPacks; ++i)
+   {
+      if (!DIR_PackValid(topPacks[i]))
+         continue;
+      METRIC_Escape(DIR_Name(topPacks[i]), escaped, sizeof(escaped));
+      METRIC_Printf(text, "quiznobot_pack_requests_total{pack=\"%i\","
+                    "file=\"%s\"} %u\n", topPacks[i], escaped,
+                    dirContents->requests[topPacks[i]]);
+   }
+   
+   METRIC_Header(text, "quiznobot_irc_connected", "gauge",
+                 "Whether the bot is connected to the network.");
+   for (i = 0; i < numConnections; ++i)
+   {
+      connection = &connections[i];
+      METRIC_Escape(connection->network->server, escaped, sizeof(escaped));
+      METRIC_Printf(text, "quiznobot_irc_connected{network=\"%s\"} %i\n",
+                    escaped, connection->state == IRC_ONLINE);
+   }
+   METRIC_Header(text, "quiznobot_irc_reconnects_total", "counter",
+                 "Logins to the network after the first one.");
+   for (i = 0; i < numConnections; ++i)
+   {
+      connection = &connections[i];
+      METRIC_Escape(connection->network->server, escaped, sizeof(escaped));
+      METRIC_Printf(text, "quiznobot_irc_reconnects_total{network=\"%s\"} "
+                    "%u\n", escaped, connection->logins > 0 ?
+                    connection->logins - 1 : 0);
+   }
+   METRIC_Header(text, "quiznobot_irc_sendqueue_lines", "gauge",
+                 "Lines waiting to be sent to the network.");
+   for (i = 0; i < numConnections; ++i)
+   {
+      connection = &connections[i];
+      METRIC_Escape(connection->network->server, escaped, sizeof(escaped));
+      for (priority = 0; priority < IRC_NUM_PRIORITIES; ++priority)
+         METRIC_Printf(text, "quiznobot_irc_sendqueue_lines{network=\"%s\","
+                       "class=\"%s\"} %i\n", escaped,
+                       ircPriorityNames[priority],
+                       connection->queue.depth[priority]);
+   }
+   METRIC_Header(text, "quiznobot_irc_sendqueue_dropped_total", "counter",
+                 "Lines dropped because the send queue was full.");
+   for (i = 0; i < numConnections; ++i)
+   {
+      connection = &connections[i];
+      METRIC_Escape(connection->network->server, escaped, sizeof(escaped));
+      for (priority = 0; priority < IRC_NUM_PRIORITIES; ++priority)
+         METRIC_Printf(text, "quiznobot_irc_sendqueue_dropped_total{network="
+                       "\"%s\",class=\"%s\"} %llu\n", escaped,
+                       ircPriorityNames[priority],
+                       connection->queue.dropped[priority]);
+   }
+   METRIC_Header(text, "quiznobot_irc_sent_lines_total", "counter",
+                 "Lines sent to the network.");
+   for (i = 0; i < numConnections; ++i)
+   {
+      connection = &connections[i];
+      METRIC_Escape(connection->network->server, escaped, sizeof(escaped));
+      METRIC_Printf(text, "quiznobot_irc_sent_lines_total{network=\"%s\"} "
+                    "%llu\n", escaped, connection->queue.sentLines);
+   }
+   METRIC_Header(text, "quiznobot_irc_sent_bytes_total", "counter",
+                 "Bytes sent to the network.");
+   for (i = 0; i < numConnections; ++i)
+   {
+      connection = &connections[i];
+      METRIC_Escape(connection->network->server, escaped, sizeof(escaped));
+      METRIC_Printf(text, "quiznobot_irc_sent_bytes_total{network=\"%s\"} "
+                    "%llu\n", escaped, connection->queue.sentBytes);
+   }
+   METRIC_WriteHistogram(text, "quiznobot_irc_line_seconds",
+                         "Time to parse and handle a line from a server.",
+                         &total.ircLine, ircLineBounds, 1e9);
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// The write to the temporary file and the rename make sure a reader never
+// sees half a snapshot.
+/////////////////////////////////////////////////////////////////////////////
+int METRIC_WriteStatsFile()
+{
+   struct MetricText text = { NULL, 0, 0 };
+   char temporaryPath[4200];
+   FILE *stats;
+   int result = 0;
+   
+   METRIC_Render(&text);
+   snprintf(temporaryPath, sizeof(temporaryPath), "%s.tmp", statsFile);
+   stats = fopen(temporaryPath, "w");
+   if (stats == NULL ||
+       fwrite(text.data, 1, text.length, stats) != text.length ||
+       fclose(stats) != 0 || rename(temporaryPath, statsFile) != 0)
+   {
+      fprintf(stderr, "Couldn't write the stats file %s: %s\n", statsFile,
+            strerror(errno));
+      unlink(temporaryPath);
+      result = -1;
+   }
+   free(text.data);
+   return result;
+}
+
+void METRIC_OnStatsTimer(struct Timer *timer)
+{
+   METRIC_WriteStatsFile();
+   TIMER_Arm(timer, (statsEvery > 0 ? statsEvery : 1) * 1000);
+}
+
+void METRIC_CloseClient(struct MetricsClient *client)
+{
+   REACTOR_Remove(&client->watcher);
+   TIMER_Cancel(&client->expire);
+   close(client->watcher.fd);
+   free(client->response.data);
+   free(client);
+}
+
+void METRIC_OnClientExpired(struct Timer *timer)
+{
+   METRIC_CloseClient(CONTAINER_OF(timer, struct MetricsClient, expire));
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// The answer is written as soon as the client connects; whatever it sends is
+// read and thrown away so closing doesn't reset the connection under it.
+// Once everything is written our side is shut down and the client closes.
+/////////////////////////////////////////////////////////////////////////////
+void METRIC_OnClient(struct Watcher *watcher, unsigned int events)
+{
+   struct MetricsClient *client = (struct MetricsClient*)watcher;
+   char discard[1024];
+   ssize_t result;
+   
+   while (client->written < client->response.length)
+   {
+      result = send(watcher->fd, client->response.data + client->written,
+                    client->response.length - client->written,
+                    MSG_DONTWAIT | MSG_NOSIGNAL);
+      if (result == -1 && errno != EAGAIN && errno != EWOULDBLOCK &&
+          errno != EINTR)
+      {
+         METRIC_CloseClient(client);
+         return;
+      }
+      if (result <= 0)
+         break;
+      client->written += result;
+      if (client->written == client->response.length)
+         shutdown(watcher->fd, SHUT_WR);
+   }
+   while ((result = recv(watcher->fd, discard, sizeof(discard),
+                         MSG_DONTWAIT)) > 0)
+      ;
+   if (result == 0 || (errno != EAGAIN && errno != EWOULDBLOCK &&
+                       errno != EINTR))
+      METRIC_CloseClient(client);
+}
+
+void METRIC_OnAccept(struct Watcher *watcher, unsigned int events)
+{
+   struct MetricsClient *client;
+   int clientSocket;
+   
+   while ((clientSocket = accept4(watcher->fd, NULL, NULL,
+                                  SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1)
+   {
+      client = calloc(1, sizeof(struct MetricsClient));
+      client->watcher.fd = clientSocket;
+      client->watcher.onEvent = METRIC_OnClient;
+      client->expire.onExpire = METRIC_OnClientExpired;
+      METRIC_Printf(&client->response, "HTTP/1.0 200 OK\r\nContent-Type: "
+                    "text/plain; version=0.0.4\r\n\r\n");
+      METRIC_Render(&client->response);
+      if (REACTOR_Add(&client->watcher, EPOLLIN | EPOLLOUT | EPOLLRDHUP) == -1)
+      {
+         close(clientSocket);
+         free(client->response.data);
+         free(client);
+         continue;
+      }
+      TIMER_Arm(&client->expire, METRICS_CLIENT_TIMEOUT * 1000);
+   }
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Opens the metrics socket. An address with a / in it is a unix socket
+// path, otherwise it's a port or ip:port. Returns -1 if it can't listen.
+/////////////////////////////////////////////////////////////////////////////
+int METRIC_Listen()
+{
+   struct sockaddr_un local;
+   struct sockaddr_in address;
+   struct stat info;
+   const char *colon;
+   char host[64];
+   int listenSocket;
+   int one = 1;
+   
+   if (strchr(metricsAddress, '/') != NULL)
+   {
+      memset(&local, 0, sizeof(local));
+      local.sun_family = AF_UNIX;
+      if (strlen(metricsAddress) >= sizeof(local.sun_path))
+      {
+         fprintf(stderr, "Metrics socket path is too long: %s\n",
+               metricsAddress);
+         return -1;
+      }
+      strcpy(local.sun_path, metricsAddress);
+      //a socket left over from the last run is in the way
+      if (stat(metricsAddress, &info) == 0 && S_ISSOCK(info.st_mode))
+         unlink(metricsAddress);
+      listenSocket = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK |
+                            SOCK_CLOEXEC, 0);
+      if (listenSocket != -1 &&
+          bind(listenSocket, (struct sockaddr*)&local, sizeof(local)) == -1)
+      {
+         close(listenSocket);
+         listenSocket = -1;
+      }
+   }
+   else
+   {
+      memset(&address, 0, sizeof(address));
+      address.sin_family = AF_INET;
+      address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+      colon = strrchr(metricsAddress, ':');
+      if (colon != NULL)
+      {
+         snprintf(host, sizeof(host), "%.*s", (int)(colon - metricsAddress),
+                  metricsAddress);
+         if (inet_pton(AF_INET, host, &address.sin_addr) != 1)
+         {
+            fprintf(stderr, "Invalid metrics address: %s\n", metricsAddress);
+            return -1;
+         }
+      }
+      address.sin_port = htons(atoi(colon != NULL ? colon + 1 :
+                                    metricsAddress));
+      listenSocket = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK |
+                            SOCK_CLOEXEC, 0);
+      if (listenSocket != -1)
+         setsockopt(listenSocket, SOL_SOCKET, SO_REUSEADDR, &one,
+                    sizeof(one));
+      if (listenSocket != -1 &&
+          bind(listenSocket, (struct sockaddr*)&address,
+               sizeof(address)) == -1)
+      {
+         close(listenSocket);
+         listenSocket = -1;
+      }
+   }
+   if (listenSocket == -1 || listen(listenSocket, 16) == -1)
+   {
+      fprintf(stderr, "Couldn't serve metrics on %s: %s\n", metricsAddress,
+            strerror(errno));
+      if (listenSocket != -1)
+         close(listenSocket);
+      return -1;
+   }
+   if (debugLevel > 0)
+      fprintf(stderr, "Serving metrics on %s\n", metricsAddress);
+   return listenSocket;
+}
+
+void METRIC_Start()
+{
+   if (metricsAddress[0] != '\0')
+   {
+      metricsWatcher.fd = METRIC_Listen();
+      metricsWatcher.onEvent = METRIC_OnAccept;
+      if (metricsWatcher.fd != -1 &&
+          REACTOR_Add(&metricsWatcher, EPOLLIN) == -1)
+      {
+         close(metricsWatcher.fd);
+         metricsWatcher.fd = -1;
+      }
+   }
+   if (statsFile[0] != '\0')
+   {
+      statsTimer.onExpire = METRIC_OnStatsTimer;
+      TIMER_Arm(&statsTimer, 0);
+   }
+}
+
+void METRIC_Stop()
+{
+   if (metricsWatcher.fd != -1)
+   {
+      REACTOR_Remove(&metricsWatcher);
+      close(metricsWatcher.fd);
+      metricsWatcher.fd = -1;
+      if (strchr(metricsAddress, '/') != NULL)
+         unlink(metricsAddress);
+   }
+   //the last numbers, so the file doesn't claim we're still sending
+   if (statsFile[0] != '\0')
+      METRIC_WriteStatsFile();
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// The send engine pushes a pack to the DCC socket. sendfile() and splice()
+// move the data from the page cache to the socket without copying it through
+// user space; the buffered mode is the original read()/send() loop and is
+// kept so the modes can be compared (-o sendmode=...). If the kernel refuses
+// a zero-copy mode for a file the engine drops down to the next one.
+/////////////////////////////////////////////////////////////////////////////
+struct SendEngine
+{
+   int mode;
+   off_t sentOffset;   //bytes of the file that are on the socket
+   size_t pending;     //bytes read from the file but not yet sent
+   size_t bufferStart; //buffered mode: first unsent byte in buffer
+   int pipe[2];        //splice mode: the pipe between file and socket
+   char *buffer;       //buffered mode: the copy buffer
+   const char *map;    //buffered mode: the hot pack's mapping, if it has one
+};
+
+void XFER_EngineInit(struct SendEngine *engine, int mode, off_t offset)
+{
+   memset(engine, 0, sizeof(struct SendEngine));
+   engine->mode = mode;
+   engine->sentOffset = offset;
+   engine->pipe[0] = -1;
+   engine->pipe[1] = -1;
+}
+
+void XFER_EngineFree(struct SendEngine *engine)
+{
+   if (engine->pipe[0] != -1) close(engine->pipe[0]);
+   if (engine->pipe[1] != -1) close(engine->pipe[1]);
+   free(engine->buffer);
+   engine->pipe[0] = -1;
+   engine->pipe[1] = -1;
+   engine->buffer = NULL;
+}
+
+void XFER_EngineFallback(struct SendEngine *engine, int mode)
+{
+   if (debugLevel > 0)
+      fprintf(stderr, "%s not usable (%s), falling back to %s\n",
+            sendModeNames[engine->mode], strerror(errno),
+            sendModeNames[mode]);
+   engine->mode = mode;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Moves at most limit bytes of the file (stopping at end) to the socket.
+// Returns the number of bytes that went out, 0 if the socket would block
+// and -1 on error.
+/////////////////////////////////////////////////////////////////////////////
+ssize_t XFER_EnginePump(struct SendEngine *engine, int socket,
+                        int fileDescriptor, off_t end, size_t limit)
+{
+   size_t want;
+   ssize_t result;
+   off_t readOffset;
+   
+   if (engine->sentOffset >= end && engine->pending == 0)
+      return 0;
+   want = end - engine->sentOffset;
+   if (want > limit) want = limit;
+   
+   switch (engine->mode)
+   {
+      case SEND_MODE_SENDFILE:
+         readOffset = engine->sentOffset;
+         result = sendfile(socket, fileDescriptor, &readOffset, want);
+         if (result == -1 && (errno == EINVAL || errno == ENOSYS))
+         {
+            XFER_EngineFallback(engine, SEND_MODE_SPLICE);
+            return XFER_EnginePump(engine, socket, fileDescriptor, end, limit);
+         }
+         break;
+      case SEND_MODE_SPLICE:
+         if (engine->pipe[0] == -1)
+         {
+            if (pipe(engine->pipe) == -1)
+            {
+               XFER_EngineFallback(engine, SEND_MODE_BUFFERED);
+               return XFER_EnginePump(engine, socket, fileDescriptor, end, limit);
+            }
+            fcntl(engine->pipe[1], F_SETPIPE_SZ, ZERO_COPY_CHUNK);
+         }
+         if (engine->pending == 0)
+         {
+            readOffset = engine->sentOffset;
+            result = splice(fileDescriptor, &readOffset, engine->pipe[1], NULL,
+                            want, SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (result == -1 && (errno == EINVAL || errno == ENOSYS))
+            {
+               XFER_EngineFallback(engine, SEND_MODE_BUFFERED);
+               return XFER_EnginePump(engine, socket, fileDescriptor, end, limit);
+            }
+            if (result <= 0)
+               break;
+            engine->pending = result;
+         }
+         result = splice(engine->pipe[0], NULL, socket, NULL, engine->pending,
+                         SPLICE_F_MOVE | SPLICE_F_MORE);
+         if (result > 0) engine->pending -= result;
+         break;
+      default:
+         //past the end of a pack that shrank the kernel can't copy from
+         //the mapping and send() fails with EFAULT (no SIGBUS, the fault is
+         //its own), then we go back to pread(), which reports it
+         if (engine->map != NULL && engine->pending == 0)
+         {
+            result = send(socket, engine->map + engine->sentOffset, want,
+                          MSG_NOSIGNAL);
+            if (result != -1 || errno != EFAULT)
+               break;
+            engine->map = NULL;
+         }
+         if (engine->buffer == NULL)
+         {
+            engine->buffer = calloc(BUFFERED_CHUNK, sizeof(char));
+            if (engine->buffer == NULL)
+            {
+               errno = ENOMEM;
+               return -1;
+            }
+         }
+         if (engine->pending == 0)
+         {
+            if (want > BUFFERED_CHUNK) want = BUFFERED_CHUNK;
+            result = pread(fileDescriptor, engine->buffer, want,
+                           engine->sentOffset);
+            if (result <= 0)
+               break;
+            engine->pending = result;
+            engine->bufferStart = 0;
+         }
+         result = send(socket, engine->buffer + engine->bufferStart,
+                       engine->pending, MSG_NOSIGNAL);
+         if (result > 0)
+         {
+            engine->pending -= result;
+            engine->bufferStart += result;
+         }
+         break;
+   }
+   
+   if (result > 0)
+   {
+      engine->sentOffset += result;
+      return result;
+   }
+   if (result == 0) //the file is shorter than the catalog says
+   {
+      errno = EIO;
+      return -1;
+   }
+   if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+      return 0;
+   return -1;
+}
+
+void XFER_ReportRate(int packNumber, long long bytes, struct timespec *start,
+                     int mode)
+{
+   //this may run on a transfer worker, which reads the catalog this way
+   struct Catalog *catalog = CATALOG_Current();
+   const char *name = "the pack list";
+   struct timespec end;
+   double seconds;
+   
+   if (packNumber >= 0 &&
+       packNumber < __atomic_load_n(&catalog->numPacks, __ATOMIC_ACQUIRE))
+      name = DIR_BaseName(catalog->names + catalog->nameOffsets[packNumber]);
+   clock_gettime(CLOCK_MONOTONIC, &end);
+   seconds = (end.tv_sec - start->tv_sec) +
+             (end.tv_nsec - start->tv_nsec) / 1000000000.0;
+   if (seconds <= 0.0) seconds = 0.000001;
+   if (debugLevel > 0)
+      fprintf(stderr, "Pack #%i (%s): sent %lld bytes in %.2fs (%.0f "
+            "bytes/s) using %s\n", packNumber, name, bytes, seconds,
+            bytes / seconds, sendModeNames[mode]);
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Bandwidth shaping with token buckets. A transfer may send what its own
+// bucket, its nick's bucket and the global bucket all allow. When the global
+// or nick bucket runs dry a transfer can still spend its guarantee bucket,
+// which fills at minrate, so every slot keeps moving; the shared buckets go
+// into debt for it. The global and nick buckets and the rates live in a
+// shared mapping so forked children shape against the same budget and see
+// "bot set" changes while they run.
+/////////////////////////////////////////////////////////////////////////////
+struct TokenBucket
+{
+   double tokens;
+   long long refilledAt; //monotonic microseconds, 0 for a new bucket
+};
+
+struct NickBucket
+{
+   int network;
+   char nick[128];
+   int users;
+   struct TokenBucket bucket;
+};
+
+struct ShaperState
+{
+   pthread_mutex_t lock;
+   long long globalRate;
+   long long transferRate;
+   long long nickRate;
+   long long minimumRate;
+   struct TokenBucket global;
+   struct NickBucket nicks[SHAPER_MAX_NICKS];
+};
+
+struct ShaperState *shaper = NULL;
+
+void SHAPER_Configure()
+{
+   pthread_mutexattr_t attributes;
+   
+   if (shaper == NULL)
+   {
+      shaper = mmap(NULL, sizeof(struct ShaperState), PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+      if (shaper == MAP_FAILED)
+      {
+         perror("mmap");
+         exit(1);
+      }
+      memset(shaper, 0, sizeof(struct ShaperState));
+      pthread_mutexattr_init(&attributes);
+      pthread_mutexattr_setpshared(&attributes, PTHREAD_PROCESS_SHARED);
+      pthread_mutex_init(&shaper->lock, &attributes);
+      pthread_mutexattr_destroy(&attributes);
+   }
+   pthread_mutex_lock(&shaper->lock);
+   shaper->globalRate = globalRate;
+   shaper->transferRate = transferRate;
+   shaper->nickRate = nickRate;
+   shaper->minimumRate = minimumRate;
+   pthread_mutex_unlock(&shaper->lock);
+}
+
+void BUCKET_Refill(struct TokenBucket *bucket, long long rate, long long now)
+{
+   double burst = rate * SHAPER_BURST_SECONDS;
+   
+   if (burst < SHAPER_QUANTUM) burst = SHAPER_QUANTUM;
+   if (bucket->refilledAt == 0)
+      bucket->tokens = burst;
+   else
+      bucket->tokens += rate * ((now - bucket->refilledAt) / 1000000.0);
+   if (bucket->tokens > burst) bucket->tokens = burst;
+   bucket->refilledAt = now;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Narrows *allowed down to what the bucket holds. If that is less than
+// needed, *waitUs is raised to the time the bucket needs to get there.
+/////////////////////////////////////////////////////////////////////////////
+void BUCKET_Limit(struct TokenBucket *bucket, long long rate, long long now,
+                  double needed, double *allowed, long long *waitUs)
+{
+   long long wait;
+   
+   if (rate <= 0)
+      return;
+   BUCKET_Refill(bucket, rate, now);
+   if (bucket->tokens < *allowed)
+      *allowed = bucket->tokens > 0 ? bucket->tokens : 0;
+   if (bucket->tokens < needed)
+   {
+      wait = (long long)((needed - bucket->tokens) * 1000000.0 / rate) + 1;
+      if (wait > *waitUs) *waitUs = wait;
+   }
+}
+
+int SHAPER_AttachNick(int network, const char *nick)
+{
+   int i;
+   int freeEntry = -1;
+   
+   pthread_mutex_lock(&shaper->lock);
+   for (i = 0; i < SHAPER_MAX_NICKS; ++i)
+   {
+      if (shaper->nicks[i].users > 0 && shaper->nicks[i].network == network &&
+          strcasecmp(shaper->nicks[i].nick, nick) == 0)
+         break;
+      if (shaper->nicks[i].users == 0 && freeEntry == -1)
+         freeEntry = i;
+   }
+   if (i == SHAPER_MAX_NICKS && freeEntry != -1)
+   {
+      i = freeEntry;
+      memset(&shaper->nicks[i], 0, sizeof(struct NickBucket));
+      shaper->nicks[i].network = network;
+      snprintf(shaper->nicks[i].nick, sizeof(shaper->nicks[i].nick), "%s",
+               nick);
+   }
+   if (i < SHAPER_MAX_NICKS)
+      ++shaper->nicks[i].users;
+   else
+      i = -1; //too many nicks, this one goes unshaped
+   pthread_mutex_unlock(&shaper->lock);
+   return i;
+}
+
+void SHAPER_DetachNick(int nickBucket)
+{
+   if (nickBucket < 0)
+      return;
+   pthread_mutex_lock(&shaper->lock);
+   --shaper->nicks[nickBucket].users;
+   pthread_mutex_unlock(&shaper->lock);
+}
+
+//with no limits there is nothing to count, and no lock for workers to share
+int SHAPER_Unlimited()
+{
+   return __atomic_load_n(&shaper->globalRate, __ATOMIC_RELAXED) <= 0 &&
+          __atomic_load_n(&shaper->transferRate, __ATOMIC_RELAXED) <= 0 &&
+          __atomic_load_n(&shaper->nickRate, __ATOMIC_RELAXED) <= 0;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// How many bytes the transfer may send now (at most limit and remaining).
+// Returns 0 and sets *waitUs when it has to wait for tokens.
+/////////////////////////////////////////////////////////////////////////////
+size_t SHAPER_Allowance(struct TokenBucket *own, struct TokenBucket *guarantee,
+                        int nickBucket, size_t limit, size_t remaining,
+                        long long *waitUs)
+{
+   long long now;
+   double needed = remaining < SHAPER_QUANTUM ? remaining : SHAPER_QUANTUM;
+   double allowed = limit;
+   double shared;
+   long long ownWait = 0;
+   long long sharedWait = 0;
+   long long guaranteeWait = 0;
+   
+   if (SHAPER_Unlimited())
+   {
+      *waitUs = 0;
+      return limit;
+   }
+   now = monotonicUs();
+   pthread_mutex_lock(&shaper->lock);
+   BUCKET_Limit(own, shaper->transferRate, now, needed, &allowed, &ownWait);
+   shared = allowed;
+   BUCKET_Limit(&shaper->global, shaper->globalRate, now, needed, &shared,
+                &sharedWait);
+   if (nickBucket >= 0)
+      BUCKET_Limit(&shaper->nicks[nickBucket].bucket, shaper->nickRate, now,
+                   needed, &shared, &sharedWait);
+   if (shared < needed && shaper->minimumRate > 0 && ownWait == 0)
+   {
+      //out of shared tokens, fall back on the guaranteed minimum
+      shared = allowed;
+      BUCKET_Limit(guarantee, shaper->minimumRate, now, needed, &shared,
+                   &guaranteeWait);
+      if (guaranteeWait < sharedWait) sharedWait = guaranteeWait;
+   }
+   pthread_mutex_unlock(&shaper->lock);
+   
+   if (ownWait > 0 || shared < needed)
+   {
+      *waitUs = ownWait > sharedWait ? ownWait : sharedWait;
+      return 0;
+   }
+   *waitUs = 0;
+   return (size_t)shared;
+}
+
+void SHAPER_Consume(struct TokenBucket *own, struct TokenBucket *guarantee,
+                    int nickBucket, size_t bytes)
+{
+   if (SHAPER_Unlimited())
+      return;
+   pthread_mutex_lock(&shaper->lock);
+   if (shaper->transferRate > 0) own->tokens -= bytes;
+   if (shaper->minimumRate > 0)
+   {
+      //a transfer that is getting its minimum anyway builds up no credit
+      BUCKET_Refill(guarantee, shaper->minimumRate, monotonicUs());
+      guarantee->tokens -= bytes;
+      if (guarantee->tokens < 0) guarantee->tokens = 0;
+   }
+   if (shaper->globalRate > 0) shaper->global.tokens -= bytes;
+   if (shaper->nickRate > 0 && nickBucket >= 0)
+      shaper->nicks[nickBucket].bucket.tokens -= bytes;
+   pthread_mutex_unlock(&shaper->lock);
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// A single DCC transfer. The sender streams the file as fast as the socket
+// takes it and reads the client's position acknowledgements whenever they
+// show up, instead of waiting for one after every block. Acks are the 32 bit
+// (or, from clients that support files over 4GB, 64 bit) big endian count of
+// bytes received. Turbo (TSEND) clients don't ack at all.
+/////////////////////////////////////////////////////////////////////////////
+enum TransferState
+{
+   TRANSFER_SENDING = 0,
+   TRANSFER_LINGERING, //everything is sent, waiting for the client
+   TRANSFER_DONE,
+   TRANSFER_FAILED
+};
+
+struct Transfer
+{
+   struct Watcher watcher; //watcher.fd is the DCC socket
+   struct Transfer *next;
+   int slotId;
+   int socket;
+   int fileDescriptor;
+   int packNumber;
+   char nick[128];
+   off_t filesize;
+   off_t startOffset;  //where a resumed transfer started
+   char turbo;
+   enum TransferState state;
+   struct SendEngine engine;
+   unsigned char ackBuffer[8];
+   int ackFill;
+   int ackWidth;       //0 until the first ack tells us 4 or 8
+   off_t ackedOffset;
+   time_t lastActivity;
+   off_t progressOffset; //sentOffset when it last moved
+   time_t progressAt;    //when it last moved
+   struct timespec started;
+   struct TokenBucket rate;      //transferrate
+   struct TokenBucket guarantee; //minrate
+   int nickBucket;
+   long long throttledUntil;     //monotonic ms, 0 when not throttled
+   struct Timer resume;          //reactor: fires at throttledUntil
+   struct TransferStats *stats;  //NULL when it isn't listed in the metrics
+   long long rttSampledAt;       //monotonic ms
+   char uring;                   //its I/O goes through the io_uring
+   struct UringOp *chunkOp;      //io=uring: the chunk read or sent
+   struct UringOp *ackOp;        //io=uring: the receive waiting for acks
+};
+
+void XFER_Init(struct Transfer *transfer, int socket, int fileDescriptor,
+               int packNumber, int network, const char *toNick,
+               off_t filesize, char turbo, off_t offset)
+{
+   memset(transfer, 0, sizeof(struct Transfer));
+   transfer->socket = socket;
+   transfer->fileDescriptor = fileDescriptor;
+   transfer->packNumber = packNumber;
+   snprintf(transfer->nick, sizeof(transfer->nick), "%s", toNick);
+   transfer->filesize = filesize;
+   transfer->turbo = turbo;
+   transfer->state = TRANSFER_SENDING;
+   transfer->lastActivity = time(NULL);
+   transfer->nickBucket = SHAPER_AttachNick(network, toNick);
+   //acks count from the start of the file, not of this connection
+   transfer->startOffset = offset;
+   transfer->ackedOffset = offset;
+   transfer->progressOffset = offset;
+   transfer->progressAt = transfer->lastActivity;
+   XFER_EngineInit(&transfer->engine, sendMode, offset);
+   clock_gettime(CLOCK_MONOTONIC, &transfer->started);
+}
+
+void XFER_AttachStats(struct Transfer *transfer, struct TransferStats *stats)
+{
+   transfer->stats = stats;
+   if (stats == NULL)
+      return;
+   stats->startOffset = transfer->startOffset;
+   __atomic_store_n(&stats->startedAt, monotonicMs(), __ATOMIC_RELAXED);
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Publishes the progress for the metrics. The round trip time comes from
+// the kernel's TCP_INFO, at most once a second since that's a system call.
+/////////////////////////////////////////////////////////////////////////////
+void XFER_UpdateStats(struct Transfer *transfer)
+{
+   struct TransferStats *stats = transfer->stats;
+   struct tcp_info info;
+   socklen_t length = sizeof(info);
+   long long now;
+   
+   if (stats == NULL)
+      return;
+   __atomic_store_n(&stats->sentBytes, (long long)transfer->engine.sentOffset -
+                    transfer->startOffset, __ATOMIC_RELAXED);
+   __atomic_store_n(&stats->ackedBytes, (long long)transfer->ackedOffset -
+                    transfer->startOffset, __ATOMIC_RELAXED);
+   now = monotonicMs();
+   if (now - transfer->rttSampledAt < 1000)
+      return;
+   transfer->rttSampledAt = now;
+   if (getsockopt(transfer->socket, IPPROTO_TCP, TCP_INFO, &info,
+                  &length) == 0)
+      __atomic_store_n(&stats->rttUs, info.tcpi_rtt, __ATOMIC_RELAXED);
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Turns a complete ack into an absolute offset. A 32 bit ack only carries
+// the low half of the position, the high half is taken from what we've sent.
+/////////////////////////////////////////////////////////////////////////////
+void XFER_ApplyAck(struct Transfer *transfer)
+{
+   unsigned long long value = 0;
+   unsigned long long sent = transfer->engine.sentOffset;
+   int i;
+   
+   for (i = 0; i < transfer->ackWidth; ++i)
+      value = (value << 8) | transfer->ackBuffer[i];
+   if (transfer->ackWidth == 4)
+   {
+      value |= sent & ~0xffffffffULL;
+      if (value > sent && value >= 0x100000000ULL)
+         value -= 0x100000000ULL;
+   }
+   if ((off_t)value > transfer->ackedOffset && value <= sent)
+      transfer->ackedOffset = value;
+}
+
+void XFER_ParseAcks(struct Transfer *transfer, const unsigned char *data,
+                    size_t length)
+{
+   size_t i;
+   unsigned long long firstWord;
+   
+   for (i = 0; i < length; ++i)
+   {
+      transfer->ackBuffer[transfer->ackFill++] = data[i];
+      if (transfer->ackWidth == 0 && transfer->ackFill == 4)
+      {
+         //a 64 bit ack starts with the high word of the position, which is
+         //at most what we've sent shifted down; the low word of a 32 bit
+         //ack is practically never that small
+         firstWord = ((unsigned long long)transfer->ackBuffer[0] << 24) |
+                     (transfer->ackBuffer[1] << 16) |
+                     (transfer->ackBuffer[2] << 8) | transfer->ackBuffer[3];
+         if (transfer->filesize > 0xffffffffLL &&
+             firstWord <= (unsigned long long)transfer->engine.sentOffset >> 32)
+            transfer->ackWidth = 8;
+         else
+            transfer->ackWidth = 4;
+         if (debugLevel > 1)
+            fprintf(stderr, "Pack #%i: %d bit acks\n", transfer->packNumber,
+                  transfer->ackWidth * 8);
+      }
+      if (transfer->ackWidth != 0 && transfer->ackFill == transfer->ackWidth)
+      {
+         XFER_ApplyAck(transfer);
+         transfer->ackFill = 0;
+      }
+   }
+}
+
+//the client hung up, which is how a turbo transfer ends
+void XFER_OnHangup(struct Transfer *transfer)
+{
+   if (transfer->ackedOffset >= transfer->filesize ||
+       (transfer->turbo && transfer->state == TRANSFER_LINGERING))
+      transfer->state = TRANSFER_DONE;
+   else
+      transfer->state = TRANSFER_FAILED;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Drains whatever acks are waiting on the socket without blocking.
+/////////////////////////////////////////////////////////////////////////////
+void XFER_ReadAcks(struct Transfer *transfer)
+{
+   unsigned char data[512];
+   ssize_t received;
+   
+   while (1)
+   {
+      received = recv(transfer->socket, data, sizeof(data), MSG_DONTWAIT);
+      if (received > 0)
+      {
+         transfer->lastActivity = time(NULL);
+         XFER_ParseAcks(transfer, data, received);
+      }
+      else if (received == 0)
+      {
+         XFER_OnHangup(transfer);
+         return;
+      }
+      else
+      {
+         if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+            transfer->state = TRANSFER_FAILED;
+         return;
+      }
+   }
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Sends as much as the socket will take right now.
+/////////////////////////////////////////////////////////////////////////////
+void XFER_Send(struct Transfer *transfer)
+{
+   ssize_t sent;
+   size_t allowance;
+   long long waitUs;
+   
+   transfer->throttledUntil = 0;
+   while (transfer->state == TRANSFER_SENDING)
+   {
+      allowance = SHAPER_Allowance(&transfer->rate, &transfer->guarantee,
+                                   transfer->nickBucket, ZERO_COPY_CHUNK,
+                                   transfer->filesize -
+                                   transfer->engine.sentOffset, &waitUs);
+      if (allowance == 0)
+      {
+         transfer->throttledUntil = monotonicMs() + waitUs / 1000 + 1;
+         return;
+      }
+      sent = XFER_EnginePump(&transfer->engine, transfer->socket,
+                             transfer->fileDescriptor, transfer->filesize,
+                             allowance);
+      if (sent > 0)
+         SHAPER_Consume(&transfer->rate, &transfer->guarantee,
+                        transfer->nickBucket, sent);
+      if (sent < 0)
+      {
+         fprintf(stderr, "Transfer of pack #%i failed: %s\n",
+               transfer->packNumber, strerror(errno));
+         transfer->state = TRANSFER_FAILED;
+      }
+      else if (transfer->engine.sentOffset >= transfer->filesize &&
+               transfer->engine.pending == 0)
+      {
+         transfer->state = TRANSFER_LINGERING;
+         transfer->lastActivity = time(NULL);
+         //a turbo client won't ack, so let it know we're finished
+         if (transfer->turbo)
+            shutdown(transfer->socket, SHUT_WR);
+      }
+      else if (sent == 0)
+         return;
+   }
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Checks the completion and timeout conditions. Completion is decided by the
+// last acked offset; turbo transfers finish when the client closes. Turbo
+// clients don't ack, so they stall when the socket stops taking data.
+/////////////////////////////////////////////////////////////////////////////
+void XFER_CheckProgress(struct Transfer *transfer)
+{
+   time_t now = time(NULL);
+   
+   XFER_UpdateStats(transfer);
+   if (transfer->state != TRANSFER_SENDING &&
+       transfer->state != TRANSFER_LINGERING)
+      return;
+   if (transfer->engine.sentOffset != transfer->progressOffset)
+   {
+      transfer->progressOffset = transfer->engine.sentOffset;
+      transfer->progressAt = now;
+   }
+   if (!transfer->turbo && transfer->ackedOffset >= transfer->filesize)
+      transfer->state = TRANSFER_DONE;
+   else if (transfer->turbo && transfer->state == TRANSFER_LINGERING &&
+            now - transfer->lastActivity > DCC_LINGER_TIMEOUT)
+      transfer->state = TRANSFER_DONE;
+   else if ((!transfer->turbo &&
+             now - transfer->lastActivity > DCC_STALL_TIMEOUT) ||
+            (transfer->turbo && transfer->state == TRANSFER_SENDING &&
+             now - transfer->progressAt > DCC_STALL_TIMEOUT))
+   {
+      fprintf(stderr, "Transfer of pack #%i to %s stalled at %lld bytes\n",
+            transfer->packNumber, transfer->nick,
+            (long long)(transfer->turbo ? transfer->progressOffset :
+                        transfer->ackedOffset));
+      transfer->state = TRANSFER_FAILED;
+   }
+}
+
+void XFER_Finish(struct Transfer *transfer)
+{
+   if (transfer->state == TRANSFER_DONE)
+      XFER_ReportRate(transfer->packNumber,
+                      transfer->engine.sentOffset - transfer->startOffset,
+                      &transfer->started, transfer->engine.mode);
+   else if (debugLevel > 0)
+      fprintf(stderr, "Pack #%i to %s failed after %lld of %lld bytes\n",
+            transfer->packNumber, transfer->nick,
+            (long long)transfer->ackedOffset, (long long)transfer->filesize);
+   if (transfer->stats != NULL)
+   {
+      XFER_UpdateStats(transfer);
+      transfer->stats->succeeded = transfer->state == TRANSFER_DONE;
+      transfer->stats->finished = 1;
+   }
+   XFER_EngineFree(&transfer->engine);
+   SHAPER_DetachNick(transfer->nickBucket);
+   close(transfer->fileDescriptor);
+   close(transfer->socket);
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Runs a transfer to completion in the calling process.
+/////////////////////////////////////////////////////////////////////////////
+void XFER_RunBlocking(struct Transfer *transfer)
+{
+   struct pollfd waitFor;
+   long long wait;
+   int timeout;
+   
+   fcntl(transfer->socket, F_SETFL,
+         fcntl(transfer->socket, F_GETFL) | O_NONBLOCK);
+   while (transfer->state == TRANSFER_SENDING ||
+          transfer->state == TRANSFER_LINGERING)
+   {
+      waitFor.fd = transfer->socket;
+      waitFor.events = POLLIN;
+      waitFor.revents = 0;
+      timeout = 1000;
+      wait = transfer->throttledUntil - monotonicMs();
+      if (transfer->state == TRANSFER_SENDING && wait <= 0)
+         waitFor.events |= POLLOUT;
+      else if (transfer->state == TRANSFER_SENDING && wait < timeout)
+         timeout = (int)wait;
+      if (poll(&waitFor, 1, timeout) > 0)
+      {
+         if (waitFor.revents & (POLLIN | POLLHUP | POLLERR))
+            XFER_ReadAcks(transfer);
+         if (waitFor.revents & POLLOUT)
+            XFER_Send(transfer);
+      }
+      XFER_CheckProgress(transfer);
+   }
+   XFER_Finish(transfer);
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// The pack list for xdcc list. It is rendered once per listingVersion into
+// a memfd, one "#N name, size bytes" line per pack, and every request is
+// served from that: a page of NOTICEs is a copy of its lines, and the whole
+// list is sent over DCC from the memfd like a pack, as pseudo-pack
+// LIST_PACK. The list isn't rendered again while it is being sent, so an
+// offer and the transfer that follows it always see the same file.
+/////////////////////////////////////////////////////////////////////////////
+#define LIST_PACK -2
+#define LIST_NAME "packlist.txt"
+#define LIST_MAX_NOTICE 400
+#define LIST_MAX_SENDS 2 //lists sent over DCC at once, on top of the slots
+
+struct PackList
+{
+   int fd;               //memfd with the list, -1 until it is first rendered
+   char *text;           //the memfd mapped, NULL for an empty list
+   size_t length;
+   size_t *lines;        //where every pack's line starts, numLines + 1 of them
+   int numLines;
+   unsigned int version; //listingVersion it was rendered for
+};
+
+struct PackList packList = { -1, NULL, 0, NULL, 0, 0 };
+
+int LIST_InUse()
+{
+   int i;
+   
+   for (i = 0; i < numActiveSlots; ++i)
+      if (activeSlots[i].packNumber == LIST_PACK)
+         return 1;
+   return 0;
+}
+
+int LIST_Render()
+{
+   struct PackList list = { -1, NULL, 0, NULL, 0, listingVersion };
+   char *buffer = NULL;
+   size_t bufferSize = 0;
+   int lineLength;
+   int i;
+   
+   list.lines = malloc(sizeof(size_t) * (dirContents->numPacks + 1));
+   for (i = 0; i < dirContents->numPacks; ++i)
+   {
+      if (!DIR_PackValid(i))
+         continue;
+      lineLength = snprintf(NULL, 0, "#%i %s, %li bytes\n", i,
+                            DIR_Name(i), dirContents->filesizes[i]);
+      if (list.length + lineLength + 1 > bufferSize)
+      {
+         bufferSize = bufferSize == 0 ? 65536 : bufferSize * 2;
+         if (bufferSize < list.length + lineLength + 1)
+            bufferSize = list.length + lineLength + 1;
+         buffer = realloc(buffer, bufferSize);
+      }
+      list.lines[list.numLines++] = list.length;
+      list.length += sprintf(buffer + list.length, "#%i %s, %li bytes\n", i,
+                             DIR_Name(i), dirContents->filesizes[i]);
+   }
+   list.lines[list.numLines] = list.length;
+   
+   list.fd = memfd_create("quiznoBot-list", MFD_CLOEXEC);
+   if (list.fd == -1 ||
+       (list.length > 0 && write(list.fd, buffer, list.length) !=
+                           (ssize_t)list.length))
+   {
+      fprintf(stderr, "Couldn't render the pack list: %s\n", strerror(errno));
+      if (list.fd != -1) close(list.fd);
+      free(list.lines);
+      free(buffer);
+      return -1;
+   }
+   free(buffer);
+   if (list.length > 0)
+   {
+      list.text = mmap(NULL, list.length, PROT_READ, MAP_SHARED, list.fd, 0);
+      if (list.text == MAP_FAILED)
+      {
+         fprintf(stderr, "Couldn't map the pack list: %s\n", strerror(errno));
+         close(list.fd);
+         free(list.lines);
+         return -1;
+      }
+   }
+   
+   if (packList.fd != -1) close(packList.fd);
+   if (packList.text != NULL) munmap(packList.text, packList.length);
+   free(packList.lines);
+   packList = list;
+   if (debugLevel > 0)
+      fprintf(stderr, "Rendered the pack list, %i packs in %zu bytes\n",
+              list.numLines, list.length);
+   return 0;
+}
+
+//the list for the current catalog, or the last one while that is being sent
+struct PackList *LIST_Current()
+{
+   if (packList.fd == -1 ||
+       (packList.version != listingVersion && !LIST_InUse()))
+      LIST_Render();
+   return packList.fd != -1 ? &packList : NULL;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// DCC offers. A pack request binds a listening socket, tells the client where
+// to connect and waits for it. In the reactor model the listener is watched
+// by the event loop; in the fork model a child waits on it and runs the
+// transfer.
+/////////////////////////////////////////////////////////////////////////////
+struct Offer
+{
+   struct Watcher watcher; //watcher.fd is the listening socket, or for a
+                           //passive offer the socket connecting to the
+                           //client (-1 until the client answers)
+   struct Timer expire;
+   struct Offer *next;
+   int slotId;
+   int packNumber;
+   int port;
+   struct IrcConnection *connection;
+   char nick[128];
+   char turbo;
+   off_t resumeOffset; //set by DCC RESUME
+   unsigned int token; //passive offers: the client sends it back, else 0
+   struct UringOp *uringOp; //io=uring: the accept, or the connect
+};
+
+struct Offer *pendingOffers = NULL;
+unsigned int nextOfferToken = 1;
+__thread struct Transfer *activeTransfers = NULL;
+__thread struct Timer progressTimer;
+
+/////////////////////////////////////////////////////////////////////////////
+// The address we advertise in DCC offers, in host byte order. Unless it was
+// set with -e it is the address of our end of the IRC connection.
+/////////////////////////////////////////////////////////////////////////////
+unsigned int DCC_LocalAddress(struct IrcConnection *connection)
+{
+   struct in_addr myself;
+   
+   if ((settings & IRC_EXTERNAL_IP_SET) == 0)
+   {
+      struct sockaddr_storage myselfSockAddr;
+      socklen_t myselfSockAddrLen = sizeof(myselfSockAddr);
+      if (getsockname(connection->socket, (struct sockaddr*)&myselfSockAddr,
+                  &myselfSockAddrLen) == 0 &&
+          myselfSockAddr.ss_family == AF_INET)
+      {
+         inet_ntop(AF_INET,
+                &(((struct sockaddr_in*)&myselfSockAddr)->sin_addr),
+                externalIP, 20);
+      }
+   }
+   inet_aton(externalIP, &myself);
+   return ntohl(myself.s_addr);
+}
+
+//the pack list goes out like a pack, under a name of its own
+const char *DCC_PackName(int packNumber)
+{
+   if (packNumber == LIST_PACK)
+      return LIST_NAME;
+   return DIR_BaseName(DIR_Name(packNumber));
+}
+
+long DCC_PackSize(int packNumber)
+{
+   if (packNumber == LIST_PACK)
+      return packList.length;
+   return dirContents->filesizes[packNumber];
+}
+
+//the pack mapped for buffered sends, NULL if it has to be read
+const char *DCC_PackMap(int packNumber)
+{
+   if (packNumber == LIST_PACK)
+      return packList.text;
+   return CACHE_Lookup(packNumber);
+}
+
+//a passive offer has port 0 and a token on the end
+void DCC_SendOffer(struct IrcConnection *connection, const char *toNick,
+                   int packNumber, int port, char turbo, unsigned int token)
+{
+   char sendBuffer[1024];
+   char tokenText[16] = "";
+   unsigned int address = DCC_LocalAddress(connection);
+   
+   if (debugLevel > 0)
+      fprintf(stderr, "Sending pack #%i to %s on %s(%u) port %i\n",
+              packNumber, toNick, externalIP, address, port);
+   if (token != 0)
+      snprintf(tokenText, sizeof(tokenText), " %u", token);
+   snprintf(sendBuffer, sizeof(sendBuffer),
+         "PRIVMSG %s :\001DCC %s \"%s\" %u %i %li%s\001\n",
+         toNick, turbo ? "TSEND" : "SEND", DCC_PackName(packNumber),
+         address, port, DCC_PackSize(packNumber), tokenText);
+   IRC_SendMessage(connection, sendBuffer, IRC_REPLY);
+}
+
+int DCC_OpenPack(int packNumber)
+{
+   char fileToOpen[4096];
+   int fileDescriptor;
+   
+   if (packNumber == LIST_PACK)
+      return fcntl(packList.fd, F_DUPFD_CLOEXEC, 0);
+   if (!DIR_PackValid(packNumber))
+   {
+      fprintf(stderr, "Pack #%i is no longer shared\n", packNumber);
+      return -1;
+   }   
+   snprintf(fileToOpen, sizeof(fileToOpen), "%s/%s", directory,
+            DIR_Name(packNumber));
+   fileDescriptor = open(fileToOpen, O_RDONLY);
+   if (fileDescriptor == -1)
+      fprintf(stderr, "Failed to open %s: %s\n", fileToOpen, strerror(errno));
+   return fileDescriptor;
+}
+
+//takes the transfer off the calling thread's list
+void XFER_Unlink(struct Transfer *transfer)
+{
+   struct Transfer **link = &activeTransfers;
+   
+   while (*link != NULL && *link != transfer)
+      link = &(*link)->next;
+   if (*link == transfer)
+      *link = transfer->next;
+}
+
+void XFER_Release(struct Transfer *transfer)
+{
+   XFER_Unlink(transfer);
+   if (transfer->uring)
+   {
+      URING_Detach(&transfer->chunkOp);
+      URING_Detach(&transfer->ackOp);
+   }
+   else
+      REACTOR_Remove(&transfer->watcher);
+   TIMER_Cancel(&transfer->resume);
+   XFER_Finish(transfer);
+   if (currentWorker != NULL)
+      WORKER_Finished(transfer->slotId);
+   else
+      SCHED_ReleaseSlot(transfer->slotId);
+   free(transfer);
+}
+
+//releases finished transfers and wakes throttled ones when they may go on
+void XFER_Settle(struct Transfer *transfer)
+{
+   long long wait;
+   
+   XFER_CheckProgress(transfer);
+   if (transfer->state == TRANSFER_DONE || transfer->state == TRANSFER_FAILED)
+   {
+      XFER_Release(transfer);
+      return;
+   }
+   if (transfer->state == TRANSFER_SENDING && transfer->throttledUntil != 0)
+   {
+      wait = transfer->throttledUntil - monotonicMs();
+      TIMER_Arm(&transfer->resume, wait > 0 ? (int)wait : 0);
+   }
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// io=uring transfers. A transfer has one chunk in flight at a time, read
+// into a ring buffer and then sent (a hot pack's too: its pages are in
+// memory already, and a copy from its mapping would fault if the file
+// shrank, or the cache unmapped it while the send was in flight), and a
+// receive that waits for acks, or for the client to hang up, as long as it
+// runs. Each chunk is started by the resume timer, which runs in the same
+// pass of the loop that completed the last one, so the next chunks of all
+// transfers go to the kernel together, and the shaper is asked before every
+// chunk like XFER_Send does.
+/////////////////////////////////////////////////////////////////////////////
+//a chunk was read from the file, or (some of it) went out on the socket
+void URING_OnChunk(struct UringOp *op, int result)
+{
+   struct Transfer *transfer = op->owner;
+   
+   if (result > 0 && op->opcode == URING_READ)
+   {
+      op->opcode = URING_SEND;
+      op->fd = transfer->socket;
+      op->length = result;
+   }
+   else if (result > 0)
+   {
+      SHAPER_Consume(&transfer->rate, &transfer->guarantee,
+                     transfer->nickBucket, result);
+      transfer->engine.sentOffset += result;
+      op->memory += result;
+      op->length -= result;
+   }
+   else //reading nothing means the file got shorter
+   {
+      fprintf(stderr, "Transfer of pack #%i failed: %s\n",
+            transfer->packNumber, strerror(result == 0 ? EIO : -result));
+      transfer->state = TRANSFER_FAILED;
+   }
+   if (transfer->state == TRANSFER_SENDING && op->length > 0)
+   {
+      if (URING_Queue(op) == 0)
+         return;
+      transfer->state = TRANSFER_FAILED;
+   }
+   transfer->chunkOp = NULL;
+   URING_FreeOp(op);
+   if (transfer->state == TRANSFER_SENDING)
+      TIMER_Arm(&transfer->resume, 0);
+   XFER_Settle(transfer);
+}
+
+void URING_SendNext(struct Transfer *transfer)
+{
+   struct UringOp *op;
+   size_t allowance;
+   size_t remaining = transfer->filesize - transfer->engine.sentOffset;
+   long long waitUs;
+   
+   if (transfer->state != TRANSFER_SENDING || transfer->chunkOp != NULL)
+      return;
+   transfer->throttledUntil = 0;
+   if (remaining == 0)
+   {
+      transfer->state = TRANSFER_LINGERING;
+      transfer->lastActivity = time(NULL);
+      //a turbo client won't ack, so let it know we're finished
+      if (transfer->turbo)
+         shutdown(transfer->socket, SHUT_WR);
+      return;
+   }
+   allowance = SHAPER_Allowance(&transfer->rate, &transfer->guarantee,
+                                transfer->nickBucket, URING_CHUNK, remaining,
+                                &waitUs);
+   if (allowance == 0)
+   {
+      transfer->throttledUntil = monotonicMs() + waitUs / 1000 + 1;
+      return;
+   }
+   op = URING_NewOp(transfer, URING_OnChunk);
+   op->length = allowance < remaining ? allowance : remaining;
+   if (URING_TakeBuffer(op) == -1)
+   {
+      //every buffer is in flight, try again in a moment
+      URING_FreeOp(op);
+      transfer->throttledUntil = monotonicMs() + 1;
+      return;
+   }
+   op->opcode = URING_READ;
+   op->fd = transfer->fileDescriptor;
+   op->offset = transfer->engine.sentOffset;
+   if (URING_Queue(op) == -1)
+   {
+      URING_FreeOp(op);
+      transfer->state = TRANSFER_FAILED;
+      return;
+   }
+   transfer->chunkOp = op;
+}
+
+void URING_OnAcks(struct UringOp *op, int result)
+{
+   struct Transfer *transfer = op->owner;
+   
+   if (result > 0)
+   {
+      transfer->lastActivity = time(NULL);
+      XFER_ParseAcks(transfer, op->data, result);
+      if (URING_Queue(op) == -1)
+         transfer->state = TRANSFER_FAILED;
+   }
+   else if (result == 0)
+      XFER_OnHangup(transfer);
+   else
+      transfer->state = TRANSFER_FAILED;
+   if (result <= 0)
+   {
+      transfer->ackOp = NULL;
+      URING_FreeOp(op);
+   }
+   XFER_Settle(transfer);
+}
+
+void URING_StartTransfer(struct Transfer *transfer)
+{
+   struct UringOp *op = URING_NewOp(transfer, URING_OnAcks);
+   
+   transfer->uring = 1;
+   op->opcode = URING_RECV;
+   op->fd = transfer->socket;
+   op->memory = (char*)op->data;
+   op->length = sizeof(op->data);
+   if (URING_Queue(op) == -1)
+   {
+      URING_FreeOp(op);
+      transfer->state = TRANSFER_FAILED;
+   }
+   else
+   {
+      transfer->ackOp = op;
+      URING_SendNext(transfer);
+   }
+   XFER_Settle(transfer);
+}
+
+void XFER_OnEvent(struct Watcher *watcher, unsigned int events)
+{
+   struct Transfer *transfer = (struct Transfer*)watcher;
+   
+   if (events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+      XFER_ReadAcks(transfer);
+   //while throttled the resume timer does the sending
+   if ((events & EPOLLOUT) && !transfer->resume.armed)
+      XFER_Send(transfer);
+   XFER_Settle(transfer);
+}
+
+void XFER_OnResume(struct Timer *timer)
+{
+   struct Transfer *transfer = CONTAINER_OF(timer, struct Transfer, resume);
+   
+   if (transfer->uring)
+      URING_SendNext(transfer);
+   else
+      XFER_Send(transfer);
+   XFER_Settle(transfer);
+}
+
+//catches stalled transfers and turbo transfers whose client never hangs up
+void XFER_OnProgressTimer(struct Timer *timer)
+{
+   struct Transfer *transfer = activeTransfers;
+   struct Transfer *next;
+   
+   while (transfer != NULL)
+   {
+      next = transfer->next;
+      XFER_Settle(transfer);
+      transfer = next;
+   }
+   TIMER_Arm(timer, 1000);
+}
+
+//runs a connected transfer in the calling thread's event loop
+void XFER_Adopt(struct Transfer *transfer)
+{
+   transfer->next = activeTransfers;
+   activeTransfers = transfer;
+   //data read but not sent yet (buffered, splice) stays with epoll
+   if (uring.watcher.fd != -1 && transfer->engine.pending == 0)
+      URING_StartTransfer(transfer);
+   else if (REACTOR_Add(&transfer->watcher,
+                        EPOLLIN | EPOLLOUT | EPOLLRDHUP) == -1)
+   {
+      transfer->state = TRANSFER_FAILED;
+      XFER_Release(transfer);
+   }
+}
+
+void WORKER_Hand(struct Worker *worker, struct Transfer *transfer)
+{
+   pthread_mutex_lock(&worker->lock);
+   transfer->next = NULL;
+   if (worker->inbox == NULL)
+      worker->inbox = transfer;
+   else
+      worker->inboxTail->next = transfer;
+   worker->inboxTail = transfer;
+   __atomic_add_fetch(&worker->load, 1, __ATOMIC_RELAXED);
+   pthread_mutex_unlock(&worker->lock);
+   WORKER_Wake(worker->wake.fd);
+}
+
+//in the main loop: lets the scheduler have the slots of ended transfers
+void WORKER_OnCollect(struct Watcher *watcher, unsigned int events)
+{
+   unsigned long long count;
+   int *finished;
+   int numFinished;
+   int i;
+   
+   read(watcher->fd, &count, sizeof(count));
+   pthread_mutex_lock(&workerPool.lock);
+   finished = workerPool.finished;
+   numFinished = workerPool.numFinished;
+   workerPool.finished = NULL;
+   workerPool.numFinished = workerPool.finishedSize = 0;
+   pthread_mutex_unlock(&workerPool.lock);
+   for (i = 0; i < numFinished; ++i)
+      SCHED_ReleaseSlot(finished[i]);
+   free(finished);
+}
+
+//in a worker: starts what the main loop (or a busy worker) handed over
+void WORKER_OnWake(struct Watcher *watcher, unsigned int events)
+{
+   struct Worker *worker = CONTAINER_OF(watcher, struct Worker, wake);
+   struct Transfer *transfer, *next;
+   unsigned long long count;
+   
+   read(watcher->fd, &count, sizeof(count));
+   pthread_mutex_lock(&worker->lock);
+   transfer = worker->inbox;
+   worker->inbox = worker->inboxTail = NULL;
+   pthread_mutex_unlock(&worker->lock);
+   for (; transfer != NULL; transfer = next)
+   {
+      next = transfer->next;
+      ++worker->running;
+      XFER_Adopt(transfer);
+   }
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Work stealing. A worker with nothing to run looks at the busiest one: a
+// transfer still waiting in its inbox is taken right away, otherwise it is
+// asked to give up a running one, which it hands to the least busy worker at
+// the end of its pass. Only the owner touches a running transfer, so that
+// is the one that moves it; io=uring transfers always have a receive in
+// flight and stay where they are.
+/////////////////////////////////////////////////////////////////////////////
+void WORKER_Steal(struct Worker *worker)
+{
+   struct Worker *victim = NULL;
+   struct Transfer *transfer;
+   int numWorkers = __atomic_load_n(&workerPool.numWorkers, __ATOMIC_ACQUIRE);
+   int load, most = 1;
+   int i;
+   
+   for (i = 0; i < numWorkers; ++i)
+   {
+      load = __atomic_load_n(&workerPool.workers[i].load, __ATOMIC_RELAXED);
+      if (&workerPool.workers[i] != worker && load > most)
+      {
+         victim = &workerPool.workers[i];
+         most = load;
+      }
+   }
+   if (victim == NULL)
+      return;
+   pthread_mutex_lock(&victim->lock);
+   transfer = victim->inbox;
+   if (transfer != NULL)
+   {
+      victim->inbox = transfer->next;
+      if (victim->inbox == NULL)
+         victim->inboxTail = NULL;
+      __atomic_sub_fetch(&victim->load, 1, __ATOMIC_RELAXED);
+   }
+   pthread_mutex_unlock(&victim->lock);
+   if (transfer == NULL)
+   {
+      if (!__atomic_exchange_n(&victim->wanted, 1, __ATOMIC_RELAXED))
+         WORKER_Wake(victim->wake.fd);
+      return;
+   }
+   METRIC_Count(METRIC_WORKER_STEALS, 1);
+   __atomic_add_fetch(&worker->load, 1, __ATOMIC_RELAXED);
+   ++worker->running;
+   XFER_Adopt(transfer);
+}
+
+void WORKER_GiveUp(struct Worker *worker)
+{
+   struct Transfer *transfer = activeTransfers;
+   
+   if (!__atomic_exchange_n(&worker->wanted, 0, __ATOMIC_RELAXED) ||
+       worker->running < 2)
+      return;
+   while (transfer != NULL && transfer->uring)
+      transfer = transfer->next;
+   if (transfer == NULL)
+      return;
+   XFER_Unlink(transfer);
+   REACTOR_Remove(&transfer->watcher);
+   TIMER_Cancel(&transfer->resume);
+   --worker->running;
+   __atomic_sub_fetch(&worker->load, 1, __ATOMIC_RELAXED);
+   METRIC_Count(METRIC_WORKER_STEALS, 1);
+   WORKER_Hand(WORKER_Least(), transfer);
+}
+
+void *WORKER_Run(void *argument)
+{
+   struct Worker *worker = argument;
+   struct epoll_event events[64];
+   struct Watcher *watcher;
+   int count;
+   int i;
+   
+   currentWorker = worker;
+   reactor = worker->reactor;
+   if (REACTOR_Add(&worker->wake, EPOLLIN) == -1)
+      return NULL;
+   if (ioBackend == IO_URING && URING_Setup(workerPool.ringBuffers) == 0)
+      __atomic_store_n(&worker->ring, uring.watcher.fd, __ATOMIC_RELAXED);
+   progressTimer.onExpire = XFER_OnProgressTimer;
+   TIMER_Arm(&progressTimer, 1000);
+   while (1)
+   {
+      //the progress timer makes sure an idle worker gets here every second
+      CATALOG_Quiesce(worker - workerPool.workers);
+      count = epoll_wait(reactor, events, 64, TIMER_NextTimeout());
+      for (i = 0; i < count; ++i)
+      {
+         watcher = events[i].data.ptr;
+         watcher->onEvent(watcher, events[i].events);
+      }
+      TIMER_RunExpired();
+      WORKER_GiveUp(worker);
+      //the progress timer wakes an idle worker once a second to look
+      if (worker->running == 0)
+         WORKER_Steal(worker);
+      if (uring.queued > 0)
+         URING_Submit();
+   }
+   return NULL;
+}
+
+//starts the workers; the threads never see signals meant for the main loop
+void WORKER_Start()
+{
+   struct Worker *worker;
+   sigset_t allSignals, previous;
+   int count = transferWorkers;
+   int started = 0;
+   
+   if (count <= 0)
+      count = sysconf(_SC_NPROCESSORS_ONLN);
+   //forked children run their transfer themselves
+   if (count <= 1 || transferModel == MODEL_FORK)
+      return;
+   workerPool.collect.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+   workerPool.collect.onEvent = WORKER_OnCollect;
+   if (workerPool.collect.fd == -1 ||
+       REACTOR_Add(&workerPool.collect, EPOLLIN) == -1)
+   {
+      perror("eventfd");
+      return;
+   }
+   workerPool.ringBuffers = (URING_BUFFERS + count - 1) / count;
+   if (workerPool.ringBuffers < 16)
+      workerPool.ringBuffers = 16;
+   workerPool.workers = calloc(count, sizeof(struct Worker));
+   CATALOG_AddReaders(count);
+   sigfillset(&allSignals);
+   pthread_sigmask(SIG_BLOCK, &allSignals, &previous);
+   while (started < count)
+   {
+      worker = &workerPool.workers[started];
+      pthread_mutex_init(&worker->lock, NULL);
+      worker->ring = -1;
+      worker->wake.onEvent = WORKER_OnWake;
+      worker->wake.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+      worker->reactor = epoll_create1(EPOLL_CLOEXEC);
+      if (worker->wake.fd == -1 || worker->reactor == -1 ||
+          pthread_create(&worker->thread, NULL, WORKER_Run, worker) != 0)
+      {
+         if (worker->wake.fd != -1) close(worker->wake.fd);
+         if (worker->reactor != -1) close(worker->reactor);
+         break;
+      }
+      ++started;
+   }
+   pthread_sigmask(SIG_SETMASK, &previous, NULL);
+   __atomic_store_n(&workerPool.numWorkers, started, __ATOMIC_RELEASE);
+   if (debugLevel > 0)
+      fprintf(stderr, "Running transfers on %i worker threads\n", started);
+}
+
+void DCC_ReleaseOffer(struct Offer *offer)
+{
+   struct Offer **link = &pendingOffers;
+   
+   while (*link != NULL && *link != offer)
+      link = &(*link)->next;
+   if (*link == offer)
+      *link = offer->next;
+   TIMER_Cancel(&offer->expire);
+   if (offer->uringOp != NULL)
+   {
+      //a cancelled accept gives the port back when it completes
+      offer->uringOp->port = offer->port;
+      URING_Detach(&offer->uringOp);
+   }
+   else
+   {
+      if (offer->watcher.fd != -1)
+         REACTOR_Remove(&offer->watcher);
+      if (offer->token == 0)
+         PORT_Return(offer->port);
+   }
+   //a connect that didn't work out
+   if (offer->token != 0 && offer->watcher.fd != -1)
+      close(offer->watcher.fd);
+   SCHED_ReleaseSlot(offer->slotId);
+   free(offer);
+}
+
+void DCC_OnOfferExpired(struct Timer *timer)
+{
+   struct Offer *offer = CONTAINER_OF(timer, struct Offer, expire);
+   
+   if (debugLevel > 0)
+      fprintf(stderr, "Offer of pack #%i to %s timed out\n",
+            offer->packNumber, offer->nick);
+   DCC_ReleaseOffer(offer);
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Runs the offer's transfer on a connected (non-blocking) socket, whichever
+// side connected, and lets go of the offer.
+/////////////////////////////////////////////////////////////////////////////
+void DCC_StartTransfer(struct Offer *offer, int transferSocket)
+{
+   struct Transfer *transfer;
+   int fileDescriptor;
+   
+   if (debugLevel > 0)
+      fprintf(stderr, "%s connected for pack #%i\n", offer->nick,
+            offer->packNumber);
+   fileDescriptor = DCC_OpenPack(offer->packNumber);
+   if (fileDescriptor == -1)
+   {
+      close(transferSocket);
+      DCC_ReleaseOffer(offer);
+      return;
+   }
+   transfer = malloc(sizeof(struct Transfer));
+   XFER_Init(transfer, transferSocket, fileDescriptor, offer->packNumber,
+             offer->connection->id, offer->nick,
+             DCC_PackSize(offer->packNumber), offer->turbo,
+             offer->resumeOffset);
+   transfer->engine.map = DCC_PackMap(offer->packNumber);
+   transfer->watcher.fd = transferSocket;
+   transfer->watcher.onEvent = XFER_OnEvent;
+   transfer->resume.onExpire = XFER_OnResume;
+   //the slot moves from the offer to the transfer
+   transfer->slotId = offer->slotId;
+   offer->slotId = 0;
+   XFER_AttachStats(transfer, SCHED_SlotStats(transfer->slotId));
+   DCC_ReleaseOffer(offer);
+   if (workerPool.numWorkers > 0)
+      WORKER_Hand(WORKER_Least(), transfer);
+   else
+      XFER_Adopt(transfer);
+}
+
+void DCC_OnAccept(struct Watcher *watcher, unsigned int events)
+{
+   struct Offer *offer = (struct Offer*)watcher;
+   int transferSocket;
+   
+   transferSocket = accept4(offer->watcher.fd, NULL, NULL, SOCK_NONBLOCK);
+   if (transferSocket == -1)
+   {
+      if (errno != EAGAIN && errno != EWOULDBLOCK)
+         DCC_ReleaseOffer(offer);
+      return;
+   }
+   DCC_StartTransfer(offer, transferSocket);
+}
+
+//io=uring: the accept queued by prepareTransfer completed
+void DCC_OnUringAccept(struct UringOp *op, int result)
+{
+   struct Offer *offer = op->owner;
+   
+   offer->uringOp = NULL;
+   URING_FreeOp(op);
+   if (result < 0)
+   {
+      if (debugLevel > 0)
+         fprintf(stderr, "Couldn't accept %s for pack #%i: %s\n",
+               offer->nick, offer->packNumber, strerror(-result));
+      DCC_ReleaseOffer(offer);
+      return;
+   }
+   DCC_StartTransfer(offer, result);
+}
+
+//in a forked child: lets go of what only the parent uses
+void DCC_ChildDetach()
+{
+   int i, j;
+   
+   //only the parent talks to the servers
+   for (i = 0; i < numConnections; ++i)
+   {
+      if (connections[i].socket != -1)
+         close(connections[i].socket);
+      connections[i].socket = -1;
+   }
+   close(reactor);
+   if (uring.watcher.fd != -1) close(uring.watcher.fd);
+   if (workerPool.collect.fd != -1) close(workerPool.collect.fd);
+   for (i = 0; i < workerPool.numWorkers; ++i)
+   {
+      close(workerPool.workers[i].reactor);
+      close(workerPool.workers[i].wake.fd);
+      if (workerPool.workers[i].ring != -1)
+         close(workerPool.workers[i].ring);
+   }
+   if (catalogWatchFd != -1) close(catalogWatchFd);
+   if (metricsWatcher.fd != -1) close(metricsWatcher.fd);
+   for (i = 0; i < numConnections; ++i)
+      for (j = 0; j < IRC_MAX_ATTEMPTS; ++j)
+         if (connections[i].attempts[j].watcher.fd != -1)
+            close(connections[i].attempts[j].watcher.fd);
+}
+
+//in a forked child: sends the pack over the connected socket and exits
+void DCC_ChildSend(int transferSocket, int network, const char *toNick,
+                   int packNumber, char turbo, off_t resumeOffset, int slotId)
+{
+   struct Transfer transfer;
+   int fileDescriptor;
+   
+   fileDescriptor = DCC_OpenPack(packNumber);
+   if (fileDescriptor == -1)
+      _exit(-1);
+   XFER_Init(&transfer, transferSocket, fileDescriptor, packNumber,
+             network, toNick, DCC_PackSize(packNumber), turbo,
+             resumeOffset);
+   //the mapping was made before the fork and is still there
+   transfer.engine.map = DCC_PackMap(packNumber);
+   XFER_AttachStats(&transfer, SCHED_SlotStats(slotId));
+   XFER_RunBlocking(&transfer);
+   _exit(transfer.state == TRANSFER_DONE ? 0 : 1);
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Fork model: the child waits for the client and runs the transfer on its
+// own, the parent forgets about it.
+/////////////////////////////////////////////////////////////////////////////
+pid_t DCC_ForkTransfer(int listenSocket, int network, const char *toNick,
+                       int packNumber, char turbo, int resumePipe, int slotId)
+{
+   pid_t forkId;
+   int transferSocket;
+   struct pollfd waitFor[2];
+   long long deadline;
+   off_t resumeOffset = 0;
+   
+   forkId = fork();
+   if (forkId == -1)
+   {
+      fprintf(stderr, "Couldn't fork child process!\n");
+      return -1;
+   }
+   else if (forkId == 0) //child process
+   {
+      DCC_ChildDetach();
+      //the parent answers DCC RESUME and passes the offset down the pipe
+      waitFor[0].fd = listenSocket;
+      waitFor[0].events = POLLIN;
+      waitFor[1].fd = resumePipe;
+      waitFor[1].events = POLLIN;
+      deadline = monotonicMs() + offerTimeout * 1000;
+      if (debugLevel > 0) fprintf(stderr, "Listening...");
+      while (1)
+      {
+         waitFor[0].revents = waitFor[1].revents = 0;
+         if (deadline <= monotonicMs() ||
+             poll(waitFor, 2, deadline - monotonicMs()) < 1)
+         {
+            if (debugLevel > 0) fprintf(stderr, "timed out\n");
+            _exit(1);
+         }
+         if (waitFor[0].revents & POLLIN)
+            break;
+         if (waitFor[1].revents != 0 &&
+             read(resumePipe, &resumeOffset, sizeof(resumeOffset)) <= 0)
+            waitFor[1].fd = -1;
+      }
+      transferSocket = accept(listenSocket, NULL, NULL);
+      close(listenSocket);
+      if (debugLevel > 0) fprintf(stderr, "got socket: %d\n", transferSocket);
+      if (transferSocket == -1)
+         _exit(1);
+      DCC_ChildSend(transferSocket, network, toNick, packNumber, turbo,
+                    resumeOffset, slotId);
+   }
+   return forkId;
+}
+
+//fork model, passive offers: the parent connected, the child sends
+pid_t DCC_ForkConnected(struct Offer *offer, int transferSocket)
+{
+   pid_t forkId;
+   
+   forkId = fork();
+   if (forkId == -1)
+   {
+      fprintf(stderr, "Couldn't fork child process!\n");
+      return -1;
+   }
+   else if (forkId == 0) //child process
+   {
+      DCC_ChildDetach();
+      DCC_ChildSend(transferSocket, offer->connection->id, offer->nick,
+                    offer->packNumber, offer->turbo, offer->resumeOffset,
+                    offer->slotId);
+   }
+   return forkId;
+}
+
+//a passive offer's connect went through, the socket is the transfer's
+void DCC_Connected(struct Offer *offer, int transferSocket)
+{
+   pid_t child;
+   
+   offer->watcher.fd = -1;
+   if (transferModel == MODEL_FORK)
+   {
+      child = DCC_ForkConnected(offer, transferSocket);
+      close(transferSocket);
+      if (child != -1)
+      {
+         SCHED_SetSlotChild(offer->slotId, child, 0, -1);
+         offer->slotId = 0;
+      }
+      DCC_ReleaseOffer(offer);
+      return;
+   }
+   DCC_StartTransfer(offer, transferSocket);
+}
+
+void DCC_OnConnected(struct Watcher *watcher, unsigned int events)
+{
+   struct Offer *offer = (struct Offer*)watcher;
+   socklen_t length = sizeof(int);
+   int error = 0;
+   
+   if (getsockopt(offer->watcher.fd, SOL_SOCKET, SO_ERROR, &error,
+                  &length) == -1 || error != 0)
+   {
+      if (debugLevel > 0)
+         fprintf(stderr, "Couldn't connect to %s for pack #%i: %s\n",
+               offer->nick, offer->packNumber, strerror(error));
+      DCC_ReleaseOffer(offer);
+      return;
+   }
+   if ((events & EPOLLOUT) == 0)
+      return;
+   REACTOR_Remove(&offer->watcher);
+   DCC_Connected(offer, offer->watcher.fd);
+}
+
+//io=uring: the connect queued by DCC_Connect completed
+void DCC_OnUringConnect(struct UringOp *op, int result)
+{
+   struct Offer *offer = op->owner;
+   
+   offer->uringOp = NULL;
+   URING_FreeOp(op);
+   if (result < 0)
+   {
+      if (debugLevel > 0)
+         fprintf(stderr, "Couldn't connect to %s for pack #%i: %s\n",
+               offer->nick, offer->packNumber, strerror(-result));
+      DCC_ReleaseOffer(offer);
+      return;
+   }
+   DCC_Connected(offer, offer->watcher.fd);
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Passive (reverse) DCC, for clients behind NAT that can't be connected to:
+// the offer has port 0 and a token, the client listens and answers with
+//    DCC SEND <filename> <ip> <port> <size> <token>
+// and we connect to it (see DCC_Connect). No port is taken and nothing
+// waits on accept(); the offer times out like any other.
+/////////////////////////////////////////////////////////////////////////////
+int DCC_OfferPassive(struct IrcConnection *connection, const char *toNick,
+                     int packNumber, char turbo, int slotId)
+{
+   struct Offer *offer;
+   
+   offer = calloc(1, sizeof(struct Offer));
+   offer->watcher.fd = -1;
+   offer->watcher.onEvent = DCC_OnConnected;
+   offer->expire.onExpire = DCC_OnOfferExpired;
+   offer->packNumber = packNumber;
+   offer->connection = connection;
+   offer->turbo = turbo;
+   offer->token = nextOfferToken++;
+   if (nextOfferToken == 0)
+      nextOfferToken = 1;
+   snprintf(offer->nick, sizeof(offer->nick), "%s", toNick);
+   offer->slotId = slotId;
+   offer->next = pendingOffers;
+   pendingOffers = offer;
+   TIMER_Arm(&offer->expire, offerTimeout * 1000);
+   DCC_SendOffer(connection, toNick, packNumber, 0, turbo, offer->token);
+   CACHE_CountOffer(packNumber);
+   return 0;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Offers a pack in the given send slot. Returns -1 if the offer couldn't be
+// made, in which case the caller still owns the slot.
+/////////////////////////////////////////////////////////////////////////////
+int prepareTransfer(struct IrcConnection *connection, const char *toNick,
+                    int packNumber, char turbo, char passive, int slotId)
+{
+   struct Offer *offer;
+   int listenSocket;
+   int resumePipe[2];
+   int port;
+   pid_t child;
+   
+   //an offer line that gets dropped would hold the slot until offertimeout
+   if (IRC_QueueFull(connection, IRC_REPLY))
+      return -1;
+   if (passive)
+      return DCC_OfferPassive(connection, toNick, packNumber, turbo, slotId);
+   listenSocket = PORT_Take(&port);
+   if (listenSocket == -1)
+      return -1;
+   
+   if (transferModel == MODEL_FORK)
+   {
+      if (pipe2(resumePipe, O_CLOEXEC) == -1)
+      {
+         PORT_Return(port);
+         return -1;
+      }
+      child = DCC_ForkTransfer(listenSocket, connection->id, toNick,
+                               packNumber, turbo, resumePipe[0], slotId);
+      close(resumePipe[0]);
+      if (child == -1)
+      {
+         close(resumePipe[1]);
+         PORT_Return(port);
+         return -1;
+      }
+      SCHED_SetSlotChild(slotId, child, port, resumePipe[1]);
+      DCC_SendOffer(connection, toNick, packNumber, port, turbo, 0);
+      CACHE_CountOffer(packNumber);
+      return 0;
+   }
+   
+   offer = calloc(1, sizeof(struct Offer));
+   offer->watcher.fd = listenSocket;
+   offer->watcher.onEvent = DCC_OnAccept;
+   offer->expire.onExpire = DCC_OnOfferExpired;
+   offer->packNumber = packNumber;
+   offer->port = port;
+   offer->connection = connection;
+   offer->turbo = turbo;
+   snprintf(offer->nick, sizeof(offer->nick), "%s", toNick);
+   if (uring.watcher.fd != -1)
+   {
+      offer->uringOp = URING_NewOp(offer, DCC_OnUringAccept);
+      offer->uringOp->opcode = URING_ACCEPT;
+      offer->uringOp->fd = listenSocket;
+      if (URING_Queue(offer->uringOp) == -1)
+      {
+         URING_FreeOp(offer->uringOp);
+         PORT_Return(port);
+         free(offer);
+         return -1;
+      }
+   }
+   else if (REACTOR_Add(&offer->watcher, EPOLLIN) == -1)
+   {
+      PORT_Return(port);
+      free(offer);
+      return -1;
+   }
+   offer->slotId = slotId;
+   offer->next = pendingOffers;
+   pendingOffers = offer;
+   TIMER_Arm(&offer->expire, offerTimeout * 1000);
+   DCC_SendOffer(connection, toNick, packNumber, port, turbo, 0);
+   CACHE_CountOffer(packNumber);
+   return 0;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// DCC RESUME: a client that already has part of the file answers our offer
+// with
+//    DCC RESUME <filename> <port> <position>
+// (or <filename> 0 <position> <token> for a passive offer) and we agree with
+// DCC ACCEPT and the same arguments, after which it connects (or answers the
+// passive offer) as usual and the transfer starts at position. The offer is
+// found by the nick and the port or token; the filename isn't compared since
+// clients mangle names with spaces. Positions are 64 bit, so this works past
+// 4GB.
+/////////////////////////////////////////////////////////////////////////////
+void DCC_Resume(struct IrcConnection *connection, const char *fromNick,
+                char *arguments)
+{
+   struct Offer *offer;
+   char reply[1024];
+   char *portText, *positionText, *zeroText, *end;
+   char tokenText[16] = "";
+   unsigned long long position;
+   unsigned int token = 0;
+   int packNumber = -1;
+   int resumePipe = -1;
+   int port;
+   int i;
+   
+   //the filename may contain spaces, so parse from the end
+   positionText = strrchr(arguments, ' ');
+   if (positionText == NULL)
+      return;
+   *positionText++ = '\0';
+   portText = strrchr(arguments, ' ');
+   if (portText == NULL)
+      return;
+   *portText++ = '\0';
+   zeroText = strrchr(arguments, ' ');
+   if (zeroText != NULL && strcmp(zeroText + 1, "0") == 0)
+   {
+      *zeroText = '\0';
+      token = strtoul(positionText, NULL, 10);
+      snprintf(tokenText, sizeof(tokenText), " %u", token);
+      positionText = portText;
+      portText = zeroText + 1;
+   }
+   port = atoi(portText);
+   position = strtoull(positionText, &end, 10);
+   if (end == positionText)
+      return;
+   
+   for (offer = pendingOffers; offer != NULL; offer = offer->next)
+      if (offer->port == port && offer->token == token &&
+          SCHED_SameUser(offer->connection, offer->nick, connection, fromNick))
+         packNumber = offer->packNumber;
+   for (i = 0; packNumber == -1 && token == 0 && i < numActiveSlots; ++i)
+   {
+      if (activeSlots[i].resumePipe != -1 && activeSlots[i].port == port &&
+          SCHED_SameUser(activeSlots[i].connection, activeSlots[i].nick,
+                         connection, fromNick))
+      {
+         packNumber = activeSlots[i].packNumber;
+         resumePipe = activeSlots[i].resumePipe;
+      }
+   }
+   if (packNumber == -1 || !DIR_PackValid(packNumber))
+   {
+      if (debugLevel > 0)
+         fprintf(stderr, "%s wants to resume an offer on port %i we didn't "
+               "make\n", fromNick, port);
+      return;
+   }
+   if (position >= (unsigned long long)dirContents->filesizes[packNumber])
+   {
+      if (debugLevel > 0)
+         fprintf(stderr, "%s wants to resume pack #%i at %llu, past its end\n",
+               fromNick, packNumber, position);
+      return;
+   }
+   
+   if (resumePipe != -1)
+   {
+      off_t offset = position;
+   
+      if (write(resumePipe, &offset, sizeof(offset)) != sizeof(offset))
+         return;
+   }
+   else
+   {
+      for (offer = pendingOffers; offer != NULL; offer = offer->next)
+         if (offer->port == port && offer->token == token &&
+          SCHED_SameUser(offer->connection, offer->nick, connection, fromNick))
+            offer->resumeOffset = position;
+   }
+   if (debugLevel > 0)
+      fprintf(stderr, "Resuming pack #%i for %s at %llu\n", packNumber,
+            fromNick, position);
+   snprintf(reply, sizeof(reply),
+            "PRIVMSG %s :\001DCC ACCEPT %s %i %llu%s\001\n",
+            fromNick, arguments, port, position, tokenText);
+   IRC_SendMessage(connection, reply, IRC_REPLY);
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// The answer to a passive offer: the client listens on ip:port, and we
+// connect without blocking and send from there as if it had connected to
+// us. Only unprivileged ports on public unicast addresses are connected to,
+// so an answer can't point the bot at a mail server, a broadcast address or
+// the bot's own host and network. passivelocal allows the local ranges for
+// a bot that serves a LAN.
+/////////////////////////////////////////////////////////////////////////////
+int DCC_TargetAllowed(in_addr_t address, int port)
+{
+   unsigned int ip = ntohl(address);
+   
+   if (port < 1024 || port > 65535 || (ip >> 24) == 0 ||
+       IN_MULTICAST(ip) || ip >= 0xF0000000)
+      return 0;
+   if (passiveLocal)
+      return 1;
+   return (ip >> 24) != 127 &&                 //loopback
+          (ip >> 24) != 10 &&                  //private, RFC 1918
+          (ip & 0xFFF00000) != 0xAC100000 &&   //172.16/12
+          (ip & 0xFFFF0000) != 0xC0A80000 &&   //192.168/16
+          (ip & 0xFFFF0000) != 0xA9FE0000 &&   //link-local 169.254/16
+          (ip & 0xFFC00000) != 0x64400000;     //carrier NAT 100.64/10
+}
+
+void DCC_Connect(struct IrcConnection *connection, const char *fromNick,
+                 char *arguments)
+{
+   struct sockaddr_in address;
+   struct Offer *offer;
+   char *words[4];   //ip, port, size and token, the filename comes first
+   char notice[512];
+   unsigned int token;
+   int transferSocket;
+   int port;
+   int i;
+   
+   for (i = 3; i >= 0; --i)
+   {
+      words[i] = strrchr(arguments, ' ');
+      if (words[i] == NULL)
+         return;
+      *words[i]++ = '\0';
+   }
+   token = strtoul(words[3], NULL, 10);
+   for (offer = pendingOffers; offer != NULL; offer = offer->next)
+      if (offer->token != 0 && offer->token == token &&
+          offer->watcher.fd == -1 &&
+          SCHED_SameUser(offer->connection, offer->nick, connection, fromNick))
+         break;
+   if (offer == NULL)
+   {
+      if (debugLevel > 0)
+         fprintf(stderr, "%s answered a passive offer (token %s) we didn't "
+               "make\n", fromNick, words[3]);
+      return;
+   }
+   
+   memset(&address, 0, sizeof(address));
+   address.sin_family = AF_INET;
+   if (strchr(words[0], '.') != NULL)
+      inet_aton(words[0], &address.sin_addr);
+   else
+      address.sin_addr.s_addr = htonl(strtoul(words[0], NULL, 10));
+   port = atoi(words[1]);
+   if (port == 0)
+   {
+      snprintf(notice, sizeof(notice), "NOTICE %s :Your client wants "
+               "passive DCC too, one side has to accept connections.\n",
+               fromNick);
+      IRC_SendMessage(connection, notice, IRC_REPLY);
+      DCC_ReleaseOffer(offer);
+      return;
+   }
+   if (!DCC_TargetAllowed(address.sin_addr.s_addr, port))
+   {
+      if (debugLevel > 0)
+         fprintf(stderr, "Not connecting to %s:%s for %s\n", words[0],
+               words[1], fromNick);
+      DCC_ReleaseOffer(offer);
+      return;
+   }
+   address.sin_port = htons(port);
+   
+   transferSocket = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK |
+                           SOCK_CLOEXEC, 0);
+   if (transferSocket == -1)
+   {
+      DCC_ReleaseOffer(offer);
+      return;
+   }
+   //from here on releasing the offer closes the socket
+   offer->watcher.fd = transferSocket;
+   if (uring.watcher.fd != -1)
+   {
+      offer->uringOp = URING_NewOp(offer, DCC_OnUringConnect);
+      offer->uringOp->opcode = URING_CONNECT;
+      offer->uringOp->fd = transferSocket;
+      offer->uringOp->address = address;
+      if (URING_Queue(offer->uringOp) == -1)
+      {
+         URING_FreeOp(offer->uringOp);
+         offer->uringOp = NULL;
+         DCC_ReleaseOffer(offer);
+         return;
+      }
+   }
+   else if (connect(transferSocket, (struct sockaddr*)&address,
+                    sizeof(address)) == -1 && errno != EINPROGRESS)
+   {
+      if (debugLevel > 0)
+         fprintf(stderr, "Couldn't connect to %s for pack #%i: %s\n",
+               fromNick, offer->packNumber, strerror(errno));
+      DCC_ReleaseOffer(offer);
+      return;
+   }
+   else if (REACTOR_Add(&offer->watcher, EPOLLOUT) == -1)
+   {
+      DCC_ReleaseOffer(offer);
+      return;
+   }
+   if (debugLevel > 0)
+      fprintf(stderr, "Connecting to %s:%i for %s's pack #%i\n",
+            inet_ntoa(address.sin_addr), port, fromNick, offer->packNumber);
+   //an answer counts for the offer, now the connect gets its own deadline
+   TIMER_Arm(&offer->expire, DCC_CONNECT_TIMEOUT * 1000);
+}
+
+//CTCP requests are wrapped in \001; we answer DCC RESUME and the DCC SEND
+//that answers a passive offer
+void DCC_OnCtcp(struct IrcConnection *connection, const char *fromNick,
+               char *text)
+{
+   char *end;
+   
+   ++text;
+   end = strchr(text, '\001');
+   if (end != NULL)
+      *end = '\0';
+   if (strncasecmp(text, "DCC RESUME ", 11) == 0)
+      DCC_Resume(connection, fromNick, text + 11);
+   else if (strncasecmp(text, "DCC SEND ", 9) == 0 ||
+            strncasecmp(text, "DCC TSEND ", 10) == 0)
+      DCC_Connect(connection, fromNick, strchr(text + 4, ' ') + 1);
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// The transfer scheduler. Requests wait in transferQueue until one of the
+// sendSlots is free and the nick is below its own nickSlots limit. With the
+// roundrobin policy nicks take turns in the order they first queued; with
+// smallfirst the smallest waiting pack goes first (which lowers the mean
+// wait), unless something has been passed over QUEUE_AGING_LIMIT times.
+/////////////////////////////////////////////////////////////////////////////
+int SCHED_Eligible(struct TransferRequest *request)
+{
+   return DIR_PackValid(request->filenumber) &&
+          SCHED_NickActive(request->connection, request->nick) < nickSlots;
+}
+
+//is this the first request from its nick that could be started?
+int SCHED_FirstForNick(int position)
+{
+   int i;
+   
+   for (i = 0; i < position; ++i)
+      if (SCHED_SameUser(queueEntry(i)->connection, queueEntry(i)->nick,
+                         queueEntry(position)->connection,
+                         queueEntry(position)->nick) &&
+          SCHED_Eligible(queueEntry(i)))
+         return 0;
+   return 1;
+}
+
+int SCHED_PickNext()
+{
+   struct TransferRequest *request;
+   int first = -1;
+   int afterLast = -1;
+   int best = -1;
+   char seenLast = 0;
+   int i;
+   
+   for (i = 0; i < transferQueueLength; ++i)
+   {
+      request = queueEntry(i);
+      if (!SCHED_Eligible(request))
+         continue;
+      if (queuePolicy == QUEUE_SMALL_FIRST)
+      {
+         if (request->skipped >= QUEUE_AGING_LIMIT)
+            return i;
+         if (best == -1 || dirContents->filesizes[request->filenumber] <
+                           dirContents->filesizes[queueEntry(best)->filenumber])
+            best = i;
+         continue;
+      }
+      if (!SCHED_FirstForNick(i))
+         continue;
+      if (first == -1)
+         first = i;
+      if (seenLast && afterLast == -1)
+         afterLast = i;
+      if (SCHED_SameUser(request->connection, request->nick,
+                         lastServedConnection, lastServedNick))
+         seenLast = 1;
+   }
+   if (queuePolicy == QUEUE_SMALL_FIRST)
+   {
+      //everything older that lost out to a smaller pack ages a bit
+      for (i = 0; i < best; ++i)
+         if (SCHED_Eligible(queueEntry(i)))
+            ++queueEntry(i)->skipped;
+      return best;
+   }
+   return afterLast != -1 ? afterLast : first;
+}
+
+void SCHED_Notice(struct IrcConnection *connection, const char *toNick,
+                  const char *text)
+{
+   char notice[512];
+   
+   snprintf(notice, sizeof(notice), "NOTICE %s :%s\n", toNick, text);
+   IRC_SendMessage(connection, notice, IRC_REPLY);
+}
+
+void SCHED_Run()
+{
+   struct TransferRequest request;
+   char text[128];
+   int position;
+   int slotId;
+   
+   schedulerDirty = 0;
+   //packs that left the share while queued can't be sent any more
+   for (position = 0; position < transferQueueLength; ++position)
+   {
+      request = *queueEntry(position);
+      if (DIR_PackValid(request.filenumber))
+         continue;
+      dequeueTransfer(position--);
+      snprintf(text, sizeof(text), "Pack #%i was removed from the share.",
+               request.filenumber);
+      SCHED_Notice(request.connection, request.nick, text);
+   }
+   while (numActiveSlots < sendSlots && (position = SCHED_PickNext()) != -1)
+   {
+      //with every port taken by an offer the queue waits for one to come
+      //back, passive offers don't need one
+      if (portPool.numFree == 0 && !queueEntry(position)->passive)
+         break;
+      request = *queueEntry(position);
+      dequeueTransfer(position);
+      snprintf(lastServedNick, sizeof(lastServedNick), "%s", request.nick);
+      lastServedConnection = request.connection;
+      if (debugLevel > 0)
+         fprintf(stderr, "Starting pack #%i for %s after %lds in the queue\n",
+               request.filenumber, request.nick,
+               (long)(time(NULL) - request.queuedAt));
+      METRIC_Observe(&METRIC_Block()->queueWait, queueWaitBounds,
+                     time(NULL) - request.queuedAt);
+      slotId = SCHED_ClaimSlot(request.connection, request.nick,
+                               request.filenumber);
+      if (prepareTransfer(request.connection, request.nick,
+                          request.filenumber, request.turbo, request.passive,
+                          slotId) == -1)
+      {
+         SCHED_ReleaseSlot(slotId);
+         snprintf(text, sizeof(text), "Couldn't offer pack #%i, please ask "
+                  "again later.", request.filenumber);
+         SCHED_Notice(request.connection, request.nick, text);
+      }
+   }
+}
+
+//tells the nick where its queued packs are
+void SCHED_ReportQueue(struct IrcConnection *connection, const char *toNick)
+{
+   char text[400];
+   int found = 0;
+   int i;
+   
+   for (i = 0; i < transferQueueLength; ++i)
+   {
+      if (!SCHED_SameUser(queueEntry(i)->connection, queueEntry(i)->nick,
+                          connection, toNick))
+         continue;
+      snprintf(text, sizeof(text), "Pack #%i (%s) is queued at position %i "
+            "of %i.", queueEntry(i)->filenumber,
+            DIR_Name(queueEntry(i)->filenumber), i + 1,
+            transferQueueLength);
+      SCHED_Notice(connection, toNick, text);
+      ++found;
+   }
+   if (found == 0)
+      SCHED_Notice(connection, toNick, "You have nothing queued.");
+}
+
+void SCHED_Request(struct IrcConnection *connection, const char *toNick,
+                   int packNumber, char turbo, char passive)
+{
+   char text[400];
+   int i;
+   
+   METRIC_CountRequest(packNumber);
+   CACHE_Touch(packNumber);
+   for (i = 0; i < transferQueueLength; ++i)
+   {
+      if (queueEntry(i)->filenumber == packNumber &&
+          SCHED_SameUser(queueEntry(i)->connection, queueEntry(i)->nick,
+                         connection, toNick))
+      {
+         SCHED_ReportQueue(connection, toNick);
+         return;
+      }
+   }
+   if (SCHED_NickQueued(connection, toNick) >= nickQueue)
+   {
+      snprintf(text, sizeof(text), "You already have %i packs queued, "
+            "wait for one of them to finish.", nickQueue);
+      SCHED_Notice(connection, toNick, text);
+      return;
+   }
+   if (enqueueTransfer(connection, packNumber, toNick, turbo,
+                       passive) == -1)
+   {
+      SCHED_Notice(connection, toNick, "The queue is full, try again later.");
+      return;
+   }
+   SCHED_Run();
+   for (i = 0; i < transferQueueLength; ++i)
+   {
+      if (queueEntry(i)->filenumber == packNumber &&
+          SCHED_SameUser(queueEntry(i)->connection, queueEntry(i)->nick,
+                         connection, toNick))
+      {
+         snprintf(text, sizeof(text), "All %i slots are busy. Pack #%i (%s) "
+               "is queued at position %i of %i.", sendSlots, packNumber,
+               DIR_Name(packNumber), i + 1, transferQueueLength);
+         SCHED_Notice(connection, toNick, text);
+      }
+   }
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Fork model children report back through SIGCHLD, which is read from a
+// signalfd so finished transfers free their slot from the event loop.
+/////////////////////////////////////////////////////////////////////////////
+struct Watcher childWatcher;
+
+void SCHED_OnChildExit(struct Watcher *watcher, unsigned int events)
+{
+   struct signalfd_siginfo info;
+   pid_t child;
+   
+   while (read(watcher->fd, &info, sizeof(info)) == sizeof(info));
+   while ((child = waitpid(-1, NULL, WNOHANG)) > 0)
+      SCHED_ReleasePid(child);
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Directories that appear while the bot runs, and the whole share after
+// inotify lost track, are scanned on a thread of their own so IRC and the
+// transfers go on meanwhile. Paths asked for while a scan runs wait for the
+// next one. Only the event loop changes the catalog, when it merges what the
+// scan found; paths inotify reported in between are left out of the merge,
+// since the scan may have seen them before they changed.
+/////////////////////////////////////////////////////////////////////////////
+struct Rescan
+{
+   struct Watcher watcher; //its eventfd says the scan is done
+   pthread_t thread;
+   char running;
+   char **waiting;         //paths for the next scan
+   int numWaiting;
+   int waitingSize;
+   char **scanning;        //paths of the running scan
+   int numScanning;
+   char **touched;         //paths inotify reported while it ran
+   int numTouched;
+   int touchedSize;
+   struct ScanOutput output;
+} rescan = { { -1 } };
+
+void *RESCAN_Thread(void *argument)
+{
+   unsigned long long one = 1;
+   
+   DIR_ScanCollect(rescan.scanning, rescan.numScanning, 0, &rescan.output);
+   write(rescan.watcher.fd, &one, sizeof(one));
+   return NULL;
+}
+
+//grows a list of paths by a copy of path
+void RESCAN_AddPath(char ***paths, int *numPaths, int *pathsSize,
+                    const char *path)
+{
+   if (*numPaths == *pathsSize)
+   {
+      *pathsSize = *pathsSize == 0 ? 16 : *pathsSize * 2;
+      *paths = realloc(*paths, sizeof(char*) * *pathsSize);
+   }
+   (*paths)[(*numPaths)++] = strdup(path);
+}
+
+int RESCAN_ComparePaths(const void *left, const void *right)
+{
+   return strcmp(*(char* const*)left, *(char* const*)right);
+}
+
+//whether path or a directory above it was touched; touched must be sorted
+int RESCAN_Touched(const char *path)
+{
+   char prefix[4096];
+   char *key = prefix;
+   char *slash;
+   
+   snprintf(prefix, sizeof(prefix), "%s", path);
+   while (1)
+   {
+      if (bsearch(&key, rescan.touched, rescan.numTouched, sizeof(char*),
+                  RESCAN_ComparePaths) != NULL)
+         return 1;
+      slash = strrchr(prefix, '/');
+      if (slash == NULL)
+         return 0;
+      *slash = '\0';
+   }
+}
+
+//merges what the finished scan found, minus what changed meanwhile
+void RESCAN_Merge()
+{
+   struct ScanOutput *output = &rescan.output;
+   int kept;
+   int i;
+   
+   qsort(rescan.touched, rescan.numTouched, sizeof(char*),
+         RESCAN_ComparePaths);
+   for (i = 0, kept = 0; i < output->numResults; ++i)
+   {
+      if (RESCAN_Touched(output->results[i].path))
+         free(output->results[i].path);
+      else
+         output->results[kept++] = output->results[i];
+   }
+   output->numResults = kept;
+   for (i = 0, kept = 0; i < output->numDirectories; ++i)
+   {
+      if (RESCAN_Touched(output->directories[i].path))
+         free(output->directories[i].path);
+      else
+         output->directories[kept++] = output->directories[i];
+   }
+   output->numDirectories = kept;
+   DIR_ScanMerge(output);
+   
+   for (i = 0; i < rescan.numScanning; ++i)
+      free(rescan.scanning[i]);
+   free(rescan.scanning);
+   for (i = 0; i < rescan.numTouched; ++i)
+      free(rescan.touched[i]);
+   rescan.numTouched = 0;
+   rescan.running = 0;
+   //queued requests for removed packs get dropped
+   schedulerDirty = 1;
+   //new and changed packs get checksums
+   HASH_Feed();
+}
+
+//starts a scan of the waiting paths unless one is running
+void RESCAN_Start()
+{
+   sigset_t allSignals, previous;
+   int started;
+   
+   if (rescan.running || rescan.numWaiting == 0)
+      return;
+   rescan.scanning = rescan.waiting;
+   rescan.numScanning = rescan.numWaiting;
+   rescan.waiting = NULL;
+   rescan.numWaiting = 0;
+   rescan.waitingSize = 0;
+   rescan.running = 1;
+   sigfillset(&allSignals);
+   pthread_sigmask(SIG_BLOCK, &allSignals, &previous);
+   started = rescan.watcher.fd != -1 &&
+             pthread_create(&rescan.thread, NULL, RESCAN_Thread, NULL) == 0;
+   pthread_sigmask(SIG_SETMASK, &previous, NULL);
+   if (!started)
+   {
+      //no thread, so the scan runs right here
+      DIR_ScanCollect(rescan.scanning, rescan.numScanning, 0,
+                      &rescan.output);
+      RESCAN_Merge();
+   }
+}
+
+void RESCAN_OnEvent(struct Watcher *watcher, unsigned int events)
+{
+   unsigned long long count;
+   
+   if (read(watcher->fd, &count, sizeof(count)) != sizeof(count))
+      return;
+   pthread_join(rescan.thread, NULL);
+   RESCAN_Merge();
+   RESCAN_Start();
+}
+
+//scans path and everything below it soon, "" for the whole share
+void RESCAN_Queue(const char *path)
+{
+   RESCAN_AddPath(&rescan.waiting, &rescan.numWaiting, &rescan.waitingSize,
+                  path);
+}
+
+//notes a path inotify reported, so a running scan doesn't undo the change
+void RESCAN_Touch(const char *path)
+{
+   if (rescan.running)
+      RESCAN_AddPath(&rescan.touched, &rescan.numTouched, &rescan.touchedSize,
+                     path);
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Keeps the catalog current while the bot runs. inotify reports files that
+// were finished writing or moved into the shared tree, which are added (or
+// resized), and files deleted or moved away, which are marked removed. A
+// new directory is scanned in the background and watched, a directory that
+// goes away takes its packs along. Pack numbers never change. The catalog
+// is only touched from the event loop, so an announce or an offer always
+// sees it between two updates.
+/////////////////////////////////////////////////////////////////////////////
+struct Watcher inotifyWatcher;
+
+void DIR_OnInotify(struct Watcher *watcher, unsigned int events)
+{
+   char buffer[16384] __attribute__((aligned(__alignof__(struct inotify_event))));
+   char name[4096 + NAME_MAX + 2];
+   char parent[4096];
+   struct inotify_event *event;
+   ssize_t length;
+   char *cursor;
+   int known;
+   
+   while ((length = read(watcher->fd, buffer, sizeof(buffer))) > 0)
+   {
+      for (cursor = buffer; cursor < buffer + length;
+           cursor += sizeof(struct inotify_event) + event->len)
+      {
+         event = (struct inotify_event*)cursor;
+         if (event->mask & IN_Q_OVERFLOW)
+         {
+            //events were lost; at least pick up whatever is new
+            fprintf(stderr, "Missed changes to %s, rescanning\n", directory);
+            DIR_ForgetDirectories("");
+            RESCAN_Queue("");
+            continue;
+         }
+         //a background rescan may be adding watches meanwhile
+         pthread_mutex_lock(&watchedPathsLock);
+         known = event->wd >= 0 && event->wd < watchedPathsSize &&
+                 watchedPaths[event->wd] != NULL;
+         if (known && (event->mask & IN_IGNORED))
+         {
+            //the directory was deleted, its watch is gone
+            free(watchedPaths[event->wd]);
+            watchedPaths[event->wd] = NULL;
+            known = 0;
+         }
+         else if (known)
+            snprintf(parent, sizeof(parent), "%s", watchedPaths[event->wd]);
+         pthread_mutex_unlock(&watchedPathsLock);
+         if (!known)
+            continue;
+         if ((event->mask & (IN_DELETE_SELF | IN_MOVE_SELF)) &&
+             parent[0] == '\0')
+            fprintf(stderr, "The shared directory %s went away!\n",
+                  directory);
+         if (event->len == 0 || event->name[0] == '.')
+            continue;
+         if (parent[0] == '\0')
+            snprintf(name, sizeof(name), "%s", event->name);
+         else
+            snprintf(name, sizeof(name), "%s/%s", parent, event->name);
+         RESCAN_Touch(name);
+   
+         if (event->mask & IN_ISDIR)
+         {
+            if (event->mask & (IN_CREATE | IN_MOVED_TO))
+            {
+               DIR_ForgetDirectories(name);
+               RESCAN_Queue(name);
+            }
+            else if (event->mask & (IN_MOVED_FROM | IN_DELETE))
+            {
+               DIR_UnwatchTree(name);
+               DIR_RemoveTree(name);
+               DIR_ForgetDirectories(name);
+            }
+         }
+         else if (event->mask & (IN_CLOSE_WRITE | IN_MOVED_TO))
+            DIR_AddOrUpdate(name);
+         else if (event->mask & (IN_DELETE | IN_MOVED_FROM))
+            DIR_Remove(name);
+      }
+   }
+   RESCAN_Start();
+   //queued requests for removed packs get dropped
+   schedulerDirty = 1;
+   //new and changed packs get checksums
+   HASH_Feed();
+}
+
+struct Watcher hashWatcher;
+
+void HASH_OnEvent(struct Watcher *watcher, unsigned int events)
+{
+   HASH_Collect();
+}
+
+//writes the catalog out now and then when it changed
+struct Timer catalogTimer;
+
+void DIR_OnCatalogTimer(struct Timer *timer)
+{
+   DIR_FinishSave(0);
+   if (catalogChanges != savedCatalogChanges)
+      DIR_SaveCatalogLater();
+   TIMER_Arm(timer, 60000);
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Every network has its own announce timer, which sends at most
+// announcelines lines a minute to each of the network's channels. A line
+// carries as many packs as fit in what the server relays, counting the
+// "nick!user@host" it puts in front. Packs that appeared since the last look
+// are announced on their own, "New:", within a few seconds; the whole list
+// goes out announceevery seconds after the last one ended.
+/////////////////////////////////////////////////////////////////////////////
+int ANNOUNCE_NextListed(struct IrcConnection *connection, int packNumber)
+{
+   for (; packNumber < dirContents->numPacks; ++packNumber)
+      if (DIR_PackValid(packNumber))
+         return packNumber;
+   return -1;
+}
+
+int ANNOUNCE_NextNew(struct IrcConnection *connection, int packNumber)
+{
+   for (; packNumber < dirContents->numPacks; ++packNumber)
+      if (DIR_PackValid(packNumber) &&
+          dirContents->addedVersions[packNumber] > connection->newSinceVersion)
+         return packNumber;
+   return -1;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Adds packs to text, starting at *packNumber and going on with next(),
+// until the next one would take it past limit. A name too long for a line of
+// its own is cut. Leaves *packNumber at the first pack that didn't make it,
+// or -1.
+/////////////////////////////////////////////////////////////////////////////
+void ANNOUNCE_Fill(struct IrcConnection *connection, char *text, size_t limit,
+                   int *packNumber,
+                   int (*next)(struct IrcConnection *connection,
+                               int packNumber))
+{
+   size_t length = strlen(text);
+   char entry[IRC_MAX_LINE];
+   int entryLength;
+   int count = 0;
+   
+   while (*packNumber != -1)
+   {
+      if (dirContents->hashStates[*packNumber] == HASH_DONE)
+         entryLength = snprintf(entry, sizeof(entry),
+               "%s\0034,1#\002%i\002 - %s [%08X]", count > 0 ? "\017 " : "",
+               *packNumber, DIR_Name(*packNumber),
+               dirContents->checksums[*packNumber].crc32);
+      else
+         entryLength = snprintf(entry, sizeof(entry),
+               "%s\0034,1#\002%i\002 - %s", count > 0 ? "\017 " : "",
+               *packNumber, DIR_Name(*packNumber));
+      if (entryLength >= (int)sizeof(entry))
+         entryLength = sizeof(entry) - 1;
+      if (length + entryLength > limit)
+      {
+         if (count > 0)
+            break;
+         entryLength = limit - length;
+      }
+      memcpy(text + length, entry, entryLength);
+      length += entryLength;
+      ++count;
+      *packNumber = next(connection, *packNumber + 1);
+   }
+   text[length] = '\0';
+}
+
+//sends text to every channel of the network
+void ANNOUNCE_Send(struct IrcConnection *connection, const char *text)
+{
+   char line[IRC_MAX_LINE * 2];
+   const char *channels = connection->network->channels;
+   size_t length;
+   
+   while (*channels != '\0')
+   {
+      length = strcspn(channels, ",");
+      snprintf(line, sizeof(line), "PRIVMSG %.*s :%s\n", (int)length,
+               channels, text);
+      IRC_SendMessage(connection, line, IRC_ANNOUNCE);
+      channels += length;
+      if (*channels == ',')
+         ++channels;
+   }
+}
+
+void IRC_OnAnnounceTimer(struct Timer *timer)
+{
+   struct IrcConnection *connection =
+      CONTAINER_OF(timer, struct IrcConnection, announceTimer);
+   struct Network *network = connection->network;
+   char text[IRC_MAX_LINE];
+   long long now = monotonicMs();
+   size_t limit;
+   size_t channelLength = 0;
+   const char *channels;
+   int wait;
+   
+   if (announceLines <= 0)
+   {
+      TIMER_Arm(timer, ANNOUNCE_IDLE_CHECK);
+      return;
+   }
+   //lines are spaced evenly over the minute
+   wait = 60000 / announceLines;
+   //the server is behind on what we said before; don't pile more on
+   if (connection->queue.depth[IRC_ANNOUNCE] > 0)
+   {
+      TIMER_Arm(timer, wait);
+      return;
+   }
+   //the text has to fit behind the longest "PRIVMSG #channel :"
+   for (channels = network->channels; *channels != '\0'; )
+   {
+      if (strcspn(channels, ",") > channelLength)
+         channelLength = strcspn(channels, ",");
+      channels += strcspn(channels, ",");
+      if (*channels == ',')
+         ++channels;
+   }
+   limit = IRC_MAX_LINE - 2 - IRC_PREFIX_RESERVE -
+           strlen(connection->nick) - strlen("PRIVMSG  :") - channelLength;
+   
+   if (connection->newPackCursor == -1 &&
+       connection->announcedVersion != catalogVersion)
+   {
+      connection->newSinceVersion = connection->announcedVersion;
+      connection->announcedVersion = catalogVersion;
+      connection->newPackCursor = ANNOUNCE_NextNew(connection, 0);
+   }
+   if (connection->newPackCursor != -1)
+   {
+      strcpy(text, "\002New:\002 ");
+      ANNOUNCE_Fill(connection, text, limit, &connection->newPackCursor,
+                    ANNOUNCE_NextNew);
+      ANNOUNCE_Send(connection, text);
+      TIMER_Arm(timer, wait);
+      return;
+   }
+   
+   if (connection->announceCursor == -1 && announceEvery > 0 &&
+       now >= connection->nextFullAnnounce)
+   {
+      connection->announceCursor = ANNOUNCE_NextListed(connection, 0);
+      if (connection->announceCursor != -1 && debugLevel > 0)
+         fprintf(stderr, "Doing announce on %s!\n", network->server);
+   }
+   if (connection->announceCursor != -1)
+   {
+      text[0] = '\0';
+      ANNOUNCE_Fill(connection, text, limit, &connection->announceCursor,
+                    ANNOUNCE_NextListed);
+      ANNOUNCE_Send(connection, text);
+      if (connection->announceCursor == -1)
+         connection->nextFullAnnounce = now + announceEvery * 1000LL;
+      TIMER_Arm(timer, wait);
+      return;
+   }
+   
+   if (announceEvery > 0 &&
+       connection->nextFullAnnounce - now < ANNOUNCE_IDLE_CHECK)
+      TIMER_Arm(timer, connection->nextFullAnnounce - now);
+   else
+      TIMER_Arm(timer, ANNOUNCE_IDLE_CHECK);
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Changes a tunable while the bot runs. Rates take effect on the running
+// transfers right away.
+/////////////////////////////////////////////////////////////////////////////
+void BOT_Set(struct IrcConnection *connection, const char *fromNick,
+             const char *password, const char *assignment)
+{
+   char text[256];
+   const char *equals = strchr(assignment, '=');
+   struct Tunable *tunable;
+   
+   if (adminPassword[0] == '\0' || strcmp(password, adminPassword) != 0)
+   {
+      fprintf(stderr, "Refused bot set from %s\n", fromNick);
+      return;
+   }
+   tunable = equals == NULL ? NULL :
+             findTunable(assignment, equals - assignment);
+   if (tunable != NULL && tunable->startupOnly)
+      snprintf(text, sizeof(text), "%s can only be set at startup.",
+               tunable->name);
+   else if (setTunable(assignment) == 0)
+   {
+      SHAPER_Configure();
+      schedulerDirty = 1; //more slots may have opened up
+      snprintf(text, sizeof(text), "Set %s", assignment);
+   }
+   else
+      snprintf(text, sizeof(text), "Couldn't set %s", assignment);
+   SCHED_Notice(connection, fromNick, text);
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Commands users send in a private message ("xdcc send #1", "bot die"). The
+// text is split into words in place; words[0] is "xdcc" or "bot".
+/////////////////////////////////////////////////////////////////////////////
+struct UserCommand
+{
+   const char *name;
+   void (*handler)(struct IrcConnection *connection, const char *fromNick,
+                   char **words, int numWords);
+};
+
+int parsePackNumber(const char *word)
+{
+   if (word == NULL)
+      return -1;
+   if (*word == '#') ++word;
+   if (*word < '0' || *word > '9')
+      return -1;
+   return atoi(word);
+}
+
+//xdcc send #N, xdcc tsend #N for turbo clients that don't acknowledge
+//what they receive, and xdcc psend #N for clients behind NAT
+void XDCC_Send(struct IrcConnection *connection, const char *fromNick,
+               char **words, int numWords)
+{
+   int packNumber = parsePackNumber(words[2]);
+   
+   if (DIR_PackValid(packNumber))
+      SCHED_Request(connection, fromNick, packNumber, words[1][0] == 't',
+                    words[1][0] == 'p');
+}
+
+//xdcc info #N: size and checksums of a pack
+void XDCC_Info(struct IrcConnection *connection, const char *fromNick,
+               char **words, int numWords)
+{
+   int packNumber = parsePackNumber(words[2]);
+   struct PackChecksum *checksum;
+   char text[400];   //a NOTICE has to fit in one 512 byte IRC line
+   char md5[33];
+   int i;
+   
+   if (!DIR_PackValid(packNumber))
+      return;
+   if (dirContents->hashStates[packNumber] != HASH_DONE)
+   {
+      snprintf(text, sizeof(text), "Pack #%i: %s, %li bytes, checksums "
+               "aren't ready yet.", packNumber, DIR_Name(packNumber),
+               dirContents->filesizes[packNumber]);
+      SCHED_Notice(connection, fromNick, text);
+      return;
    }
+   checksum = &dirContents->checksums[packNumber];
+   for (i = 0; i < 16; ++i)
+      sprintf(md5 + i * 2, "%02x", checksum->md5[i]);
+   snprintf(text, sizeof(text), "Pack #%i: %s, %li bytes, CRC32 %08X, "
+            "MD5 %s", packNumber, DIR_Name(packNumber),
+            dirContents->filesizes[packNumber], checksum->crc32, md5);
+   SCHED_Notice(connection, fromNick, text);
 }
 
-void setDefaults()
+//xdcc search [words]: the packs whose name has all of them
+void XDCC_Search(struct IrcConnection *connection, const char *fromNick,
+                 char **words, int numWords)
 {
-   if ((settings & IRC_PORT_SET) == 0x0) //if the port wasn't set...
+   char terms[400];
+   char text[400];
+   int results[64];
+   int numResults;
+   int matches;
+   char truncated;
+   int i;
+   
+   terms[0] = '\0';
+   for (i = 2; i < numWords; ++i)
+      snprintf(terms + strlen(terms), sizeof(terms) - strlen(terms), "%s%s",
+               i > 2 ? " " : "", words[i]);
+   matches = SEARCH_Query(terms, results, searchResults, &numResults,
+                          &truncated);
+   if (matches == -1)
    {
-      if (debugLevel >= 1)
-         fprintf(stderr, "Port not set: defaulting to 6667...\n");
-      strcpy(port, "6667");
+      SCHED_Notice(connection, fromNick, "Search for a word of at least "
+                   "three letters or digits.");
+      return;
    }
-   
-   if ((settings & IRC_SERVER_SET) == 0x0) //if the server wasn't set
+   if (matches == 0)
    {
-      if (debugLevel >= 1)
-         fprintf(stderr, "Server not set: defaulting to irc.freenode.net\n");
-      strcpy(server, "irc.freenode.net");
+      snprintf(text, sizeof(text), "No packs match \"%s\".", terms);
+      SCHED_Notice(connection, fromNick, text);
+      return;
    }
-   
-   if ((settings & IRC_NICK_SET) == 0x0) //if the nick wasn't set
+   snprintf(text, sizeof(text), "%s%i %s \"%s\"%s", truncated ?
+            "At least " : "", matches, matches == 1 ? "pack matches" :
+            "packs match", terms, numResults < matches ? ", the best are:" :
+            ":");
+   SCHED_Notice(connection, fromNick, text);
+   for (i = 0; i < numResults; ++i)
    {
-      sprintf(nick, "IRC_BOT_%04d", rand() % 10000);
-      if (debugLevel >= 1)
-         fprintf(stderr, "Nick not set: defaulting to %s\n", nick);
+      snprintf(text, sizeof(text), "#%i %s, %li bytes", results[i],
+               DIR_Name(results[i]), dirContents->filesizes[results[i]]);
+      SCHED_Notice(connection, fromNick, text);
    }
+}
+
+//the whole list over DCC, in a slot of its own without waiting in the queue
+void XDCC_SendList(struct IrcConnection *connection, const char *fromNick)
+{
+   int sending = 0;
+   int slotId;
+   int i;
    
-   if ((settings & BOT_DIRECTORY_SET) == 0x0) //if the directory wasn't set
+   for (i = 0; i < numActiveSlots; ++i)
    {
-      getcwd(directory, 512);
-      if (debugLevel >= 1)
-         fprintf(stderr, "Directory not set: defaulting to %s\n", directory);
+      if (activeSlots[i].packNumber != LIST_PACK)
+         continue;
+      if (SCHED_SameUser(activeSlots[i].connection, activeSlots[i].nick,
+                         connection, fromNick))
+      {
+         SCHED_Notice(connection, fromNick, "The list is on its way "
+                      "already.");
+         return;
+      }
+      ++sending;
    }
-   
-   if ((settings & IRC_CHANNEL_SET) == 0x0) //if the channel wasn't set
+   //lists skip the queue, so they get a few slots of their own and no more
+   if (sending >= LIST_MAX_SENDS)
    {
-      strcpy(channel, "#bottest");
-      if (debugLevel >= 1)
-         fprintf(stderr, "Channel not set: defaulting to %s\n", channel);
+      SCHED_Notice(connection, fromNick, "The list is being sent to others "
+                   "right now, please ask again in a minute.");
+      return;
+   }
+   slotId = SCHED_ClaimSlot(connection, fromNick, LIST_PACK);
+   if (prepareTransfer(connection, fromNick, LIST_PACK, 0, 0, slotId) == -1)
+   {
+      SCHED_ReleaseSlot(slotId);
+      SCHED_Notice(connection, fromNick, "Couldn't send the list, please ask "
+                   "again later.");
    }
 }
 
-int IRC_GetServerResponse(char *serverMessage)
+//xdcc list [page]: a page of the pack list; xdcc list file sends all of it
+void XDCC_List(struct IrcConnection *connection, const char *fromNick,
+               char **words, int numWords)
 {
-   char *currentChar = serverMessage;
-   char temp[5];
-   int tempPos = 0;
-   int numSpacesPassed = 0;
+   struct PackList *list = LIST_Current();
+   char notice[IRC_MAX_LINE];
+   char text[400];
+   int perPage = listPage > 0 ? listPage : 1;
+   int numPages;
+   int page = 1;
+   int last;
+   int i;
+   size_t prefix;
+   size_t length;
+   size_t limit;
    
-   while (numSpacesPassed < 1)
+   if (list == NULL)
+      return;
+   if (list->numLines == 0)
    {
-      if (*currentChar == ' ') ++numSpacesPassed;
-      ++currentChar;
+      SCHED_Notice(connection, fromNick, "There are no packs.");
+      return;
+   }
+   if (words[2] != NULL && strcasecmp(words[2], "file") == 0)
+   {
+      XDCC_SendList(connection, fromNick);
+      return;
+   }
+   numPages = (list->numLines + perPage - 1) / perPage;
+   if (words[2] != NULL)
+      page = atoi(words[2]);
+   if (page < 1 || page > numPages)
+   {
+      snprintf(text, sizeof(text), "There %s %i %s.", numPages == 1 ? "is" :
+               "are", numPages, numPages == 1 ? "page" : "pages");
+      SCHED_Notice(connection, fromNick, text);
+      return;
    }
    
-   while (*currentChar != ' ')
+   //the lines are ready, each NOTICE only puts its prefix in front. Pages
+   //wait with the announces, so a few of them can't crowd out DCC offers
+   prefix = snprintf(notice, sizeof(notice), "NOTICE %s :", fromNick);
+   //a line has to fit behind our "nick!user@host " when the server relays it
+   limit = IRC_MAX_LINE - 2 - IRC_PREFIX_RESERVE - strlen(connection->nick) -
+           prefix;
+   if (limit > LIST_MAX_NOTICE)
+      limit = LIST_MAX_NOTICE;
+   if (limit > sizeof(notice) - prefix - 1)
+      limit = sizeof(notice) - prefix - 1;
+   last = page * perPage < list->numLines ? page * perPage : list->numLines;
+   for (i = (page - 1) * perPage; i < last; ++i)
    {
-      if (*currentChar >= 0x30 && *currentChar <= 0x39)
-      {
-         temp[tempPos] = *currentChar;
-         temp[tempPos + 1] = '\0';
-         tempPos += 1;
-      }
-      ++currentChar;
+      length = list->lines[i + 1] - list->lines[i];
+      if (length > limit)
+         length = limit;
+      memcpy(notice + prefix, list->text + list->lines[i], length);
+      notice[prefix + length - 1] = '\n';
+      notice[prefix + length] = '\0';
+      IRC_SendMessage(connection, notice, IRC_ANNOUNCE);
    }
-   return atoi(temp);
+   if (page < numPages)
+      snprintf(text, sizeof(text), "Page %i of %i, %i packs. \"xdcc list %i\" "
+               "for the next page, \"xdcc list file\" for all of them.",
+               page, numPages, list->numLines, page + 1);
+   else
+      snprintf(text, sizeof(text), "Page %i of %i, %i packs. \"xdcc list "
+               "file\" sends all of them.", page, numPages, list->numLines);
+   snprintf(notice, sizeof(notice), "NOTICE %s :%s\n", fromNick, text);
+   IRC_SendMessage(connection, notice, IRC_ANNOUNCE);
 }
 
-int IRC_Connect()
+//xdcc queue: where are my packs?
+void XDCC_Queue(struct IrcConnection *connection, const char *fromNick,
+                char **words, int numWords)
 {
-   struct addrinfo *currentAddress = serverAddress;
-   int connectResult = -1;
-   char ipString[128];
-   
-   if (debugLevel >= 1)
-      fprintf(stderr, "\nConnecting to %s:%s...\n", server, port);
-   
-   memset(&serverAddressHints, 0, sizeof(serverAddressHints));
-   serverAddressHints.ai_family = AF_INET;
-   serverAddressHints.ai_socktype = SOCK_STREAM;
-   if (getaddrinfo(server, port, &serverAddressHints, &serverAddress))
-   {
-      fprintf(stderr, "Error: Could not resolve %s!\n", server);
-      return -1;
-   }
-   currentAddress = serverAddress;
-   while (currentAddress != NULL && (serverSocket == -1 || connectResult == -1))
+   SCHED_ReportQueue(connection, fromNick);
+}
+
+void BOT_Die(struct IrcConnection *connection, const char *fromNick,
+             char **words, int numWords)
+{
+   if (debugLevel > 0)
+      fprintf(stderr, "Shutting down...\n");
+   running = 0;
+}
+
+//bot set [password] [name]=[value] changes a tunable
+void BOT_SetCommand(struct IrcConnection *connection, const char *fromNick,
+                    char **words, int numWords)
+{
+   if (numWords >= 4)
+      BOT_Set(connection, fromNick, words[2], words[3]);
+}
+
+struct UserCommand xdccCommands[] =
+{
+   { "send", XDCC_Send },
+   { "tsend", XDCC_Send },
+   { "psend", XDCC_Send },
+   { "queue", XDCC_Queue },
+   { "info", XDCC_Info },
+   { "search", XDCC_Search },
+   { "list", XDCC_List },
+   { NULL, NULL }
+};
+
+struct UserCommand botCommands[] =
+{
+   { "die", BOT_Die },
+   { "set", BOT_SetCommand },
+   { NULL, NULL }
+};
+
+void runUserCommand(struct UserCommand *table,
+                    struct IrcConnection *connection, const char *fromNick,
+                    char **words, int numWords)
+{
+   if (numWords < 2)
+      return;
+   for (; table->name != NULL; ++table)
    {
-      if (debugLevel > 1)
+      if (strcasecmp(table->name, words[1]) == 0)
       {
-         inet_ntop(currentAddress->ai_family, currentAddress->ai_addr,
-            ipString, 128);
-         fprintf(stderr, "Trying: %s...\n", ipString);
+         table->handler(connection, fromNick, words, numWords);
+         return;
       }
-      serverSocket = socket(currentAddress->ai_family,
-                           currentAddress->ai_socktype,
-                           currentAddress->ai_protocol);
-      if (serverSocket != -1)
-         connectResult = connect(serverSocket, currentAddress->ai_addr,
-                                 currentAddress->ai_addrlen);
-         
-      //get the next address
-      currentAddress = currentAddress->ai_next;
    }
-   if (debugLevel >= 1)
-      fprintf(stderr, "Connected to %s:%s socket num: %08x!\n", server, port,
-            serverSocket);
-
-   return 0;
 }
 
 /////////////////////////////////////////////////////////////////////////////
-// This function has been ripped apart because the code that's commented out
-// didn't want to work on some servers. So I commented it out and just put
-// a sleep in there so it'd wait a few seconds before trying to login to the
-// server...
+// Handlers for what the server sends, looked up by command in ircCommands.
 /////////////////////////////////////////////////////////////////////////////
-void IRC_WaitEndOfMOTD()
+void IRC_OnPrivmsg(struct IrcConnection *connection,
+                   struct IrcMessage *message)
 {
-   /*
-   char buffer[4096];
-   int bufferPos = 0;
-   char temp[6];
-   int end = 0;
-   */
+   char fromNick[128];
+   char *words[8];
+   char *text;
+   char *savePointer = NULL;
+   int numWords = 0;
    
-   sleep(3);
-   
-   /*
-   memset(buffer, 0, 4096);
-   while (end == 0)
+   //make sure it's a privmsg for us, not for the channel
+   if (message->numParams < 2 ||
+       !IRC_SliceEquals(&message->params[0], connection->nick))
+      return;
+   IRC_SliceCopy(&message->nick, fromNick, sizeof(fromNick));
+   text = (char*)message->params[1].text;
+   if (text[0] == '\001')
    {
-      if (debugLevel == 2) fprintf(stderr, "\nWaiting for server...");
-      recv(serverSocket, buffer, 4096, 0);
-      if (debugLevel == 2) fprintf(stderr, "\nGot response!\n");
-      bufferPos = 0;
-      while (bufferPos <= 4096 - 6 && end == 0)
-      {
-         memcpy(temp, &(buffer[bufferPos]), 5);
-         temp[5] = '\0';
-         if (strcmp(temp, " 376 ") == 0)
-            end = 1;
-         //speedup trick: if we've read a response, but it's the wrong one;
-         //we'll just advance to the end of the line...
-         if (temp[0] == ' ' && temp[4] == ' ')
-            while (buffer[bufferPos] != '\n') ++bufferPos;
-         ++bufferPos;
-      }
+      DCC_OnCtcp(connection, fromNick, text);
+      return;
    }
-   */
+   memset(words, 0, sizeof(words));
+   words[0] = strtok_r(text, " ", &savePointer);
+   while (words[numWords] != NULL && ++numWords < 8)
+      words[numWords] = strtok_r(NULL, " ", &savePointer);
+   if (numWords == 0)
+      return;
+   
+   //see if it's an xdcc request
+   if (strcasecmp(words[0], "xdcc") == 0)
+      runUserCommand(xdccCommands, connection, fromNick, words, numWords);
+   //see if it's a bot request
+   else if (strcasecmp(words[0], "bot") == 0)
+      runUserCommand(botCommands, connection, fromNick, words, numWords);
 }
 
-int IRC_Login()
+void IRC_OnPing(struct IrcConnection *connection, struct IrcMessage *message)
 {
-   char userCommand[100];
-   char nickCommand[100];
-   char joinCommand[100];
-   char hostname[100];
-   
-   gethostname(hostname, 100);
-   
-   sprintf(userCommand, "USER %s %s %s :%s\n", nick, hostname, server, nick);
-   sprintf(nickCommand, "NICK %s\n", nick);
-   sprintf(joinCommand, "JOIN %s\n", channel);
-   
-   if (debugLevel == 1)
-      fprintf(stderr, "Sending login commands...\n");
-   else if (debugLevel > 1)
-      fprintf(stderr, "Sending user command: %s\n", userCommand);
-   send(serverSocket, userCommand, strlen(userCommand), 0);
-   userCommandSent = 1;
+   char tempString[600];
    
+   snprintf(tempString, sizeof(tempString), "PONG :%s\r\n",
+            message->numParams > 0 ? message->params[0].text :
+            connection->network->server);
+   IRC_SendMessage(connection, tempString, IRC_CONTROL);
    if (debugLevel > 1)
-      fprintf(stderr, "Sending nick command: %s\n", nickCommand);
-   send(serverSocket, nickCommand, strlen(nickCommand), 0);
-   nickCommandSent = 1;
-   
-   if (debugLevel > 0)
-      fprintf(stderr, "Listening 'till end of MOTD...");
-   IRC_WaitEndOfMOTD();
-   if (debugLevel > 0)
-      fprintf(stderr, "done...\n");
+      fprintf(stderr, "Responding to ping: %s\n", tempString);
+}
+
+void IRC_Join(struct IrcConnection *connection)
+{
+   char joinCommand[600];
    
+   snprintf(joinCommand, sizeof(joinCommand), "JOIN %s\n",
+            connection->network->channels);
    if (debugLevel > 1)
       fprintf(stderr, "Sending join command: %s\n", joinCommand);
-   send(serverSocket, joinCommand, strlen(joinCommand), 0);
-   joinCommandSent = 1;
+   IRC_SendMessage(connection, joinCommand, IRC_CONTROL);
+   connection->joined = 1;
+   TIMER_Arm(&connection->announceTimer, 0);
+   if (strcasecmp(connection->nick, connection->network->nick) != 0)
+      TIMER_Arm(&connection->stateTimer, IRC_REGAIN_EVERY * 1000);
+   else
+      TIMER_Cancel(&connection->stateTimer);
+}
+
+//what stateTimer does depends on how far the connection got
+void IRC_OnStateTimer(struct Timer *timer)
+{
+   struct IrcConnection *connection =
+      CONTAINER_OF(timer, struct IrcConnection, stateTimer);
+   struct Network *network = connection->network;
+   char nickCommand[256];
+   long long left;
    
+   switch (connection->state)
+   {
+      case IRC_OFFLINE:
+         if (IRC_Connect(connection) == -1)
+            IRC_Lost(connection);
+         break;
+      case IRC_CONNECTING:
+         //the next address joins the race, until time is up
+         left = connection->connectDeadline - monotonicMs();
+         if (left <= 0)
+         {
+            fprintf(stderr, "Connecting to %s timed out\n", network->server);
+            IRC_Lost(connection);
+         }
+         else if (IRC_StartAttempt(connection) == 0 &&
+                  left > IRC_ATTEMPT_DELAY)
+            TIMER_Arm(timer, IRC_ATTEMPT_DELAY);
+         else
+            TIMER_Arm(timer, (int)left);
+         break;
+      case IRC_REGISTERING:
+         fprintf(stderr, "%s didn't let us log in\n", network->server);
+         IRC_Lost(connection);
+         break;
+      case IRC_ONLINE:
+         if (!connection->joined)
+         {
+            IRC_Join(connection);
+            break;
+         }
+         //we got in under another nick; ask for ours back now and then
+         snprintf(nickCommand, sizeof(nickCommand), "NICK %s\n",
+                  network->nick);
+         IRC_SendMessage(connection, nickCommand, IRC_CONTROL);
+         TIMER_Arm(timer, IRC_REGAIN_EVERY * 1000);
+         break;
+   }
+}
+
+//001: we're registered, under the nick it is addressed to
+void IRC_OnWelcome(struct IrcConnection *connection,
+                   struct IrcMessage *message)
+{
+   if (connection->state != IRC_REGISTERING)
+      return;
+   if (message->numParams > 0)
+      IRC_SliceCopy(&message->params[0], connection->nick,
+                    sizeof(connection->nick));
+   connection->state = IRC_ONLINE;
+   connection->onlineSince = monotonicMs();
+   //what's shared now goes out with the first list, not as new
+   if (connection->logins++ == 0)
+      connection->announcedVersion = catalogVersion;
    if (debugLevel == 1)
       fprintf(stderr, "Logged in...\n");
    else if (debugLevel > 1)
-      fprintf(stderr, "Logged in as %s\n", nick);
-   
-   return 0;
+      fprintf(stderr, "Logged in to %s as %s\n", connection->network->server,
+            connection->nick);
+   //the end of the MOTD says when to join, if it comes at all
+   TIMER_Arm(&connection->stateTimer, IRC_JOIN_DELAY * 1000);
 }
 
-int IRC_Disconnect()
+//376 ends the MOTD, 422 says there is none
+void IRC_OnEndOfMotd(struct IrcConnection *connection,
+                     struct IrcMessage *message)
 {
-   if (debugLevel >= 1)
-      fprintf(stderr, "Diconnecting from server...\n");
-   send(serverSocket, QUIT_COMMAND, strlen(QUIT_COMMAND), 0);
-   sleep(2);
-   freeaddrinfo(serverAddress);
-   if (close(serverSocket) == -1)
-   {
-      fprintf(stderr, "Couldn't close socket: %i\n", serverSocket);
-      return -1;
-   }
-   return 0;
+   if (connection->state == IRC_ONLINE && !connection->joined)
+      IRC_Join(connection);
 }
 
-int IRC_SendMessage(char *toSend)
+/////////////////////////////////////////////////////////////////////////////
+// 433 (nick in use), 432 (not a valid nick), 436 (nick collision) and 437
+// (nick held back): while logging in we try the nick with a _ or two on the
+// end, then the start of it with four random digits. Once we are in, a
+// refusal is the answer to asking for our nick back and is left alone.
+/////////////////////////////////////////////////////////////////////////////
+void IRC_OnNickRefused(struct IrcConnection *connection,
+                       struct IrcMessage *message)
 {
-   return send(serverSocket, toSend, strlen(toSend), 0);
+   struct Network *network = connection->network;
+   char nickCommand[256];
+   
+   if (connection->state != IRC_REGISTERING)
+      return;
+   if (++connection->nickTries <= 2)
+      snprintf(connection->nick, sizeof(connection->nick), "%.120s%.*s",
+               network->nick, connection->nickTries, "__");
+   else
+      snprintf(connection->nick, sizeof(connection->nick), "%.5s%04i",
+               network->nick, rand() % 10000);
+   if (debugLevel > 0)
+      fprintf(stderr, "%s won't let us be %s, trying %s\n", network->server,
+            network->nick, connection->nick);
+   snprintf(nickCommand, sizeof(nickCommand), "NICK %s\n", connection->nick);
+   IRC_SendMessage(connection, nickCommand, IRC_CONTROL);
 }
 
-void DIR_Scan()
+//NICK: ours changed, because we got it back or the server changed it
+void IRC_OnNick(struct IrcConnection *connection, struct IrcMessage *message)
 {
-   DIR *toScan;
-   FILE *fileToAdd;
-   struct dirent *dirEntry = NULL;
-   char fullpath[4096];
-   
+   if (message->numParams < 1 ||
+       !IRC_SliceEquals(&message->nick, connection->nick))
+      return;
+   IRC_SliceCopy(&message->params[0], connection->nick,
+                 sizeof(connection->nick));
    if (debugLevel > 0)
-      fprintf(stderr, "\nScanning directory: %s\n", directory);
+      fprintf(stderr, "Our nick on %s is now %s\n",
+            connection->network->server, connection->nick);
+   if (strcasecmp(connection->nick, connection->network->nick) == 0 &&
+       connection->joined)
+      TIMER_Cancel(&connection->stateTimer);
+}
+
+struct IrcCommand
+{
+   const char *name;
+   void (*handler)(struct IrcConnection *connection,
+                   struct IrcMessage *message);
+};
+
+struct IrcCommand ircCommands[] =
+{
+   { "PRIVMSG", IRC_OnPrivmsg },
+   { "PING", IRC_OnPing },
+   { "001", IRC_OnWelcome },
+   { "376", IRC_OnEndOfMotd },
+   { "422", IRC_OnEndOfMotd },
+   { "432", IRC_OnNickRefused },
+   { "433", IRC_OnNickRefused },
+   { "436", IRC_OnNickRefused },
+   { "437", IRC_OnNickRefused },
+   { "NICK", IRC_OnNick },
+   { NULL, NULL }
+};
+
+void IRC_Dispatch(struct IrcReader *reader, struct IrcMessage *message)
+{
+   struct IrcConnection *connection =
+      CONTAINER_OF(reader, struct IrcConnection, reader);
+   struct IrcCommand *command;
+   int i;
    
-   toScan = opendir(directory);
-   if (toScan == NULL)
+   if (debugLevel > 1)
    {
-      fprintf(stderr, "Couldn't open directory: %s", directory);
-      exit(-1);
+      fprintf(stderr, "prefix = %s, command = %s\n",
+            message->prefix.text != NULL ? message->prefix.text : "",
+            message->command.text);
+      for (i = 0; i < message->numParams; ++i)
+         fprintf(stderr, "params[%i] = %s\n", i, message->params[i].text);
    }
-   
-   dirEntry = readdir(toScan);
-   while (dirEntry != NULL)
+   for (command = ircCommands; command->name != NULL; ++command)
    {
-      if (debugLevel >= 2)
-      {
-         fprintf(stderr, "Checking file %s\n", dirEntry->d_name);
-      }
-      if (dirEntry->d_name[0] != '.' && dirEntry->d_type == DT_REG)
+      if (IRC_SliceEquals(&message->command, command->name))
       {
-         strcpy(fullpath, directory);
-         if (fullpath[strlen(fullpath) - 1] != '/')
-            strcat(fullpath, "/");
-         strcat(fullpath, dirEntry->d_name);
-         fileToAdd = fopen(fullpath, "r");
-         if (fileToAdd != NULL)
-         {
-            if (dirContents == NULL)
-            {
-               dirContents = malloc(sizeof(struct SharedFile) * 25);
-               sharedFileArraySize = 25;
-            }
-            if (sharedFileArraySize == numSharedFiles)
-            {
-               dirContents = realloc(dirContents, sizeof(struct SharedFile) *
-                  (sharedFileArraySize * 2));
-               sharedFileArraySize *= 2;
-            }
-            fseek(fileToAdd, 0, SEEK_END);
-            dirContents[numSharedFiles].filesize = ftell(fileToAdd);
-            dirContents[numSharedFiles].filename = 
-               calloc(sizeof(char), (strlen(dirEntry->d_name) + 1));
-            strcat(dirContents[numSharedFiles].filename, dirEntry->d_name);
-            if (debugLevel > 1)
-               fprintf(stderr, "\tAdding file %s - %i bytes to slot #%i\n", 
-                  dirContents[numSharedFiles].filename,
-                  (int)dirContents[numSharedFiles].filesize, numSharedFiles);
-            ++numSharedFiles;
-            fclose(fileToAdd);
-         }
+         command->handler(connection, message);
+         return;
       }
-      dirEntry = readdir(toScan);
    }
-   closedir(toScan);
 }
 
-char ** getMessageParts(char *message)
+void IRC_OnEvent(struct Watcher *watcher, unsigned int events)
 {
-   static char **toReturn;
-   char *temp;
-   int i;
+   struct IrcConnection *connection =
+      CONTAINER_OF(watcher, struct IrcConnection, watcher);
    
-   toReturn = calloc(COMMAND_TOKENS, sizeof(char*));
-   for (i = 0; i < COMMAND_TOKENS; ++i)
-      toReturn[i] = calloc(128, sizeof(char));
-
-   //reset i
-   i = 0;
-
-   temp = strtok(message, " :!\r\n");
-   while (temp != NULL)
+   if (events & EPOLLOUT)
+      IRC_OnWritable(connection);
+   //edge-triggered, so IRC_Read drains the socket
+   if (IRC_Read(&connection->reader, connection->socket, IRC_Dispatch) == 0 ||
+       (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
    {
-      strcpy(toReturn[i], temp);
-      temp = strtok(NULL, " :!\r\n");
-      ++i;
+      //server closed the socket; running transfers go on meanwhile
+      fprintf(stderr, "Lost connection to %s\n", connection->network->server);
+      IRC_Lost(connection);
    }
-   
-   return toReturn;
-}
-
-void freeMessageParts(char **toFree)
-{
-   int i;
-   for (i = 0; i < COMMAND_TOKENS; ++i)
-      free(toFree[i]);
-   free(toFree);
 }
 
-void prepareTransfer(char **message)
+/////////////////////////////////////////////////////////////////////////////
+// Makes a connection for every network and starts connecting them all at
+// once. They log in as their servers answer, each on its own.
+/////////////////////////////////////////////////////////////////////////////
+void IRC_ConnectAll()
 {
-   char *buffer = NULL;
-   pid_t forkId;
-   int listenSocket = 0;
-   int transferSocket = 0;
-   size_t filePosition = 0;
-   FILE *toTransfer;
-   struct addrinfo hints;
-   struct sockaddr connectedAddr;
-   struct sockaddr_storage theirAddr;
-   socklen_t theirAddrSize = 120;
-   char *inputBuffer = NULL;
-   char *fileToOpen = NULL;
+   struct IrcConnection *connection;
+   int i, j;
    
-   forkId = fork();
-   if (forkId == -1)
-   {
-      fprintf(stderr, "Couldn't fork child process!\n");
-      return;
-   }
-   else if (forkId == 0) //child process
+   connections = calloc(numNetworks, sizeof(struct IrcConnection));
+   numConnections = numNetworks;
+   for (i = 0; i < numConnections; ++i)
    {
-      struct in_addr myself;
-      //moved from mainLoop function
-      srand(time(NULL));
-      transferPort = rand() % 50 + transferPort;
-      sprintf(transferPortString, "%d", transferPort);
-      //socklen_t addrSize = sizeof(struct sockaddr_in);
-      int packNumber = atoi(message[6] + 1);
-      char *sendBuffer;
-
-      memset(&hints, 0, sizeof(hints));
-      getsockname(serverSocket, &connectedAddr, &theirAddrSize);
-      hints.ai_addr = &connectedAddr;
-      hints.ai_family = AF_UNSPEC;
-      hints.ai_socktype = SOCK_STREAM;
-      hints.ai_flags = AI_PASSIVE;
-      getaddrinfo(NULL, transferPortString, &hints, &myAddress);
-      listenSocket = socket(myAddress->ai_family, myAddress->ai_socktype,
-                              myAddress->ai_protocol);
-      if (debugLevel > 0) fprintf(stderr, "Binding...");
-      bind(listenSocket, myAddress->ai_addr, myAddress->ai_addrlen);
-      if (debugLevel > 0) fprintf(stderr, "done!\n");
-      //moved from main loop function..
-      sendBuffer = calloc(sizeof(char), 1024);
-
-      //this would be a good spot to fill in the externalIP string
-      if ((settings & IRC_EXTERNAL_IP_SET) == 0)
-      {
-         struct sockaddr myselfSockAddr;
-         socklen_t myselfSockAddrLen = 32;
-         if (getsockname(serverSocket, &myselfSockAddr,
-                     &myselfSockAddrLen) == 0)
-         {
-            inet_ntop(AF_INET,
-                   &(((struct sockaddr_in*)&myselfSockAddr)->sin_addr),
-                   externalIP, 20);
-         }
-      }
-      
-      inet_aton(externalIP, &myself);
-      
-      if (debugLevel > 0)
-         fprintf(stderr, "Sending pack #%i to %s on %s(%d) port %i\n",
-                 atoi(message[6] + 1), message[0], externalIP,
-                 htonl(myself.s_addr), transferPort);
-      
-      sprintf(sendBuffer, "PRIVMSG %s :\001DCC SEND \"%s\" %i %i %li\001\n",
-         message[0], dirContents[atoi(message[6] + 1)].filename, 
-         (unsigned int)htonl(myself.s_addr), transferPort,
-         dirContents[atoi(message[6] + 1)].filesize);
-      send(serverSocket, sendBuffer, strlen(sendBuffer), 0);
-      //end move
-      listen(listenSocket, 2);
-      if (debugLevel > 0) fprintf(stderr, "Listening...");
-      transferSocket = accept(listenSocket, (struct sockaddr*)&theirAddr,
-                              &theirAddrSize);
-      if (debugLevel > 0) fprintf(stderr, "got socket: %d\n", transferSocket);
-      //now we have the socket; now we can send them the data...
-      buffer = calloc(4096, sizeof(char));
-      inputBuffer = calloc(128, sizeof(char));
-      fileToOpen = calloc(sizeof(char), 128);
-      sprintf(fileToOpen, "%s/%s", directory, dirContents[packNumber].filename);
-      toTransfer = fopen(fileToOpen, "rb");
-      if (toTransfer == NULL)
+      connection = &connections[i];
+      connection->id = i;
+      connection->network = &networks[i];
+      connection->socket = -1;
+      connection->announceCursor = -1;
+      connection->newPackCursor = -1;
+      snprintf(connection->nick, sizeof(connection->nick), "%s",
+               networks[i].nick);
+      connection->watcher.onEvent = IRC_OnEvent;
+      connection->floodTimer.onExpire = IRC_OnFloodTimer;
+      connection->announceTimer.onExpire = IRC_OnAnnounceTimer;
+      connection->stateTimer.onExpire = IRC_OnStateTimer;
+      for (j = 0; j < IRC_MAX_ATTEMPTS; ++j)
       {
-         fprintf(stderr, "Failed to open file to send!\n");
-         _exit(-1);
+         connection->attempts[j].watcher.fd = -1;
+         connection->attempts[j].watcher.onEvent = IRC_OnAttempt;
+         connection->attempts[j].connection = connection;
       }
-      while (filePosition < dirContents[packNumber].filesize)
-      {
-         fread(buffer, sizeof(char), 4096, toTransfer);
-         send(transferSocket, buffer, 4096, 0);
-         recv(transferSocket, inputBuffer, 128, 0);
-         filePosition = ftell(toTransfer);
-      }
-      close(listenSocket);
-      close(transferSocket);
-      _exit(0);
+      if (IRC_Connect(connection) == -1)
+         IRC_Lost(connection);
    }
 }
 
-void sigchld_handler(int s)
-{
-   while (waitpid(-1, NULL, WNOHANG) > 0);
-}
-
 void RunMainLoop()
 {
-   char running = 1;
-   char buffer[4096];
-   char **message;
-   struct sigaction sa;
-   struct timeval recvTimeout;
-   int bytesRecved = 0;
-   time_t nextAnnounce = 0;
-   time_t nextAnnounceMessage = 0;
-   char doingAnnounce = 0;
-   int nextPackToAnnounce = 0;
-   char* announceString = 0x0;
-   
-   //clear out the recvTimeout struct
-   memset(&recvTimeout, 0, sizeof(struct timeval));
-   //we'll timeout every 10 seconds so we can run thruogh the loop to announce
-   //in the channel, or do other things as needed.
-   recvTimeout.tv_sec = 10;
-   setsockopt(serverSocket, SOL_SOCKET, SO_RCVTIMEO, (char*)&recvTimeout,
-            sizeof(recvTimeout));
+   struct epoll_event events[64];
+   struct Watcher *watcher;
+   sigset_t childSignal;
+   int count;
+   int i;
    
+   reactor = epoll_create1(0);
+   if (reactor == -1)
+   {
+      perror("epoll_create1");
+      exit(1);
+   }
+   WORKER_Start();
+   //with workers the main loop only accepts and connects, it needs no buffers
+   if (ioBackend == IO_URING &&
+       URING_Setup(workerPool.numWorkers > 0 ? 0 : URING_BUFFERS) == -1)
+      fprintf(stderr, "Using epoll for DCC I/O\n");
+   
+   //the fork model's children are reaped when the signalfd says so
+   sigemptyset(&childSignal);
+   sigaddset(&childSignal, SIGCHLD);
+   sigprocmask(SIG_BLOCK, &childSignal, NULL);
+   childWatcher.fd = signalfd(-1, &childSignal, SFD_NONBLOCK);
+   childWatcher.onEvent = SCHED_OnChildExit;
+   if (childWatcher.fd == -1 || REACTOR_Add(&childWatcher, EPOLLIN) == -1)
+   {
+      perror("signalfd");
+      exit(1);
+   }
+   //new uploads show up without a restart
+   inotifyWatcher.fd = catalogWatchFd;
+   inotifyWatcher.onEvent = DIR_OnInotify;
+   if (inotifyWatcher.fd != -1)
+      REACTOR_Add(&inotifyWatcher, EPOLLIN);
+   //without the eventfd new directories are scanned on the event loop
+   rescan.watcher.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+   rescan.watcher.onEvent = RESCAN_OnEvent;
+   if (rescan.watcher.fd != -1 &&
+       REACTOR_Add(&rescan.watcher, EPOLLIN) == -1)
+   {
+      close(rescan.watcher.fd);
+      rescan.watcher.fd = -1;
+   }
+   catalogTimer.onExpire = DIR_OnCatalogTimer;
+   TIMER_Arm(&catalogTimer, 60000);
+   cacheTimer.onExpire = CACHE_OnTimer;
+   TIMER_Arm(&cacheTimer, CACHE_REBALANCE_EVERY * 1000);
+   //after SIGCHLD is blocked, the hashing threads inherit the mask
+   HASH_Start();
+   hashWatcher.fd = hashPool.eventFd;
+   hashWatcher.onEvent = HASH_OnEvent;
+   if (hashWatcher.fd != -1 && REACTOR_Add(&hashWatcher, EPOLLIN) == 0)
+      HASH_Feed();
+   
+   //connect and login to every network
+   IRC_ConnectAll();
+   queueReportTimer.onExpire = IRC_OnQueueReport;
+   TIMER_Arm(&queueReportTimer, 60000);
+   progressTimer.onExpire = XFER_OnProgressTimer;
+   TIMER_Arm(&progressTimer, 1000);
+   METRIC_Start();
+   
+   //lost networks are reconnected, so only bot die ends this
    while (running)
    {
-      //we need to reap the zombie processes at some point; this looks like a
-      //good place to do it...
-      sa.sa_handler = sigchld_handler;
-      sigemptyset(&sa.sa_mask);
-      sa.sa_flags = SA_RESTART;
-      if (sigaction(SIGCHLD, &sa, NULL) == -1)
-      {
-         perror("sigaction");
-         exit(1);
-      }
-      
-      //first thing we need to do is read in the input and check if it's a
-      //private message for us.
-      
-      //clear the buffer
-      memset(buffer, 0, 4096);
-      
-      bytesRecved = recv(serverSocket, buffer, 4096, 0);
-      
-      //we don't care if we timed out or if we actually got some text from
-      //the server to check if we're doing an announce...
-      if (time(NULL) >= nextAnnounce)
-      {
-         doingAnnounce = 1;
-         //next line is just to keep it from coming here again
-         nextAnnounce = time(NULL) + 50000; 
-         announceString = calloc(sizeof(char), 2048);
-         if (debugLevel > 0) fprintf(stderr, "Doing announce!\n");
-      }
-      if (doingAnnounce)
-      {
-         //we need to reset the timeout to a lower value (only a couple seconds)
-         recvTimeout.tv_sec = 2;
-         setsockopt(serverSocket, SOL_SOCKET, SO_RCVTIMEO,
-                     (char*)&recvTimeout, sizeof(recvTimeout));
-         if (time(NULL) > nextAnnounceMessage)
-         {
-            nextAnnounceMessage += 2;
-            sprintf(announceString, "PRIVMSG %s :\0034,1#\002%i\002 - %s\n", channel, 
-                  nextPackToAnnounce,
-                  dirContents[nextPackToAnnounce].filename);
-            ++nextPackToAnnounce;
-            IRC_SendMessage(announceString);
-         }
-         if (nextPackToAnnounce >= numSharedFiles)
-         {
-            nextPackToAnnounce = 0;
-            doingAnnounce = 0;
-            nextAnnounce = time(NULL) + 90; //next announce in 90 seconds
-            nextAnnounceMessage = time(NULL) + 92;
-            free(announceString);
-            //restore original timeout
-            recvTimeout.tv_sec = 10;
-            setsockopt(serverSocket, SOL_SOCKET, SO_RCVTIMEO,
-                        (char*)&recvTimeout, sizeof(recvTimeout));
-         }
-      }
-      
-      if (bytesRecved < 0)
-      {
-         //there was a timeout on the recv
-         if (debugLevel > 1)
-            fprintf(stderr, "Recv Timeout!\n");
-      }
-      else if (bytesRecved == 0)
+      count = epoll_wait(reactor, events, 64, TIMER_NextTimeout());
+      if (count == -1 && errno != EINTR)
       {
-         //server closed the socket
+         perror("epoll_wait");
+         break;
       }
-      else //there was an actual message recived...
+      for (i = 0; i < count; ++i)
       {
-         //this will divide up the message into parts...
-         message = getMessageParts(buffer);
-         
-         if (debugLevel > 1)
-         {
-            int i = 0;
-            for (i = 0; i < COMMAND_TOKENS; ++i)
-            {
-               if (strlen(message[i]) != 0)
-                  printf("message[%i] = %s\n", i, message[i]);
-            }
-         }
-         
-         //here's where we process the message
-         if (strcmp(message[2], "PRIVMSG") == 0)
-         {
-            //make sure it'sa privmsg for us, not for the channel
-            if (strcmp(message[3], nick) == 0)
-            {
-               //see if it's an xdcc request
-               if (strcmp(message[4], "xdcc") == 0)
-               {
-                  //do they want a packet?
-                  if (strcmp(message[5], "send") == 0)
-                  {
-                     if (atoi(message[5]) > 0 ||
-                        atoi(message[5]) < numSharedFiles)
-                        prepareTransfer(message);
-                  }
-               }
-               //see if it's a bot request
-               if (strcmp(message[4], "bot") == 0)
-               {
-                  //do they want me to die?
-                  if (strcmp(message[5], "die") == 0)
-                  {
-                     if (debugLevel > 0)
-                        fprintf(stderr, "Shutting down...\n");
-                     running = 0;
-                  }
-               }
-            }
-         }
-         if (strcmp(message[0], "PING") == 0)
-         {
-            char tempString[128];
-            sprintf(tempString, "PONG %s\n", server);
-            send(serverSocket, tempString, strlen(tempString), 0);
-            if (debugLevel > 1)
-               fprintf(stderr, "Responding to ping: %s\n", tempString);
-         }
-         
-         //here's where the message is freed
-         freeMessageParts(message);
+         watcher = events[i].data.ptr;
+         watcher->onEvent(watcher, events[i].events);
       }
+      TIMER_RunExpired();
+      //slots freed up while handling the events go to the queue
+      if (schedulerDirty)
+         SCHED_Run();
+      //everything queued on the io_uring during this pass goes in one call
+      if (uring.queued > 0)
+         URING_Submit();
+      for (i = 0; i < numConnections; ++i)
+         if (connections[i].queue.dirty)
+            IRC_FlushQueue(&connections[i], 0);
+      if (retiredCatalogs != NULL)
+         CATALOG_Reclaim();
    }
+   METRIC_Stop();
 
    //if the message is for us we can parse it to see if we're going to send a
    //file (and which file to send).
@@ -838,24 +9502,42 @@ int main(int argc, char **argv)
    //seed the random number generator
    srand(time(NULL));
    
+   //a client that hangs up mid-transfer shouldn't kill us
+   signal(SIGPIPE, SIG_IGN);
+   
    //set defaults for values not set
    setDefaults();
    
-   //scan the directory for files to share
-   DIR_Scan();
+   //put the bandwidth limits where every transfer can see them
+   SHAPER_Configure();
+   //and the records forked children report their progress in
+   METRIC_Init();
+   //an empty catalog for the scan to fill
+   CATALOG_Publish(CATALOG_New(0, 0));
+   
+   if (benchmarkScan)
+   {
+      DIR_Benchmark();
+      return 0;
+   }
    
-   //connect to the server
-   IRC_Connect();
+   //every DCC port is bound before the first offer
+   if (PORT_Open() == -1)
+      exit(1);
    
-   //login to the server
-   IRC_Login();
+   //scan the directory for files to share
+   DIR_Watch();
+   DIR_Scan();
    
    //Here's where we need to make the main loop. A multi processing solution
    //would be awesome (something like having a forked process to send files for
    //each connected client.
    RunMainLoop();
+   DIR_FinishSave(1);
+   if (catalogChanges != savedCatalogChanges)
+      DIR_SaveCatalog();
    
-   //disconnect from the server
+   //disconnect from the servers
    IRC_Disconnect();
    
    return 0;